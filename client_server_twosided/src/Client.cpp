@@ -1,14 +1,16 @@
+#include <algorithm>
+#include <cstring>
 #include <openssl/rand.h>
 
 #include "Client.h"
 #include "client_server_common.h"
 erpc::Nexus *nexus = nullptr;
 
-thread_local bool connected;
 
-
-void disconnect_callback(enum ret_val, const void *) {
-    connected = false;
+/* Tag of the disconnect messages is the Client, several Clients may share a
+ * thread */
+void disconnect_callback(enum ret_val, const void *user_tag) {
+    static_cast<Client *>(const_cast<void *>(user_tag))->connected = false;
 }
 
 void empty_sm_handler(int, erpc::SmEventType, erpc::SmErrType, void *) {
@@ -43,16 +45,45 @@ void Client::terminate() {
 Client::Client(uint8_t id,
     size_t max_key_size, size_t max_val_size) :
     session_nr{-1},
+    connected{false},
     erpc_id{id},
     client_rpc{nexus, this, id, empty_sm_handler, 0},
-    queue{id},
+    queue{id, &(this->crypto[0])},
+    key_phase{0},
+    control_pending{false},
+    control_type{CONTROL_HANDSHAKE},
+    control_ret{ret_val::INVALID_RESPONSE},
     max_key_size{max_key_size},
-    max_val_size{max_val_size}
+    max_val_size{max_val_size},
+    sending_chunks{false},
+    poll_events{0}
 {
-    size_t max_req_size = CIPHERTEXT_SIZE(max_key_size + max_val_size);
-    size_t max_resp_size = CIPHERTEXT_SIZE(max_val_size);
+    this->chunked = CIPHERTEXT_SIZE(max_key_size + max_val_size) >
+        erpc::Rpc<erpc::CTransport>::kMaxMsgSize;
+    if (this->chunked) {
+        if (max_key_size + sizeof(struct rdma_chunk_header) > CHUNK_SIZE)
+            throw std::runtime_error("Keys are too big for chunked transfers");
+        this->max_req_size = CHUNK_MESSAGE_SIZE;
+        this->max_resp_size = CHUNK_MESSAGE_SIZE;
+    } else {
+        /* Control messages have to fit as well: */
+        this->max_req_size = std::max(
+            CIPHERTEXT_SIZE(max_key_size + max_val_size), CONTROL_MESSAGE_SIZE);
+        this->max_resp_size = std::max(
+            CIPHERTEXT_SIZE(max_val_size), CONTROL_MESSAGE_SIZE);
+    }
     this->queue.allocate_req_buffers(
-        this->client_rpc, max_req_size, max_resp_size);
+        this->client_rpc, this->max_req_size, this->max_resp_size);
+    for (auto& transfer : this->transfers)
+        transfer.active = false;
+    for (auto& multi : this->multi_ops)
+        multi.active = false;
+#if PRECOMPUTE_KEYSTREAM
+    for (auto& session : this->crypto) {
+        if (0 != session.enable_precomputation(PRECOMPUTED_MESSAGES))
+            throw std::runtime_error("Couldn't allocate keystream ring");
+    }
+#endif // PRECOMPUTE_KEYSTREAM
 }
 
 Client::~Client() {
@@ -62,20 +93,38 @@ Client::~Client() {
 
 
 /**
- * Connects to a anchor server
+ * Connects to a anchor server and derives the key of the session in a
+ * handshake. The master key itself is only used for the handshake
  * @param server_hostname Hostname of the anchor server
  * @param udp_port Port on which the communication takes place
- * @param id Assumption: The client ID was agreed on in an initial handshake
- *          It is used in the sequence number
+ * @param encryption_key Master key that is shared with the server
+ * @param mode Protection of all messages of the session. The server has to
+ *          accept this mode. Without encryption support, it's always
+ *          SECURITY_NONE
+ * @param server_threads Number of threads the server was hosted with.
+ *          Clients are spread across them by their ID. If 0, the client
+ *          connects to the thread with its own ID
  * @return negative value if an error occurs. Otherwise the eRPC session number is returned
  */
 int Client::connect(std::string& server_hostname,
-    unsigned int udp_port, const unsigned char *encryption_key) {
+    unsigned int udp_port, const unsigned char *encryption_key,
+    enum security_mode mode, uint8_t server_threads) {
 
     std::string server_uri = server_hostname + ":" + std::to_string(udp_port);
-    enc_key = encryption_key;
-
-    session_nr = client_rpc.create_session(server_uri, this->erpc_id);
+    /* Until the handshake is done, key phase 0 uses the master key: */
+    this->key_phase = 0;
+    this->queue.set_idle_session(&(this->crypto[0]));
+    if (0 != this->crypto[0].set_key(encryption_key))
+        return -1;
+    this->crypto[1].clear_key();
+#if NO_ENCRYPTION
+    mode = SECURITY_NONE;
+#endif // NO_ENCRYPTION
+    for (auto& session : this->crypto)
+        session.set_security_mode(mode);
+
+    session_nr = client_rpc.create_session(server_uri, server_threads ?
+        this->erpc_id % server_threads : this->erpc_id);
     if (unlikely(session_nr < 0)) {
         std::cout << "Error: " << strerror(-session_nr) <<
              " Could not establish session with server at " << server_uri << endl;
@@ -84,26 +133,128 @@ int Client::connect(std::string& server_hostname,
     while(!client_rpc.is_connected(session_nr))
         client_rpc.run_event_loop_once();
 
-    connected = true;
+    this->connected = true;
+
+    if (0 != this->send_control_message(CONTROL_HANDSHAKE, 0))
+        return -1;
+    while (this->control_pending && this->connected)
+        client_rpc.run_event_loop_once();
+    if (this->control_ret != ret_val::OP_SUCCESS) {
+        cerr << "Handshake with server at " << server_uri << " failed" << endl;
+        return -1;
+    }
     return session_nr;
 }
 
 
+/**
+ * Starts the derivation of a new session key. Requests are sent in the new
+ * key phase as soon as the server responds, pending requests of the current
+ * key phase are still answered. Happens automatically every REKEY_INTERVAL
+ * messages
+ * @param loop_iterations Number of event loop iterations to perform
+ * @return 0 if the rekeying was started, -1 on error or if a rekeying is
+ *          already pending
+ */
+int Client::rekey(size_t loop_iterations) {
+    if (this->control_pending)
+        return -1;
+    return this->send_control_message(CONTROL_REKEY, loop_iterations);
+}
+
+
+/**
+ * Sends the random of the client for a handshake or rekeying. The control
+ * message is encrypted in the current key phase, the new key is installed
+ * by control_cont_func
+ * @param type CONTROL_HANDSHAKE or CONTROL_REKEY
+ * @param loop_iterations Number of event loop iterations to perform
+ * @return 0 on success, -1 on error
+ */
+int Client::send_control_message(uint8_t type, size_t loop_iterations) {
+    struct rdma_control_payload control;
+    struct rdma_enc_payload payload =
+        { nullptr, (unsigned char *) &control, sizeof(control) };
+    msg_tag_t *tag;
+    CryptoSession *session;
+    enum security_mode mode;
+    int ret;
+
+    control.type = type;
+    if (1 != RAND_bytes(control.random, KDF_RANDOM_LEN)) {
+        cerr << "Could not generate random for key derivation" << endl;
+        return -1;
+    }
+
+    tag = this->queue.prepare_new_request(
+        this->client_rpc, RDMA_GET, nullptr, nullptr);
+    tag->header.key_len = 0;
+    tag->value = nullptr;
+    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(
+        &(tag->request), CONTROL_MESSAGE_SIZE);
+
+    /* Control messages are always encrypted: */
+    session = this->current_session();
+    mode = session->get_security_mode();
+    session->set_security_mode(CONTROL_SECURITY_MODE);
+    ret = encrypt_message(session, &(tag->header),
+        &payload, (unsigned char **) &(tag->request.buf));
+    session->set_security_mode(mode);
+    if (unlikely(0 > ret)) {
+        tag->valid = false;
+        return -1;
+    }
+
+    this->control_type = type;
+    (void) memcpy(this->control_random, control.random, KDF_RANDOM_LEN);
+    this->control_pending = true;
+    this->enqueue(tag, CONTROL_REQ_TYPE(this->key_phase), control_cont_func);
+
+    for (size_t i = 0; i < loop_iterations; i++)
+        client_rpc.run_event_loop_once();
+    return 0;
+}
+
+
+/**
+ * Derives the session key from the randoms of the pending control message
+ * and switches to it. After a handshake, the master key is replaced in key
+ * phase 0. After a rekeying, the key phase flips, the session key of the
+ * previous phase is kept for the responses to pending requests
+ * @param server_random Random of the server of length KDF_RANDOM_LEN
+ * @return 0 on success, -1 on error
+ */
+int Client::install_session_key(const unsigned char *server_random) {
+    uint8_t next_phase = this->key_phase;
+    if (this->control_type == CONTROL_REKEY)
+        next_phase = NEXT_KEY_PHASE(this->key_phase);
+
+    if (0 != derive_session_key(&(this->crypto[next_phase]),
+            this->crypto[this->key_phase].get_key(), this->control_type,
+            this->erpc_id, this->control_random, server_random))
+        return -1;
+
+    this->key_phase = next_phase;
+    this->queue.set_idle_session(this->current_session());
+    return 0;
+}
+
+
 /**
  * A simple message with type RDMA_ERR signalises the server to shut down its
  * thread and eRPC object for this client
  */
 void Client::send_disconnect_message() {
     msg_tag_t *tag = queue.prepare_new_request(
-        this->client_rpc, RDMA_ERR, nullptr, disconnect_callback);
+        this->client_rpc, RDMA_ERR, this, disconnect_callback);
     tag->header.key_len = 0;
     struct rdma_enc_payload payload = { nullptr, nullptr, 0 };
 
-    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(
-        &(tag->request), MIN_MSG_LEN);
+    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(&(tag->request),
+        MESSAGE_SIZE(this->current_session()->get_security_mode(), 0));
 
-    if (unlikely(0 > encrypt_message(&(tag->header), &payload,
-        static_cast<unsigned char **>(&(tag->request.buf)))))
+    if (unlikely(0 > encrypt_message(this->current_session(), &(tag->header),
+        &payload, static_cast<unsigned char **>(&(tag->request.buf)))))
         goto err_send_disconnect_message;
 
     this->send_message(tag, 5);
@@ -114,7 +265,7 @@ err_send_disconnect_message:
 }
 
 void Client::prepare_disconnect() {
-    for (size_t i = 0; i < MAX_ACCEPTED_RESPONSES && connected; i++) {
+    for (size_t i = 0; i < MAX_ACCEPTED_RESPONSES && this->connected; i++) {
         send_disconnect_message();
     }
 }
@@ -130,25 +281,83 @@ void Client::disconnect() {
         (void) client_rpc.destroy_session(session_nr);
         this->queue.invalidate_all_requests();
     }
+    for (auto& transfer : this->transfers) {
+        if (transfer.active) {
+            transfer.ret = ret_val::TIMEOUT;
+            this->finish_transfer(&transfer);
+        }
+    }
+    for (auto& multi : this->multi_ops) {
+        if (multi.active)
+            this->finish_multi_operation(&multi, ret_val::TIMEOUT);
+    }
 }
 
+/**
+ * Runs the event loop once and sends the chunks that the window of pending
+ * chunked transfers allows
+ */
+void Client::run_event_loop_once() {
+    this->client_rpc.run_event_loop_once();
+    this->send_pending_chunks();
+    size_t events = this->queue.get_events();
+    /* Responses to requests in flight are due in one of the next polls: */
+    this->governor.polled(events != this->poll_events ||
+            this->queue.get_in_flight() > 0);
+    this->poll_events = events;
+}
+
+
+/**
+ * Sets how the event loop of the client polls while it is idle. Every poll
+ * that neither follows a new request nor delivers a response is idle, as
+ * long as no request is in flight. The
+ * client busy-polls first and then backs off to pauses and sleeps
+ * @param config DEFAULT_POLLING, BUSY_POLLING or a custom governor. The
+ *          reaction time of an idle client is bounded by config.max_sleep
+ */
+void Client::set_polling(const struct poll_config& config) {
+    this->governor.set_config(config);
+}
+
+
 /**
  * Method that is always called for enqueuing a request
- * The sequence number is incremented, the request is enqueued and the event
- * loop is run for sending
+ * The sequence number is incremented and the request is enqueued. The request
+ * has to be encrypted in the current key phase
+ * @param tag Tag that will be passed by the callback
+ * @param req_type eRPC request type of the request
+ * @param cont_func Continuation function for the response
+ */
+void Client::enqueue(msg_tag_t *tag,
+    uint8_t req_type, erpc::erpc_cont_func_t cont_func) {
+
+    tag->key_phase = this->key_phase;
+    this->queue.inc_seq();
+
+    client_rpc.enqueue_request(session_nr, req_type,
+        &(tag->request), &(tag->response), cont_func, (void *)tag);
+}
+
+
+/**
+ * Enqueues a get, put or delete request and runs the event loop for sending
  * @param tag Tag that will be passed by the callback
  * @param loop_iterations Number of event loop iterations to perform
  */
 void Client::send_message(
     msg_tag_t *tag, size_t loop_iterations) {
 
-    this->queue.inc_seq();
+    CryptoSession *session = this->current_session();
+    this->enqueue(tag, REQ_TYPE(OP_FROM_SEQ_OP(tag->header.seq_op),
+        session->get_security_mode(), this->key_phase), decrypt_cont_func);
 
-    client_rpc.enqueue_request(session_nr, DEFAULT_REQ_TYPE,
-        &(tag->request), &(tag->response), decrypt_cont_func, (void *)tag);
+    /* Renew the session key long before its nonces could run out: */
+    if (unlikely(session->get_encrypted_messages() >= REKEY_INTERVAL))
+        (void) this->rekey(0);
 
     for (size_t i = 0; i < loop_iterations; i++)
-        client_rpc.run_event_loop_once();
+        this->run_event_loop_once();
 }
 
 
@@ -173,6 +382,10 @@ int Client::get(const void *key, size_t key_len,
     assert(this->session_nr >= 0);
     assert(key_len <= this->max_key_size);
 
+    if (this->chunked)
+        return this->get_chunked(key, key_len, value, value_len,
+            callback, user_tag, loop_iterations);
+
     msg_tag_t *tag = this->queue.prepare_new_request(
         this->client_rpc, RDMA_GET, user_tag, callback, value_len);
 
@@ -183,10 +396,10 @@ int Client::get(const void *key, size_t key_len,
     struct rdma_enc_payload enc_payload =
         { (unsigned char *) key, nullptr, 0 };
 
-    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(
-        &(tag->request), CIPHERTEXT_SIZE(key_len));
+    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(&(tag->request),
+        MESSAGE_SIZE(this->current_session()->get_security_mode(), key_len));
 
-    if (unlikely(0 > encrypt_message(&(tag->header),
+    if (unlikely(0 > encrypt_message(this->current_session(), &(tag->header),
         &enc_payload, (unsigned char **) &(tag->request.buf))))
         goto err_get;
 
@@ -217,27 +430,65 @@ int Client::put(const void *key, size_t key_len,
     const void *value, size_t value_len, status_callback callback,
     const void *user_tag, size_t loop_iterations) {
 
+    if (!value) {
+        return -1;
+    }
+    struct iovec fragment = { const_cast<void *>(value), value_len };
+    return this->put_v(key, key_len, &fragment, 1,
+        callback, user_tag, loop_iterations);
+}
+
+
+/**
+ * Like put, but the value is gathered from several fragments (e.g. header,
+ * body and trailer of an application value). The fragments are encrypted
+ * straight into the request buffer, without copying them together before.
+ * Values that don't fit into one message are sent in chunks. Then, the
+ * fragments have to stay valid until the callback is called
+ * @param key Key whose value is updated/inserted
+ * @param key_len Length of key
+ * @param value Fragments of the value, in order
+ * @param value_count Number of fragments
+ * @param callback Callback that is called if the server responds to the request
+ * @param user_tag Arbitrary tag a user can specify to re-identify his request
+ * @param timeout Maximum time to wait for the server response
+ * @return 0 on success, -1 on error
+ */
+int Client::put_v(const void *key, size_t key_len,
+    const struct iovec *value, size_t value_count, status_callback callback,
+    const void *user_tag, size_t loop_iterations) {
+
     if (!(key && value)) {
         return -1;
     }
+    size_t value_len = 0;
+    for (size_t i = 0; i < value_count; i++) {
+        if (value[i].iov_base)
+            value_len += value[i].iov_len;
+    }
     assert(this->session_nr >= 0);
     assert(key_len <= this->max_key_size);
     assert(value_len <= this->max_val_size);
 
+    if (unlikely(MESSAGE_SIZE(this->current_session()->get_security_mode(),
+            key_len + value_len) > this->max_req_size))
+        return this->put_chunked(key, key_len, value, value_count, value_len,
+            callback, user_tag, loop_iterations);
+
     msg_tag_t *tag = this->queue.prepare_new_request(
         this->client_rpc, RDMA_PUT, user_tag, callback);
 
     tag->header.key_len = key_len;
     tag->value = nullptr;
     tag->user_tag = user_tag;
-    struct rdma_enc_payload enc_payload =
-        { (unsigned char *) key, (unsigned char *) value, value_len };
 
-    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(
-        &(tag->request), CIPHERTEXT_SIZE(key_len + value_len));
+    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(&(tag->request),
+        MESSAGE_SIZE(this->current_session()->get_security_mode(),
+            key_len + value_len));
 
-    if (unlikely(0 > encrypt_message(&(tag->header),
-        &enc_payload, (unsigned char **) &(tag->request.buf))))
+    if (unlikely(0 > encrypt_message_v(this->current_session(), &(tag->header),
+        (const unsigned char *) key, value, value_count,
+        (unsigned char **) &(tag->request.buf))))
         goto err_put;
 
     send_message(tag, loop_iterations);
@@ -278,10 +529,10 @@ int Client::del(const void *key, size_t key_len,
     struct rdma_enc_payload payload =
         { (unsigned char *) key, nullptr, 0 };
 
-    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(
-        &(tag->request), CIPHERTEXT_SIZE(key_len));
+    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(&(tag->request),
+        MESSAGE_SIZE(this->current_session()->get_security_mode(), key_len));
 
-    if (unlikely(0 > encrypt_message(
+    if (unlikely(0 > encrypt_message(this->current_session(),
         &(tag->header), &payload, (unsigned char **)&(tag->request.buf))))
         goto err_delete;
 
@@ -295,8 +546,10 @@ err_delete:
 }
 
 void Client::run_event_loop_n_times(size_t n) {
-    for (size_t i = 0; i < n; i++)
-        this->client_rpc.run_event_loop_once();
+    for (size_t i = 0; i < n; i++) {
+        this->run_event_loop_once();
+        (void) this->current_session()->precompute_keystreams();
+    }
 }
 
 
@@ -313,14 +566,15 @@ void Client::decrypt_cont_func(void *context, void *message_tag) {
 
     enum ret_val ret = ret_val::INVALID_RESPONSE;
     auto *tag = static_cast<msg_tag_t *>(message_tag);
-    struct rdma_msg_header incoming_header;
+    struct rdma_msg_header incoming_header = { 0, 0, 0 };
     struct rdma_dec_payload payload = { nullptr,
                                         (unsigned char *) tag->value, 0 };
     int expected_op, incoming_op;
     size_t ciphertext_size = tag->response.get_data_size();
     unsigned char *ciphertext = tag->response.buf;
 
-    if (unlikely(0 > decrypt_message(&incoming_header,
+    if (unlikely(0 > decrypt_message(&(client->crypto[tag->key_phase]),
+        &incoming_header,
         &payload, ciphertext, ciphertext_size))) {
         goto end_decrypt_cont_func; // invalid response
     }
@@ -344,7 +598,565 @@ void Client::decrypt_cont_func(void *context, void *message_tag) {
     ret = ret_val::OP_SUCCESS;
 
 end_decrypt_cont_func:
-    client->queue.message_arrived(ret, incoming_header.seq_op);
+    client->queue.message_arrived(
+        ret, incoming_header.seq_op, incoming_header.credits);
+}
+
+
+/**
+ * Continuation function that is called when the server responds to a control
+ * message. Installs the session key that is derived from both randoms
+ * @param client
+ * @param message_tag Tag that was associated with the control message
+ */
+void Client::control_cont_func(void *context, void *message_tag) {
+    if (!(context && message_tag))
+        return;
+    auto *client = static_cast<Client *>(context);
+    auto *tag = static_cast<msg_tag_t *>(message_tag);
+
+    enum ret_val ret = ret_val::INVALID_RESPONSE;
+    struct rdma_msg_header incoming_header = { 0, 0, 0 };
+    struct rdma_control_payload control;
+    struct rdma_dec_payload payload = { nullptr,
+                                        (unsigned char *) &control, 0 };
+    CryptoSession *session = &(client->crypto[tag->key_phase]);
+    enum security_mode mode = session->get_security_mode();
+    size_t ciphertext_size = tag->response.get_data_size();
+    int dec_ret;
+
+    /* Release the tag of this request, whatever arrived: */
+    incoming_header.seq_op = NEXT_SEQ(tag->header.seq_op);
+    /* Don't let the server write past the control payload: */
+    if (unlikely(ciphertext_size != CONTROL_MESSAGE_SIZE))
+        goto end_control_cont_func;
+
+    session->set_security_mode(CONTROL_SECURITY_MODE);
+    dec_ret = decrypt_message(session, &incoming_header, &payload,
+        tag->response.buf, ciphertext_size);
+    session->set_security_mode(mode);
+    if (unlikely(0 > dec_ret || payload.value_len != sizeof(control) ||
+            control.type != client->control_type)) {
+        incoming_header.seq_op = NEXT_SEQ(tag->header.seq_op);
+        goto end_control_cont_func;
+    }
+    if (unlikely((incoming_header.seq_op & (SEQ_MASK | ID_MASK)) !=
+        (NEXT_SEQ(tag->header.seq_op) & (ID_MASK | SEQ_MASK))))
+        return;
+
+    ret = ret_val::OP_FAILED;
+    if (likely(0 == client->install_session_key(control.random)))
+        ret = ret_val::OP_SUCCESS;
+
+end_control_cont_func:
+    client->control_ret = ret;
+    client->control_pending = false;
+    client->queue.message_arrived(
+        ret, incoming_header.seq_op, incoming_header.credits);
+}
+
+
+/* Collects the parts of the fragments that make up the bytes
+ * [offset, offset + len) of a value */
+static void select_fragments(const std::vector<struct iovec>& fragments,
+    size_t offset, size_t len, std::vector<struct iovec>& selected) {
+
+    selected.clear();
+    for (const auto& fragment : fragments) {
+        if (len == 0)
+            break;
+        if (offset >= fragment.iov_len) {
+            offset -= fragment.iov_len;
+            continue;
+        }
+        size_t part = std::min(fragment.iov_len - offset, len);
+        selected.push_back(
+            { static_cast<unsigned char *>(fragment.iov_base) + offset, part });
+        offset = 0;
+        len -= part;
+    }
+}
+
+
+/**
+ * Reserves the state for a chunked transfer. If MAX_CHUNKED_TRANSFERS are
+ * in progress, the event loop is run until one of them has finished
+ * @return The transfer or nullptr on error
+ */
+struct chunked_transfer *Client::start_transfer(uint8_t op,
+    const void *key, size_t key_len,
+    status_callback callback, const void *user_tag) {
+
+    struct chunked_transfer *transfer = nullptr;
+    while (!transfer) {
+        for (auto& candidate : this->transfers) {
+            if (!candidate.active) {
+                transfer = &candidate;
+                break;
+            }
+        }
+        if (!transfer)
+            this->run_event_loop_once();
+    }
+
+    transfer->chunk_key = static_cast<unsigned char *>(
+        malloc(sizeof(struct rdma_chunk_header) + key_len));
+    if (!transfer->chunk_key) {
+        cerr << "Memory allocation failure" << endl;
+        return nullptr;
+    }
+    (void) memcpy(transfer->chunk_key + sizeof(struct rdma_chunk_header),
+        key, key_len);
+    transfer->active = true;
+    transfer->op = op;
+    transfer->key_len = key_len;
+    transfer->fragments.clear();
+    transfer->value = nullptr;
+    transfer->value_len = nullptr;
+    transfer->total_len = 0;
+    transfer->count = 0;
+    transfer->next_index = 0;
+    transfer->completed = 0;
+    transfer->ret = ret_val::OP_SUCCESS;
+    transfer->callback = callback;
+    transfer->user_tag = user_tag;
+    return transfer;
+}
+
+
+/**
+ * Encrypts and enqueues the next chunk of a transfer. Afterwards, the event
+ * loop is run once, so the chunk is on its way while the next one is
+ * encrypted
+ * @return 0 on success, -1 on error
+ */
+int Client::send_chunk(struct chunked_transfer *transfer) {
+    uint32_t index = transfer->next_index;
+    size_t key_len = sizeof(struct rdma_chunk_header);
+    size_t chunk_len = 0;
+    CryptoSession *session = this->current_session();
+    msg_tag_t *tag = this->queue.prepare_new_request(
+        this->client_rpc, transfer->op, transfer, nullptr);
+
+    if (index == 0)
+        transfer->transfer_seq = tag->header.seq_op & (SEQ_MASK | ID_MASK);
+    struct rdma_chunk_header chunk = { transfer->transfer_seq, 0, index, 0 };
+
+    if (transfer->op == RDMA_PUT) {
+        chunk.total_len = transfer->total_len;
+        chunk.count = transfer->count;
+        chunk_len = CHUNK_LEN(transfer->total_len, index);
+        select_fragments(transfer->fragments,
+            index * CHUNK_SIZE, chunk_len, this->chunk_fragments);
+        tag->value = nullptr;
+    } else {
+        this->chunk_fragments.clear();
+        tag->value = transfer->value + index * CHUNK_SIZE;
+    }
+    /* Only the first chunk of a put carries the key: */
+    if (index == 0 || transfer->op == RDMA_GET)
+        key_len += transfer->key_len;
+    (void) memcpy(transfer->chunk_key, &chunk, sizeof(chunk));
+    tag->header.key_len = key_len;
+
+    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(&(tag->request),
+        MESSAGE_SIZE(session->get_security_mode(), key_len + chunk_len));
+    if (unlikely(0 > encrypt_message_v(session, &(tag->header),
+        transfer->chunk_key, this->chunk_fragments.data(),
+        this->chunk_fragments.size(), (unsigned char **) &(tag->request.buf)))) {
+        tag->valid = false;
+        return -1;
+    }
+
+    transfer->next_index++;
+    this->enqueue(tag, CHUNK_REQ_TYPE(session->get_security_mode(),
+        this->key_phase), chunk_cont_func);
+    this->client_rpc.run_event_loop_once();
+    return 0;
+}
+
+
+/* A transfer is done when no chunk is in flight anymore and either all chunks
+ * arrived or one of them failed */
+static inline bool transfer_done(const struct chunked_transfer *transfer) {
+    return transfer->completed == transfer->next_index &&
+        (transfer->ret != ret_val::OP_SUCCESS ||
+         (transfer->count > 0 && transfer->completed == transfer->count));
+}
+
+
+/**
+ * Sends chunks of all pending transfers, as far as their windows allow.
+ * The chunks of a get are only sent after the first chunk arrived, since
+ * only then the length of the value is known
+ */
+void Client::send_pending_chunks() {
+    if (this->sending_chunks)
+        return;
+    this->sending_chunks = true;
+
+    for (auto& transfer : this->transfers) {
+        while (transfer.active && transfer.ret == ret_val::OP_SUCCESS &&
+                transfer.next_index < std::max(transfer.count, (uint32_t) 1) &&
+                transfer.next_index - transfer.completed < CHUNK_WINDOW) {
+            if (0 != this->send_chunk(&transfer))
+                transfer.ret = ret_val::OP_FAILED;
+        }
+        if (transfer.active && transfer_done(&transfer))
+            this->finish_transfer(&transfer);
+    }
+    this->sending_chunks = false;
+}
+
+
+/**
+ * Releases the state of a transfer and calls its callback
+ */
+void Client::finish_transfer(struct chunked_transfer *transfer) {
+    if (transfer->op == RDMA_GET && transfer->value_len &&
+            transfer->ret == ret_val::OP_SUCCESS)
+        *transfer->value_len = transfer->total_len;
+    free(transfer->chunk_key);
+    transfer->chunk_key = nullptr;
+    transfer->fragments.clear();
+    transfer->active = false;
+    if (transfer->callback)
+        transfer->callback(transfer->ret, transfer->user_tag);
+}
+
+
+/**
+ * Gets a value that may exceed the maximum message size in chunks.
+ * The chunks are decrypted and copied to their position in value
+ * @return 0 on success, -1 on error
+ */
+int Client::get_chunked(const void *key, size_t key_len,
+    void *value, size_t *value_len,
+    status_callback callback, const void *user_tag,
+    size_t loop_iterations) {
+
+    struct chunked_transfer *transfer = this->start_transfer(
+        RDMA_GET, key, key_len, callback, user_tag);
+    if (!transfer)
+        return -1;
+    transfer->value = static_cast<unsigned char *>(value);
+    transfer->value_len = value_len;
+
+    this->send_pending_chunks();
+    for (size_t i = 0; i < loop_iterations; i++)
+        this->run_event_loop_once();
+    return 0;
+}
+
+
+/**
+ * Puts a value that doesn't fit into one message in chunks. The server
+ * reassembles the chunks and passes the value to the KV-store as soon as
+ * all of them arrived
+ * @return 0 on success, -1 on error
+ */
+int Client::put_chunked(const void *key, size_t key_len,
+    const struct iovec *value, size_t value_count, size_t value_len,
+    status_callback callback, const void *user_tag,
+    size_t loop_iterations) {
+
+    struct chunked_transfer *transfer = this->start_transfer(
+        RDMA_PUT, key, key_len, callback, user_tag);
+    if (!transfer)
+        return -1;
+    for (size_t i = 0; i < value_count; i++) {
+        if (value[i].iov_base && value[i].iov_len > 0)
+            transfer->fragments.push_back(value[i]);
+    }
+    transfer->total_len = value_len;
+    transfer->count = static_cast<uint32_t>(CHUNK_COUNT(value_len));
+
+    this->send_pending_chunks();
+    for (size_t i = 0; i < loop_iterations; i++)
+        this->run_event_loop_once();
+    return 0;
+}
+
+
+/**
+ * Continuation function that is called when the server responds to a chunk.
+ * The response is decrypted in place, the data of a get is then copied to
+ * its position in the value
+ * @param client
+ * @param message_tag Tag that was associated with the chunk
+ */
+void Client::chunk_cont_func(void *context, void *message_tag) {
+    if (!(context && message_tag))
+        return;
+    auto *client = static_cast<Client *>(context);
+    auto *tag = static_cast<msg_tag_t *>(message_tag);
+    auto *transfer = static_cast<struct chunked_transfer *>(
+        const_cast<void *>(tag->user_tag));
+
+    enum ret_val ret = ret_val::INVALID_RESPONSE;
+    struct rdma_msg_header incoming_header = { 0, 0, 0 };
+    struct rdma_dec_payload payload = { nullptr, nullptr, 0 };
+    struct rdma_chunk_header chunk;
+    size_t index;
+
+    incoming_header.seq_op = NEXT_SEQ(tag->header.seq_op);
+    if (unlikely(0 > decrypt_message_in_place(
+            &(client->crypto[tag->key_phase]), &incoming_header, &payload,
+            tag->response.buf, tag->response.get_data_size()))) {
+        incoming_header.seq_op = NEXT_SEQ(tag->header.seq_op);
+        goto end_chunk_cont_func;
+    }
+    if (unlikely((incoming_header.seq_op & (SEQ_MASK | ID_MASK)) !=
+        (NEXT_SEQ(tag->header.seq_op) & (ID_MASK | SEQ_MASK))))
+        return;
+    if (OP_FROM_SEQ_OP(tag->header.seq_op) !=
+            OP_FROM_SEQ_OP(incoming_header.seq_op)) {
+        ret = ret_val::OP_FAILED;
+        goto end_chunk_cont_func;
+    }
+
+    if (transfer->op == RDMA_GET) {
+        if (incoming_header.key_len != sizeof(chunk))
+            goto end_chunk_cont_func;
+        (void) memcpy(&chunk, payload.key, sizeof(chunk));
+        index = static_cast<size_t>(
+            static_cast<unsigned char *>(tag->value) - transfer->value) /
+            CHUNK_SIZE;
+        if (chunk.transfer_seq != transfer->transfer_seq ||
+                chunk.index != index ||
+                chunk.total_len > client->max_val_size ||
+                chunk.count != CHUNK_COUNT(chunk.total_len) ||
+                (transfer->count > 0 && chunk.total_len != transfer->total_len) ||
+                payload.value_len != CHUNK_LEN(chunk.total_len, index))
+            goto end_chunk_cont_func;
+        transfer->total_len = chunk.total_len;
+        transfer->count = chunk.count;
+        if (payload.value_len > 0)
+            (void) memcpy(tag->value, payload.value, payload.value_len);
+    }
+    ret = ret_val::OP_SUCCESS;
+
+end_chunk_cont_func:
+    client->queue.message_arrived(
+        ret, incoming_header.seq_op, incoming_header.credits);
+    transfer->completed++;
+    if (ret != ret_val::OP_SUCCESS)
+        transfer->ret = ret;
+    if (transfer_done(transfer))
+        client->finish_transfer(transfer);
+}
+
+
+/**
+ * Reserves the state for a multi-operation. If MAX_MULTI_OPERATIONS are
+ * in flight, the event loop is run until one of them has finished
+ * @return The multi-operation
+ */
+struct multi_operation *Client::start_multi_operation() {
+    while (true) {
+        for (auto& multi : this->multi_ops) {
+            if (!multi.active)
+                return &multi;
+        }
+        this->run_event_loop_once();
+    }
+}
+
+
+/**
+ * Gets the values of several keys with a single request. Each entry
+ * succeeds or fails on its own. If the values don't fit into one response,
+ * the entries at the end fail
+ * @param count Number of keys, at most MAX_MULTI_ENTRIES
+ * @param keys Keys whose values we want to get
+ * @param values Destinations of the values. iov_len is the size of the
+ *          destination and is set to the length of the value on success
+ * @param results Is filled with the result of every entry
+ * @param callback Callback that is called if the server responds, with
+ *          OP_SUCCESS if the response is valid. results has to be checked
+ * @param user_tag Arbitrary tag a user can specify to re-identify his request
+ * @param loop_iterations Number of event loop iterations to perform
+ * @return 0 on success, -1 on error
+ */
+int Client::multi_get(size_t count, const struct iovec *keys,
+    struct iovec *values, enum ret_val *results,
+    status_callback callback, const void *user_tag,
+    size_t loop_iterations) {
+
+    return this->send_multi(RDMA_GET, count, keys, nullptr, values, results,
+        callback, user_tag, loop_iterations);
+}
+
+
+/**
+ * Puts several key-value-pairs with a single request. Each entry succeeds or
+ * fails on its own. The request has to fit into one message
+ * @param count Number of key-value-pairs, at most MAX_MULTI_ENTRIES
+ * @param keys Keys whose values are updated/inserted
+ * @param values Values that are put to the KV-store
+ * @param results Is filled with the result of every entry
+ * @param callback Callback that is called if the server responds, with
+ *          OP_SUCCESS if the response is valid. results has to be checked
+ * @param user_tag Arbitrary tag a user can specify to re-identify his request
+ * @param loop_iterations Number of event loop iterations to perform
+ * @return 0 on success, -1 on error
+ */
+int Client::multi_put(size_t count, const struct iovec *keys,
+    const struct iovec *values, enum ret_val *results,
+    status_callback callback, const void *user_tag,
+    size_t loop_iterations) {
+
+    return this->send_multi(RDMA_PUT, count, keys, values, nullptr, results,
+        callback, user_tag, loop_iterations);
+}
+
+
+/**
+ * Encrypts the entry table, the keys and the values of a multi-operation
+ * straight into one request and enqueues it
+ * @return 0 on success, -1 on error
+ */
+int Client::send_multi(uint8_t op, size_t count,
+    const struct iovec *keys, const struct iovec *values,
+    struct iovec *get_values, enum ret_val *results,
+    status_callback callback, const void *user_tag,
+    size_t loop_iterations) {
+
+    struct multi_operation *multi;
+    struct rdma_multi_header header;
+    struct rdma_multi_entry entry;
+    CryptoSession *session = this->current_session();
+    size_t table_len = sizeof(header) + count * sizeof(entry);
+    size_t value_len = table_len;
+    msg_tag_t *tag;
+
+    if (!(keys && results && (values || get_values)) || count == 0 ||
+            count > MAX_MULTI_ENTRIES ||
+            count * sizeof(struct rdma_multi_result) >
+            PAYLOAD_SIZE(this->max_resp_size))
+        return -1;
+    assert(this->session_nr >= 0);
+
+    header.count = static_cast<uint32_t>(count);
+    header.response_len = static_cast<uint32_t>(std::min(
+        PAYLOAD_SIZE(this->max_resp_size), (size_t) UINT32_MAX));
+    (void) memcpy(this->multi_table, &header, sizeof(header));
+    this->multi_fragments.clear();
+    this->multi_fragments.push_back({ this->multi_table, table_len });
+    for (size_t i = 0; i < count; i++) {
+        entry.key_len = static_cast<uint32_t>(keys[i].iov_len);
+        entry.value_len = values ? static_cast<uint32_t>(values[i].iov_len) : 0;
+        (void) memcpy(this->multi_table + sizeof(header) + i * sizeof(entry),
+            &entry, sizeof(entry));
+        this->multi_fragments.push_back(keys[i]);
+        value_len += keys[i].iov_len;
+    }
+    for (size_t i = 0; values && i < count; i++) {
+        this->multi_fragments.push_back(values[i]);
+        value_len += values[i].iov_len;
+    }
+    if (MESSAGE_SIZE(session->get_security_mode(), value_len) >
+            this->max_req_size)
+        return -1;
+
+    multi = this->start_multi_operation();
+    tag = this->queue.prepare_new_request(
+        this->client_rpc, op, multi, nullptr);
+    tag->header.key_len = 0;
+    tag->value = nullptr;
+
+    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(&(tag->request),
+        MESSAGE_SIZE(session->get_security_mode(), value_len));
+    if (unlikely(0 > encrypt_message_v(session, &(tag->header), nullptr,
+        this->multi_fragments.data(), this->multi_fragments.size(),
+        (unsigned char **) &(tag->request.buf)))) {
+        tag->valid = false;
+        return -1;
+    }
+
+    multi->active = true;
+    multi->op = op;
+    multi->count = count;
+    multi->values = get_values;
+    multi->results = results;
+    multi->callback = callback;
+    multi->user_tag = user_tag;
+    this->enqueue(tag, MULTI_REQ_TYPE(session->get_security_mode(),
+        this->key_phase), multi_cont_func);
+
+    if (unlikely(session->get_encrypted_messages() >= REKEY_INTERVAL))
+        (void) this->rekey(0);
+    for (size_t i = 0; i < loop_iterations; i++)
+        this->run_event_loop_once();
+    return 0;
+}
+
+
+/**
+ * Releases the state of a multi-operation and calls its callback. If the
+ * response wasn't valid, all entries get its result
+ */
+void Client::finish_multi_operation(
+    struct multi_operation *multi, enum ret_val ret) {
+    if (ret != ret_val::OP_SUCCESS) {
+        for (size_t i = 0; i < multi->count; i++)
+            multi->results[i] = ret;
+    }
+    multi->active = false;
+    if (multi->callback)
+        multi->callback(ret, multi->user_tag);
+}
+
+
+/**
+ * Continuation function that is called when the server responds to a
+ * multi-operation. The response is decrypted in place, the values of a
+ * multi-get are then copied to their destinations
+ * @param client
+ * @param message_tag Tag that was associated with the multi-operation
+ */
+void Client::multi_cont_func(void *context, void *message_tag) {
+    if (!(context && message_tag))
+        return;
+    auto *client = static_cast<Client *>(context);
+    auto *tag = static_cast<msg_tag_t *>(message_tag);
+    auto *multi = static_cast<struct multi_operation *>(
+        const_cast<void *>(tag->user_tag));
+
+    enum ret_val ret = ret_val::INVALID_RESPONSE;
+    struct rdma_msg_header incoming_header = { 0, 0, 0 };
+    struct rdma_dec_payload payload = { nullptr, nullptr, 0 };
+    bool succeeded[MAX_MULTI_ENTRIES];
+
+    incoming_header.seq_op = NEXT_SEQ(tag->header.seq_op);
+    if (unlikely(0 > decrypt_message_in_place(
+            &(client->crypto[tag->key_phase]), &incoming_header, &payload,
+            tag->response.buf, tag->response.get_data_size()))) {
+        incoming_header.seq_op = NEXT_SEQ(tag->header.seq_op);
+        goto end_multi_cont_func;
+    }
+    if (unlikely((incoming_header.seq_op & (SEQ_MASK | ID_MASK)) !=
+        (NEXT_SEQ(tag->header.seq_op) & (ID_MASK | SEQ_MASK))))
+        return;
+    if (OP_FROM_SEQ_OP(tag->header.seq_op) !=
+            OP_FROM_SEQ_OP(incoming_header.seq_op)) {
+        ret = ret_val::OP_FAILED;
+        goto end_multi_cont_func;
+    }
+
+    if (incoming_header.key_len != 0 || 0 != parse_multi_response(
+            payload.value, payload.value_len, multi->op, multi->count,
+            multi->values, succeeded))
+        goto end_multi_cont_func;
+    for (size_t i = 0; i < multi->count; i++)
+        multi->results[i] = succeeded[i] ?
+            ret_val::OP_SUCCESS : ret_val::OP_FAILED;
+    ret = ret_val::OP_SUCCESS;
+
+end_multi_cont_func:
+    client->queue.message_arrived(
+        ret, incoming_header.seq_op, incoming_header.credits);
+    client->finish_multi_operation(multi, ret);
 }
 
 
@@ -3,28 +3,147 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "rpc.h"
 #include "client_server_common.h"
+#include "CryptoSession.h"
 #include "PendingRequestQueue.h"
+#include "PollGovernor.h"
+
+/* State of a value that is transferred in chunks */
+struct chunked_transfer {
+    bool active;
+    uint8_t op;
+    uint64_t transfer_seq;
+    /* Chunk header followed by the key, sent in front of the chunks */
+    unsigned char *chunk_key;
+    size_t key_len;
+    /* Fragments of the value of a put: */
+    std::vector<struct iovec> fragments;
+    /* Destination of the value of a get: */
+    unsigned char *value;
+    size_t *value_len;
+    size_t total_len;
+    /* Number of chunks, 0 until the first chunk of a get arrived */
+    uint32_t count;
+    uint32_t next_index;
+    uint32_t completed;
+    enum ret_val ret;
+    status_callback callback;
+    const void *user_tag;
+};
+
+/* Multi-get or multi-put that waits for the response of the server */
+struct multi_operation {
+    bool active;
+    uint8_t op;
+    size_t count;
+    /* Destinations of the values of a multi-get: */
+    struct iovec *values;
+    enum ret_val *results;
+    status_callback callback;
+    const void *user_tag;
+};
+
+/* Maximum number of multi-operations in flight */
+static constexpr size_t MAX_MULTI_OPERATIONS = 16;
 
 class Client {
 private:
 
     /* eRPC session number */
     int session_nr;
+    /* Until the server answered a disconnect: */
+    bool connected;
     uint8_t erpc_id;
     /* This is always the next sequence number that the Client sends */
     erpc::Rpc<erpc::CTransport> client_rpc;
     PendingRequestQueue queue;
+    /* Session keys of both key phases. Requests are encrypted in key_phase,
+     * responses in the key phase of their request */
+    CryptoSession crypto[NUM_KEY_PHASES];
+    uint8_t key_phase;
+    /* Handshake or rekeying that waits for the response of the server: */
+    bool control_pending;
+    uint8_t control_type;
+    unsigned char control_random[KDF_RANDOM_LEN];
+    enum ret_val control_ret;
 
     size_t max_key_size;
     size_t max_val_size;
+    size_t max_req_size;
+    size_t max_resp_size;
+    /* If values may exceed the maximum message size of eRPC, gets are always
+     * sent in chunks, puts if they don't fit into one message */
+    bool chunked;
+    struct chunked_transfer transfers[MAX_CHUNKED_TRANSFERS];
+    bool sending_chunks;
+    /* Fragments of the chunk that is currently encrypted: */
+    std::vector<struct iovec> chunk_fragments;
+    struct multi_operation multi_ops[MAX_MULTI_OPERATIONS];
+    /* Header and entry table of the multi-operation that is encrypted: */
+    unsigned char multi_table[sizeof(struct rdma_multi_header) +
+        MAX_MULTI_ENTRIES * sizeof(struct rdma_multi_entry)];
+    std::vector<struct iovec> multi_fragments;
+    /* Backs off the event loop while no requests are sent or answered: */
+    PollGovernor governor;
+    size_t poll_events;
+
+    inline CryptoSession *current_session() {
+        return &(this->crypto[this->key_phase]);
+    }
+
+    void run_event_loop_once();
+
+    void enqueue(msg_tag_t *tag,
+        uint8_t req_type, erpc::erpc_cont_func_t cont_func);
 
     void send_message(msg_tag_t *tag, size_t loop_iterations);
 
+    int send_control_message(uint8_t type, size_t loop_iterations);
+
+    int install_session_key(const unsigned char *server_random);
+
     static void decrypt_cont_func(void *context, void *message_tag);
 
+    static void control_cont_func(void *context, void *message_tag);
+
+    struct chunked_transfer *start_transfer(uint8_t op,
+        const void *key, size_t key_len,
+        status_callback callback, const void *user_tag);
+
+    int send_chunk(struct chunked_transfer *transfer);
+
+    void send_pending_chunks();
+
+    void finish_transfer(struct chunked_transfer *transfer);
+
+    int get_chunked(const void *key, size_t key_len,
+        void *value, size_t *value_len,
+        status_callback callback, const void *user_tag,
+        size_t loop_iterations);
+
+    int put_chunked(const void *key, size_t key_len,
+        const struct iovec *value, size_t value_count, size_t value_len,
+        status_callback callback, const void *user_tag,
+        size_t loop_iterations);
+
+    static void chunk_cont_func(void *context, void *message_tag);
+
+    struct multi_operation *start_multi_operation();
+
+    int send_multi(uint8_t op, size_t count,
+        const struct iovec *keys, const struct iovec *values,
+        struct iovec *get_values, enum ret_val *results,
+        status_callback callback, const void *user_tag,
+        size_t loop_iterations);
+
+    void finish_multi_operation(
+        struct multi_operation *multi, enum ret_val ret);
+
+    static void multi_cont_func(void *context, void *message_tag);
+
     void send_disconnect_message();
 
     friend void disconnect_callback(enum ret_val, const void *);
@@ -39,7 +158,9 @@ public:
     ~Client();
 
     int connect(std::string& server_hostname,
-            unsigned int udp_port, const unsigned char *encryption_key);
+            unsigned int udp_port, const unsigned char *encryption_key,
+            enum security_mode mode = SECURITY_ENCRYPT,
+            uint8_t server_threads = 0);
 
     void prepare_disconnect();
 
@@ -54,14 +175,43 @@ public:
             status_callback callback, const void *user_tag,
             size_t loop_iterations = 1000);
 
+    int put_v(const void *key, size_t key_len,
+            const struct iovec *value, size_t value_count,
+            status_callback callback, const void *user_tag,
+            size_t loop_iterations = 1000);
+
     int del(const void *key, size_t key_len,
             status_callback callback, const void *user_tag,
             size_t loop_iterations = 1000);
 
 
+    int multi_get(size_t count, const struct iovec *keys,
+            struct iovec *values, enum ret_val *results,
+            status_callback callback, const void *user_tag,
+            size_t loop_iterations = 1000);
+
+    int multi_put(size_t count, const struct iovec *keys,
+            const struct iovec *values, enum ret_val *results,
+            status_callback callback, const void *user_tag,
+            size_t loop_iterations = 1000);
+
+    int rekey(size_t loop_iterations = 1000);
+
     void run_event_loop_n_times(size_t n);
 
+    void set_polling(const struct poll_config& config);
+
     bool queue_full();
+
+    /* Requests sent and responses arrived so far */
+    inline size_t get_events() const {
+        return this->queue.get_events();
+    }
+
+    /* Requests sent and not answered yet */
+    inline size_t get_in_flight() const {
+        return this->queue.get_in_flight();
+    }
 };
 
 
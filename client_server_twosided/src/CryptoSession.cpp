@@ -0,0 +1,521 @@
+#include <cstring>
+#include <stdexcept>
+#include <openssl/crypto.h>
+#include <openssl/kdf.h>
+#include <common.h>
+
+#include "client_server_common.h"
+#include "CryptoSession.h"
+
+
+/**
+ * Constructs a session and expands the given key
+ * @param encryption_key Key of length ENC_KEY_LEN
+ */
+CryptoSession::CryptoSession(const unsigned char *encryption_key) {
+    if (0 != this->set_key(encryption_key))
+        throw std::runtime_error("Couldn't initialize crypto session");
+}
+
+CryptoSession::~CryptoSession() {
+    this->free_contexts();
+    OPENSSL_cleanse(this->derived_key, ENC_KEY_LEN);
+    free(this->keystreams);
+}
+
+void CryptoSession::free_contexts() {
+    EVP_CIPHER_CTX_free(this->enc_ctx);
+    EVP_CIPHER_CTX_free(this->dec_ctx);
+    this->enc_ctx = nullptr;
+    this->dec_ctx = nullptr;
+    this->key = nullptr;
+    this->impl = AES_GCM_OPENSSL;
+    this->encrypted_messages = 0;
+    /* Precomputed keystreams belong to the old key: */
+    this->keystream_head = 0;
+    this->keystream_count = 0;
+}
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+/* En-/decrypts data using EVP_CipherUpdate
+ * Supports data lengths over (2^31 - 1) bytes
+ * On success (i.e. if in_size bytes have been en-/decrypted without error),
+ * 0 is returned, otherwise -1
+ * */
+static int cipher_update(EVP_CIPHER_CTX *aes_ctx,
+        const unsigned char *in, size_t in_size, unsigned char *out) {
+
+    size_t total_processed_bytes = 0;
+    int processed_bytes, to_process;
+
+    while (static_cast<size_t>(total_processed_bytes) < in_size) {
+        to_process = static_cast<int>(
+                MIN(INT32_MAX, in_size - total_processed_bytes));
+        if (1 != EVP_CipherUpdate(
+                aes_ctx, out, &processed_bytes, in, to_process)) {
+            cerr << "Could not en-/decrypt payload" << endl;
+            return -1;
+        }
+        if (processed_bytes < 0) {
+            cerr << "Something went wrong while en-/decrypting" << endl;
+            return -1;
+        }
+        total_processed_bytes += static_cast<size_t>(processed_bytes);
+        out += static_cast<size_t>(processed_bytes);
+        in += static_cast<size_t>(processed_bytes);
+    }
+    if (total_processed_bytes != in_size) {
+        cerr << "Number of en-/decrypted bytes doesn't match expected number"
+                << endl;
+        return -1;
+    }
+    return 0;
+}
+
+/* Passes additional authenticated data to EVP_CipherUpdate
+ * Supports data lengths over (2^31 - 1) bytes
+ * Returns 0 on success, -1 otherwise
+ * */
+static int cipher_aad_update(EVP_CIPHER_CTX *aes_ctx,
+        const unsigned char *in, size_t in_size) {
+
+    int processed_bytes, to_process;
+
+    while (in_size > 0) {
+        to_process = static_cast<int>(MIN(INT32_MAX, in_size));
+        if (1 != EVP_CipherUpdate(
+                aes_ctx, nullptr, &processed_bytes, in, to_process)) {
+            cerr << "Could not authenticate additional data" << endl;
+            return -1;
+        }
+        in += static_cast<size_t>(to_process);
+        in_size -= static_cast<size_t>(to_process);
+    }
+    return 0;
+}
+
+
+/**
+ * (Re-)initializes the session with a new key.
+ * This is the only place where the key schedule is computed
+ * @param encryption_key Key of length ENC_KEY_LEN
+ * @param preferred_impl Implementation to use. If the CPU doesn't support it,
+ *          the next best one is used. Defaults to the best available one
+ * @return 0 on success, -1 on error
+ */
+int CryptoSession::set_key(const unsigned char *encryption_key,
+        enum aes_gcm_impl preferred_impl) {
+    this->free_contexts();
+    if (!encryption_key) {
+        cerr << "CryptoSession: No key specified" << endl;
+        return -1;
+    }
+
+    if (preferred_impl > aes_gcm_best_impl())
+        preferred_impl = aes_gcm_best_impl();
+    if (preferred_impl != AES_GCM_OPENSSL) {
+        if (0 != aes_gcm_set_key(
+                &(this->native_key), encryption_key, preferred_impl)) {
+            cerr << "CryptoSession: Could not expand key" << endl;
+            return -1;
+        }
+        this->impl = preferred_impl;
+        this->key = encryption_key;
+        return 0;
+    }
+
+    this->enc_ctx = EVP_CIPHER_CTX_new();
+    this->dec_ctx = EVP_CIPHER_CTX_new();
+    if (!(this->enc_ctx && this->dec_ctx)) {
+        cerr << "Memory allocation failure" << endl;
+        goto err_set_key;
+    }
+
+    if (1 != EVP_EncryptInit_ex(this->enc_ctx,
+            EVP_aes_128_gcm(), nullptr, encryption_key, nullptr)) {
+        cerr << "CryptoSession: Could not initialize encryption" << endl;
+        goto err_set_key;
+    }
+    if (1 != EVP_CIPHER_CTX_ctrl(this->enc_ctx,
+            EVP_CTRL_AEAD_SET_IVLEN, IV_LEN, nullptr)) {
+        cerr << "CryptoSession: Could not set IV length" << endl;
+        goto err_set_key;
+    }
+
+    if (1 != EVP_DecryptInit_ex(this->dec_ctx,
+            EVP_aes_128_gcm(), nullptr, encryption_key, nullptr)) {
+        cerr << "CryptoSession: Could not initialize decryption" << endl;
+        goto err_set_key;
+    }
+    if (1 != EVP_CIPHER_CTX_ctrl(this->dec_ctx,
+            EVP_CTRL_AEAD_SET_IVLEN, IV_LEN, nullptr)) {
+        cerr << "CryptoSession: Could not set IV length" << endl;
+        goto err_set_key;
+    }
+
+    this->key = encryption_key;
+    return 0;
+
+err_set_key:
+    this->free_contexts();
+    return -1;
+}
+
+
+/**
+ * Derives a new key with HKDF-SHA256 and (re-)initializes the session with it.
+ * The derived key is stored in the session, so input_key may be the key of
+ * another session that is re-keyed afterwards
+ * @param input_key Key of length ENC_KEY_LEN to derive from
+ * @param salt HKDF salt, e.g. randoms of both sides
+ * @param info HKDF info that binds the key to its purpose
+ * @param preferred_impl Implementation to use, see set_key()
+ * @return 0 on success, -1 on error
+ */
+int CryptoSession::derive_key(const unsigned char *input_key,
+        const unsigned char *salt, size_t salt_len,
+        const unsigned char *info, size_t info_len,
+        enum aes_gcm_impl preferred_impl) {
+    unsigned char output_key[ENC_KEY_LEN];
+    size_t output_len = ENC_KEY_LEN;
+    int ret = -1;
+    EVP_PKEY_CTX *kdf_ctx;
+
+    if (!input_key) {
+        cerr << "CryptoSession: No key to derive from" << endl;
+        return -1;
+    }
+    kdf_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+    if (!kdf_ctx) {
+        cerr << "Memory allocation failure" << endl;
+        return -1;
+    }
+    if (1 != EVP_PKEY_derive_init(kdf_ctx) ||
+            1 != EVP_PKEY_CTX_set_hkdf_md(kdf_ctx, EVP_sha256()) ||
+            1 != EVP_PKEY_CTX_set1_hkdf_key(kdf_ctx,
+                input_key, static_cast<int>(ENC_KEY_LEN)) ||
+            1 != EVP_PKEY_CTX_set1_hkdf_salt(kdf_ctx,
+                salt, static_cast<int>(salt_len)) ||
+            1 != EVP_PKEY_CTX_add1_hkdf_info(kdf_ctx,
+                info, static_cast<int>(info_len)) ||
+            1 != EVP_PKEY_derive(kdf_ctx, output_key, &output_len) ||
+            output_len != ENC_KEY_LEN) {
+        cerr << "CryptoSession: Could not derive key" << endl;
+        goto end_derive_key;
+    }
+
+    (void) memcpy(this->derived_key, output_key, ENC_KEY_LEN);
+    ret = this->set_key(this->derived_key, preferred_impl);
+
+end_derive_key:
+    OPENSSL_cleanse(output_key, ENC_KEY_LEN);
+    EVP_PKEY_CTX_free(kdf_ctx);
+    return ret;
+}
+
+
+/**
+ * Removes the key from the session. En-/decryption fails until a new key
+ * is set
+ */
+void CryptoSession::clear_key() {
+    this->free_contexts();
+    OPENSSL_cleanse(this->derived_key, ENC_KEY_LEN);
+}
+
+
+/**
+ * Lets the session keep the keystreams of up to the given number of upcoming
+ * messages, see precompute_keystreams(). Only has an effect with the built-in
+ * implementation. Survives changes of the key
+ * @param messages Capacity of the keystream ring, 0 disables precomputation
+ * @return 0 on success, -1 on error
+ */
+int CryptoSession::enable_precomputation(size_t messages) {
+    free(this->keystreams);
+    this->keystreams = nullptr;
+    this->keystream_capacity = 0;
+    this->keystream_head = 0;
+    this->keystream_count = 0;
+    if (messages == 0)
+        return 0;
+
+    this->keystreams = static_cast<struct aes_gcm_keystream *>(
+            malloc(messages * sizeof(struct aes_gcm_keystream)));
+    if (!this->keystreams) {
+        cerr << "Memory allocation failure" << endl;
+        return -1;
+    }
+    this->keystream_capacity = messages;
+    return 0;
+}
+
+
+/**
+ * Draws the nonces of upcoming messages and computes their keystreams, so
+ * encrypting these messages later only takes XOR and GHASH. Meant to be
+ * called whenever the owning thread would otherwise spin idly, but not
+ * while a message is en-/decrypted
+ * @param max_messages Maximum number of keystreams to compute in this call
+ * @return Number of keystreams that were computed
+ */
+size_t CryptoSession::precompute_keystreams(size_t max_messages) {
+    size_t computed = 0;
+    if (this->impl == AES_GCM_OPENSSL)
+        return 0;
+
+    while (computed < max_messages &&
+            this->keystream_count < this->keystream_capacity) {
+        struct aes_gcm_keystream *keystream = this->keystreams +
+                (this->keystream_head + this->keystream_count) %
+                this->keystream_capacity;
+        unsigned char iv[IV_LEN];
+        if (unlikely(0 != next_iv(iv)))
+            break;
+        aes_gcm_precompute(keystream, &(this->native_key), iv);
+        this->keystream_count++;
+        computed++;
+    }
+    return computed;
+}
+
+
+/**
+ * Starts the encryption of a new message with a fresh nonce. If a keystream
+ * has been precomputed, its nonce is used, otherwise a new one is drawn
+ * @param iv Buffer of length IV_LEN that the nonce of the message is written to
+ * @return 0 on success, -1 on error
+ */
+int CryptoSession::init_encryption_next_iv(unsigned char *iv) {
+    this->encrypted_messages++;
+    if (this->keystream_count > 0) {
+        const struct aes_gcm_keystream *keystream =
+                this->keystreams + this->keystream_head;
+        (void) memcpy(iv, keystream->iv, IV_LEN);
+        aes_gcm_init_precomputed(
+                &(this->native_ctx), &(this->native_key), keystream);
+        this->keystream_head =
+                (this->keystream_head + 1) % this->keystream_capacity;
+        this->keystream_count--;
+        return 0;
+    }
+    if (unlikely(0 != next_iv(iv)))
+        return -1;
+    return this->init_encryption(iv);
+}
+
+
+/**
+ * Starts the encryption of a new message. The expanded key is kept, only
+ * the IV is replaced
+ * @param iv IV of length IV_LEN for the next message
+ * @return 0 on success, -1 on error
+ */
+int CryptoSession::init_encryption(const unsigned char *iv) {
+    if (unlikely(!this->key)) {
+        cerr << "CryptoSession: No key set" << endl;
+        return -1;
+    }
+    if (this->impl != AES_GCM_OPENSSL) {
+        aes_gcm_init(&(this->native_ctx), &(this->native_key), iv);
+        return 0;
+    }
+    if (unlikely(1 != EVP_EncryptInit_ex(
+            this->enc_ctx, nullptr, nullptr, nullptr, iv))) {
+        cerr << "CryptoSession: Could not set IV" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Starts the decryption of a new message. The expanded key is kept, only
+ * the IV and the expected tag are replaced
+ * @param iv IV of length IV_LEN of the incoming message
+ * @param tag Authentication tag of length MAC_LEN of the incoming message.
+ *          Has to stay valid until finish_decryption
+ * @return 0 on success, -1 on error
+ */
+int CryptoSession::init_decryption(const unsigned char *iv,
+        const unsigned char *tag) {
+    if (unlikely(!this->key)) {
+        cerr << "CryptoSession: No key set" << endl;
+        return -1;
+    }
+    if (this->impl != AES_GCM_OPENSSL) {
+        aes_gcm_init(&(this->native_ctx), &(this->native_key), iv);
+        this->expected_tag = tag;
+        return 0;
+    }
+    if (unlikely(1 != EVP_DecryptInit_ex(
+            this->dec_ctx, nullptr, nullptr, nullptr, iv))) {
+        cerr << "CryptoSession: Could not set IV" << endl;
+        return -1;
+    }
+    if (unlikely(1 != EVP_CIPHER_CTX_ctrl(this->dec_ctx,
+            EVP_CTRL_AEAD_SET_TAG, MAC_LEN, (void *) tag))) {
+        cerr << "CryptoSession: Could not set Tag location" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Authenticates the next part of the current message without encrypting it.
+ * All additional authenticated data has to be passed before encrypt_update
+ * @return 0 on success, -1 on error
+ */
+int CryptoSession::encrypt_aad_update(const unsigned char *in, size_t in_size) {
+    if (this->impl != AES_GCM_OPENSSL) {
+        aes_gcm_aad_update(&(this->native_ctx), in, in_size);
+        return 0;
+    }
+    return cipher_aad_update(this->enc_ctx, in, in_size);
+}
+
+
+/**
+ * Verifies the next part of the current message, that wasn't encrypted.
+ * All additional authenticated data has to be passed before decrypt_update
+ * @return 0 on success, -1 on error
+ */
+int CryptoSession::decrypt_aad_update(const unsigned char *in, size_t in_size) {
+    if (this->impl != AES_GCM_OPENSSL) {
+        aes_gcm_aad_update(&(this->native_ctx), in, in_size);
+        return 0;
+    }
+    return cipher_aad_update(this->dec_ctx, in, in_size);
+}
+
+
+/**
+ * Encrypts the next part of the current message. in and out may be the same
+ * @return 0 on success, -1 on error
+ */
+int CryptoSession::encrypt_update(const unsigned char *in, size_t in_size,
+        unsigned char *out) {
+    if (this->impl != AES_GCM_OPENSSL) {
+        aes_gcm_encrypt_update(&(this->native_ctx), in, in_size, out);
+        return 0;
+    }
+    return cipher_update(this->enc_ctx, in, in_size, out);
+}
+
+
+/**
+ * Decrypts the next part of the current message. in and out may be the same
+ * @return 0 on success, -1 on error
+ */
+int CryptoSession::decrypt_update(const unsigned char *in, size_t in_size,
+        unsigned char *out) {
+    if (this->impl != AES_GCM_OPENSSL) {
+        aes_gcm_decrypt_update(&(this->native_ctx), in, in_size, out);
+        return 0;
+    }
+    return cipher_update(this->dec_ctx, in, in_size, out);
+}
+
+
+/**
+ * Finishes the current message and writes its authentication tag
+ * @param tag Buffer of length MAC_LEN
+ * @return 0 on success, -1 on error
+ */
+int CryptoSession::finish_encryption(unsigned char *tag) {
+    if (this->impl != AES_GCM_OPENSSL) {
+        aes_gcm_finish(&(this->native_ctx), tag);
+        return 0;
+    }
+
+    int length;
+    /* GCM doesn't write any final data: */
+    if (1 != EVP_EncryptFinal_ex(this->enc_ctx, tag, &length)) {
+        cerr << "Could not write final encrypted data" << endl;
+        return -1;
+    }
+    if (1 != EVP_CIPHER_CTX_ctrl(
+            this->enc_ctx, EVP_CTRL_AEAD_GET_TAG, MAC_LEN, tag)) {
+        cerr << "Could not write authentication tag" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Finishes the current message and verifies its authentication tag
+ * @return 0 if the tag is valid, -1 otherwise
+ */
+int CryptoSession::finish_decryption() {
+    if (this->impl != AES_GCM_OPENSSL) {
+        unsigned char tag[MAC_LEN];
+        aes_gcm_finish(&(this->native_ctx), tag);
+        if (0 != CRYPTO_memcmp(tag, this->expected_tag, MAC_LEN)) {
+            cerr << "Could not finish decryption" << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    int length;
+    if (1 != EVP_DecryptFinal_ex(this->dec_ctx, nullptr, &length)) {
+        cerr << "Could not finish decryption" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Encrypts a batch of whole messages without additional authenticated data,
+ * see aes_gcm_encrypt_messages. Only supported by the built-in implementation
+ * @param messages Messages to encrypt with their own IVs. The tags are
+ *          written to the messages
+ * @param count Number of messages
+ * @return 0 on success, -1 if batches are not supported
+ */
+int CryptoSession::encrypt_messages(struct aes_gcm_message *messages,
+        size_t count) {
+    if (unlikely(!this->key || !this->supports_batches())) {
+        cerr << "CryptoSession: Batches are not supported" << endl;
+        return -1;
+    }
+    this->encrypted_messages += count;
+    aes_gcm_encrypt_messages(&(this->native_key), messages, count);
+    return 0;
+}
+
+
+/**
+ * Decrypts a batch of whole messages without additional authenticated data
+ * and verifies their tags. Only supported by the built-in implementation
+ * @param messages Messages to decrypt
+ * @param tags Expected tag of every message, of length MAC_LEN
+ * @param results Is set to 0 for every message whose tag is valid, to -1
+ *          otherwise
+ * @param count Number of messages
+ * @return 0 if all tags are valid, -1 otherwise
+ */
+int CryptoSession::decrypt_messages(struct aes_gcm_message *messages,
+        const unsigned char *const *tags, int *results, size_t count) {
+    int ret = 0;
+    if (unlikely(!this->key || !this->supports_batches())) {
+        cerr << "CryptoSession: Batches are not supported" << endl;
+        for (size_t i = 0; i < count; i++)
+            results[i] = -1;
+        return -1;
+    }
+    aes_gcm_decrypt_messages(&(this->native_key), messages, count);
+    for (size_t i = 0; i < count; i++) {
+        results[i] = 0;
+        if (0 != CRYPTO_memcmp(messages[i].tag, tags[i], MAC_LEN)) {
+            cerr << "Could not finish decryption" << endl;
+            results[i] = -1;
+            ret = -1;
+        }
+    }
+    return ret;
+}
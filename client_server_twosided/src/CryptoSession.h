@@ -0,0 +1,123 @@
+#ifndef CLIENT_SERVER_TWOSIDED_CRYPTOSESSION_H
+#define CLIENT_SERVER_TWOSIDED_CRYPTOSESSION_H
+
+#include <openssl/evp.h>
+
+#include "aes_gcm.h"
+#include "client_server_common.h"
+
+/*
+ * AES-GCM state that is kept across messages.
+ * The key schedule and the GHASH tables are computed only once per key.
+ * For every message, only the IV is swapped in.
+ * Depending on the CPU, the built-in AES-NI/VAES implementation (aes_gcm.h)
+ * or the EVP interface of OpenSSL is used. Both produce the same output.
+ * A session must only be used by one thread at a time and only for one
+ * message at a time.
+ * Optionally, the session keeps a ring of precomputed keystreams for the next
+ * messages it encrypts, which is filled while the owning thread is idle.
+ * Keys derived with derive_key() are owned by the session itself.
+ */
+class CryptoSession {
+private:
+    const unsigned char *key{nullptr};
+    /* Key material of derive_key(), key points here afterwards: */
+    unsigned char derived_key[ENC_KEY_LEN];
+    /* Messages encrypted since the key was set: */
+    uint64_t encrypted_messages{0};
+    enum aes_gcm_impl impl{AES_GCM_OPENSSL};
+    enum security_mode mode{SECURITY_ENCRYPT};
+    /* OpenSSL implementation: */
+    EVP_CIPHER_CTX *enc_ctx{nullptr};
+    EVP_CIPHER_CTX *dec_ctx{nullptr};
+    /* Built-in implementation: */
+    struct aes_gcm_key native_key;
+    struct aes_gcm_ctx native_ctx;
+    const unsigned char *expected_tag{nullptr};
+    /* Ring of keystreams for the next messages, with nonces already drawn: */
+    struct aes_gcm_keystream *keystreams{nullptr};
+    size_t keystream_capacity{0};
+    size_t keystream_head{0};
+    size_t keystream_count{0};
+
+    void free_contexts();
+
+public:
+    CryptoSession() = default;
+    explicit CryptoSession(const unsigned char *encryption_key);
+    ~CryptoSession();
+
+    CryptoSession(const CryptoSession&) = delete;
+    CryptoSession& operator=(const CryptoSession&) = delete;
+
+    int set_key(const unsigned char *encryption_key,
+            enum aes_gcm_impl preferred_impl = aes_gcm_best_impl());
+
+    int derive_key(const unsigned char *input_key,
+            const unsigned char *salt, size_t salt_len,
+            const unsigned char *info, size_t info_len,
+            enum aes_gcm_impl preferred_impl = aes_gcm_best_impl());
+
+    void clear_key();
+
+    inline const unsigned char *get_key() const {
+        return this->key;
+    }
+
+    inline uint64_t get_encrypted_messages() const {
+        return this->encrypted_messages;
+    }
+
+    inline enum aes_gcm_impl get_impl() const {
+        return this->impl;
+    }
+
+    inline void set_security_mode(enum security_mode security) {
+        this->mode = security;
+    }
+
+    inline enum security_mode get_security_mode() const {
+        return this->mode;
+    }
+
+    /* Whether encrypt_messages and decrypt_messages can be used */
+    inline bool supports_batches() const {
+        return this->impl != AES_GCM_OPENSSL;
+    }
+
+    int enable_precomputation(size_t messages);
+
+    size_t precompute_keystreams(size_t max_messages = 1);
+
+    inline size_t get_precomputed_keystreams() const {
+        return this->keystream_count;
+    }
+
+    int init_encryption(const unsigned char *iv);
+
+    int init_encryption_next_iv(unsigned char *iv);
+
+    int init_decryption(const unsigned char *iv, const unsigned char *tag);
+
+    int encrypt_aad_update(const unsigned char *in, size_t in_size);
+
+    int decrypt_aad_update(const unsigned char *in, size_t in_size);
+
+    int encrypt_update(const unsigned char *in, size_t in_size,
+            unsigned char *out);
+
+    int decrypt_update(const unsigned char *in, size_t in_size,
+            unsigned char *out);
+
+    int finish_encryption(unsigned char *tag);
+
+    int finish_decryption();
+
+    int encrypt_messages(struct aes_gcm_message *messages, size_t count);
+
+    int decrypt_messages(struct aes_gcm_message *messages,
+            const unsigned char *const *tags, int *results, size_t count);
+};
+
+
+#endif //CLIENT_SERVER_TWOSIDED_CRYPTOSESSION_H
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include "CryptoWorker.h"
+#include "Placement.h"
+#include "ServerThread.h"
+
+
+/**
+ * Constructs a CryptoWorker and starts its thread
+ * @param st ServerThread whose requests are handled by the worker
+ * @param max_msg_size Maximum possible request size
+ * @param polling How the worker polls while no requests are submitted, like
+ *      its ServerThread
+ */
+CryptoWorker::CryptoWorker(ServerThread *st, size_t max_msg_size,
+        const struct poll_config& polling) : governor(polling) {
+    this->st = st;
+    this->slot_size = max_msg_size;
+    this->slot_count = std::max((size_t) 1, std::min(
+            CRYPTO_WORKER_QUEUE, CRYPTO_WORKER_BUFFER_SIZE / max_msg_size));
+    this->next_slot = 0;
+    this->in_flight = 0;
+    this->payload_allocations = 0;
+    this->slots = static_cast<unsigned char *>(
+            alloc_local(this->slot_count * this->slot_size));
+    if (!this->slots)
+        throw std::runtime_error("Couldn't allocate crypto worker buffer");
+
+    this->running = true;
+    this->worker_thread = std::thread(work, this);
+}
+
+
+CryptoWorker::~CryptoWorker() {
+    this->stop();
+    for (auto sessions : this->crypto)
+        delete[] sessions;
+    free_local(this->slots, this->slot_count * this->slot_size);
+}
+
+
+/**
+ * CryptoWorkers are allocated on the NUMA node of the placement, like their
+ * slots (see anchor_server::set_placement)
+ */
+void *CryptoWorker::operator new(size_t size) {
+    void *worker = alloc_local(size);
+    if (!worker)
+        throw std::bad_alloc();
+    return worker;
+}
+
+
+void CryptoWorker::operator delete(void *worker, size_t size) {
+    free_local(worker, size);
+}
+
+
+/**
+ * Main loop of the worker thread. Handles submitted requests in order,
+ * until the worker is stopped and no request is left
+ * @param worker The worker whose thread is running
+ */
+void CryptoWorker::work(CryptoWorker *worker) {
+    struct crypto_job job;
+    struct crypto_completion completion;
+    size_t allocations_before = ::get_payload_allocations();
+
+    place_thread();
+    while (true) {
+        if (!worker->jobs.try_pop(&job)) {
+            if (unlikely(!worker->running.load(std::memory_order_acquire)))
+                break;
+            worker->governor.polled(false);
+            continue;
+        }
+        worker->governor.polled(true);
+        completion.handle = job.handle;
+        completion.response = job.ciphertext;
+        completion.response_size = 0;
+        completion.respond = process_offloaded_request(worker->st,
+                job.session, worker->crypto[job.session->get_session_num()] +
+                job.key_phase, job.handle, job.ciphertext, job.ciphertext_len,
+                worker->slot_size, &(completion.response_size));
+        /* Never fails, there are at most as many completions as jobs: */
+        (void) worker->completions.try_push(completion);
+    }
+
+    worker->payload_allocations =
+            ::get_payload_allocations() - allocations_before;
+}
+
+
+/**
+ * Copies a request and hands it to the worker.
+ * May only be called by the dispatch thread
+ * @param handle Handle of the request
+ * @param session Session of the request, has to be synchronized already
+ * @param ciphertext Request buffer
+ * @param ciphertext_size Size of the request, at most max_msg_size
+ * @param key_phase Key phase of the request
+ * @return true if the request was handed over, false if the worker is busy
+ */
+bool CryptoWorker::submit(erpc::ReqHandle *handle, ServerSession *session,
+        const unsigned char *ciphertext, size_t ciphertext_size,
+        uint8_t key_phase) {
+    if (this->in_flight == this->slot_count)
+        return false;
+
+    /* Requests are completed in order, so the slot of the oldest request in
+     * flight is never the next one: */
+    struct crypto_job job = { handle, session,
+            this->slots + this->next_slot * this->slot_size,
+            ciphertext_size, key_phase };
+    this->next_slot = (this->next_slot + 1) % this->slot_count;
+    (void) memcpy(job.ciphertext, ciphertext, ciphertext_size);
+    (void) this->jobs.try_push(job);
+    this->in_flight++;
+    return true;
+}
+
+
+/**
+ * Enqueues the responses that the worker finished since the last call. Only
+ * then they are copied to response buffers, which fit their actual size.
+ * May only be called by the dispatch thread
+ * @return Number of requests that were completed
+ */
+size_t CryptoWorker::collect() {
+    struct crypto_completion completion;
+    size_t completed = 0;
+    while (this->completions.try_pop(&completion)) {
+        if (likely(completion.respond))
+            this->st->enqueue_response_copy(completion.handle,
+                    completion.response, completion.response_size);
+        completed++;
+    }
+    this->in_flight -= completed;
+    return completed;
+}
+
+
+/**
+ * Waits until all requests in flight are completed and enqueues their
+ * responses
+ */
+void CryptoWorker::drain() {
+    while (this->in_flight > 0) {
+        if (this->collect() == 0)
+            std::this_thread::yield();
+    }
+}
+
+
+/**
+ * Takes over the keys and the security mode of a client session.
+ * May only be called while no request is in flight
+ * @param session Client session of the ServerThread
+ * @return 0 on success, -1 on error
+ */
+int CryptoWorker::sync_session(const ServerSession *session) {
+    return copy_session_keys(this->crypto, session);
+}
+
+
+/**
+ * Copies the keys and the security mode of a client session to crypto
+ * sessions of another thread. They may not be in use meanwhile
+ * @param crypto NUM_KEY_PHASES crypto sessions per eRPC session number, the
+ *          ones of the session are allocated on first use
+ * @param session Client session of the ServerThread
+ * @return 0 on success, -1 on error
+ */
+int copy_session_keys(std::vector<CryptoSession *>& crypto,
+        const ServerSession *session) {
+    uint16_t session_num = session->get_session_num();
+    if (session_num >= crypto.size())
+        crypto.resize(session_num + 1, nullptr);
+    if (!crypto[session_num]) {
+        crypto[session_num] = new (std::nothrow) CryptoSession[NUM_KEY_PHASES];
+        if (!crypto[session_num]) {
+            cerr << "Memory allocation failure" << endl;
+            return -1;
+        }
+    }
+
+    CryptoSession *own = crypto[session_num];
+    const CryptoSession *sessions = session->get_crypto_sessions();
+    for (uint8_t phase = 0; phase < NUM_KEY_PHASES; phase++) {
+        if (sessions[phase].get_key() && 0 != own[phase].set_key(
+                sessions[phase].get_key(), sessions[phase].get_impl()))
+            return -1;
+        own[phase].set_security_mode(sessions[phase].get_security_mode());
+    }
+    return 0;
+}
+
+
+/**
+ * Stops the worker thread after it handled all submitted requests.
+ * Their responses still need to be collected
+ */
+void CryptoWorker::stop() {
+    this->running.store(false, std::memory_order_release);
+    if (this->worker_thread.joinable())
+        this->worker_thread.join();
+}
@@ -0,0 +1,120 @@
+#ifndef CLIENT_SERVER_TWOSIDED_CRYPTOWORKER_H
+#define CLIENT_SERVER_TWOSIDED_CRYPTOWORKER_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "client_server_common.h"
+#include "CryptoSession.h"
+#include "rpc.h"
+#include "PollGovernor.h"
+#include "ServerSession.h"
+#include "SpscRing.h"
+
+/* Maximum number of requests that are handed to a worker at once */
+static constexpr size_t CRYPTO_WORKER_QUEUE = 64;
+/* Requests handed to a worker are copied to a buffer of at most this size */
+static constexpr size_t CRYPTO_WORKER_BUFFER_SIZE = 1 << 22;
+
+class ServerThread;
+
+/* Request that is decrypted, handled and answered by a worker */
+struct crypto_job {
+    erpc::ReqHandle *handle;
+    ServerSession *session;
+    unsigned char *ciphertext;
+    size_t ciphertext_len;
+    uint8_t key_phase;
+};
+
+/* Request whose response was encrypted to the slot of the request */
+struct crypto_completion {
+    erpc::ReqHandle *handle;
+    const unsigned char *response;
+    size_t response_size;
+    bool respond;
+};
+
+bool process_offloaded_request(ServerThread *st, ServerSession *session,
+        CryptoSession *crypto, erpc::ReqHandle *req_handle,
+        unsigned char *ciphertext, size_t ciphertext_size, size_t slot_size,
+        size_t *resp_size);
+
+int copy_session_keys(std::vector<CryptoSession *>& crypto,
+        const ServerSession *session);
+
+/*
+ * Thread that takes AES-GCM and the KV-store call off the dispatch thread
+ * of a ServerThread. The dispatch thread submits requests over one SPSC ring
+ * and collects the encrypted responses over another one, since responses
+ * may only be enqueued by the thread that owns the eRPC endpoint.
+ * The worker has its own crypto sessions for every client session, which are
+ * synchronized with the client session while no request is in flight.
+ */
+class CryptoWorker {
+private:
+    ServerThread *st;
+    /* NUM_KEY_PHASES crypto sessions per eRPC session number: */
+    std::vector<CryptoSession *> crypto;
+    SpscRing<struct crypto_job, CRYPTO_WORKER_QUEUE> jobs;
+    SpscRing<struct crypto_completion, CRYPTO_WORKER_QUEUE> completions;
+    /* Copies of the submitted requests, one slot per request in flight.
+     * The response is encrypted to the slot of its request: */
+    unsigned char *slots;
+    size_t slot_size;
+    size_t slot_count;
+    /* Only used by the dispatch thread: */
+    size_t next_slot;
+    size_t in_flight;
+    /* Keeps the state of the dispatch thread and the worker thread on
+     * separate cache lines: */
+    char pad_dispatch[CACHE_LINE_SIZE - 2 * sizeof(size_t)];
+    /* Allocations on the request path of the worker thread */
+    size_t payload_allocations;
+    /* Backs off the worker thread while no requests are submitted: */
+    PollGovernor governor;
+    std::atomic<bool> running;
+    std::thread worker_thread;
+
+    static void work(CryptoWorker *worker);
+
+public:
+    CryptoWorker(ServerThread *st, size_t max_msg_size,
+            const struct poll_config& polling);
+
+    ~CryptoWorker();
+
+    static void *operator new(size_t size);
+
+    static void operator delete(void *worker, size_t size);
+
+    CryptoWorker(const CryptoWorker&) = delete;
+    CryptoWorker& operator=(const CryptoWorker&) = delete;
+
+    bool submit(erpc::ReqHandle *handle, ServerSession *session,
+            const unsigned char *ciphertext, size_t ciphertext_size,
+            uint8_t key_phase);
+
+    size_t collect();
+
+    void drain();
+
+    int sync_session(const ServerSession *session);
+
+    inline bool is_idle() const {
+        return this->in_flight == 0;
+    }
+
+    inline size_t get_in_flight() const {
+        return this->in_flight;
+    }
+
+    void stop();
+
+    inline size_t get_payload_allocations() const {
+        return this->payload_allocations;
+    }
+};
+
+
+#endif //CLIENT_SERVER_TWOSIDED_CRYPTOWORKER_H
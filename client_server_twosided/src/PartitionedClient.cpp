@@ -0,0 +1,191 @@
+#include <stdexcept>
+
+#include "PartitionedClient.h"
+
+
+/**
+ * Constructs the Clients of all partitions. Client::init has to be called
+ * before
+ * @param first_id eRPC ID of the first Client, the partitions use the IDs
+ *          first_id to first_id + partitions - 1
+ * @param partitions Number of threads the partitioned server was hosted with
+ * @param max_key_size Maximum Key size that should be transmitted
+ * @param max_val_size Maximum Value size that should be transmitted
+ */
+PartitionedClient::PartitionedClient(uint8_t first_id, uint8_t partitions,
+        size_t max_key_size, size_t max_val_size) :
+        clients(partitions, nullptr), poll_events{0} {
+    if (partitions == 0 || first_id + partitions - 1 > UINT8_MAX)
+        throw std::runtime_error("Invalid number of partitions");
+    try {
+        for (size_t i = 0; i < partitions; i++) {
+            auto id = static_cast<uint8_t>(first_id + i);
+            this->clients[id % partitions] =
+                    new Client(id, max_key_size, max_val_size);
+            /* An idle partition must not hold up the others: */
+            this->clients[id % partitions]->set_polling(BUSY_POLLING);
+        }
+    } catch (...) {
+        for (auto client : this->clients)
+            delete client;
+        throw;
+    }
+}
+
+PartitionedClient::~PartitionedClient() {
+    for (auto client : this->clients)
+        delete client;
+}
+
+
+/**
+ * Connects every Client to the server thread of its partition
+ * @param server_hostname Hostname of the anchor server
+ * @param udp_port Port on which the communication takes place
+ * @param encryption_key Master key that is shared with the server
+ * @param mode Protection of all messages of the sessions
+ * @return 0 on success, negative value if a session couldn't be established
+ */
+int PartitionedClient::connect(std::string& server_hostname,
+        unsigned int udp_port, const unsigned char *encryption_key,
+        enum security_mode mode) {
+    auto partitions = static_cast<uint8_t>(this->clients.size());
+    for (auto client : this->clients) {
+        int ret = client->connect(server_hostname, udp_port,
+                encryption_key, mode, partitions);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+
+void PartitionedClient::prepare_disconnect() {
+    for (auto client : this->clients)
+        client->prepare_disconnect();
+}
+
+
+/**
+ * Ends the sessions of all partitions
+ */
+void PartitionedClient::disconnect() {
+    for (auto client : this->clients)
+        client->disconnect();
+}
+
+
+/**
+ * Gets the value of a key from the server thread that owns it, see
+ * Client::get
+ * @return 0 on success, -1 on error
+ */
+int PartitionedClient::get(const void *key, size_t key_len,
+        void *value, size_t *value_len,
+        status_callback callback, const void *user_tag,
+        size_t loop_iterations) {
+    if (!key)
+        return -1;
+    return this->route(key, key_len)->get(key, key_len, value, value_len,
+            callback, user_tag, loop_iterations);
+}
+
+
+/**
+ * Puts a value to the server thread that owns its key, see Client::put
+ * @return 0 on success, -1 on error
+ */
+int PartitionedClient::put(const void *key, size_t key_len,
+        const void *value, size_t value_len, status_callback callback,
+        const void *user_tag, size_t loop_iterations) {
+    if (!key)
+        return -1;
+    return this->route(key, key_len)->put(key, key_len, value, value_len,
+            callback, user_tag, loop_iterations);
+}
+
+
+/**
+ * Puts a fragmented value to the server thread that owns its key, see
+ * Client::put_v
+ * @return 0 on success, -1 on error
+ */
+int PartitionedClient::put_v(const void *key, size_t key_len,
+        const struct iovec *value, size_t value_count,
+        status_callback callback, const void *user_tag,
+        size_t loop_iterations) {
+    if (!key)
+        return -1;
+    return this->route(key, key_len)->put_v(key, key_len, value, value_count,
+            callback, user_tag, loop_iterations);
+}
+
+
+/**
+ * Deletes a key at the server thread that owns it, see Client::del
+ * @return 0 on success, -1 on error
+ */
+int PartitionedClient::del(const void *key, size_t key_len,
+        status_callback callback, const void *user_tag,
+        size_t loop_iterations) {
+    if (!key)
+        return -1;
+    return this->route(key, key_len)->del(
+            key, key_len, callback, user_tag, loop_iterations);
+}
+
+
+/**
+ * Starts the derivation of new session keys in all partitions
+ * @param loop_iterations Number of event loop iterations per partition
+ * @return 0 if all rekeyings were started, -1 otherwise
+ */
+int PartitionedClient::rekey(size_t loop_iterations) {
+    int ret = 0;
+    for (auto client : this->clients) {
+        if (0 != client->rekey(loop_iterations))
+            ret = -1;
+    }
+    return ret;
+}
+
+
+/**
+ * Runs the event loops of all partitions n times, one after the other in
+ * every round. A round is idle if no partition sent or received anything
+ * and no request is in flight
+ */
+void PartitionedClient::run_event_loop_n_times(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        size_t events = 0, in_flight = 0;
+        for (auto client : this->clients) {
+            client->run_event_loop_n_times(1);
+            events += client->get_events();
+            in_flight += client->get_in_flight();
+        }
+        this->governor.polled(events != this->poll_events || in_flight > 0);
+        this->poll_events = events;
+    }
+}
+
+
+/**
+ * Sets how the event loops of all partitions poll while they are idle,
+ * see Client::set_polling
+ */
+void PartitionedClient::set_polling(const struct poll_config& config) {
+    this->governor.set_config(config);
+}
+
+
+/**
+ * @return true if the queue of any partition is full, so the next request
+ *          may have to wait for a response
+ */
+bool PartitionedClient::queue_full() {
+    for (auto client : this->clients) {
+        if (client->queue_full())
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,81 @@
+#ifndef CLIENT_SERVER_TWOSIDED_PARTITIONEDCLIENT_H
+#define CLIENT_SERVER_TWOSIDED_PARTITIONEDCLIENT_H
+
+#include <string>
+#include <vector>
+
+#include "client_server_common.h"
+#include "Client.h"
+#include "PollGovernor.h"
+
+/*
+ * Client of a server whose keys are partitioned among its threads (see
+ * anchor_server::set_partitioned). It holds one session per server thread,
+ * each with a Client and an eRPC ID of its own, and sends every request to
+ * the session of the thread that owns its key (see key_partition). The
+ * partition of a session is the remote thread of its Client: the eRPC ID of
+ * the Client modulo the number of partitions. The Clients busy-poll, the
+ * event loop of all partitions backs off as a whole
+ */
+class PartitionedClient {
+private:
+    /* Client of every partition, indexed by the partition */
+    std::vector<Client *> clients;
+    PollGovernor governor;
+    size_t poll_events;
+
+    inline Client *route(const void *key, size_t key_len) {
+        return this->clients[key_partition(key, key_len,
+                static_cast<uint8_t>(this->clients.size()))];
+    }
+
+public:
+
+    PartitionedClient(uint8_t first_id, uint8_t partitions,
+            size_t max_key_size, size_t max_val_size);
+    ~PartitionedClient();
+
+    PartitionedClient(const PartitionedClient&) = delete;
+    PartitionedClient& operator=(const PartitionedClient&) = delete;
+
+    int connect(std::string& server_hostname,
+            unsigned int udp_port, const unsigned char *encryption_key,
+            enum security_mode mode = SECURITY_ENCRYPT);
+
+    void prepare_disconnect();
+
+    void disconnect();
+
+    int get(const void *key, size_t key_len,
+            void *value, size_t *value_len,
+            status_callback callback, const void *user_tag,
+            size_t loop_iterations = 1000);
+
+    int put(const void *key, size_t key_len, const void *value, size_t value_len,
+            status_callback callback, const void *user_tag,
+            size_t loop_iterations = 1000);
+
+    int put_v(const void *key, size_t key_len,
+            const struct iovec *value, size_t value_count,
+            status_callback callback, const void *user_tag,
+            size_t loop_iterations = 1000);
+
+    int del(const void *key, size_t key_len,
+            status_callback callback, const void *user_tag,
+            size_t loop_iterations = 1000);
+
+    int rekey(size_t loop_iterations = 1000);
+
+    void run_event_loop_n_times(size_t n);
+
+    void set_polling(const struct poll_config& config);
+
+    bool queue_full();
+
+    inline size_t get_partitions() const {
+        return this->clients.size();
+    }
+};
+
+
+#endif //CLIENT_SERVER_TWOSIDED_PARTITIONEDCLIENT_H
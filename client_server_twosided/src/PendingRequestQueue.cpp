@@ -2,6 +2,7 @@
 // Created by philip on 04.06.21.
 //
 
+#include <algorithm>
 #include <openssl/rand.h>
 #include "PendingRequestQueue.h"
 
@@ -17,8 +18,11 @@
  * Constructs a queue and initializes the sequence number
  * @param id ID for identification at the server side
  *          (will be included in the sequence number)
+ * @param idle_session If not null, keystreams of this session are precomputed
+ *          while waiting for a free message tag
  */
-PendingRequestQueue::PendingRequestQueue(uint8_t id) {
+PendingRequestQueue::PendingRequestQueue(uint8_t id,
+        CryptoSession *idle_session) : idle_session{idle_session} {
     if (RAND_status() != 1) {
         if (RAND_poll() != 1) {
             throw std::runtime_error("Couldn't initialize RNG");
@@ -60,7 +64,8 @@ void PendingRequestQueue::free_req_buffers(erpc::Rpc<erpc::CTransport>& rpc) {
 
 /**
  * Finds and fills an according message tag for a new request
- * Also fills in the sequence number to the according header
+ * Also fills in the sequence number to the according header. Waits until
+ * the tag is free and the credits of the server allow another request
  * @param op Operation to be performed (e.g. RDMA_PUT)
  * @param user_tag Tag of the caller
  * @param cb Callback of the caller
@@ -74,13 +79,16 @@ msg_tag_t *PendingRequestQueue::prepare_new_request(
 
     size_t index = ACCEPTED_INDEX(this->current_seq_op);
     msg_tag_t *ret = this->queue + index;
-    while (likely(ret->valid)) {
+    while (likely(ret->valid) || this->in_flight >= this->credits) {
         client_rpc.run_event_loop_once();
+        if (this->idle_session)
+            (void) this->idle_session->precompute_keystreams();
     }
 
     // Fill the struct with the provided values:
     ret->validate(user_tag, cb, value_size);
     ret->header.seq_op = SET_OP(this->current_seq_op, op);
+    ret->header.credits = 0;
 
     return ret;
 }
@@ -91,15 +99,26 @@ msg_tag_t *PendingRequestQueue::prepare_new_request(
  * Looks up whether the according
  * @param ret
  * @param seq_op
+ * @param credits Credits of the response, only taken over from authentic
+ *      responses (ret isn't INVALID_RESPONSE). 0 keeps the current credits
  */
-void PendingRequestQueue::message_arrived(enum ret_val ret, uint64_t seq_op) {
+void PendingRequestQueue::message_arrived(enum ret_val ret, uint64_t seq_op,
+        uint16_t credits) {
     size_t index = ACCEPTED_INDEX(PREV_SEQ(seq_op));
     msg_tag_t& tag = this->queue[index];
+    this->events++;
+    if (ret != ret_val::INVALID_RESPONSE && CREDITS_GRANTED(credits) > 0) {
+        this->credits = std::min(static_cast<size_t>(CREDITS_GRANTED(credits)),
+                MAX_ACCEPTED_RESPONSES);
+        if (ret == ret_val::OP_FAILED && (credits & CREDITS_REJECTED))
+            ret = ret_val::OP_REJECTED;
+    }
     /* If this is an expired answer to a request or a replay, we're done */
     if (unlikely(!tag.valid)) {
         // cerr << "Expired message arrived" << endl;
         return;
     }
+    this->in_flight--;
 
     /* Call the Client callback and invalidate */
     tag.invalidate(ret);
@@ -115,11 +134,13 @@ void PendingRequestQueue::invalidate_all_requests() {
         index++;
         index %= MAX_ACCEPTED_RESPONSES;
     }
+    this->in_flight = 0;
 }
 
 
 bool PendingRequestQueue::queue_full() {
     // If the request at the current sequence number index is valid,
     // we know that the queue is full
-    return this->queue[ACCEPTED_INDEX(this->current_seq_op)].valid;
+    return this->queue[ACCEPTED_INDEX(this->current_seq_op)].valid ||
+        this->in_flight >= this->credits;
 }
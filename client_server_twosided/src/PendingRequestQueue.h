@@ -7,6 +7,7 @@
 
 #include "rpc.h"
 #include "client_server_common.h"
+#include "CryptoSession.h"
 #include "sent_message_tag.h"
 
 static constexpr size_t MAX_ACCEPTED_RESPONSES = MAX_PENDING_REQUESTS;
@@ -14,11 +15,20 @@ static constexpr size_t MAX_ACCEPTED_RESPONSES = MAX_PENDING_REQUESTS;
 class PendingRequestQueue {
 private:
     uint64_t current_seq_op = 0;
+    /* Requests sent and responses arrived so far: */
+    size_t events = 0;
+    /* Requests sent and not answered yet, and the number of them that the
+     * server allows (its credits): */
+    size_t in_flight = 0;
+    size_t credits = MAX_ACCEPTED_RESPONSES;
     msg_tag_t queue[MAX_ACCEPTED_RESPONSES];
+    /* Session whose keystreams are precomputed while waiting for a free tag */
+    CryptoSession *idle_session;
 
 public:
 
-    explicit PendingRequestQueue(uint8_t id);
+    explicit PendingRequestQueue(uint8_t id,
+        CryptoSession *idle_session = nullptr);
 
     void allocate_req_buffers(
         erpc::Rpc<erpc::CTransport>& rpc, size_t req_size, size_t resp_size);
@@ -30,15 +40,34 @@ public:
         uint8_t op, const void *user_tag,
         status_callback cb, size_t *value_size=nullptr);
 
-    void message_arrived(enum ret_val ret, uint64_t seq_op);
+    void message_arrived(enum ret_val ret, uint64_t seq_op,
+        uint16_t credits = 0);
 
     void invalidate_all_requests();
 
     bool queue_full();
 
+    inline void set_idle_session(CryptoSession *session) {
+        this->idle_session = session;
+    }
+
     inline void inc_seq() {
         /* Skip one sequence number for the server response */
         this->current_seq_op = NEXT_SEQ(NEXT_SEQ(this->current_seq_op));
+        this->events++;
+        this->in_flight++;
+    }
+
+    inline size_t get_events() const {
+        return this->events;
+    }
+
+    inline size_t get_in_flight() const {
+        return this->in_flight;
+    }
+
+    inline size_t get_credits() const {
+        return this->credits;
     }
 
 };
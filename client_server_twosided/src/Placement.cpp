@@ -0,0 +1,132 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <vector>
+#include <numa.h>
+#include <pthread.h>
+#include <sched.h>
+#include "Placement.h"
+
+static enum anchor_server::placement_policy policy = anchor_server::PLACEMENT_NONE;
+static int node = 0;
+/* Cores of node, handed out in order with PLACEMENT_CORES: */
+static std::vector<size_t> cores;
+static std::atomic_size_t next_core{0};
+
+
+/**
+ * Sets the placement of the threads and buffers that are created afterwards
+ * @param new_policy Placement policy
+ * @param numa_node NUMA node that the threads and buffers are placed on
+ * @return 0 on success, -1 if the node doesn't exist
+ */
+int init_placement(enum anchor_server::placement_policy new_policy,
+        int numa_node) {
+    policy = anchor_server::PLACEMENT_NONE;
+    cores.clear();
+    next_core = 0;
+    if (new_policy == anchor_server::PLACEMENT_NONE)
+        return 0;
+    if (numa_available() < 0) {
+        cerr << "NUMA is not available, threads are not placed" << endl;
+        return 0;
+    }
+    if (numa_node < 0 || numa_node > numa_max_node()) {
+        cerr << "Invalid NUMA node: " << numa_node << endl;
+        return -1;
+    }
+
+    struct bitmask *cpus = numa_allocate_cpumask();
+    if (!cpus || 0 != numa_node_to_cpus(numa_node, cpus)) {
+        cerr << "Could not get the cores of NUMA node " << numa_node << endl;
+        if (cpus)
+            numa_free_cpumask(cpus);
+        return -1;
+    }
+    for (unsigned int cpu = 0; cpu < cpus->size; cpu++) {
+        if (numa_bitmask_isbitset(cpus, cpu))
+            cores.push_back(cpu);
+    }
+    numa_free_cpumask(cpus);
+    if (cores.empty()) {
+        cerr << "NUMA node " << numa_node << " has no cores" << endl;
+        return -1;
+    }
+
+    policy = new_policy;
+    node = numa_node;
+    return 0;
+}
+
+
+/**
+ * Places the calling thread according to the policy. Is called by every
+ * server thread and crypto worker, before it allocates anything
+ */
+void place_thread() {
+    if (policy == anchor_server::PLACEMENT_NONE)
+        return;
+    numa_set_preferred(node);
+    if (policy == anchor_server::PLACEMENT_NODE) {
+        (void) numa_run_on_node(node);
+        return;
+    }
+
+    size_t index = next_core++;
+    if (index == cores.size())
+        cerr << "More threads than cores on NUMA node " << node
+             << ", cores are shared" << endl;
+    cpu_set_t core;
+    CPU_ZERO(&core);
+    CPU_SET(cores[index % cores.size()], &core);
+    if (0 != pthread_setaffinity_np(pthread_self(), sizeof(core), &core))
+        cerr << "Could not pin thread to core " << cores[index % cores.size()]
+             << endl;
+}
+
+
+/**
+ * Allocates memory on the NUMA node of the placement. The memory is
+ * page-aligned then
+ * @param size Size of the memory
+ * @return The memory or nullptr on error
+ */
+void *alloc_local(size_t size) {
+    if (policy == anchor_server::PLACEMENT_NONE)
+        return malloc(size);
+    return numa_alloc_onnode(size, node);
+}
+
+
+/**
+ * Frees memory of alloc_local
+ * @param ptr Memory, may be nullptr
+ * @param size Size that was allocated
+ */
+void free_local(void *ptr, size_t size) {
+    if (policy == anchor_server::PLACEMENT_NONE)
+        free(ptr);
+    else if (ptr)
+        numa_free(ptr, size);
+}
+
+
+/**
+ * Reads the NUMA node of a NIC from sysfs
+ * @param device Name of the network interface (e.g. "eth0") or PCI address
+ *          of the NIC (e.g. "0000:3b:00.0"), if it's bound to DPDK
+ * @return The NUMA node, -1 if it's unknown
+ */
+int anchor_server::get_nic_numa_node(const char *device) {
+    const std::string paths[] = {
+            std::string("/sys/class/net/") + device + "/device/numa_node",
+            std::string("/sys/bus/pci/devices/") + device + "/numa_node" };
+    for (const auto& path : paths) {
+        std::ifstream file(path);
+        int numa_node;
+        if (file >> numa_node)
+            return numa_node;
+    }
+    return -1;
+}
@@ -0,0 +1,23 @@
+#ifndef CLIENT_SERVER_TWOSIDED_PLACEMENT_H
+#define CLIENT_SERVER_TWOSIDED_PLACEMENT_H
+
+#include <cstddef>
+#include "Server.h"
+
+/*
+ * Placement of the server threads, the crypto workers and their buffers on
+ * the NUMA node of the NIC (see anchor_server::set_placement). The policy is
+ * set before the server threads are spawned and stays the same while they
+ * run, so buffers are always freed the way they were allocated
+ */
+
+int init_placement(enum anchor_server::placement_policy policy, int numa_node);
+
+void place_thread();
+
+void *alloc_local(size_t size);
+
+void free_local(void *ptr, size_t size);
+
+
+#endif //CLIENT_SERVER_TWOSIDED_PLACEMENT_H
@@ -0,0 +1,79 @@
+#ifndef CLIENT_SERVER_TWOSIDED_POLLGOVERNOR_H
+#define CLIENT_SERVER_TWOSIDED_POLLGOVERNOR_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#endif
+#include "client_server_common.h"
+
+/*
+ * Decides how an event loop waits after polls that found nothing to do:
+ * While there is traffic, the loop busy-polls. After spin_polls empty polls
+ * in a row, every poll is followed by a pause of the core, after further
+ * pause_polls empty polls the loop sleeps between two polls. The sleep time
+ * doubles from MIN_POLL_SLEEP up to max_sleep, so an idle loop wakes up at
+ * least every max_sleep us. The first poll with traffic returns to
+ * busy-polling
+ */
+class PollGovernor {
+private:
+    struct poll_config config;
+    size_t empty_polls;
+    uint32_t sleep_time;
+
+    static inline void pause_core() {
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    void idle() {
+        if (this->empty_polls - this->config.spin_polls <=
+                this->config.pause_polls || this->config.max_sleep == 0) {
+            pause_core();
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(this->sleep_time));
+        this->sleep_time = std::min(2 * this->sleep_time, this->config.max_sleep);
+    }
+
+public:
+    explicit PollGovernor(const struct poll_config& config = DEFAULT_POLLING) :
+        config(config), empty_polls{0}, sleep_time{MIN_POLL_SLEEP} {}
+
+    inline const struct poll_config& get_config() const {
+        return this->config;
+    }
+
+    inline void set_config(const struct poll_config& new_config) {
+        this->config = new_config;
+        this->empty_polls = 0;
+        this->sleep_time = MIN_POLL_SLEEP;
+    }
+
+    /**
+     * Is called after every poll of the event loop and waits as long as the
+     * phase of the loop demands
+     * @param active True if the poll found traffic or work is in progress
+     */
+    inline void polled(bool active) {
+        if (active) {
+            this->empty_polls = 0;
+            this->sleep_time = MIN_POLL_SLEEP;
+            return;
+        }
+        if (++this->empty_polls <= this->config.spin_polls)
+            return;
+        this->idle();
+    }
+};
+
+
+#endif //CLIENT_SERVER_TWOSIDED_POLLGOVERNOR_H
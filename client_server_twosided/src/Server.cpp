@@ -1,19 +1,109 @@
+#include <algorithm>
+#include <cstring>
 #include <openssl/rand.h>
 
 #include "client_server_common.h"
 
 #include "Server.h"
+#include "Placement.h"
 #include "ServerThread.h"
 
 erpc::Nexus *nexus = nullptr;
+static uint8_t nexus_numa_node = 0;
+/* How the server threads poll while idle: */
+static struct poll_config server_polling = DEFAULT_POLLING;
+/* Credits and rate limits of the clients: */
+static struct anchor_server::admission_config server_admission =
+        anchor_server::DEFAULT_ADMISSION;
+/* Whether idle server threads take over requests of busy ones: */
+static bool work_stealing = false;
+/* Whether every server thread only serves the keys of its partition: */
+static bool partitioned = false;
+/* Whether sessions keep acks for retransmitted requests: */
+static bool response_cache = false;
 std::vector<ServerThread *> *threads = nullptr;
 size_t max_msg_size;
+/* Biggest value that is accepted in a chunked put */
+size_t max_value_size;
+/* Security modes that clients may choose (see SECURITY_MODE_BIT) */
+uint8_t accepted_security_modes;
+/* Allocations on the request path of all terminated ServerThreads */
+size_t request_allocations = 0;
 
 anchor_server::get_function kv_get;
 anchor_server::put_function kv_put;
 anchor_server::delete_function kv_delete;
+/* Set instead of the functions above, if the KV-store is asynchronous: */
+anchor_server::async_get_function kv_async_get = nullptr;
+anchor_server::async_put_function kv_async_put = nullptr;
+anchor_server::async_delete_function kv_async_delete = nullptr;
+/* Optional batched functions for multi-gets and multi-puts: */
+anchor_server::multi_get_function kv_multi_get = nullptr;
+anchor_server::multi_put_function kv_multi_put = nullptr;
 
-void req_handler(erpc::ReqHandle *req_handle, void *context);
+template <uint8_t op, enum security_mode mode, uint8_t phase>
+void typed_req_handler(erpc::ReqHandle *req_handle, void *context);
+template <uint8_t phase>
+void typed_control_handler(erpc::ReqHandle *req_handle, void *context);
+template <enum security_mode mode, uint8_t phase>
+void typed_chunk_handler(erpc::ReqHandle *req_handle, void *context);
+template <enum security_mode mode, uint8_t phase>
+void typed_multi_handler(erpc::ReqHandle *req_handle, void *context);
+
+typedef void (*req_handler_function)(erpc::ReqHandle *, void *);
+
+/* What happens to a request after handle_request */
+enum request_result {
+    REQUEST_DROPPED,
+    REQUEST_RESPOND,
+    REQUEST_CACHED
+};
+
+#define DATA_REQ_HANDLERS(op) \
+    { REQ_TYPE(op, SECURITY_ENCRYPT, 0), \
+            typed_req_handler<op, SECURITY_ENCRYPT, 0> }, \
+    { REQ_TYPE(op, SECURITY_ENCRYPT, 1), \
+            typed_req_handler<op, SECURITY_ENCRYPT, 1> }, \
+    { REQ_TYPE(op, SECURITY_AUTHENTICATE, 0), \
+            typed_req_handler<op, SECURITY_AUTHENTICATE, 0> }, \
+    { REQ_TYPE(op, SECURITY_AUTHENTICATE, 1), \
+            typed_req_handler<op, SECURITY_AUTHENTICATE, 1> }, \
+    { REQ_TYPE(op, SECURITY_NONE, 0), typed_req_handler<op, SECURITY_NONE, 0> }, \
+    { REQ_TYPE(op, SECURITY_NONE, 1), typed_req_handler<op, SECURITY_NONE, 1> }
+
+/* Handlers of all request types, see REQ_TYPE, CONTROL_REQ_TYPE,
+ * CHUNK_REQ_TYPE and MULTI_REQ_TYPE: */
+static const struct {
+    uint8_t req_type;
+    req_handler_function handler;
+} req_handlers[] = {
+    DATA_REQ_HANDLERS(RDMA_GET),
+    DATA_REQ_HANDLERS(RDMA_PUT),
+    DATA_REQ_HANDLERS(RDMA_DELETE),
+    DATA_REQ_HANDLERS(RDMA_ERR),
+    { CONTROL_REQ_TYPE(0), typed_control_handler<0> },
+    { CONTROL_REQ_TYPE(1), typed_control_handler<1> },
+    { CHUNK_REQ_TYPE(SECURITY_ENCRYPT, 0),
+            typed_chunk_handler<SECURITY_ENCRYPT, 0> },
+    { CHUNK_REQ_TYPE(SECURITY_ENCRYPT, 1),
+            typed_chunk_handler<SECURITY_ENCRYPT, 1> },
+    { CHUNK_REQ_TYPE(SECURITY_AUTHENTICATE, 0),
+            typed_chunk_handler<SECURITY_AUTHENTICATE, 0> },
+    { CHUNK_REQ_TYPE(SECURITY_AUTHENTICATE, 1),
+            typed_chunk_handler<SECURITY_AUTHENTICATE, 1> },
+    { CHUNK_REQ_TYPE(SECURITY_NONE, 0), typed_chunk_handler<SECURITY_NONE, 0> },
+    { CHUNK_REQ_TYPE(SECURITY_NONE, 1), typed_chunk_handler<SECURITY_NONE, 1> },
+    { MULTI_REQ_TYPE(SECURITY_ENCRYPT, 0),
+            typed_multi_handler<SECURITY_ENCRYPT, 0> },
+    { MULTI_REQ_TYPE(SECURITY_ENCRYPT, 1),
+            typed_multi_handler<SECURITY_ENCRYPT, 1> },
+    { MULTI_REQ_TYPE(SECURITY_AUTHENTICATE, 0),
+            typed_multi_handler<SECURITY_AUTHENTICATE, 0> },
+    { MULTI_REQ_TYPE(SECURITY_AUTHENTICATE, 1),
+            typed_multi_handler<SECURITY_AUTHENTICATE, 1> },
+    { MULTI_REQ_TYPE(SECURITY_NONE, 0), typed_multi_handler<SECURITY_NONE, 0> },
+    { MULTI_REQ_TYPE(SECURITY_NONE, 1), typed_multi_handler<SECURITY_NONE, 1> }
+};
 
 
 /**
@@ -21,19 +111,44 @@ void req_handler(erpc::ReqHandle *req_handle, void *context);
  * connections
  * @param hostname Hostname (e.g. IP-address) of the server
  * @param udp_port Port for communication for initialization for the connection
+ * @param numa_node NUMA node that eRPC takes its hugepages from. Should be the
+ *          node of the NIC (see get_nic_numa_node)
  */
-int anchor_server::init(string &hostname, uint16_t udp_port) {
+int anchor_server::init(string &hostname, uint16_t udp_port, uint8_t numa_node) {
     std::string server_uri = hostname + ":" + std::to_string(udp_port);
-    nexus = new erpc::Nexus(server_uri, 0, 0);
-    if (nexus->register_req_func(DEFAULT_REQ_TYPE, req_handler)) {
-        cerr << "Failed to initialize Server" << endl;
-        terminate();
-        return -1;
+    nexus = new erpc::Nexus(server_uri, numa_node, 0);
+    nexus_numa_node = numa_node;
+    for (const auto& req_handler : req_handlers) {
+        if (nexus->register_req_func(req_handler.req_type, req_handler.handler)) {
+            cerr << "Failed to initialize Server" << endl;
+            terminate();
+            return -1;
+        }
     }
     return 0;
 }
 
 
+/**
+ * Sets how the server threads and crypto workers of the next call to
+ * host_server are placed. All of them run on the NUMA node that init was
+ * called with, their scratch and batch buffers are allocated there as well.
+ * With PLACEMENT_CORES, each thread is pinned to a core of its own, in the
+ * order the threads start. If host_server isn't asynchronous, the calling
+ * thread is pinned as well. May not be called while server threads run,
+ * since they are freed according to the placement
+ * @param policy Placement policy, PLACEMENT_NONE leaves it to the OS
+ * @return 0 on success, -1 if the threads can't be placed on the node
+ */
+int anchor_server::set_placement(enum placement_policy policy) {
+    if (threads && !threads->empty()) {
+        cerr << "Placement can't be changed while the server runs" << endl;
+        return -1;
+    }
+    return init_placement(policy, nexus_numa_node);
+}
+
+
 /**
  * Deletes the nexus object, new connections can't be initialized after calling
  */
@@ -44,13 +159,91 @@ void anchor_server::terminate() {
     }
 }
 
+/**
+ * Spawns the server threads after the KV-store functions were set
+ * (see host_server)
+ */
+static int host_threads(const unsigned char *encryption_key,
+        uint8_t number_threads, size_t max_entry_size, bool asynchronous,
+        uint8_t security_modes, uint8_t crypto_workers,
+        uint8_t max_crypto_workers, bool persistent) {
+
+    /* Control messages and values with chunk header have to fit into the
+     * response buffers as well: */
+    max_msg_size = std::max(CIPHERTEXT_SIZE(max_entry_size +
+            sizeof(struct rdma_chunk_header)), CONTROL_MESSAGE_SIZE);
+    max_value_size = max_entry_size;
+    if (max_msg_size > erpc::Rpc<erpc::CTransport>::kMaxMsgSize) {
+        /* Bigger entries are transferred in chunks: */
+        max_msg_size = CHUNK_MESSAGE_SIZE;
+        if (max_msg_size > erpc::Rpc<erpc::CTransport>::kMaxMsgSize) {
+            cerr << "Chunks don't fit into an eRPC message" << endl;
+            return -1;
+        }
+    }
+
+    if (persistent && !asynchronous) {
+        cerr << "A persistent server has to be asynchronous" << endl;
+        return -1;
+    }
+
+    if (RAND_status() != 1) {
+        if (RAND_poll() != 1) {
+            cerr << "Could not initialize RNG" << endl;
+            return -1;
+        }
+    }
+
+    /* Workers would call the KV-store for the keys of their thread
+     * concurrently: */
+    if (partitioned && (crypto_workers > 0 || max_crypto_workers > 0)) {
+        cerr << "A partitioned server can't have crypto workers" << endl;
+        return -1;
+    }
+    uint8_t partitions = partitioned ? number_threads : 0;
+
+    threads = new std::vector<ServerThread *>();
+
+#if NO_ENCRYPTION
+    (void) security_modes;
+    accepted_security_modes = SECURITY_MODE_BIT(SECURITY_NONE);
+#else
+    accepted_security_modes = security_modes;
+#endif // NO_ENCRYPTION
+
+    if (!asynchronous)
+        number_threads--;
+    for (uint8_t id = 0; id < number_threads; id++) {
+        threads->push_back(new ServerThread(nexus, id, max_msg_size,
+                encryption_key, true, crypto_workers, max_crypto_workers,
+                persistent, server_polling, server_admission,
+                work_stealing && !kv_async_get, partitions, response_cache));
+    }
+    if (!asynchronous) {
+        ServerThread thread(nexus, number_threads, max_msg_size,
+                encryption_key, false, crypto_workers, max_crypto_workers,
+                false, server_polling, server_admission, false, partitions,
+                response_cache);
+        request_allocations += thread.get_payload_allocations();
+    }
+
+    return 0;
+}
+
+
 /**
  * Hosts a server that answers client put/get/delete requests
  *
- * @param encryption_key Network key to use for en-/decryption of the messages
- * @param number_threads Number of threads that are spawned at the beginning
- *          Limits the number of clients
- * @param max_entry_size Size of biggest key-value-pair in the KV-store
+ * @param encryption_key Master key that the key of every session is derived
+ *          from. Is only used for the handshakes and has to stay valid as
+ *          long as new clients may connect
+ * @param number_threads Number of threads that are spawned at the beginning.
+ *          Every thread serves any number of clients and terminates when all
+ *          clients that connected to it disconnected again, unless the server
+ *          is persistent
+ * @param max_entry_size Size of biggest key-value-pair in the KV-store.
+ *          Entries that don't fit into one eRPC message are transferred in
+ *          chunks
  * @param asynchronous If true, the method terminates when the last spawned
  *          thread has terminated. Other threads may still run after termination
  *          of this method.
@@ -58,48 +251,212 @@ void anchor_server::terminate() {
  * @param get Function of the KV-Store that is called on client get-requests
  * @param put Function of the KV-Store that is called on client put-requests
  * @param del Function of the KV-Store that is called on client delete-requests
+ * @param security_modes Security modes that clients may choose, as a bitmask
+ *          of SECURITY_MODE_BIT. Without encryption support, only
+ *          SECURITY_NONE is accepted
+ * @param crypto_workers Number of worker threads per server thread that
+ *          en-/decrypt requests and call the KV-store, while the server
+ *          thread only polls. With 0, every server thread handles its
+ *          requests itself. The get_function has to return values that stay
+ *          valid until its next call in the same thread
+ * @param max_crypto_workers If bigger than crypto_workers, the workers of
+ *          every server thread are an elastic pool: a worker is added while
+ *          requests have to wait for a free worker and removed while the
+ *          remaining workers would suffice. The pool keeps at least one worker
+ * @param persistent If true, server threads keep running after their clients
+ *          disconnected, so clients may connect and disconnect at any time
+ *          until close_connection(true) is called. Requires asynchronous
  * @return 0 if Server was hosted successfully, -1 on error
  */
 int anchor_server::host_server(
         const unsigned char *encryption_key,
         uint8_t number_threads,
         size_t max_entry_size, bool asynchronous,
-        get_function get, put_function put, delete_function del) {
+        get_function get, put_function put, delete_function del,
+        uint8_t security_modes, uint8_t crypto_workers,
+        uint8_t max_crypto_workers, bool persistent) {
+    kv_get = get;
+    kv_put = put;
+    kv_delete = del;
+    kv_async_get = nullptr;
+    kv_async_put = nullptr;
+    kv_async_delete = nullptr;
+    return host_threads(encryption_key, number_threads, max_entry_size,
+            asynchronous, security_modes, crypto_workers, max_crypto_workers,
+            persistent);
+}
 
-    max_msg_size = CIPHERTEXT_SIZE(max_entry_size);
-    if (max_msg_size > erpc::Rpc<erpc::CTransport>::kMaxMsgSize) {
-        cerr << "Maximum entry size is too big. Not supported (yet)" << endl;
-        cerr << "Maximum supported entry size: ";
-        cerr << PAYLOAD_SIZE(erpc::Rpc<erpc::CTransport>::kMaxMsgSize) << endl;
-        return -1;
-    }
 
-    if (RAND_status() != 1) {
-        if (RAND_poll() != 1) {
-            cerr << "Could not initialize RNG" << endl;
-            return -1;
+/**
+ * Hosts a server with an asynchronous KV-store. The KV-store functions only
+ * start an operation and return. Every operation is finished by a call to
+ * complete_request, from any thread, and the server thread that received the
+ * request sends the response afterwards. So a slow KV-store doesn't stall the
+ * event loop, and many operations may be in flight per server thread.
+ * Keys and values passed to the KV-store are only valid during the call.
+ * Requests aren't offloaded to crypto workers.
+ * For the other parameters, see the synchronous host_server
+ *
+ * @param get Function that starts a get operation
+ * @param put Function that starts a put operation
+ * @param del Function that starts a delete operation
+ * @return 0 if Server was hosted successfully, -1 on error
+ */
+int anchor_server::host_server(
+        const unsigned char *encryption_key,
+        uint8_t number_threads,
+        size_t max_entry_size, bool asynchronous,
+        async_get_function get, async_put_function put,
+        async_delete_function del,
+        uint8_t security_modes, bool persistent) {
+    kv_get = nullptr;
+    kv_put = nullptr;
+    kv_delete = nullptr;
+    kv_async_get = get;
+    kv_async_put = put;
+    kv_async_delete = del;
+    return host_threads(encryption_key, number_threads, max_entry_size,
+            asynchronous, security_modes, 0, 0, persistent);
+}
+
+
+/**
+ * Finishes an operation of the asynchronous KV-store. May be called by any
+ * thread, but only once per request. The request must not be used afterwards
+ * @param request Request that was passed to the KV-store function
+ * @param status Negative, if the operation failed
+ * @param value Value of a get, nullptr if the key doesn't exist. Is copied
+ *          before this function returns
+ * @param value_len Length of value
+ */
+void anchor_server::complete_request(struct kv_request *request, int status,
+        const void *value, size_t value_len) {
+    const unsigned char *data = static_cast<const unsigned char *>(value);
+    bool get = OP_FROM_SEQ_OP(request->header.seq_op) == RDMA_GET;
+    request->status = status;
+
+    if (status >= 0 && get && unlikely(!value))
+        request->status = -1;
+
+    /* Chunked gets keep the whole value as well, the server thread takes the
+     * snapshot of the transfer from it: */
+    if (request->status >= 0 && get && value_len > 0) {
+        if (value_len > request->value_capacity) {
+            auto buf = static_cast<unsigned char *>(
+                    realloc(request->value, value_len));
+            if (buf) {
+                request->value = buf;
+                request->value_capacity = value_len;
+            }
+        }
+        if (likely(value_len <= request->value_capacity)) {
+            (void) memcpy(request->value, data, value_len);
+            request->value_len = value_len;
+        } else {
+            cerr << "Memory allocation failure" << endl;
+            request->status = -1;
         }
     }
+    request->st->push_completed_request(request);
+}
 
-    enc_key = encryption_key;
-    threads = new std::vector<ServerThread *>();
 
-    kv_get = get;
-    kv_put = put;
-    kv_delete = del;
+/**
+ * Sets how the server threads of the next call to host_server poll eRPC.
+ * They busy-poll while requests arrive and back off to pauses and sleeps
+ * when they are idle, so other workloads can share their cores. Their crypto
+ * workers poll for submitted requests the same way
+ * @param config DEFAULT_POLLING, BUSY_POLLING for dedicated cores, or a
+ *          custom governor. The reaction time of an idle server thread or
+ *          crypto worker is bounded by config.max_sleep
+ */
+void anchor_server::set_polling(const struct poll_config& config) {
+    server_polling = config;
+}
 
-    if (!asynchronous)
-        number_threads--;
-    for (uint8_t id = 0; id < number_threads; id++) {
-        threads->push_back(new ServerThread(nexus, id, max_msg_size));
-    }
-    if (!asynchronous)
-        ServerThread thread(nexus, number_threads, max_msg_size, false);
 
+/**
+ * Sets the flow control of the clients of the next call to host_server.
+ * Every session is granted credits, the number of requests that its client
+ * may have in flight: config.session_credits, unless the sessions of a
+ * server thread would exceed config.thread_credits together. Then the
+ * thread credits are shared equally, at least one per session. The credits
+ * are advertised in every response and follow the sessions that connect
+ * and disconnect. A client that exceeds its credits at the asynchronous
+ * KV-store or its request rate gets an error with CREDITS_REJECTED set,
+ * without the KV-store being called
+ * @param config DEFAULT_ADMISSION or custom limits
+ * @return 0 on success, -1 if the limits are invalid
+ */
+int anchor_server::set_admission(const struct admission_config& config) {
+    if (config.session_credits == 0 || config.thread_credits == 0 ||
+            config.session_credits > CREDITS_GRANTED(UINT16_MAX)) {
+        cerr << "Invalid admission limits" << endl;
+        return -1;
+    }
+    server_admission = config;
     return 0;
 }
 
 
+/**
+ * Lets the server threads of the next call to host_server balance skewed
+ * load: Each asynchronous thread without crypto workers shares the requests
+ * it receives while other threads are idle, and those take them over.
+ * Decryption, the KV-store call and encryption of a request then run on the
+ * idle thread, while the response is still sent by the thread of the
+ * session. Has no effect with the asynchronous KV-store, whose completions
+ * arrive at the thread of the session
+ * @param enabled True to share requests between the server threads
+ */
+void anchor_server::set_work_stealing(bool enabled) {
+    work_stealing = enabled;
+}
+
+
+/**
+ * Partitions the keys among the server threads of the next call to
+ * host_server, so a KV-store that is partitioned itself (e.g. one hash table
+ * per core) needs no locks: Thread i only calls the KV-store for keys with
+ * key_partition(key, key_len, number_threads) == i, requests for other keys
+ * fail. Clients send every request to the thread of its key, see
+ * PartitionedClient. Crypto workers and work stealing are not available,
+ * since they call the KV-store from other threads
+ * @param enabled True to partition the keys
+ */
+void anchor_server::set_partitioned(bool enabled) {
+    partitioned = enabled;
+}
+
+
+/**
+ * Lets the sessions of the next call to host_server keep the acks of their
+ * last requests, so a client that retransmits a request with the same
+ * sequence number gets the same ack again, without a second KV-store call
+ * (see RESPONSE_CACHE_SIZE). Client never does so, so the cache is off by
+ * default and acks are sent without copying them to it
+ * @param enabled True to cache acks
+ */
+void anchor_server::set_response_cache(bool enabled) {
+    response_cache = enabled;
+}
+
+
+/**
+ * Sets batched KV-store functions for multi-gets and multi-puts, so the
+ * KV-store is called once per multi-operation. Without them, the functions
+ * for single keys are called for every key. Has to be called before
+ * host_server
+ * @param get Function that gets the values of several keys
+ * @param put Function that puts several key-value-pairs
+ */
+void anchor_server::set_multi_functions(
+        multi_get_function get, multi_put_function put) {
+    kv_multi_get = get;
+    kv_multi_put = put;
+}
+
+
 /**
  * Closes the connection that was before opened by a call to host_server
  * @param force If true, forces each server thread to disconnect from the client
@@ -110,62 +467,202 @@ void anchor_server::close_connection(bool force) {
         if (force)
             thread->terminate();
         thread->join();
-        delete thread;
+        request_allocations += thread->get_payload_allocations();
     }
+    /* Threads steal from each other until all of them stopped: */
+    ServerThread::clear_peers();
+    for (auto thread : *threads)
+        delete thread;
     delete threads;
+    threads = nullptr;
 }
 
 
 /**
- * Internal function for sending an encrypted response to a client.
- * Is called whenever any response is sent
+ * Returns the number of heap allocations on the request path of all server
+ * threads that have terminated so far. Is 0 if all requests could be
+ * decrypted into the pre-allocated scratch buffers
+ */
+size_t anchor_server::get_request_allocations() {
+    return request_allocations;
+}
+
+
+/**
+ * Encrypts a response to a response buffer of its request
  *
- * @param req_handle Handle that came with the request
- * @param st ServerThread for the according client
+ * @param resp_buffer Response buffer (see ServerThread::get_response_buffer)
+ * @param resp_size Size of the response buffer
+ * @param session Crypto session that the response is encrypted with
  * @param header struct for the header of the sent message
  * @param payload Payload struct
+ * @return true if the response buffer can be enqueued, false on error
  */
-void send_encrypted_response(erpc::ReqHandle *req_handle, ServerThread *st,
-        struct rdma_msg_header *header, struct rdma_enc_payload *payload) {
+bool encrypt_response(erpc::MsgBuffer *resp_buffer, size_t resp_size,
+        CryptoSession *session, struct rdma_msg_header *header,
+        struct rdma_enc_payload *payload) {
 
     unsigned char *ciphertext;
-    erpc::MsgBuffer *resp_buffer;
-    /* The server never sends back a key, so the value length is sufficient */
-    size_t ciphertext_size = CIPHERTEXT_SIZE(payload->value_len);
-    if (unlikely(ciphertext_size > max_msg_size)) {
-        cerr << "Answer too long for pre-allocated message buffer" << endl;
-        return;
+    /* Only responses to chunks have a key, the chunk header */
+    size_t ciphertext_size = MESSAGE_SIZE(session->get_security_mode(),
+            header->key_len + payload->value_len);
+    if (unlikely(ciphertext_size > resp_size)) {
+        cerr << "Answer too long for response buffer" << endl;
+        return false;
     }
-    resp_buffer = &(req_handle->pre_resp_msgbuf);
     erpc::Rpc<erpc::CTransport>::resize_msg_buffer(resp_buffer, ciphertext_size);
     ciphertext = (unsigned char *) resp_buffer->buf;
 
-    if (unlikely(0 != encrypt_message(header, payload, &ciphertext))) {
+    if (unlikely(0 != encrypt_message(session, header, payload, &ciphertext))) {
         cerr << "Failed to encrypt message" << endl;
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Encrypts a response with the given crypto session to a response buffer of
+ * its size class and enqueues it
+ *
+ * @param req_handle Handle that came with the request
+ * @param st ServerThread for the according client
+ * @param session Crypto session that the response is encrypted with
+ * @param header struct for the header of the sent message
+ * @param payload Payload struct
+ * @param cache If set, the response is kept in the response cache of this
+ *          session for retransmissions of the request
+ */
+void send_encrypted_response(erpc::ReqHandle *req_handle, ServerThread *st,
+        CryptoSession *session, struct rdma_msg_header *header,
+        struct rdma_enc_payload *payload, ServerSession *cache = nullptr) {
+    size_t resp_size = MESSAGE_SIZE(session->get_security_mode(),
+            header->key_len + payload->value_len);
+    erpc::MsgBuffer *resp_buffer = st->get_response_buffer(req_handle, resp_size);
+    if (unlikely(!resp_buffer))
         return;
+    if (encrypt_response(resp_buffer, resp_size, session, header, payload)) {
+        if (cache)
+            cache->cache_response(header->seq_op, resp_buffer->buf,
+                    resp_buffer->get_data_size());
+        st->enqueue_response(req_handle, resp_buffer);
     }
+    else
+        st->release_response_buffer(req_handle, resp_buffer);
+}
 
-    st->enqueue_response(req_handle, resp_buffer);
+
+/**
+ * Copies the cached response to a retransmitted request into a response
+ * buffer (see handle_request)
+ * @param st ServerThread for the according client
+ * @param session Session of the client
+ * @param seq_op seq_op of the request
+ * @param resp_buffer Response buffer with room for CACHED_RESPONSE_SIZE bytes
+ * @return true if the response buffer can be enqueued, false if the response
+ *      was evicted in the meantime
+ */
+static bool copy_cached_response(ServerThread *st, ServerSession *session,
+        uint64_t seq_op, erpc::MsgBuffer *resp_buffer) {
+    size_t size;
+    if (unlikely(!session->get_cached_response(seq_op,
+            static_cast<unsigned char *>(resp_buffer->buf), &size))) {
+        st->get_stats()->count_replay();
+        return false;
+    }
+    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(resp_buffer, size);
+    st->get_stats()->count_retransmit();
+    return true;
+}
+
+
+/**
+ * Answers a retransmitted request from the response cache with a response
+ * buffer of its own
+ * @param req_handle Handle of the request
+ * @param st ServerThread for the according client
+ * @param session Session of the client
+ * @param seq_op seq_op of the request
+ */
+static void send_cached_response(erpc::ReqHandle *req_handle, ServerThread *st,
+        ServerSession *session, uint64_t seq_op) {
+    erpc::MsgBuffer *resp_buffer =
+            st->get_response_buffer(req_handle, CACHED_RESPONSE_SIZE);
+    if (unlikely(!resp_buffer))
+        return;
+    if (copy_cached_response(st, session, seq_op, resp_buffer))
+        st->enqueue_response(req_handle, resp_buffer);
+    else
+        st->release_response_buffer(req_handle, resp_buffer);
+}
+
+
+/**
+ * Internal function for sending an encrypted response to a client.
+ * Is called whenever any response is sent by the ServerThread itself
+ *
+ * @param req_handle Handle that came with the request
+ * @param st ServerThread for the according client
+ * @param session Session of the client
+ * @param header struct for the header of the sent message
+ * @param payload Payload struct
+ */
+void send_encrypted_response(erpc::ReqHandle *req_handle, ServerThread *st,
+        ServerSession *session, struct rdma_msg_header *header,
+        struct rdma_enc_payload *payload) {
+    send_encrypted_response(req_handle, st,
+            session->get_crypto_session(), header, payload);
 }
 
 
 /**
- * Sends a response with no payload (e.g. error message, put/delete response)
+ * Like send_encrypted_response, but the value of the response is gathered
+ * from several fragments. The response never has a key
+ *
+ * @param req_handle Handle that came with the request
  * @param st ServerThread for the according client
+ * @param session Session of the client
+ * @param header struct for the header of the sent message
+ * @param value Fragments of the value
+ * @param value_count Number of fragments
  */
-void send_empty_response(erpc::ReqHandle *req_handle, ServerThread *st,
-        struct rdma_msg_header *header) {
+void send_encrypted_response_v(erpc::ReqHandle *req_handle, ServerThread *st,
+        ServerSession *session, struct rdma_msg_header *header,
+        const struct iovec *value, size_t value_count) {
+
+    CryptoSession *crypto = session->get_crypto_session();
+    erpc::MsgBuffer *resp_buffer;
+    unsigned char *ciphertext;
+    size_t value_len = 0;
+    for (size_t i = 0; i < value_count; i++) {
+        if (value[i].iov_base)
+            value_len += value[i].iov_len;
+    }
     header->key_len = 0;
-    struct rdma_enc_payload payload = { nullptr, nullptr, 0 };
-    send_encrypted_response(req_handle, st, header, &payload);
+    size_t ciphertext_size = MESSAGE_SIZE(
+            crypto->get_security_mode(), value_len);
+    resp_buffer = st->get_response_buffer(req_handle, ciphertext_size);
+    if (unlikely(!resp_buffer))
+        return;
+    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(resp_buffer, ciphertext_size);
+    ciphertext = (unsigned char *) resp_buffer->buf;
+
+    if (unlikely(0 != encrypt_message_v(crypto,
+            header, nullptr, value, value_count, &ciphertext))) {
+        cerr << "Failed to encrypt message" << endl;
+        st->release_response_buffer(req_handle, resp_buffer);
+        return;
+    }
+    st->enqueue_response(req_handle, resp_buffer);
 }
 
+
 /**
-* Request handler for incoming receive requests
-* Then, transfers data at the specified address to the client
+* Handles a get request by passing it to the KV-store
+* The response contains the value, if the key exists
 * */
-void send_response_get(erpc::ReqHandle *req_handle, ServerThread *st,
-        struct rdma_msg_header *header, const void *key) {
+void response_get(ServerSession *session, struct rdma_msg_header *header,
+        const void *key, struct rdma_enc_payload *response) {
 
     size_t resp_len;
     /* Call KV-store: */
@@ -173,18 +670,13 @@ void send_response_get(erpc::ReqHandle *req_handle, ServerThread *st,
             kv_get(key, header->key_len, &resp_len));
 
     if (!resp) {
-        header->seq_op = st->get_next_seq(header->seq_op, RDMA_ERR);
-        send_empty_response(req_handle, st, header);
+        session->set_response(header, RDMA_ERR);
         return;
     }
 
     /* Reuse the request header for creating and enqueueing the response: */
-    header->seq_op = st->get_next_seq(header->seq_op, RDMA_GET);
-    header->key_len = 0;
-    struct rdma_enc_payload payload = { nullptr, resp, resp_len };
-
-    send_encrypted_response(req_handle, st, header, &payload);
-
+    session->set_response(header, RDMA_GET);
+    *response = { nullptr, resp, resp_len };
 }
 
 
@@ -193,112 +685,994 @@ void send_response_get(erpc::ReqHandle *req_handle, ServerThread *st,
 * Checks freshness and checksum
 * Then, writes data from the client to the specified address
 * */
-void send_response_put(erpc::ReqHandle *req_handle, ServerThread *st,
+void response_put(ServerSession *session,
         struct rdma_msg_header *header, struct rdma_dec_payload *payload) {
 
     /* Call KV-store: */
     int resp = kv_put(payload->key, header->key_len, payload->value, payload->value_len);
     if (0 > resp) {
-        header->seq_op = st->get_next_seq(header->seq_op, RDMA_ERR);
+        session->set_response(header, RDMA_ERR);
     }
     else {
-        header->seq_op = st->get_next_seq(header->seq_op, RDMA_PUT);
+        session->set_response(header, RDMA_PUT);
     }
     /* We only inform the client about whether the operation was successful or not */
-    send_empty_response(req_handle, st, header);
 }
 
 
 /**
- * Handles a delete request, passes it to the KV-store and sends a response message
- * to the client
- * @param req_handle Handle of the request
+ * Handles a delete request and passes it to the KV-store
  * @param header Header of the incoming request that is reused for the response
- * @param payload Payload structure of the incoming request
+ * @param key Key to delete
  */
-void send_response_delete(erpc::ReqHandle *req_handle, ServerThread *st,
-        struct rdma_msg_header *header,
-        const void *key) {
+void response_delete(ServerSession *session,
+        struct rdma_msg_header *header, const void *key) {
 
     /* Call KV-store: */
     int resp = kv_delete(key, header->key_len);
     if (0 > resp) {
-        header->seq_op = st->get_next_seq(header->seq_op, RDMA_ERR);
+        session->set_response(header, RDMA_ERR);
     }
     else {
-        header->seq_op = st->get_next_seq(header->seq_op, RDMA_DELETE);
+        session->set_response(header, RDMA_DELETE);
     }
     /* We only inform the client about whether the operation was successful or not */
-    send_empty_response(req_handle, st, header);
 }
 
 
 /**
- * Sends a response to a disconnect request
+ * Fills in the response to a chunk of a get. When chunk 0 of a value with more
+ * chunks is answered, a snapshot of the value is taken, so the other chunks
+ * are served from the same version of it
+ * @param session Session of the client
+ * @param header Header of the request that is reused for the response
+ * @param chunk Chunk header of the request, is filled in for the response
+ * @param value Whole value, nullptr if it doesn't exist
+ * @param value_len Length of value
+ * @param response Payload of the response
+ * @param snapshot Snapshot that value belongs to, nullptr for chunk 0
+ * @return true if the chunk is sent, false if an error is sent instead
  */
-void send_response_disconnect(erpc::ReqHandle *req_handle, ServerThread *st,
-        struct rdma_msg_header *header) {
+static bool set_chunk_response(ServerSession *session,
+        struct rdma_msg_header *header, struct rdma_chunk_header *chunk,
+        const unsigned char *value, size_t value_len,
+        struct rdma_enc_payload *response, struct chunk_snapshot *snapshot) {
+    if (!value || chunk->index >= CHUNK_COUNT(value_len) ||
+            (snapshot && snapshot->chunk_served[chunk->index]))
+        goto err_set_chunk_response;
+    chunk->total_len = value_len;
+    chunk->count = static_cast<uint32_t>(CHUNK_COUNT(value_len));
+    if (chunk->index == 0 && chunk->count > 1) {
+        snapshot = session->take_snapshot(chunk->transfer_seq,
+                value, value_len);
+        if (!snapshot)
+            goto err_set_chunk_response;
+    }
+    if (snapshot) {
+        snapshot->chunk_served[chunk->index] = true;
+        snapshot->served++;
+    }
+
+    session->set_response(header, RDMA_GET);
+    header->key_len = sizeof(struct rdma_chunk_header);
+    *response = { (const unsigned char *) chunk,
+            value + chunk->index * CHUNK_SIZE,
+            CHUNK_LEN(value_len, chunk->index) };
+    return true;
+
+err_set_chunk_response:
+    session->set_response(header, RDMA_ERR);
+    header->key_len = 0;
+    return false;
+}
+
+
+/**
+ * Hands a request to the asynchronous KV-store. Once the KV-store completed
+ * it, the ServerThread sends the response with send_deferred_response
+ * @param st ServerThread for the according client
+ * @param session Session of the client
+ * @param req_handle Handle of the request
+ * @param header Header of the request
+ * @param key Key of the request
+ * @param key_len Length of key
+ * @param value Value of a put
+ * @param value_len Length of value
+ * @param chunk Chunk header of a chunked get, nullptr otherwise
+ * @return true if the request was handed over, false if the KV-store couldn't
+ *      be called and an error has to be sent back
+ */
+bool defer_kv_request(ServerThread *st, ServerSession *session,
+        erpc::ReqHandle *req_handle, const struct rdma_msg_header *header,
+        const void *key, size_t key_len, void *value, size_t value_len,
+        const struct rdma_chunk_header *chunk) {
+    struct anchor_server::kv_request *request =
+            st->defer_request(session, req_handle);
+    if (unlikely(!request))
+        return false;
+    request->header = *header;
+    if (chunk) {
+        request->chunked = true;
+        request->chunk = *chunk;
+    }
 
     /* Call KV-store: */
-    header->seq_op = st->get_next_seq(header->seq_op, RDMA_ERR);
-    /* We only inform the client about whether the operation was successful or not */
-    send_empty_response(req_handle, st, header);
+    switch (OP_FROM_SEQ_OP(header->seq_op)) {
+        case RDMA_GET:
+            kv_async_get(key, key_len, request);
+            break;
+        case RDMA_PUT:
+            kv_async_put(key, key_len, value, value_len, request);
+            break;
+        default:
+            kv_async_delete(key, key_len, request);
+    }
+    return true;
+}
+
+
+/**
+ * Sends the response to a request that the asynchronous KV-store completed.
+ * Is called by the ServerThread that received the request, the response is
+ * encrypted with the key phase of the request
+ * @param st ServerThread that received the request
+ * @param request Completed request
+ */
+void send_deferred_response(ServerThread *st,
+        struct anchor_server::kv_request *request) {
+    ServerSession *session = request->session;
+    struct rdma_msg_header *header = &(request->header);
+    struct rdma_enc_payload response = { nullptr, nullptr, 0 };
+    uint8_t op = OP_FROM_SEQ_OP(header->seq_op);
+
+    /* The client disconnected in the meantime: */
+    if (unlikely(session->is_closed()))
+        return;
+
+    header->key_len = 0;
+    if (unlikely(request->status < 0))
+        op = RDMA_ERR;
+    else if (op == RDMA_GET && request->chunked) {
+        /* An empty value exists, even without a buffer: */
+        (void) set_chunk_response(session, header, &(request->chunk),
+                request->value_len > 0 ? request->value :
+                (const unsigned char *) "", request->value_len, &response,
+                nullptr);
+        send_encrypted_response(request->handle, st,
+                session->get_crypto_session(request->key_phase), header,
+                &response);
+        return;
+    } else if (op == RDMA_GET) {
+        response.value = request->value;
+        response.value_len = request->value_len;
+    }
+    session->set_response(header, op);
+    send_encrypted_response(request->handle, st,
+            session->get_crypto_session(request->key_phase), header, &response,
+            session);
+}
+
+
+/**
+ * Checks a decrypted request, passes it to the KV-store and fills in the
+ * response. The request header is reused for the response
+ * @param st ServerThread for the according client
+ * @param session Session of the client
+ * @param req_handle Handle of the request
+ * @param header Header of the incoming request
+ * @param payload Payload of the incoming request
+ * @param response Payload of the response (only contains a value for gets)
+ * @return REQUEST_RESPOND if the response has to be sent, REQUEST_CACHED if
+ *      the request is a retransmission that is answered from the response
+ *      cache, REQUEST_DROPPED if the request is dropped or answered after
+ *      the asynchronous KV-store completed it
+ */
+enum request_result handle_request(ServerThread *st, ServerSession *session,
+        erpc::ReqHandle *req_handle, struct rdma_msg_header *header,
+        struct rdma_dec_payload *payload, struct rdma_enc_payload *response) {
+
+    uint8_t op = OP_FROM_SEQ_OP(header->seq_op);
+    *response = { nullptr, nullptr, 0 };
+
+    /* Always disconnect, if the client requests it: */
+    if (unlikely(op == RDMA_ERR)) {
+        session->set_response(header, RDMA_ERR);
+        header->key_len = 0;
+        st->close_session(session);
+        return REQUEST_RESPOND;
+    }
+
+    /* Check for replays by checking the sequence number. A client that
+     * retransmits a request on the same session gets the same response again
+     * (Client itself doesn't retransmit, see RESPONSE_CACHE_SIZE): */
+    if (unlikely(!session->is_seq_valid(header->seq_op))) {
+        if (session->has_cached_response(header->seq_op))
+            return REQUEST_CACHED;
+        st->get_stats()->count_replay();
+        return REQUEST_DROPPED;
+    }
+
+    /* The client exceeded its credits or its request rate: */
+    if (unlikely(!session->admit(stats_clock()))) {
+        st->get_stats()->count_admission_reject();
+        session->set_response(header, RDMA_ERR);
+        header->key_len = 0;
+        header->credits |= CREDITS_REJECTED;
+        return REQUEST_RESPOND;
+    }
+
+    /* The key belongs to another server thread: */
+    if (unlikely(!st->owns_key(payload->key, header->key_len))) {
+        session->set_response(header, RDMA_ERR);
+        header->key_len = 0;
+        return REQUEST_RESPOND;
+    }
+
+    if (kv_async_get) {
+        if (likely(defer_kv_request(st, session, req_handle, header,
+                payload->key, header->key_len,
+                payload->value, payload->value_len, nullptr)))
+            return REQUEST_DROPPED;
+        session->set_response(header, RDMA_ERR);
+        header->key_len = 0;
+        return REQUEST_RESPOND;
+    }
+
+    switch (op) {
+        case RDMA_GET:
+            response_get(session, header, payload->key, response);
+            break;
+        case RDMA_PUT:
+            response_put(session, header, payload);
+            break;
+        case RDMA_DELETE:
+            response_delete(session, header, payload->key);
+            break;
+        default:
+            cerr << "Invalid operation: " << op << endl;
+            return REQUEST_DROPPED;
+    }
+    /* The server never sends back a key */
+    header->key_len = 0;
+    return REQUEST_RESPOND;
+}
+
+
+/**
+ * Processes the requests that a ServerThread collected during one event loop
+ * iteration. All requests are decrypted in a batch, the responses without
+ * value are encrypted in a batch.
+ * Values returned by get_function are only valid until its next call, so
+ * responses to gets are encrypted and sent right away
+ * @param st ServerThread that received the requests
+ * @param session Session that all requests of the batch belong to
+ * @param handles Request handles of the batch
+ * @param requests Requests of the batch. The ciphertexts are copies of the
+ *          request buffers and are decrypted in place
+ * @param count Number of requests in the batch
+ */
+void process_request_batch(ServerThread *st, ServerSession *session,
+        erpc::ReqHandle **handles, struct rdma_dec_batch_entry *requests,
+        size_t count) {
+
+    struct rdma_enc_batch_entry responses[MAX_BATCH_SIZE];
+    erpc::ReqHandle *response_handles[MAX_BATCH_SIZE];
+    struct rdma_enc_payload response;
+    erpc::MsgBuffer *resp_buffer;
+    size_t response_count = 0;
+
+    (void) decrypt_messages(session->get_crypto_session(), requests, count);
+
+    for (size_t i = 0; i < count; i++) {
+        struct rdma_dec_batch_entry *request = requests + i;
+        if (unlikely(request->ret)) {
+            cerr << "Failed to decrypt message" << endl;
+            st->get_stats()->count_decrypt_failure();
+            continue;
+        }
+        switch (handle_request(st, session, handles[i],
+                &(request->header), &(request->payload), &response)) {
+            case REQUEST_DROPPED:
+                continue;
+            case REQUEST_CACHED:
+                resp_buffer = &(handles[i]->pre_resp_msgbuf);
+                if (copy_cached_response(
+                        st, session, request->header.seq_op, resp_buffer))
+                    st->enqueue_response(handles[i], resp_buffer);
+                continue;
+            case REQUEST_RESPOND:
+                break;
+        }
+
+        if (response.value_len > 0) {
+            send_encrypted_response(handles[i], st, session,
+                    &(request->header), &response);
+            continue;
+        }
+        /* Acks always fit into the pre-allocated response buffer: */
+        resp_buffer = &(handles[i]->pre_resp_msgbuf);
+        erpc::Rpc<erpc::CTransport>::resize_msg_buffer(resp_buffer,
+                MESSAGE_SIZE(session->get_crypto_session()->get_security_mode(), 0));
+        responses[response_count] = {
+                request->header, response, resp_buffer->buf, -1 };
+        response_handles[response_count++] = handles[i];
+    }
+
+    (void) encrypt_messages(
+            session->get_crypto_session(), responses, response_count);
+
+    for (size_t i = 0; i < response_count; i++) {
+        if (unlikely(responses[i].ret)) {
+            cerr << "Failed to encrypt message" << endl;
+            continue;
+        }
+        resp_buffer = &(response_handles[i]->pre_resp_msgbuf);
+        session->cache_response(responses[i].header.seq_op,
+                resp_buffer->buf, resp_buffer->get_data_size());
+        st->enqueue_response(response_handles[i], resp_buffer);
+    }
+}
+
+
+/**
+ * Handles a request on a crypto worker of a ServerThread: The request is
+ * decrypted, passed to the KV-store and the response is encrypted to the slot
+ * of the request. Copying the response to a response buffer of the right
+ * size and enqueueing it is left to the ServerThread, which owns the eRPC
+ * endpoint
+ * @param st ServerThread that received the request
+ * @param session Session of the client
+ * @param crypto Crypto session of the worker for the key phase of the request
+ * @param req_handle Handle of the request
+ * @param ciphertext Copy of the request, is decrypted in place and
+ *          overwritten with the response afterwards
+ * @param ciphertext_size Size of the request
+ * @param slot_size Size of the slot that ciphertext points to
+ * @param resp_size Is set to the size of the response
+ * @return true if the response has to be enqueued, false if the request is
+ *      dropped
+ */
+bool process_offloaded_request(ServerThread *st, ServerSession *session,
+        CryptoSession *crypto, erpc::ReqHandle *req_handle,
+        unsigned char *ciphertext, size_t ciphertext_size, size_t slot_size,
+        size_t *resp_size) {
+    struct rdma_msg_header header;
+    struct rdma_dec_payload payload;
+    struct rdma_enc_payload response;
+
+    if (0 != decrypt_message_in_place(crypto,
+            &header, &payload, ciphertext, ciphertext_size)) {
+        cerr << "Failed to decrypt message" << endl;
+        st->get_stats()->count_decrypt_failure();
+        return false;
+    }
+    switch (handle_request(
+            st, session, req_handle, &header, &payload, &response)) {
+        case REQUEST_DROPPED:
+            return false;
+        case REQUEST_CACHED:
+            if (unlikely(!session->get_cached_response(
+                    header.seq_op, ciphertext, resp_size))) {
+                st->get_stats()->count_replay();
+                return false;
+            }
+            st->get_stats()->count_retransmit();
+            return true;
+        case REQUEST_RESPOND:
+            break;
+    }
+
+    /* The request was handled, its slot takes the response: */
+    *resp_size = MESSAGE_SIZE(crypto->get_security_mode(),
+            header.key_len + response.value_len);
+    if (unlikely(*resp_size > slot_size)) {
+        cerr << "Answer too long for response buffer" << endl;
+        return false;
+    }
+    if (unlikely(0 != encrypt_message(crypto, &header, &response, &ciphertext))) {
+        cerr << "Failed to encrypt message" << endl;
+        return false;
+    }
+    session->cache_response(header.seq_op, ciphertext, *resp_size);
+    return true;
 }
 
 
 /**
  * The request handler that is invoked on every incoming request
+ * If possible, the request is only copied to a crypto worker or to the batch
+ * of the ServerThread and processed after the current event loop iteration
  * @param req_handle Request Handle needed for Message Buffers and response
  * @param context Here: Pointer to according ServerThread that should handle the
  *          message
+ * @param op Operation of the request, given by its request type
+ * @param mode Security mode of the request, given by its request type
+ * @param phase Key phase of the request, given by its request type
  */
-void req_handler(erpc::ReqHandle *req_handle, void *context) {
+void req_handler(erpc::ReqHandle *req_handle, void *context,
+        uint8_t op, enum security_mode mode, uint8_t phase) {
     struct rdma_msg_header header;
-    uint8_t op;
     auto st = static_cast<ServerThread *>(context);
+    ServerSession *session = st->get_session(req_handle);
     const erpc::MsgBuffer *ciphertext_buf = req_handle->get_req_msgbuf();
     struct rdma_dec_payload payload = { nullptr, nullptr, 0 };
+    struct rdma_enc_payload response;
+    bool scratch;
+    st->begin_request(req_handle);
+    st->get_stats()->count_request(op);
     auto *ciphertext = static_cast<unsigned char *>(ciphertext_buf->buf);
     if (!ciphertext) {
         cerr << "Could not get request message buffer" << endl;
         return;
     }
     size_t ciphertext_size = ciphertext_buf->get_data_size();
-
-    if (0 != decrypt_message(&header, &payload, ciphertext, ciphertext_size)) {
-        cerr << "Failed to decrypt message" << endl;
-        goto end_req_handler;
+    if (unlikely(!session || !session->is_key_established())) {
+        cerr << "Request before handshake" << endl;
+        return;
     }
-
-    /* Always disconnect, if the client requests it: */
-    op = OP_FROM_SEQ_OP(header.seq_op);
-    if (unlikely(op == RDMA_ERR)) {
-        send_response_disconnect(req_handle, st, &header);
-        st->terminate();
-        goto end_req_handler;
+    if (unlikely(!session->accept_security_mode(
+            mode, accepted_security_modes))) {
+        cerr << "Security mode " << static_cast<int>(mode)
+             << " is not accepted" << endl;
+        return;
     }
+    /* Batched requests of other sessions or key phases are processed
+     * before: */
+    st->select_session(session, phase);
+    /* Until the mode of the session is fixed, requests are not batched: */
+    if (likely(session->is_security_mode_fixed() &&
+            (st->offload_request(
+                    session, req_handle, ciphertext, ciphertext_size) ||
+            st->share_request(
+                    session, req_handle, ciphertext, ciphertext_size) ||
+            st->batch_request(req_handle, ciphertext, ciphertext_size))))
+        return;
+
+    /* Keep the order of requests: */
+    st->process_batch();
 
-    /* Check for replays by checking the sequence number: */
-    if (unlikely(!st->is_seq_valid(header.seq_op))) {
+    /* Decrypt to the scratch buffers of the thread to avoid allocations: */
+    scratch = st->get_scratch_payload(&payload, ciphertext_size);
+
+    if (0 != decrypt_message(session->get_crypto_session(),
+            &header, &payload, ciphertext, ciphertext_size)) {
+        cerr << "Failed to decrypt message" << endl;
+        st->get_stats()->count_decrypt_failure();
         goto end_req_handler;
     }
+    /* The first authentic request fixes the security mode of the session: */
+    session->fix_security_mode();
 
-    switch (op) {
-        case RDMA_GET:
-            send_response_get(req_handle, st, &header, payload.key);
+    switch (handle_request(
+            st, session, req_handle, &header, &payload, &response)) {
+        case REQUEST_DROPPED:
             break;
-        case RDMA_PUT:
-            send_response_put(req_handle, st, &header, &payload);
+        case REQUEST_CACHED:
+            send_cached_response(req_handle, st, session, header.seq_op);
             break;
-        case RDMA_DELETE:
-            send_response_delete(req_handle, st, &header, payload.key);
+        case REQUEST_RESPOND:
+            send_encrypted_response(req_handle, st,
+                    session->get_crypto_session(), &header, &response, session);
             break;
-        default:
-            cerr << "Invalid operation: " << op << endl;
     }
 
 end_req_handler:
-    free(payload.key);
-    free(payload.value);
+    if (unlikely(!scratch)) {
+        free(payload.key);
+        free(payload.value);
+    }
+}
+
+
+/**
+ * Stores a chunk of a put in the reassembly of its transfer. As soon as all
+ * chunks arrived, the value is passed to the KV-store
+ * @param st ServerThread for the according client
+ * @param session Session of the client
+ * @param req_handle Handle of the request
+ * @param header Header of the request
+ * @param chunk Chunk header of the request
+ * @param key Key of the transfer, only sent with chunk 0
+ * @param key_len Length of key
+ * @param payload Payload of the request, its value is the chunk data
+ * @return 0 if the chunk (and the put, if it was the last chunk) succeeded,
+ *      1 if the put was handed to the asynchronous KV-store and is answered
+ *      later, -1 otherwise
+ */
+int response_put_chunk(ServerThread *st, ServerSession *session,
+        erpc::ReqHandle *req_handle, const struct rdma_msg_header *header,
+        const struct rdma_chunk_header *chunk,
+        const unsigned char *key, size_t key_len,
+        const struct rdma_dec_payload *payload) {
+    struct chunk_reassembly *reassembly;
+    int ret;
+
+    if (unlikely(chunk->total_len > max_value_size ||
+            chunk->count != CHUNK_COUNT(chunk->total_len) ||
+            chunk->index >= chunk->count ||
+            payload->value_len != CHUNK_LEN(chunk->total_len, chunk->index) ||
+            (chunk->index > 0 && key_len > 0))) {
+        cerr << "Invalid chunk" << endl;
+        return -1;
+    }
+    reassembly = session->get_reassembly(chunk);
+    if (!reassembly || reassembly->chunk_received[chunk->index])
+        return -1;
+
+    if (chunk->index == 0) {
+        reassembly->key = static_cast<unsigned char *>(
+                malloc(std::max(key_len, (size_t) 1)));
+        if (!reassembly->key) {
+            cerr << "Memory allocation failure" << endl;
+            return -1;
+        }
+        if (key_len > 0)
+            (void) memcpy(reassembly->key, key, key_len);
+        reassembly->key_len = key_len;
+    }
+    if (payload->value_len > 0)
+        (void) memcpy(reassembly->value + chunk->index * CHUNK_SIZE,
+                payload->value, payload->value_len);
+    reassembly->chunk_received[chunk->index] = true;
+    if (++reassembly->received < reassembly->count)
+        return 0;
+
+    /* The key belongs to another server thread: */
+    if (unlikely(!st->owns_key(reassembly->key, reassembly->key_len))) {
+        ret = -1;
+    } else if (kv_async_put) {
+        ret = defer_kv_request(st, session, req_handle, header,
+                reassembly->key, reassembly->key_len,
+                reassembly->value, reassembly->total_len, nullptr) ? 1 : -1;
+    } else {
+        /* Call KV-store: */
+        ret = kv_put(reassembly->key, reassembly->key_len,
+                reassembly->value, reassembly->total_len) < 0 ? -1 : 0;
+    }
+    session->release_reassembly(reassembly);
+    return ret;
+}
+
+
+/**
+ * Answers a request for a chunk of a value. The chunk header of the response
+ * carries the length of the whole value, so the client knows which chunks
+ * are left
+ * @param st ServerThread for the according client
+ * @param session Session of the client
+ * @param req_handle Handle of the request
+ * @param header Header of the request that is reused for the response
+ * @param chunk Chunk header of the request, is filled in for the response
+ * @param key Key whose value is requested
+ * @param key_len Length of key
+ * @param response Payload of the response
+ * @param snapshot Is set to the snapshot that a chunk other than chunk 0 is
+ *      served from, nullptr otherwise. Is released after the last chunk was
+ *      sent
+ * @return true if the response has to be sent, false if the asynchronous
+ *      KV-store answers it later
+ */
+bool response_get_chunk(ServerThread *st, ServerSession *session,
+        erpc::ReqHandle *req_handle, struct rdma_msg_header *header,
+        struct rdma_chunk_header *chunk, const unsigned char *key,
+        size_t key_len, struct rdma_enc_payload *response,
+        struct chunk_snapshot **snapshot) {
+    size_t resp_len = 0;
+    const unsigned char *resp = nullptr;
+
+    if (chunk->index > 0) {
+        /* Only chunk 0 calls the KV-store: */
+        *snapshot = session->get_snapshot(chunk->transfer_seq);
+        if (*snapshot) {
+            resp = (*snapshot)->value;
+            resp_len = (*snapshot)->total_len;
+        }
+    } else if (unlikely(!st->owns_key(key, key_len))) {
+        /* Keys of other server threads fail: */
+        resp = nullptr;
+    } else if (kv_async_get) {
+        if (likely(defer_kv_request(st, session, req_handle, header,
+                key, key_len, nullptr, 0, chunk)))
+            return false;
+    } else {
+        /* Call KV-store: */
+        resp = static_cast<const unsigned char *>(
+                kv_get(key, key_len, &resp_len));
+    }
+
+    if (!set_chunk_response(session, header, chunk, resp, resp_len,
+            response, *snapshot))
+        *snapshot = nullptr;
+    return true;
 }
 
+
+/**
+ * Request handler for chunks of values that don't fit into one message.
+ * Chunks are never batched, since the chunk data is big anyway
+ * @param req_handle Request Handle needed for Message Buffers and response
+ * @param context Pointer to according ServerThread
+ * @param mode Security mode of the request, given by its request type
+ * @param phase Key phase of the request, given by its request type
+ */
+void chunk_req_handler(erpc::ReqHandle *req_handle, void *context,
+        enum security_mode mode, uint8_t phase) {
+    struct rdma_msg_header header;
+    struct rdma_chunk_header chunk;
+    auto st = static_cast<ServerThread *>(context);
+    ServerSession *session = st->get_session(req_handle);
+    const erpc::MsgBuffer *ciphertext_buf = req_handle->get_req_msgbuf();
+    struct rdma_dec_payload payload = { nullptr, nullptr, 0 };
+    struct rdma_enc_payload response = { nullptr, nullptr, 0 };
+    struct chunk_snapshot *snapshot = nullptr;
+    size_t ciphertext_size = ciphertext_buf->get_data_size();
+    uint8_t op;
+    bool scratch;
+    int ret;
+
+    st->begin_request(req_handle);
+    if (unlikely(!session || !session->is_key_established() ||
+            !session->accept_security_mode(mode, accepted_security_modes))) {
+        cerr << "Chunk in invalid session state" << endl;
+        return;
+    }
+    /* Keep the order of requests: */
+    st->process_batch();
+    st->select_session(session, phase);
+    scratch = st->get_scratch_payload(&payload, ciphertext_size);
+
+    if (0 != decrypt_message(session->get_crypto_session(), &header, &payload,
+            ciphertext_buf->buf, ciphertext_size)) {
+        cerr << "Failed to decrypt message" << endl;
+        st->get_stats()->count_decrypt_failure();
+        goto end_chunk_req_handler;
+    }
+    session->fix_security_mode();
+    op = OP_FROM_SEQ_OP(header.seq_op);
+    if (unlikely(header.key_len < sizeof(struct rdma_chunk_header) ||
+            (op != RDMA_GET && op != RDMA_PUT))) {
+        cerr << "Invalid chunk" << endl;
+        goto end_chunk_req_handler;
+    }
+    if (unlikely(!session->is_seq_valid(header.seq_op))) {
+        st->get_stats()->count_replay();
+        goto end_chunk_req_handler;
+    }
+    st->get_stats()->count_request(op);
+    (void) memcpy(&chunk, payload.key, sizeof(struct rdma_chunk_header));
+    /* Transfers of other clients can't be continued: */
+    if (unlikely(ID_FROM_SEQ_OP(chunk.transfer_seq) !=
+            ID_FROM_SEQ_OP(header.seq_op))) {
+        cerr << "Invalid chunk" << endl;
+        goto end_chunk_req_handler;
+    }
+
+    if (op == RDMA_GET) {
+        if (!response_get_chunk(st, session, req_handle, &header, &chunk,
+                payload.key + sizeof(struct rdma_chunk_header),
+                header.key_len - sizeof(struct rdma_chunk_header), &response,
+                &snapshot))
+            goto end_chunk_req_handler;
+    } else {
+        ret = response_put_chunk(st, session, req_handle, &header, &chunk,
+                payload.key + sizeof(struct rdma_chunk_header),
+                header.key_len - sizeof(struct rdma_chunk_header), &payload);
+        if (ret > 0)
+            goto end_chunk_req_handler;
+        session->set_response(&header, ret == 0 ? RDMA_PUT : RDMA_ERR);
+        header.key_len = 0;
+    }
+    send_encrypted_response(req_handle, st, session, &header, &response);
+    if (snapshot && snapshot->served == snapshot->count)
+        session->release_snapshot(snapshot);
+
+end_chunk_req_handler:
+    if (unlikely(!scratch)) {
+        free(payload.key);
+        free(payload.value);
+    }
+}
+
+
+/**
+ * Checks that all keys of a multi-operation belong to the partition of the
+ * server thread, so the batched KV-store calls never span partitions
+ * @param st ServerThread for the according client
+ * @param count Number of entries
+ * @param keys Keys of the entries
+ * @return true if the thread may call the KV-store for all keys
+ */
+static bool owns_keys(const ServerThread *st,
+        size_t count, const struct iovec *keys) {
+    for (size_t i = 0; i < count; i++) {
+        if (!st->owns_key(keys[i].iov_base, keys[i].iov_len))
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * Looks up the values of a multi-get. With a batched get, the values are
+ * sent straight from the KV-store. Otherwise, they are copied to the multi
+ * buffer of the thread, since the values of get_function are only valid
+ * until its next call
+ * @param st ServerThread for the according client
+ * @param count Number of entries
+ * @param keys Keys of the entries
+ * @param values Is filled with the values of the entries
+ * @param results Is filled with the result table of the response
+ * @param response_len Maximum length of the response value
+ * @param response Is filled with the fragments of the response value
+ * @return Number of fragments of the response value
+ */
+static size_t response_multi_get(ServerThread *st, size_t count,
+        const struct iovec *keys, struct iovec *values,
+        struct rdma_multi_result *results, size_t response_len,
+        struct iovec *response) {
+
+    size_t used = count * sizeof(struct rdma_multi_result);
+
+    if (kv_multi_get) {
+        /* Call KV-store: */
+        kv_multi_get(count, keys, values);
+    } else {
+        unsigned char *buf = st->get_multi_buffer();
+        size_t copied = used;
+        for (size_t i = 0; i < count; i++) {
+            size_t value_len;
+            /* Call KV-store: */
+            const void *value = buf ? kv_get(keys[i].iov_base,
+                    keys[i].iov_len, &value_len) : nullptr;
+            if (!value || copied + value_len > response_len) {
+                values[i] = { nullptr, 0 };
+                continue;
+            }
+            (void) memcpy(buf + copied, value, value_len);
+            values[i] = { buf + copied, value_len };
+            copied += value_len;
+        }
+    }
+
+    /* Entries that don't fit into the response anymore fail: */
+    response[0] = { results, used };
+    for (size_t i = 0; i < count; i++) {
+        if (values[i].iov_base && used + values[i].iov_len <= response_len &&
+                values[i].iov_len <= UINT32_MAX) {
+            results[i] = { MULTI_SUCCESS,
+                    static_cast<uint32_t>(values[i].iov_len) };
+            response[i + 1] = values[i];
+            used += values[i].iov_len;
+        } else {
+            results[i] = { MULTI_FAILED, 0 };
+            response[i + 1] = { nullptr, 0 };
+        }
+    }
+    return count + 1;
+}
+
+
+/**
+ * Stores the key-value-pairs of a multi-put. With a batched put, the
+ * KV-store is called once for all entries
+ * @param count Number of entries
+ * @param keys Keys of the entries
+ * @param values Values of the entries
+ * @param results Is filled with the result table of the response
+ * @param response Is filled with the fragment of the response value
+ * @return Number of fragments of the response value
+ */
+static size_t response_multi_put(size_t count,
+        const struct iovec *keys, const struct iovec *values,
+        struct rdma_multi_result *results, struct iovec *response) {
+
+    int ret[MAX_MULTI_ENTRIES];
+    /* Call KV-store: */
+    if (kv_multi_put)
+        kv_multi_put(count, keys, values, ret);
+    else {
+        for (size_t i = 0; i < count; i++)
+            ret[i] = kv_put(keys[i].iov_base, keys[i].iov_len,
+                    values[i].iov_base, values[i].iov_len);
+    }
+
+    for (size_t i = 0; i < count; i++)
+        results[i] = { ret[i] < 0 ? MULTI_FAILED : MULTI_SUCCESS, 0 };
+    response[0] = { results, count * sizeof(struct rdma_multi_result) };
+    return 1;
+}
+
+
+/**
+ * Request handler for multi-gets and multi-puts. The whole request is
+ * checked for replays once, every entry gets its own result. Multi-operations
+ * are never batched, since they carry several keys anyway
+ * @param req_handle Request Handle needed for Message Buffers and response
+ * @param context Pointer to according ServerThread
+ * @param mode Security mode of the request, given by its request type
+ * @param phase Key phase of the request, given by its request type
+ */
+void multi_req_handler(erpc::ReqHandle *req_handle, void *context,
+        enum security_mode mode, uint8_t phase) {
+    struct rdma_msg_header header;
+    struct iovec keys[MAX_MULTI_ENTRIES];
+    struct iovec values[MAX_MULTI_ENTRIES];
+    struct rdma_multi_result results[MAX_MULTI_ENTRIES];
+    struct iovec response[MAX_MULTI_ENTRIES + 1];
+    auto st = static_cast<ServerThread *>(context);
+    ServerSession *session = st->get_session(req_handle);
+    const erpc::MsgBuffer *ciphertext_buf = req_handle->get_req_msgbuf();
+    struct rdma_dec_payload payload = { nullptr, nullptr, 0 };
+    size_t ciphertext_size = ciphertext_buf->get_data_size();
+    size_t count, response_len = 0, fragments = 0;
+    uint8_t op;
+    bool scratch;
+
+    st->begin_request(req_handle);
+    if (unlikely(!session || !session->is_key_established() ||
+            !session->accept_security_mode(mode, accepted_security_modes))) {
+        cerr << "Multi-operation in invalid session state" << endl;
+        return;
+    }
+    /* Keep the order of requests: */
+    st->process_batch();
+    st->select_session(session, phase);
+    scratch = st->get_scratch_payload(&payload, ciphertext_size);
+
+    if (0 != decrypt_message(session->get_crypto_session(), &header, &payload,
+            ciphertext_buf->buf, ciphertext_size)) {
+        cerr << "Failed to decrypt message" << endl;
+        st->get_stats()->count_decrypt_failure();
+        goto end_multi_req_handler;
+    }
+    session->fix_security_mode();
+    op = OP_FROM_SEQ_OP(header.seq_op);
+    count = parse_multi_request(payload.value, payload.value_len, op,
+            keys, values, &response_len);
+    if (unlikely(header.key_len != 0 || (op != RDMA_GET && op != RDMA_PUT) ||
+            count == 0)) {
+        cerr << "Invalid multi-operation" << endl;
+        goto end_multi_req_handler;
+    }
+    if (unlikely(!session->is_seq_valid(header.seq_op))) {
+        st->get_stats()->count_replay();
+        goto end_multi_req_handler;
+    }
+    st->get_stats()->count_request(op);
+
+    if (unlikely(!session->admit(stats_clock()))) {
+        st->get_stats()->count_admission_reject();
+        session->set_response(&header, RDMA_ERR);
+        header.credits |= CREDITS_REJECTED;
+    } else if (unlikely(kv_async_get)) {
+        /* The asynchronous KV-store has no batched calls: */
+        session->set_response(&header, RDMA_ERR);
+    } else if (unlikely(!owns_keys(st, count, keys))) {
+        session->set_response(&header, RDMA_ERR);
+    } else {
+        if (op == RDMA_GET)
+            fragments = response_multi_get(st, count, keys, values, results,
+                    std::min(response_len, PAYLOAD_SIZE(max_msg_size)),
+                    response);
+        else
+            fragments = response_multi_put(
+                    count, keys, values, results, response);
+        session->set_response(&header, op);
+    }
+    send_encrypted_response_v(
+            req_handle, st, session, &header, response, fragments);
+
+end_multi_req_handler:
+    if (unlikely(!scratch)) {
+        free(payload.key);
+        free(payload.value);
+    }
+}
+
+
+/**
+ * Request handler for handshakes and rekeying. Control messages are never
+ * batched and always encrypted. The response carries the random of the
+ * server and is encrypted with the key the request was encrypted with.
+ * Afterwards, the new session key is installed.
+ * The first control message of a client opens its session
+ * @param req_handle Request Handle needed for Message Buffers and response
+ * @param context Pointer to according ServerThread
+ * @param phase Key phase of the request, given by its request type
+ */
+void control_req_handler(erpc::ReqHandle *req_handle, void *context,
+        uint8_t phase) {
+    struct rdma_msg_header header;
+    struct rdma_control_payload control;
+    struct rdma_dec_payload payload = {
+            nullptr, (unsigned char *) &control, 0 };
+    struct rdma_enc_payload response;
+    unsigned char client_random[KDF_RANDOM_LEN];
+    auto st = static_cast<ServerThread *>(context);
+    const erpc::MsgBuffer *ciphertext_buf = req_handle->get_req_msgbuf();
+    ServerSession *session;
+    CryptoSession *crypto;
+    enum security_mode mode;
+    bool valid;
+
+    st->begin_request(req_handle);
+    /* The size check keeps the decryption within the control payload: */
+    if (unlikely(ciphertext_buf->get_data_size() != CONTROL_MESSAGE_SIZE)) {
+        cerr << "Invalid control message" << endl;
+        return;
+    }
+    session = st->open_session(req_handle);
+    if (unlikely(!session || session->is_closed()))
+        return;
+    /* Keep the order of requests: */
+    st->process_batch();
+    st->select_session(session, phase);
+    crypto = session->get_crypto_session();
+    mode = crypto->get_security_mode();
+    crypto->set_security_mode(CONTROL_SECURITY_MODE);
+
+    if (0 != decrypt_message(crypto, &header, &payload,
+            ciphertext_buf->buf, ciphertext_buf->get_data_size()) ||
+            payload.value_len != sizeof(control)) {
+        cerr << "Failed to decrypt control message" << endl;
+        st->get_stats()->count_decrypt_failure();
+        goto err_control_req_handler;
+    }
+    /* A handshake is only accepted once, every other control message is
+     * authenticated with the session key: */
+    if (control.type == CONTROL_HANDSHAKE) {
+        valid = !session->is_key_established() && phase == 0;
+        /* The ID is authenticated with the master key: */
+        if (valid)
+            session->set_client_id(ID_FROM_SEQ_OP(header.seq_op));
+    }
+    else
+        valid = control.type == CONTROL_REKEY && session->is_key_established();
+    if (unlikely(!valid || !session->is_seq_valid(header.seq_op))) {
+        cerr << "Invalid control message" << endl;
+        goto err_control_req_handler;
+    }
+
+    (void) memcpy(client_random, control.random, KDF_RANDOM_LEN);
+    if (1 != RAND_bytes(control.random, KDF_RANDOM_LEN)) {
+        cerr << "Could not generate random for key derivation" << endl;
+        goto err_control_req_handler;
+    }
+    session->set_response(&header, OP_FROM_SEQ_OP(header.seq_op));
+    header.key_len = 0;
+    response = { nullptr, (unsigned char *) &control, sizeof(control) };
+    send_encrypted_response(req_handle, st, session, &header, &response);
+
+    if (0 != session->install_session_key(
+            control.type, client_random, control.random))
+        cerr << "Failed to derive session key" << endl;
+    crypto->set_security_mode(mode);
+    return;
+
+err_control_req_handler:
+    crypto->set_security_mode(mode);
+    /* Sessions without successful handshake aren't kept: */
+    if (!session->is_key_established())
+        st->close_session(session);
+}
+
+
+template <uint8_t op, enum security_mode mode, uint8_t phase>
+void typed_req_handler(erpc::ReqHandle *req_handle, void *context) {
+    req_handler(req_handle, context, op, mode, phase);
+}
+
+template <uint8_t phase>
+void typed_control_handler(erpc::ReqHandle *req_handle, void *context) {
+    control_req_handler(req_handle, context, phase);
+}
+
+template <enum security_mode mode, uint8_t phase>
+void typed_chunk_handler(erpc::ReqHandle *req_handle, void *context) {
+    chunk_req_handler(req_handle, context, mode, phase);
+}
+
+template <enum security_mode mode, uint8_t phase>
+void typed_multi_handler(erpc::ReqHandle *req_handle, void *context) {
+    multi_req_handler(req_handle, context, mode, phase);
+}
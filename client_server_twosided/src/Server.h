@@ -2,6 +2,7 @@
 #define RDMA_SERVER
 
 #include <iostream>
+#include "client_server_common.h"
 using namespace std;
 
 namespace anchor_server {
@@ -9,16 +10,134 @@ namespace anchor_server {
     typedef int (*put_function)(const void *key, size_t key_len, void *value, size_t value_len);
     typedef int (*delete_function)(const void *key, size_t key_len);
 
-    int init(string& hostname, uint16_t udp_port);
+    /* Batched KV-store calls for multi-gets and multi-puts. A multi-get sets
+     * the value of every missing key to { nullptr, 0 }, the values stay valid
+     * until the next call in the same thread. A multi-put sets a negative
+     * result for every failed put */
+    typedef void (*multi_get_function)(size_t count,
+            const struct iovec *keys, struct iovec *values);
+    typedef void (*multi_put_function)(size_t count,
+            const struct iovec *keys, const struct iovec *values, int *results);
+
+    /* KV operation that the asynchronous KV-store completes later by a call
+     * to complete_request */
+    struct kv_request;
+    typedef void (*async_get_function)(const void *key, size_t key_len,
+            struct kv_request *request);
+    typedef void (*async_put_function)(const void *key, size_t key_len,
+            void *value, size_t value_len, struct kv_request *request);
+    typedef void (*async_delete_function)(const void *key, size_t key_len,
+            struct kv_request *request);
+
+    /* Service times are counted in HDR-style buckets: the times below
+     * 2 * STATS_SUB_BUCKETS ns have a bucket each, every higher power of two
+     * is split into STATS_SUB_BUCKETS buckets of equal width */
+    static constexpr size_t STATS_SUB_BUCKETS = 8;
+    static constexpr size_t STATS_BUCKETS = 40 * STATS_SUB_BUCKETS;
+
+    /* Counters of all server threads since the start of the process */
+    struct server_stats {
+        /* Requests per operation, indexed by RDMA_GET, RDMA_PUT, RDMA_DELETE
+         * and RDMA_ERR (disconnects). Chunks and multi-operations are counted
+         * once per message */
+        uint64_t requests[NUM_REQ_OPS];
+        /* Sizes of all requests and responses, including control messages */
+        uint64_t bytes_received;
+        uint64_t bytes_sent;
+        uint64_t decrypt_failures;
+        /* Requests with invalid client ID or sequence number: */
+        uint64_t replay_rejects;
+        /* Retransmitted requests that were answered from the response
+         * cache of their session: */
+        uint64_t retransmits;
+        /* Requests that were refused because their client exceeded its
+         * credits or its request rate (see set_admission): */
+        uint64_t admission_rejects;
+        /* Requests that an idle server thread took over from a busy one
+         * (see set_work_stealing): */
+        uint64_t stolen_requests;
+        /* Time from the request handler to the enqueued response, see
+         * get_stats_bucket_start */
+        uint64_t service_time[STATS_BUCKETS];
+    };
+
+    /* Where the server threads, crypto workers and their buffers are placed,
+     * see set_placement */
+    enum placement_policy {
+        PLACEMENT_NONE,     /* Left to the OS */
+        PLACEMENT_NODE,     /* Threads and buffers on the NUMA node of init */
+        PLACEMENT_CORES     /* Additionally, every thread on a core of its own */
+    };
+
+    /* Flow control of the clients, see set_admission */
+    struct admission_config {
+        /* Requests that one client may have in flight, at most 0x7fff */
+        uint16_t session_credits;
+        /* Requests in flight of all clients of one server thread. They are
+         * shared equally by the sessions of the thread */
+        size_t thread_credits;
+        /* Requests per second of one client, 0 for no limit */
+        uint64_t rate;
+        /* Requests that a client may send at once despite the rate */
+        uint64_t burst;
+    };
+    static constexpr struct admission_config DEFAULT_ADMISSION =
+            { MAX_PENDING_REQUESTS, SIZE_MAX, 0, 0 };
+
+    int init(string& hostname, uint16_t udp_port, uint8_t numa_node = 0);
+
+    int get_nic_numa_node(const char *device);
+
+    int set_placement(enum placement_policy policy);
+
+    int host_server(
+            const unsigned char *encryption_key,
+            uint8_t number_threads,
+            size_t max_entry_size, bool asynchronous,
+            get_function get, put_function put, delete_function del,
+            uint8_t security_modes = SECURITY_MODE_BIT(SECURITY_ENCRYPT),
+            uint8_t crypto_workers = 0, uint8_t max_crypto_workers = 0,
+            bool persistent = false);
 
     int host_server(
             const unsigned char *encryption_key,
             uint8_t number_threads,
             size_t max_entry_size, bool asynchronous,
-            get_function get, put_function put, delete_function del);
+            async_get_function get, async_put_function put,
+            async_delete_function del,
+            uint8_t security_modes = SECURITY_MODE_BIT(SECURITY_ENCRYPT),
+            bool persistent = false);
+
+    void complete_request(struct kv_request *request, int status,
+            const void *value = nullptr, size_t value_len = 0);
+
+    void set_multi_functions(multi_get_function get, multi_put_function put);
+
+    void set_polling(const struct poll_config& config);
+
+    int set_admission(const struct admission_config& config);
+
+    void set_work_stealing(bool enabled);
+
+    void set_partitioned(bool enabled);
+
+    void set_response_cache(bool enabled);
 
     void close_connection(bool force);
 
+    size_t get_request_allocations();
+
+    void get_stats(struct server_stats *stats);
+
+    uint64_t get_stats_bucket_start(size_t bucket);
+
+    uint64_t get_stats_percentile(
+            const struct server_stats *stats, double percentile);
+
+    int open_stats_socket(const char *path);
+
+    void close_stats_socket();
+
     void terminate();
 }
 
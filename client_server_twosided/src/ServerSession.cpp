@@ -0,0 +1,425 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "ServerSession.h"
+
+
+/**
+ * Constructs the state of a new client session. Until the handshake, the
+ * session only holds the master key
+ * @param session_num Number of the eRPC session at the server
+ * @param master_key Key that the session key is derived from in the handshake
+ * @param concurrent True if crypto workers handle requests of the session
+ * @param response_caching True to keep acks for retransmitted requests (see
+ *      RESPONSE_CACHE_SIZE)
+ */
+ServerSession::ServerSession(uint16_t session_num,
+        const unsigned char *master_key, bool concurrent,
+        bool response_caching) {
+    this->session_num = session_num;
+    this->client_id = 0;
+    this->seq_started = false;
+    this->highest_seq = 0;
+    (void) memset(this->seen_seqs, 0, sizeof(this->seen_seqs));
+    this->response_caching = response_caching;
+    for (auto& entry : this->response_cache)
+        entry.request_seq = 0;
+    this->concurrent = concurrent;
+    this->security_mode_fixed = false;
+    this->key_established = false;
+    this->closed = false;
+    this->key_phase = 0;
+    /* Crypto workers always take over a new session: */
+    this->crypto_generation = 1;
+    this->synced_generation = 0;
+    this->deferred_requests = 0;
+    this->credits = MAX_PENDING_REQUESTS;
+    this->rate_interval = 0;
+    this->burst_time = 0;
+    this->next_admission = 0;
+    /* Only the handshake is encrypted with the master key: */
+    if (0 != this->crypto[0].set_key(master_key))
+        throw std::runtime_error("Couldn't initialize crypto session");
+#if PRECOMPUTE_KEYSTREAM
+    for (auto& session : this->crypto) {
+        if (0 != session.enable_precomputation(PRECOMPUTED_MESSAGES))
+            throw std::runtime_error("Couldn't allocate keystream ring");
+    }
+#endif // PRECOMPUTE_KEYSTREAM
+
+    for (auto& reassembly : this->reassemblies)
+        reassembly.active = false;
+    for (auto& snapshot : this->snapshots)
+        snapshot.active = false;
+}
+
+
+ServerSession::~ServerSession() {
+    for (auto& reassembly : this->reassemblies)
+        this->release_reassembly(&reassembly);
+    for (auto& snapshot : this->snapshots)
+        this->release_snapshot(&snapshot);
+}
+
+
+/**
+ * Derives the session key of the next key phase from the randoms of a
+ * control message. A handshake replaces the master key in key phase 0,
+ * a rekeying replaces the key of the other key phase. The current key phase
+ * stays valid for requests that are still in flight
+ * @param type CONTROL_HANDSHAKE or CONTROL_REKEY
+ * @param client_random Random of the client of length KDF_RANDOM_LEN
+ * @param server_random Random of the server of length KDF_RANDOM_LEN
+ * @return 0 on success, -1 on error
+ */
+int ServerSession::install_session_key(uint8_t type,
+        const unsigned char *client_random,
+        const unsigned char *server_random) {
+    uint8_t next_phase = this->key_phase;
+    if (type == CONTROL_REKEY)
+        next_phase = NEXT_KEY_PHASE(this->key_phase);
+
+    if (0 != derive_session_key(&(this->crypto[next_phase]),
+            this->crypto[this->key_phase].get_key(), type,
+            this->client_id, client_random, server_random))
+        return -1;
+    if (type == CONTROL_HANDSHAKE)
+        this->key_established = true;
+    this->crypto_generation++;
+    return 0;
+}
+
+
+/**
+ * Checks whether a request in the given security mode can be handled.
+ * As long as the mode of the session isn't fixed, the crypto session is
+ * switched to any accepted mode
+ * @param mode Security mode of the request
+ * @param accepted_modes Security modes that the server accepts
+ *          (see SECURITY_MODE_BIT)
+ * @return true if the request may be decrypted, false if it is dropped
+ */
+bool ServerSession::accept_security_mode(
+        enum security_mode mode, uint8_t accepted_modes) {
+    if (likely(this->security_mode_fixed))
+        return mode == this->get_crypto_session()->get_security_mode();
+    if (!(accepted_modes & SECURITY_MODE_BIT(mode)))
+        return false;
+    for (auto& session : this->crypto)
+        session.set_security_mode(mode);
+    return true;
+}
+
+
+/**
+ * Returns the reassembly of the transfer that a chunk of a put belongs to.
+ * The first chunk that arrives starts a new reassembly. A client has at most
+ * MAX_CHUNKED_TRANSFERS transfers in flight, so if all reassemblies are in
+ * use, the oldest one was abandoned and is replaced
+ * @param chunk Chunk header of the incoming chunk
+ * @return The reassembly or nullptr, if the chunk doesn't match its transfer
+ *      or no memory could be allocated
+ */
+struct chunk_reassembly *ServerSession::get_reassembly(
+        const struct rdma_chunk_header *chunk) {
+    struct chunk_reassembly *slot = nullptr;
+    for (auto& reassembly : this->reassemblies) {
+        if (!reassembly.active) {
+            if (!slot || slot->active)
+                slot = &reassembly;
+            continue;
+        }
+        if (reassembly.transfer_seq == chunk->transfer_seq) {
+            if (reassembly.total_len != chunk->total_len ||
+                    reassembly.count != chunk->count)
+                return nullptr;
+            return &reassembly;
+        }
+        if (!slot || (slot->active &&
+                reassembly.transfer_seq < slot->transfer_seq))
+            slot = &reassembly;
+    }
+    this->release_reassembly(slot);
+
+    slot->value = static_cast<unsigned char *>(
+            malloc(std::max(chunk->total_len, (uint64_t) 1)));
+    slot->chunk_received = static_cast<bool *>(
+            calloc(chunk->count, sizeof(bool)));
+    if (!(slot->value && slot->chunk_received)) {
+        cerr << "Memory allocation failure" << endl;
+        free(slot->value);
+        free(slot->chunk_received);
+        return nullptr;
+    }
+    slot->active = true;
+    slot->transfer_seq = chunk->transfer_seq;
+    slot->key = nullptr;
+    slot->key_len = 0;
+    slot->total_len = chunk->total_len;
+    slot->count = chunk->count;
+    slot->received = 0;
+    return slot;
+}
+
+
+void ServerSession::release_reassembly(struct chunk_reassembly *reassembly) {
+    if (!reassembly->active)
+        return;
+    free(reassembly->key);
+    free(reassembly->value);
+    free(reassembly->chunk_received);
+    reassembly->active = false;
+}
+
+
+/**
+ * Copies the value of a chunked get when its chunk 0 is answered. Like
+ * reassemblies, the snapshot of the oldest transfer is replaced if all of
+ * them are in use
+ * @param transfer_seq Transfer of the get
+ * @param value Value that the KV-store returned
+ * @param value_len Length of value
+ * @return The snapshot or nullptr, if no memory could be allocated
+ */
+struct chunk_snapshot *ServerSession::take_snapshot(uint64_t transfer_seq,
+        const unsigned char *value, size_t value_len) {
+    struct chunk_snapshot *slot = nullptr;
+    for (auto& snapshot : this->snapshots) {
+        if (!snapshot.active) {
+            if (!slot || slot->active)
+                slot = &snapshot;
+            continue;
+        }
+        if (snapshot.transfer_seq == transfer_seq) {
+            slot = &snapshot;
+            break;
+        }
+        if (!slot || (slot->active &&
+                snapshot.transfer_seq < slot->transfer_seq))
+            slot = &snapshot;
+    }
+    this->release_snapshot(slot);
+
+    slot->count = static_cast<uint32_t>(CHUNK_COUNT(value_len));
+    slot->value = static_cast<unsigned char *>(
+            malloc(std::max(value_len, (size_t) 1)));
+    slot->chunk_served = static_cast<bool *>(
+            calloc(slot->count, sizeof(bool)));
+    if (!(slot->value && slot->chunk_served)) {
+        cerr << "Memory allocation failure" << endl;
+        free(slot->value);
+        free(slot->chunk_served);
+        return nullptr;
+    }
+    if (value_len > 0)
+        (void) memcpy(slot->value, value, value_len);
+    slot->active = true;
+    slot->transfer_seq = transfer_seq;
+    slot->total_len = value_len;
+    slot->served = 0;
+    return slot;
+}
+
+
+/**
+ * @param transfer_seq Transfer of a chunked get
+ * @return The snapshot of the transfer or nullptr, if chunk 0 wasn't answered
+ *      or the snapshot was replaced in the meantime
+ */
+struct chunk_snapshot *ServerSession::get_snapshot(uint64_t transfer_seq) {
+    for (auto& snapshot : this->snapshots) {
+        if (snapshot.active && snapshot.transfer_seq == transfer_seq)
+            return &snapshot;
+    }
+    return nullptr;
+}
+
+
+void ServerSession::release_snapshot(struct chunk_snapshot *snapshot) {
+    if (!snapshot->active)
+        return;
+    free(snapshot->value);
+    free(snapshot->chunk_served);
+    snapshot->active = false;
+}
+
+
+/**
+ * Checks the ID and sequence number of a request and marks the sequence
+ * number as seen. Requests may arrive in any order, as long as they are
+ * within REPLAY_WINDOW of the highest sequence number so far. Every sequence
+ * number is only accepted once
+ * @param sequence_number seq_op of the authenticated request
+ * @return true if the request is valid, false if it's a replay, too old or
+ *      too far ahead
+ */
+bool ServerSession::is_seq_valid(uint64_t sequence_number) {
+    uint8_t id = ID_FROM_SEQ_OP(sequence_number);
+    if (unlikely(id != this->client_id)) {
+        cerr << "Invalid Client ID" << endl;
+        return false;
+    }
+    uint64_t seq = SEQ_FROM_SEQ_OP(sequence_number);
+    std::unique_lock<std::mutex> lock(this->seq_lock, std::defer_lock);
+    if (this->concurrent)
+        lock.lock();
+    if (unlikely(!this->seq_started)) {
+        this->seq_started = true;
+        this->highest_seq = seq;
+    }
+    else if (seq > this->highest_seq) {
+        if (unlikely(seq - this->highest_seq > REPLAY_WINDOW))
+            goto err_is_seq_valid;
+        /* Clears the words that the window moves over, at most all of them: */
+        size_t word = this->highest_seq / REPLAY_WORD_BITS;
+        size_t last_word = seq / REPLAY_WORD_BITS;
+        for (size_t i = 0; i < REPLAY_WINDOW_WORDS && word < last_word; i++)
+            this->seen_seqs[++word % REPLAY_WINDOW_WORDS] = 0;
+        this->highest_seq = seq;
+    }
+    else if (unlikely(this->highest_seq - seq >= REPLAY_WINDOW))
+        goto err_is_seq_valid;
+
+    {
+        uint64_t& word = this->seen_seqs[
+                seq / REPLAY_WORD_BITS % REPLAY_WINDOW_WORDS];
+        uint64_t bit = (uint64_t) 1 << (seq % REPLAY_WORD_BITS);
+        /* Replays are only counted by the caller, not logged: */
+        if (unlikely(word & bit))
+            return false;
+        word |= bit;
+    }
+    return true;
+
+err_is_seq_valid:
+    fprintf(stderr, "Highest: %lx, Got: %lx\n",
+            this->highest_seq, seq);
+    return false;
+}
+
+/**
+ * Turns the header of a request into the header of its response: Sets the
+ * sequence number of the response and advertises the credits of the session.
+ * Should only be called with already checked sequence numbers
+ * @param header Header of the request, is reused for the response
+ * @param operation Operation of the response, RDMA_ERR on failure
+ */
+void ServerSession::set_response(struct rdma_msg_header *header,
+        uint8_t operation) {
+    header->seq_op = SET_OP(NEXT_SEQ(header->seq_op), operation);
+    header->credits = this->get_credits();
+}
+
+
+/**
+ * Limits the request rate of the client
+ * @param rate Requests per second, 0 for no limit
+ * @param burst Requests that may arrive at once despite the rate, at least 1
+ */
+void ServerSession::limit_rate(uint64_t rate, uint64_t burst) {
+    this->rate_interval = rate ? std::max<uint64_t>(1000000000 / rate, 1) : 0;
+    this->burst_time = (std::max<uint64_t>(burst, 1) - 1) * this->rate_interval;
+    this->next_admission = 0;
+}
+
+
+/**
+ * Admission control of a request that passed the replay check: The requests
+ * at the asynchronous KV-store must stay below the credits of the session,
+ * and the client must keep to its request rate
+ * @param now Current time in ns, of a monotonic clock
+ * @return true if the request is handled, false if it is refused
+ */
+bool ServerSession::admit(uint64_t now) {
+    if (unlikely(this->deferred_requests >= this->get_credits()))
+        return false;
+    if (likely(this->rate_interval == 0))
+        return true;
+
+    std::unique_lock<std::mutex> lock(this->seq_lock, std::defer_lock);
+    if (this->concurrent)
+        lock.lock();
+    uint64_t admission = std::max(this->next_admission, now);
+    if (admission - now > this->burst_time)
+        return false;
+    this->next_admission = admission + this->rate_interval;
+    return true;
+}
+
+
+/* seq_op of a request without op, as it is stored in the response cache.
+ * The sequence number of a request is never 0 in there, the handshake has
+ * no cached response */
+static inline uint64_t cached_request_seq(uint64_t seq_op) {
+    return seq_op & (SEQ_MASK | ID_MASK);
+}
+
+/* Entry of the response cache that a request is mapped to. Requests of a
+ * client take every other sequence number */
+static inline size_t response_cache_slot(uint64_t request_seq) {
+    return (SEQ_FROM_SEQ_OP(request_seq) >> 1) % RESPONSE_CACHE_SIZE;
+}
+
+
+/**
+ * Keeps an encrypted response for retransmissions of its request, if the
+ * response cache is enabled. Only responses up to CACHED_RESPONSE_SIZE (acks
+ * and errors) are kept
+ * @param seq_op seq_op of the response
+ * @param ciphertext Encrypted response
+ * @param size Size of the encrypted response
+ */
+void ServerSession::cache_response(uint64_t seq_op,
+        const unsigned char *ciphertext, size_t size) {
+    if (likely(!this->response_caching) || size > CACHED_RESPONSE_SIZE)
+        return;
+    uint64_t request_seq = cached_request_seq(PREV_SEQ(seq_op));
+    struct cached_response *entry =
+            this->response_cache + response_cache_slot(request_seq);
+    std::unique_lock<std::mutex> lock(this->seq_lock, std::defer_lock);
+    if (this->concurrent)
+        lock.lock();
+    entry->request_seq = request_seq;
+    entry->size = size;
+    (void) memcpy(entry->ciphertext, ciphertext, size);
+}
+
+
+/**
+ * @param seq_op seq_op of a request
+ * @return true if the response to the request is cached
+ */
+bool ServerSession::has_cached_response(uint64_t seq_op) {
+    if (likely(!this->response_caching))
+        return false;
+    uint64_t request_seq = cached_request_seq(seq_op);
+    std::unique_lock<std::mutex> lock(this->seq_lock, std::defer_lock);
+    if (this->concurrent)
+        lock.lock();
+    return request_seq != 0 && this->response_cache[
+            response_cache_slot(request_seq)].request_seq == request_seq;
+}
+
+
+/**
+ * Copies the cached response to a retransmitted request
+ * @param seq_op seq_op of the request
+ * @param ciphertext Is filled with the encrypted response, has to have room
+ *          for CACHED_RESPONSE_SIZE bytes
+ * @param size Is set to the size of the response
+ * @return true on success, false if the response isn't cached (anymore)
+ */
+bool ServerSession::get_cached_response(uint64_t seq_op,
+        unsigned char *ciphertext, size_t *size) {
+    uint64_t request_seq = cached_request_seq(seq_op);
+    const struct cached_response *entry =
+            this->response_cache + response_cache_slot(request_seq);
+    std::unique_lock<std::mutex> lock(this->seq_lock, std::defer_lock);
+    if (this->concurrent)
+        lock.lock();
+    if (request_seq == 0 || entry->request_seq != request_seq)
+        return false;
+    (void) memcpy(ciphertext, entry->ciphertext, entry->size);
+    *size = entry->size;
+    return true;
+}
@@ -0,0 +1,243 @@
+#ifndef CLIENT_SERVER_TWOSIDED_SERVERSESSION_H
+#define CLIENT_SERVER_TWOSIDED_SERVERSESSION_H
+
+#include <atomic>
+#include <mutex>
+#include <common.h>
+#include "client_server_common.h"
+#include "CryptoSession.h"
+
+/* Sequence numbers that a client may have in flight: Every request takes
+ * two, one for its response. The replay window covers all of them, plus one
+ * word that is cleared ahead of the highest sequence number */
+static constexpr uint64_t REPLAY_WINDOW = 2 * MAX_PENDING_REQUESTS;
+static constexpr size_t REPLAY_WORD_BITS = 64;
+static constexpr size_t REPLAY_WINDOW_WORDS =
+        REPLAY_WINDOW / REPLAY_WORD_BITS + 1;
+static_assert(REPLAY_WINDOW % REPLAY_WORD_BITS == 0,
+        "REPLAY_WINDOW has to be a multiple of REPLAY_WORD_BITS");
+
+/* Encrypted acks of the last requests of a session are kept, so a
+ * retransmitted request is answered without the KV-store and without
+ * encrypting again. Entries are direct-mapped by sequence number.
+ * This is only the server side: Client never resends a request with the same
+ * seq_op, since eRPC already retransmits lost packets within a session and
+ * requests only time out when the session is destroyed. So the cache is off
+ * unless enabled with anchor_server::set_response_cache */
+static constexpr size_t RESPONSE_CACHE_SIZE = 64;
+static constexpr size_t CACHED_RESPONSE_SIZE = CIPHERTEXT_SIZE(0);
+
+struct cached_response {
+    /* seq_op of the request without op, 0 if the entry is empty */
+    uint64_t request_seq;
+    size_t size;
+    unsigned char ciphertext[CACHED_RESPONSE_SIZE];
+};
+
+/* Value of a chunked put that is reassembled until all chunks arrived */
+struct chunk_reassembly {
+    bool active;
+    uint64_t transfer_seq;
+    unsigned char *key;
+    size_t key_len;
+    unsigned char *value;
+    size_t total_len;
+    uint32_t count;
+    uint32_t received;
+    /* One flag per chunk, so every chunk is only accepted once */
+    bool *chunk_received;
+};
+
+/* Value of a chunked get, copied when chunk 0 is requested. The other chunks
+ * are served from the copy, so a put in between can't mix two versions */
+struct chunk_snapshot {
+    bool active;
+    uint64_t transfer_seq;
+    unsigned char *value;
+    size_t total_len;
+    uint32_t count;
+    uint32_t served;
+    /* One flag per chunk, so every chunk is only served once */
+    bool *chunk_served;
+};
+
+/*
+ * State of one client session of a ServerThread: The session keys, the
+ * security mode and the sequence numbers that protect against replays.
+ * A ServerThread serves any number of sessions, which are identified by the
+ * number of the eRPC session the requests arrive on.
+ */
+class ServerSession {
+private:
+    /* Number of the eRPC session at the server */
+    uint16_t session_num;
+    /* ID the client sent in the handshake, binds the session key */
+    uint8_t client_id;
+    /* Anti-replay window: One bit per sequence number up to REPLAY_WINDOW
+     * below highest_seq, in a ring of words that is indexed by the sequence
+     * number itself. Bits of sequence numbers above highest_seq are 0 */
+    bool seq_started;
+    uint64_t highest_seq;
+    uint64_t seen_seqs[REPLAY_WINDOW_WORDS];
+    /* Only filled if response_caching is set: */
+    bool response_caching;
+    struct cached_response response_cache[RESPONSE_CACHE_SIZE];
+    /* Sequence numbers are checked by crypto workers concurrently: */
+    bool concurrent;
+    std::mutex seq_lock;
+    /* Set once the first authentic request of the client arrived. From then
+     * on, only requests in the same security mode are accepted */
+    bool security_mode_fixed;
+    /* Set once the handshake derived the session key from the master key */
+    bool key_established;
+    /* Set by the disconnect request of the client */
+    std::atomic<bool> closed;
+    /* Session keys of both key phases, requests are handled in key_phase: */
+    CryptoSession crypto[NUM_KEY_PHASES];
+    uint8_t key_phase;
+    /* Incremented whenever a key or the security mode changes. Crypto
+     * workers take over the sessions when they are behind: */
+    uint64_t crypto_generation;
+    uint64_t synced_generation;
+    /* Requests that wait for the asynchronous KV-store. The session is only
+     * released when none is left */
+    size_t deferred_requests;
+    /* Requests that the client may have in flight, advertised in every
+     * response. Is set by the ServerThread, read by crypto workers: */
+    std::atomic<uint16_t> credits;
+    /* Rate limit of the client: Requests are admitted while next_admission,
+     * which moves rate_interval ns ahead with every admitted request, is at
+     * most burst_time ns in the future. No limit if rate_interval is 0 */
+    uint64_t rate_interval;
+    uint64_t burst_time;
+    uint64_t next_admission;
+    struct chunk_reassembly reassemblies[MAX_CHUNKED_TRANSFERS];
+    struct chunk_snapshot snapshots[MAX_CHUNKED_TRANSFERS];
+
+public:
+    ServerSession(uint16_t session_num, const unsigned char *master_key,
+            bool concurrent, bool response_caching = false);
+
+    ~ServerSession();
+
+    ServerSession(const ServerSession&) = delete;
+    ServerSession& operator=(const ServerSession&) = delete;
+
+    inline uint16_t get_session_num() const {
+        return this->session_num;
+    }
+
+    bool is_seq_valid(uint64_t sequence_number);
+
+    void set_response(struct rdma_msg_header *header, uint8_t operation);
+
+    inline void set_credits(uint16_t new_credits) {
+        this->credits.store(new_credits, std::memory_order_relaxed);
+    }
+
+    inline uint16_t get_credits() const {
+        return this->credits.load(std::memory_order_relaxed);
+    }
+
+    void limit_rate(uint64_t rate, uint64_t burst);
+
+    bool admit(uint64_t now);
+
+    void cache_response(uint64_t seq_op,
+            const unsigned char *ciphertext, size_t size);
+
+    bool has_cached_response(uint64_t seq_op);
+
+    bool get_cached_response(uint64_t seq_op,
+            unsigned char *ciphertext, size_t *size);
+
+    inline CryptoSession *get_crypto_session() {
+        return &(this->crypto[this->key_phase]);
+    }
+
+    inline CryptoSession *get_crypto_session(uint8_t phase) {
+        return &(this->crypto[phase]);
+    }
+
+    inline const CryptoSession *get_crypto_sessions() const {
+        return this->crypto;
+    }
+
+    inline void set_key_phase(uint8_t phase) {
+        this->key_phase = phase;
+    }
+
+    inline uint8_t get_key_phase() const {
+        return this->key_phase;
+    }
+
+    inline bool is_key_established() const {
+        return this->key_established;
+    }
+
+    /* Is only called for the handshake, the ID is checked afterwards: */
+    inline void set_client_id(uint8_t id) {
+        this->client_id = id;
+    }
+
+    int install_session_key(uint8_t type,
+            const unsigned char *client_random,
+            const unsigned char *server_random);
+
+    bool accept_security_mode(
+            enum security_mode mode, uint8_t accepted_modes);
+
+    inline bool is_security_mode_fixed() const {
+        return this->security_mode_fixed;
+    }
+
+    inline void fix_security_mode() {
+        if (unlikely(!this->security_mode_fixed)) {
+            this->security_mode_fixed = true;
+            this->crypto_generation++;
+        }
+    }
+
+    inline bool is_synced() const {
+        return this->synced_generation == this->crypto_generation;
+    }
+
+    inline void set_synced() {
+        this->synced_generation = this->crypto_generation;
+    }
+
+    inline void close() {
+        this->closed = true;
+    }
+
+    inline bool is_closed() const {
+        return this->closed;
+    }
+
+    inline void add_deferred() {
+        this->deferred_requests++;
+    }
+
+    inline void remove_deferred() {
+        this->deferred_requests--;
+    }
+
+    inline bool has_deferred() const {
+        return this->deferred_requests > 0;
+    }
+
+    struct chunk_reassembly *get_reassembly(
+            const struct rdma_chunk_header *chunk);
+
+    void release_reassembly(struct chunk_reassembly *reassembly);
+
+    struct chunk_snapshot *take_snapshot(uint64_t transfer_seq,
+            const unsigned char *value, size_t value_len);
+
+    struct chunk_snapshot *get_snapshot(uint64_t transfer_seq);
+
+    void release_snapshot(struct chunk_snapshot *snapshot);
+};
+
+
+#endif //CLIENT_SERVER_TWOSIDED_SERVERSESSION_H
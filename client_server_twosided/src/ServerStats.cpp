@@ -0,0 +1,245 @@
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "ServerStats.h"
+
+/* Counters of all ServerThreads that are running, and the counts of the ones
+ * that terminated already */
+static std::mutex stats_lock;
+static std::vector<const ServerStats *> live_stats;
+static struct anchor_server::server_stats retired_stats;
+
+/* Thread that answers connections to the stats socket with a snapshot */
+static int stats_socket = -1;
+static std::string stats_socket_path;
+static std::atomic<bool> serving_stats{false};
+static std::thread stats_thread;
+/* Milliseconds that the stats thread waits for a connection at once */
+static constexpr int STATS_POLL_INTERVAL = 100;
+
+
+ServerStats::ServerStats() {
+    for (auto& counter : this->requests)
+        counter.store(0, std::memory_order_relaxed);
+    this->bytes_received.store(0, std::memory_order_relaxed);
+    this->bytes_sent.store(0, std::memory_order_relaxed);
+    this->stolen_requests.store(0, std::memory_order_relaxed);
+    this->decrypt_failures.store(0, std::memory_order_relaxed);
+    this->replay_rejects.store(0, std::memory_order_relaxed);
+    this->retransmits.store(0, std::memory_order_relaxed);
+    this->admission_rejects.store(0, std::memory_order_relaxed);
+    for (auto& counter : this->service_time)
+        counter.store(0, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(stats_lock);
+    live_stats.push_back(this);
+}
+
+
+ServerStats::~ServerStats() {
+    std::lock_guard<std::mutex> lock(stats_lock);
+    this->add_to(&retired_stats);
+    live_stats.erase(
+            std::find(live_stats.begin(), live_stats.end(), this));
+}
+
+
+/**
+ * Adds the counters to a snapshot. May be called by any thread, while the
+ * ServerThread keeps counting
+ * @param stats Snapshot that the counters are added to
+ */
+void ServerStats::add_to(struct anchor_server::server_stats *stats) const {
+    for (size_t i = 0; i < NUM_REQ_OPS; i++)
+        stats->requests[i] += this->requests[i].load(std::memory_order_relaxed);
+    stats->bytes_received += this->bytes_received.load(std::memory_order_relaxed);
+    stats->bytes_sent += this->bytes_sent.load(std::memory_order_relaxed);
+    stats->stolen_requests +=
+            this->stolen_requests.load(std::memory_order_relaxed);
+    stats->decrypt_failures +=
+            this->decrypt_failures.load(std::memory_order_relaxed);
+    stats->replay_rejects += this->replay_rejects.load(std::memory_order_relaxed);
+    stats->retransmits += this->retransmits.load(std::memory_order_relaxed);
+    stats->admission_rejects +=
+            this->admission_rejects.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < anchor_server::STATS_BUCKETS; i++)
+        stats->service_time[i] +=
+                this->service_time[i].load(std::memory_order_relaxed);
+}
+
+
+/**
+ * Takes a snapshot of the counters of all server threads, without stopping
+ * them
+ * @param stats Is filled with the sums of all counters
+ */
+void anchor_server::get_stats(struct server_stats *stats) {
+    std::lock_guard<std::mutex> lock(stats_lock);
+    *stats = retired_stats;
+    for (auto thread_stats : live_stats)
+        thread_stats->add_to(stats);
+}
+
+
+/**
+ * @param bucket Bucket of the service time histogram
+ * @return The smallest service time in ns that is counted in the bucket
+ */
+uint64_t anchor_server::get_stats_bucket_start(size_t bucket) {
+    if (bucket < 2 * STATS_SUB_BUCKETS)
+        return bucket;
+    size_t shift = bucket / STATS_SUB_BUCKETS - 1;
+    return static_cast<uint64_t>(STATS_SUB_BUCKETS +
+            bucket % STATS_SUB_BUCKETS) << shift;
+}
+
+
+/**
+ * Estimates a percentile of the service times of a snapshot
+ * @param stats Snapshot of get_stats
+ * @param percentile Percentile between 0 and 100
+ * @return Start of the bucket that the percentile falls into in ns, 0 if no
+ *      service time was counted
+ */
+uint64_t anchor_server::get_stats_percentile(
+        const struct server_stats *stats, double percentile) {
+    uint64_t total = 0, counted = 0;
+    for (auto count : stats->service_time)
+        total += count;
+    if (total == 0)
+        return 0;
+    auto rank = static_cast<uint64_t>(
+            percentile / 100.0 * static_cast<double>(total));
+    for (size_t i = 0; i < STATS_BUCKETS; i++) {
+        counted += stats->service_time[i];
+        if (counted > rank)
+            return get_stats_bucket_start(i);
+    }
+    return get_stats_bucket_start(STATS_BUCKETS - 1);
+}
+
+
+/* Writes a snapshot as text, one counter per line */
+static void write_stats(int connection) {
+    struct anchor_server::server_stats stats;
+    static const char *op_names[NUM_REQ_OPS] =
+            { "get", "put", "delete", "disconnect" };
+    std::string report;
+    char line[128];
+
+    anchor_server::get_stats(&stats);
+    for (size_t i = 0; i < NUM_REQ_OPS; i++) {
+        (void) snprintf(line, sizeof(line), "requests_%s %lu\n",
+                op_names[i], stats.requests[i]);
+        report += line;
+    }
+    (void) snprintf(line, sizeof(line),
+            "bytes_received %lu\nbytes_sent %lu\n"
+            "decrypt_failures %lu\nreplay_rejects %lu\nretransmits %lu\n",
+            stats.bytes_received, stats.bytes_sent,
+            stats.decrypt_failures, stats.replay_rejects, stats.retransmits);
+    report += line;
+    (void) snprintf(line, sizeof(line),
+            "admission_rejects %lu\nstolen_requests %lu\n",
+            stats.admission_rejects, stats.stolen_requests);
+    report += line;
+    (void) snprintf(line, sizeof(line),
+            "service_time_p50_ns %lu\nservice_time_p99_ns %lu\n"
+            "service_time_p999_ns %lu\n",
+            anchor_server::get_stats_percentile(&stats, 50.0),
+            anchor_server::get_stats_percentile(&stats, 99.0),
+            anchor_server::get_stats_percentile(&stats, 99.9));
+    report += line;
+    /* The whole histogram, but only buckets that were used: */
+    for (size_t i = 0; i < anchor_server::STATS_BUCKETS; i++) {
+        if (stats.service_time[i] == 0)
+            continue;
+        (void) snprintf(line, sizeof(line), "service_time_bucket_ns %lu %lu\n",
+                anchor_server::get_stats_bucket_start(i),
+                stats.service_time[i]);
+        report += line;
+    }
+
+    for (size_t written = 0; written < report.size(); ) {
+        ssize_t ret = write(connection,
+                report.data() + written, report.size() - written);
+        if (ret <= 0)
+            return;
+        written += static_cast<size_t>(ret);
+    }
+}
+
+
+static void serve_stats() {
+    struct pollfd listener = { stats_socket, POLLIN, 0 };
+    while (serving_stats.load(std::memory_order_acquire)) {
+        if (poll(&listener, 1, STATS_POLL_INTERVAL) <= 0)
+            continue;
+        int connection = accept(stats_socket, nullptr, nullptr);
+        if (connection < 0)
+            continue;
+        write_stats(connection);
+        (void) close(connection);
+    }
+}
+
+
+/**
+ * Serves snapshots of the counters of all server threads on a Unix domain
+ * socket, e.g. for "socat - UNIX-CONNECT:<path>". Every connection gets one
+ * snapshot as text and is closed afterwards. The server threads are never
+ * stopped for this
+ * @param path Path of the socket, an existing file is replaced
+ * @return 0 on success, -1 on error or if the socket is already open
+ */
+int anchor_server::open_stats_socket(const char *path) {
+    struct sockaddr_un address;
+    if (stats_socket >= 0 || strlen(path) >= sizeof(address.sun_path)) {
+        cerr << "Could not open stats socket" << endl;
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    stats_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (stats_socket < 0)
+        goto err_open_stats_socket;
+    (void) unlink(path);
+    if (0 != bind(stats_socket, (struct sockaddr *) &address, sizeof(address))
+            || 0 != listen(stats_socket, 4))
+        goto err_open_stats_socket;
+
+    stats_socket_path = path;
+    serving_stats = true;
+    stats_thread = std::thread(serve_stats);
+    return 0;
+
+err_open_stats_socket:
+    cerr << "Could not open stats socket at " << path << ": "
+         << strerror(errno) << endl;
+    if (stats_socket >= 0)
+        (void) close(stats_socket);
+    stats_socket = -1;
+    return -1;
+}
+
+
+/**
+ * Stops serving snapshots and removes the stats socket
+ */
+void anchor_server::close_stats_socket() {
+    if (stats_socket < 0)
+        return;
+    serving_stats = false;
+    stats_thread.join();
+    (void) close(stats_socket);
+    (void) unlink(stats_socket_path.c_str());
+    stats_socket = -1;
+}
@@ -0,0 +1,117 @@
+#ifndef CLIENT_SERVER_TWOSIDED_SERVERSTATS_H
+#define CLIENT_SERVER_TWOSIDED_SERVERSTATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include "client_server_common.h"
+#include "Server.h"
+#include "SpscRing.h"
+
+/* Clock of the service times in ns */
+static inline uint64_t stats_clock() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<
+            std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+            .time_since_epoch()).count());
+}
+
+/* Bucket of the service time histogram that a time in ns is counted in */
+static inline size_t stats_bucket(uint64_t time) {
+    constexpr size_t sub_bits = 3;
+    static_assert(anchor_server::STATS_SUB_BUCKETS == 1 << sub_bits,
+            "STATS_SUB_BUCKETS has to match sub_bits");
+    if (time < 2 * anchor_server::STATS_SUB_BUCKETS)
+        return static_cast<size_t>(time);
+    auto shift = static_cast<size_t>(63 - __builtin_clzll(time)) - sub_bits;
+    size_t bucket = (shift + 1) * anchor_server::STATS_SUB_BUCKETS +
+            ((time >> shift) & (anchor_server::STATS_SUB_BUCKETS - 1));
+    return std::min(bucket, anchor_server::STATS_BUCKETS - 1);
+}
+
+/*
+ * Counters and service time histogram of one ServerThread. All counters on
+ * the request path are only written by the ServerThread itself, so they are
+ * incremented without atomic read-modify-write. Other threads only read them
+ * for a snapshot (see anchor_server::get_stats). The error counters are
+ * written by the crypto workers as well and live on a cache line of their
+ * own. Padding keeps the counters of different threads on separate lines.
+ * Every instance registers itself, its counts are kept after its destruction
+ */
+class ServerStats {
+private:
+    char pad_front[CACHE_LINE_SIZE];
+    std::atomic<uint64_t> requests[NUM_REQ_OPS];
+    std::atomic<uint64_t> bytes_received;
+    std::atomic<uint64_t> bytes_sent;
+    std::atomic<uint64_t> stolen_requests;
+    char pad_requests[CACHE_LINE_SIZE -
+            (NUM_REQ_OPS + 3) * sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> decrypt_failures;
+    std::atomic<uint64_t> replay_rejects;
+    std::atomic<uint64_t> retransmits;
+    std::atomic<uint64_t> admission_rejects;
+    char pad_errors[CACHE_LINE_SIZE - 4 * sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> service_time[anchor_server::STATS_BUCKETS];
+    char pad_back[CACHE_LINE_SIZE];
+
+    static inline void increment(
+            std::atomic<uint64_t>& counter, uint64_t value = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+    }
+
+public:
+    ServerStats();
+
+    ~ServerStats();
+
+    ServerStats(const ServerStats&) = delete;
+    ServerStats& operator=(const ServerStats&) = delete;
+
+    inline void count_request(uint8_t op) {
+        increment(this->requests[op & OP_MASK]);
+    }
+
+    inline void count_received(size_t bytes) {
+        increment(this->bytes_received, bytes);
+    }
+
+    inline void count_sent(size_t bytes) {
+        increment(this->bytes_sent, bytes);
+    }
+
+    /* Requests that the ServerThread took from its peers: */
+    inline void count_stolen(size_t requests) {
+        increment(this->stolen_requests, requests);
+    }
+
+    inline void count_service_time(uint64_t time) {
+        increment(this->service_time[stats_bucket(time)]);
+    }
+
+    /* May be called by any thread: */
+    inline void count_decrypt_failure() {
+        this->decrypt_failures.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /* May be called by any thread: */
+    inline void count_replay() {
+        this->replay_rejects.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /* May be called by any thread: */
+    inline void count_retransmit() {
+        this->retransmits.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /* May be called by any thread: */
+    inline void count_admission_reject() {
+        this->admission_rejects.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void add_to(struct anchor_server::server_stats *stats) const;
+};
+
+
+#endif //CLIENT_SERVER_TWOSIDED_SERVERSTATS_H
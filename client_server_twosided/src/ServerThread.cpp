@@ -2,99 +2,957 @@
 // Created by philip on 16.05.21.
 //
 
+#include <algorithm>
+#include <cstring>
+#include <new>
 #include <thread>
+#include "Placement.h"
 #include "rpc.h"
 #include "ServerThread.h"
 
+/* ServerThreads that share their requests, indexed by eRPC ID. They stay
+ * valid until clear_peers, which is called after all of them stopped */
+static std::atomic<ServerThread *> peers[UINT8_MAX + 1];
+static std::atomic_size_t peer_count{0};
+/* Peers whose last poll found nothing to do, requests are only shared while
+ * one of them may steal them: */
+static std::atomic_size_t idle_peers{0};
+
 
 /**
  * Constructs a ServerThread and starts to work
  * @param nexus Nexus needed for the eRPC connection
- * @param erpc_id ID for the Client to handle
+ * @param erpc_id ID of the eRPC endpoint of the thread. Any number of
+ *      clients can connect to it
  * @param max_msg_size Maximum Message possible request size
+ * @param master_key Key that the session keys are derived from in the
+ *      handshakes, has to stay valid as long as the thread runs
  * @param asynchronous If true, spawns a new Thread for working. Otherwise
  *      starts working in the current thread
+ * @param min_workers Number of worker threads that en-/decrypt and handle
+ *      requests of this thread at least. If 0 and max_workers isn't bigger,
+ *      requests are handled by the thread itself
+ * @param max_workers Number of worker threads the pool may grow to under load.
+ *      An elastic pool always keeps at least one worker
+ * @param persistent If true, the thread keeps serving new clients after all
+ *      clients disconnected, until it is terminated
+ * @param polling How the thread polls while no requests arrive
+ * @param admission Credits and rate limits of the sessions
+ * @param work_stealing If true and the thread has no crypto workers, it
+ *      shares its requests with the other ServerThreads that do so, and
+ *      steals theirs while it is idle. Only for asynchronous threads
+ * @param partitions Number of key partitions if the thread only serves the
+ *      keys of the partition of its eRPC ID, 0 to serve all keys
+ * @param response_cache If true, the sessions answer retransmitted requests
+ *      from their response cache
  */
-ServerThread::ServerThread(erpc::Nexus *nexus,
-        int erpc_id, size_t max_msg_size, bool asynchronous) {
-    this->client_id = erpc_id; // TODO: This is not secure. Find better solution
-    this->next_seq = 0;
+ServerThread::ServerThread(erpc::Nexus *nexus, int erpc_id,
+        size_t max_msg_size, const unsigned char *master_key,
+        bool asynchronous, uint8_t min_workers, uint8_t max_workers,
+        bool persistent, const struct poll_config& polling,
+        const struct anchor_server::admission_config& admission,
+        bool work_stealing, uint8_t partitions, bool response_cache) :
+        admission(admission), governor(polling) {
     this->stay_connected = true;
+    this->persistent = persistent;
+    this->master_key = master_key;
+    this->open_sessions = 0;
+    this->had_sessions = false;
+    this->closed_sessions = 0;
+    this->active_session = nullptr;
+    this->max_msg_size = max_msg_size;
+    this->pre_resp_size = std::min(max_msg_size,
+            std::max(CIPHERTEXT_SIZE(SMALL_RESPONSE_SIZE), CONTROL_MESSAGE_SIZE));
+    this->payload_allocations = 0;
+    this->next_worker = 0;
+
+    this->key_buf = static_cast<unsigned char *>(
+            alloc_local(PAYLOAD_SIZE(max_msg_size)));
+    this->value_buf = static_cast<unsigned char *>(
+            alloc_local(PAYLOAD_SIZE(max_msg_size)));
+    if (!(this->key_buf && this->value_buf)) {
+        free_local(this->key_buf, PAYLOAD_SIZE(max_msg_size));
+        free_local(this->value_buf, PAYLOAD_SIZE(max_msg_size));
+        throw std::runtime_error("Couldn't allocate scratch buffers");
+    }
+
+    this->multi_buf = nullptr;
+    this->poll_events = 0;
+    for (auto& request_start : this->request_starts)
+        request_start = { nullptr, 0 };
+
+    this->batch_size = 0;
+    this->batch_session = nullptr;
+    this->batch_capacity = MAX_BATCH_SIZE;
+    this->batch_buf = static_cast<unsigned char *>(
+            alloc_local(MAX_BATCH_SIZE * BATCH_SLOT_SIZE));
+    if (!this->batch_buf)
+        this->batch_capacity = 0;
+
+    this->min_workers = min_workers;
+    this->max_workers = std::max(min_workers, max_workers);
+    /* Without a worker, there is no load to measure: */
+    if (this->max_workers > this->min_workers && this->min_workers == 0)
+        this->min_workers = 1;
+    this->pool_iterations = 0;
+    this->pool_requests = 0;
+    this->pool_stalls = 0;
+    this->pool_in_flight = 0;
+    this->completed_kv_requests = nullptr;
+    this->deferred_requests = 0;
+    for (size_t i = 0; i < this->min_workers; i++)
+        this->workers.push_back(
+                new CryptoWorker(this, max_msg_size, polling));
+
+    /* Peers would call the KV-store for keys of other partitions: */
+    this->work_stealing = work_stealing && asynchronous &&
+            this->workers.empty() && partitions == 0;
+    this->erpc_id = static_cast<uint8_t>(erpc_id);
+    this->partitions = partitions;
+    this->response_cache = response_cache;
+    this->shared_slots = nullptr;
+    this->shared_slot_count = 0;
+    this->shared_in_flight = 0;
+    this->idle = false;
+    this->key_syncs = 0;
+    for (auto& entry : this->shared_crypto)
+        entry.keys = nullptr;
+    if (this->work_stealing) {
+        this->shared_slot_count = std::max((size_t) 1, std::min(
+                SHARED_QUEUE_SIZE, CRYPTO_WORKER_BUFFER_SIZE / max_msg_size));
+        this->shared_slots = static_cast<unsigned char *>(
+                alloc_local(this->shared_slot_count * max_msg_size));
+        /* Without slots, the thread neither shares nor steals requests: */
+        if (!this->shared_slots)
+            this->work_stealing = false;
+    }
+    if (this->work_stealing) {
+        for (size_t slot = this->shared_slot_count; slot > 0; slot--)
+            this->free_shared_slots.push_back(slot - 1);
+        peers[erpc_id] = this;
+        peer_count = std::max(peer_count.load(), (size_t) erpc_id + 1);
+    }
 
     if (asynchronous)
         this->running_thread = std::thread(
-                connect_and_work, this, nexus, erpc_id, max_msg_size);
+                connect_and_work, this, nexus, erpc_id);
     else
-        connect_and_work(this, nexus, erpc_id, max_msg_size);
+        connect_and_work(this, nexus, erpc_id);
 }
 
 
 /**
- * Connects to a client and runs the event loop until a disconnect is requested
+ * Serves clients until all clients that connected disconnected again or
+ * until the thread is terminated. A persistent thread only stops when it is
+ * terminated
  * @param st ServerThread that should connect and work
  * @param nexus Public, shared Nexus object needed for eRPC connection
- * @param erpc_id ID for identification of the according client
- * @param max_msg_size Maximum possible incoming request size
+ * @param erpc_id ID of the eRPC endpoint that clients connect to
  */
 void ServerThread::connect_and_work(ServerThread *st,
-        erpc::Nexus *nexus, uint8_t erpc_id, size_t max_msg_size) {
+        erpc::Nexus *nexus, uint8_t erpc_id) {
 
+    place_thread();
     st->rpc_host = new erpc::Rpc<erpc::CTransport>(
             nexus, st, erpc_id, nullptr);
-    st->rpc_host->set_pre_resp_msgbuf_size(max_msg_size);
+    st->rpc_host->set_pre_resp_msgbuf_size(st->pre_resp_size);
+    size_t allocations_before = ::get_payload_allocations();
 
-    while (likely(st->stay_connected))
+    while (likely(st->stay_connected)) {
+        size_t events = st->poll_events;
         st->rpc_host->run_event_loop_once();
-    for (size_t i = 0; i < MAX_PENDING_REQUESTS; i++)
+        st->process_batch();
+        /* Requests that no peer stole in the meantime: */
+        (void) st->handle_shared_jobs(st, SIZE_MAX);
+        st->collect_responses();
+        st->complete_deferred_requests();
+        if (unlikely(st->closed_sessions > 0))
+            st->release_closed_sessions();
+        if (unlikely(++st->pool_iterations == WORKER_POOL_INTERVAL))
+            st->adjust_worker_pool();
+        /* Prepare the keystreams of the next responses: */
+        if (likely(st->active_session))
+            (void) st->active_session->get_crypto_session()
+                    ->precompute_keystreams();
+        /* An idle thread helps its peers: */
+        st->set_idle(st->work_stealing && st->poll_events == events &&
+                st->shared_in_flight == 0);
+        bool stolen = st->idle && st->steal_jobs() > 0;
+        /* Requests of the KV-store and of peers are completed in one of the
+         * next polls: */
+        st->governor.polled(st->poll_events != events || stolen ||
+                st->deferred_requests > 0 || st->shared_in_flight > 0);
+    }
+    st->set_idle(false);
+    for (size_t i = 0; i < MAX_PENDING_REQUESTS; i++) {
         st->rpc_host->run_event_loop_once();
+        st->process_batch();
+        st->collect_responses();
+        st->complete_deferred_requests();
+    }
+    /* The KV-store must not complete requests of a deleted thread: */
+    while (st->deferred_requests > 0) {
+        st->rpc_host->run_event_loop_once();
+        st->complete_deferred_requests();
+    }
+    st->drain_workers();
+    for (auto worker : st->workers)
+        worker->stop();
     delete st->rpc_host;
+
+    /* Allocations of removed workers were added already: */
+    st->payload_allocations +=
+            ::get_payload_allocations() - allocations_before;
+    for (auto worker : st->workers)
+        st->payload_allocations += worker->get_payload_allocations();
 }
 
 
-void ServerThread::enqueue_response(erpc::ReqHandle *handle,
-        erpc::MsgBuffer *resp) {
-    this->rpc_host->enqueue_response(handle, resp);
+ServerThread::~ServerThread() {
+    for (auto worker : this->workers)
+        delete worker;
+    for (auto session : this->sessions)
+        delete session;
+    for (auto request : this->kv_requests) {
+        free(request->value);
+        delete request;
+    }
+    free_local(this->key_buf, PAYLOAD_SIZE(this->max_msg_size));
+    free_local(this->value_buf, PAYLOAD_SIZE(this->max_msg_size));
+    free_local(this->multi_buf, PAYLOAD_SIZE(this->max_msg_size));
+    free_local(this->batch_buf, this->batch_capacity * BATCH_SLOT_SIZE);
+    free_local(this->shared_slots,
+            this->shared_slot_count * this->max_msg_size);
+    for (auto keys : this->shared_keys)
+        delete[] keys;
+}
+
+
+/**
+ * ServerThreads are allocated on the NUMA node of the placement, like their
+ * buffers (see anchor_server::set_placement)
+ */
+void *ServerThread::operator new(size_t size) {
+    void *thread = alloc_local(size);
+    if (!thread)
+        throw std::bad_alloc();
+    return thread;
+}
+
+
+void ServerThread::operator delete(void *thread, size_t size) {
+    free_local(thread, size);
+}
+
+
+/**
+ * Returns the session of the client that sent a request
+ * @param handle Handle of the request
+ * @return The session or nullptr, if the client didn't do a handshake or
+ *      disconnected already
+ */
+ServerSession *ServerThread::get_session(const erpc::ReqHandle *handle) {
+    uint16_t session_num = get_session_num(handle);
+    if (unlikely(session_num >= this->sessions.size()))
+        return nullptr;
+    ServerSession *session = this->sessions[session_num];
+    if (unlikely(!session || session->is_closed()))
+        return nullptr;
+    return session;
+}
+
+
+/**
+ * Returns the session of the client that sent a request and creates it,
+ * if the client didn't send a request before
+ * @param handle Handle of the request
+ * @return The session or nullptr, if it couldn't be created
+ */
+ServerSession *ServerThread::open_session(const erpc::ReqHandle *handle) {
+    uint16_t session_num = get_session_num(handle);
+    if (session_num >= this->sessions.size())
+        this->sessions.resize(session_num + 1, nullptr);
+    if (this->sessions[session_num])
+        return this->sessions[session_num];
+
+    try {
+        this->sessions[session_num] = new ServerSession(session_num,
+                this->master_key, !this->workers.empty() || this->work_stealing,
+                this->response_cache);
+    } catch (std::exception& e) {
+        cerr << "Couldn't open session: " << e.what() << endl;
+        return nullptr;
+    }
+    this->sessions[session_num]->limit_rate(
+            this->admission.rate, this->admission.burst);
+    this->open_sessions++;
+    this->had_sessions = true;
+    this->update_credits();
+    return this->sessions[session_num];
+}
+
+
+/**
+ * Marks a session as closed after the disconnect request of its client.
+ * Its requests are dropped from now on, the session itself is released
+ * after the current event loop iteration. May be called by crypto workers
+ * @param session Session to close
+ */
+void ServerThread::close_session(ServerSession *session) {
+    if (session->is_closed())
+        return;
+    session->close();
+    this->closed_sessions++;
+}
+
+
+/**
+ * Releases all closed sessions once no request of them is in flight. Sessions
+ * with requests at the asynchronous KV-store are released in a later call.
+ * When the last client disconnected, the thread stops, unless it is
+ * persistent
+ */
+void ServerThread::release_closed_sessions() {
+    size_t released = 0;
+    this->process_batch();
+    this->drain_workers();
+    for (auto& session : this->sessions) {
+        if (!session || !session->is_closed() || session->has_deferred())
+            continue;
+        if (this->batch_session == session)
+            this->batch_session = nullptr;
+        if (this->active_session == session)
+            this->active_session = nullptr;
+        delete session;
+        session = nullptr;
+        this->open_sessions--;
+        released++;
+    }
+    /* Crypto workers may have closed sessions in the meantime: */
+    this->closed_sessions -= released;
+    if (released > 0)
+        this->update_credits();
+    if (!this->persistent && this->had_sessions && this->open_sessions == 0)
+        this->stay_connected = false;
+}
+
+
+/**
+ * Shares the credits of the thread equally among its sessions, but grants
+ * no session more than its own limit and every session at least one. Is
+ * called whenever a session is opened or released
+ */
+void ServerThread::update_credits() {
+    if (this->open_sessions == 0)
+        return;
+    size_t credits = std::max(
+            this->admission.thread_credits / this->open_sessions, (size_t) 1);
+    credits = std::min(credits, (size_t) this->admission.session_credits);
+    for (auto session : this->sessions) {
+        if (session)
+            session->set_credits(static_cast<uint16_t>(credits));
+    }
+}
+
+
+/**
+ * Grows the crypto worker pool by one worker, if more than
+ * 1/WORKER_POOL_STALL_RATIO of the requests since the last adjustment found
+ * all workers busy. Shrinks it by one worker, if the requests in flight
+ * would have fit on one worker less. Without any requests, the pool shrinks
+ * down to its minimum
+ */
+void ServerThread::adjust_worker_pool() {
+    size_t count = this->workers.size();
+    if (this->min_workers < this->max_workers) {
+        if (count < this->max_workers && this->pool_stalls *
+                WORKER_POOL_STALL_RATIO > this->pool_requests)
+            (void) this->add_worker();
+        else if (count > this->min_workers && this->pool_in_flight <
+                (count - 1) * std::max(this->pool_requests, (size_t) 1))
+            this->remove_worker();
+    }
+    this->pool_iterations = 0;
+    this->pool_requests = 0;
+    this->pool_stalls = 0;
+    this->pool_in_flight = 0;
+}
+
+
+/**
+ * Starts a new crypto worker. The sessions are rebalanced onto it right
+ * away: it takes over the keys of every synchronized session, so it gets its
+ * share of the requests of all clients, not only of new ones
+ * @return 0 on success, -1 on error
+ */
+int ServerThread::add_worker() {
+    CryptoWorker *worker;
+    try {
+        worker = new CryptoWorker(this, this->max_msg_size,
+                this->governor.get_config());
+    } catch (std::exception& e) {
+        cerr << "Couldn't start crypto worker: " << e.what() << endl;
+        return -1;
+    }
+
+    /* Sessions that aren't synchronized are synchronized with all workers
+     * on their next request: */
+    for (auto session : this->sessions) {
+        if (session && session->is_synced() &&
+                0 != worker->sync_session(session)) {
+            cerr << "Couldn't synchronize crypto worker" << endl;
+            delete worker;
+            return -1;
+        }
+    }
+    this->workers.push_back(worker);
+    return 0;
+}
+
+
+/**
+ * Stops the crypto worker that was added last, after its requests in flight
+ * were answered
+ */
+void ServerThread::remove_worker() {
+    CryptoWorker *worker = this->workers.back();
+    worker->drain();
+    worker->stop();
+    this->payload_allocations += worker->get_payload_allocations();
+    this->workers.pop_back();
+    delete worker;
+    this->next_worker %= this->workers.size();
+}
+
+
+/**
+ * Copies a request to the batch that is processed after the current event
+ * loop iteration. If the batch is full, it is processed right away.
+ * Only requests that decrypt_messages interleaves with others are batched.
+ * The request has to belong to the session of the last select_session()
+ * @param handle Handle of the request
+ * @param ciphertext Request buffer
+ * @param ciphertext_size Size of the request
+ * @return true if the request was added to the batch, false if it needs to be
+ *      processed directly (batching disabled or not worth the copy)
+ */
+bool ServerThread::batch_request(erpc::ReqHandle *handle,
+        const unsigned char *ciphertext, size_t ciphertext_size) {
+    if (unlikely(this->batch_capacity == 0) || !is_interleaved(
+            this->active_session->get_crypto_session(), ciphertext_size))
+        return false;
+
+    struct rdma_dec_batch_entry *entry = this->batch + this->batch_size;
+    entry->ciphertext = this->batch_buf + this->batch_size * BATCH_SLOT_SIZE;
+    entry->ciphertext_len = ciphertext_size;
+    entry->payload = { nullptr, nullptr, 0 };
+    (void) memcpy(entry->ciphertext, ciphertext, ciphertext_size);
+    this->batch_handles[this->batch_size++] = handle;
+
+    if (this->batch_size == this->batch_capacity)
+        this->process_batch();
+    return true;
 }
 
-/* *
- * Checks if sequence number is valid by checking whether we expect the
- * according sequence number from the according client
- * Returns 0, if the sequence number is valid, -1 otherwise
- * */
-bool ServerThread::is_seq_valid(uint64_t sequence_number) {
-    uint8_t id = ID_FROM_SEQ_OP(sequence_number);
-    if (unlikely(id != this->client_id)) {
-        cerr << "Invalid Client ID" << endl;
+
+/**
+ * Processes all requests that were batched since the last call
+ */
+void ServerThread::process_batch() {
+    if (this->batch_size == 0)
+        return;
+    process_request_batch(this, this->batch_session,
+            this->batch_handles, this->batch, this->batch_size);
+    this->batch_size = 0;
+}
+
+
+/**
+ * Hands a request to the next crypto worker that isn't busy. If the keys or
+ * the security mode of the session changed since its last request, the
+ * workers take over the session before. If all workers are busy, waits for
+ * the next completed request. Both are recorded for the adjustment of the
+ * worker pool
+ * @param session Session of the request
+ * @param handle Handle of the request
+ * @param ciphertext Request buffer
+ * @param ciphertext_size Size of the request
+ * @return true if the request was handed to a worker, false if it needs to
+ *      be processed by this thread (no workers or request too big)
+ */
+bool ServerThread::offload_request(ServerSession *session,
+        erpc::ReqHandle *handle,
+        const unsigned char *ciphertext, size_t ciphertext_size) {
+    if (this->workers.empty() || unlikely(ciphertext_size > this->max_msg_size))
         return false;
+
+    if (unlikely(!session->is_synced())) {
+        this->drain_workers();
+        for (auto worker : this->workers) {
+            if (0 != worker->sync_session(session)) {
+                cerr << "Couldn't synchronize crypto workers" << endl;
+                return false;
+            }
+        }
+        session->set_synced();
     }
-    if (unlikely(this->next_seq == 0)) {
-        this->next_seq = sequence_number & SEQ_MASK;
-        return true;
+
+    for (auto worker : this->workers)
+        this->pool_in_flight += worker->get_in_flight();
+    this->pool_requests++;
+
+    bool stalled = false;
+    while (true) {
+        for (size_t i = 0; i < this->workers.size(); i++) {
+            CryptoWorker *worker = this->workers[this->next_worker];
+            this->next_worker = (this->next_worker + 1) % this->workers.size();
+            if (worker->submit(handle, session,
+                    ciphertext, ciphertext_size, session->get_key_phase()))
+                return true;
+        }
+        if (!stalled) {
+            this->pool_stalls++;
+            stalled = true;
+        }
+        this->collect_responses();
     }
-    auto seq_diff = std::abs(static_cast<ssize_t>(SEQ_FROM_SEQ_OP(
-        sequence_number & SEQ_MASK) - SEQ_FROM_SEQ_OP(this->next_seq)));
+}
 
-    if (likely(seq_diff <= (SEQ_THRESHOLD * 2))) {
-        if (likely(seq_diff > 0))
-            this->next_seq = sequence_number & SEQ_MASK;
-        return true;
+
+/**
+ * Takes a request from the pool, which is handed to the asynchronous
+ * KV-store. The request and its session are kept until it is completed
+ * @param session Session of the request
+ * @param handle Handle of the request, the response is enqueued on it later
+ * @return The pooled request or nullptr, if no memory could be allocated
+ */
+struct anchor_server::kv_request *ServerThread::defer_request(
+        ServerSession *session, erpc::ReqHandle *handle) {
+    struct anchor_server::kv_request *request;
+    if (likely(!this->free_kv_requests.empty())) {
+        request = this->free_kv_requests.back();
+        this->free_kv_requests.pop_back();
+    } else {
+        request = new (std::nothrow) anchor_server::kv_request();
+        if (!request) {
+            cerr << "Memory allocation failure" << endl;
+            return nullptr;
+        }
+        this->kv_requests.push_back(request);
+        /* Returning a request to the pool never allocates: */
+        this->free_kv_requests.reserve(this->kv_requests.size());
+        request->value = nullptr;
+        request->value_capacity = 0;
     }
-    else {
-        fprintf(stderr, "Expected: %lx, Got: %lx\n",
-                this->next_seq, sequence_number & SEQ_MASK);
+    request->st = this;
+    request->session = session;
+    request->handle = handle;
+    request->key_phase = session->get_key_phase();
+    request->chunked = false;
+    request->status = 0;
+    request->value_len = 0;
+    session->add_deferred();
+    this->deferred_requests++;
+    return request;
+}
+
+
+/**
+ * Hands a completed request back to this thread. May be called by any thread
+ * @param request Request that was completed by the KV-store
+ */
+void ServerThread::push_completed_request(
+        struct anchor_server::kv_request *request) {
+    request->next = this->completed_kv_requests.load(std::memory_order_relaxed);
+    while (!this->completed_kv_requests.compare_exchange_weak(request->next,
+            request, std::memory_order_release, std::memory_order_relaxed));
+}
+
+
+/**
+ * Sends the responses of all requests that the KV-store completed since the
+ * last call, in the order of their completion. The requests are returned to
+ * the pool afterwards
+ */
+void ServerThread::complete_deferred_requests() {
+    struct anchor_server::kv_request *request, *completed = nullptr, *next;
+    if (likely(!this->completed_kv_requests.load(std::memory_order_relaxed)))
+        return;
+    request = this->completed_kv_requests.exchange(
+            nullptr, std::memory_order_acquire);
+    /* The stack holds the last completion first: */
+    for (; request; request = next) {
+        next = request->next;
+        request->next = completed;
+        completed = request;
+    }
+    for (request = completed; request; request = request->next) {
+        send_deferred_response(this, request);
+        request->session->remove_deferred();
+        this->deferred_requests--;
+        this->free_kv_requests.push_back(request);
+    }
+}
+
+
+/**
+ * Enqueues the responses of all requests the crypto workers and the peers
+ * finished
+ */
+void ServerThread::collect_responses() {
+    for (auto worker : this->workers)
+        (void) worker->collect();
+    if (this->shared_in_flight > 0)
+        (void) this->collect_shared();
+}
+
+
+/**
+ * Waits until the crypto workers and the peers finished all requests in
+ * flight. Shared requests that no peer stole are handled by this thread
+ */
+void ServerThread::drain_workers() {
+    for (auto worker : this->workers)
+        worker->drain();
+    while (this->shared_in_flight > 0) {
+        (void) this->handle_shared_jobs(this, SIZE_MAX);
+        if (this->collect_shared() == 0)
+            std::this_thread::yield();
+    }
+}
+
+
+/**
+ * Shares a request with the peers instead of handling it right away: It is
+ * handled by the first thread that takes it from the queue, this one after
+ * the current event loop iteration or an idle peer before. Requests are only
+ * shared while peers are idle, up to STEAL_BATCH per idle peer, since the
+ * ones that this thread handles itself would just miss the batch. If the
+ * keys or the security mode of the session changed since its last request,
+ * they are copied for the peers once no shared request is in flight
+ * @param session Session of the request
+ * @param handle Handle of the request
+ * @param ciphertext Request buffer
+ * @param ciphertext_size Size of the request
+ * @return true if the request was shared, false if it needs to be processed
+ *      by this thread (no work stealing, no idle peer, all slots in use or
+ *      request too big)
+ */
+bool ServerThread::share_request(ServerSession *session,
+        erpc::ReqHandle *handle,
+        const unsigned char *ciphertext, size_t ciphertext_size) {
+    if (likely(!this->work_stealing))
+        return false;
+    /* This thread still counts as idle until its poll is over: */
+    size_t idle_count = idle_peers.load(std::memory_order_relaxed) -
+            (this->idle ? 1 : 0);
+    if (this->shared_in_flight >= idle_count * STEAL_BATCH ||
+            this->free_shared_slots.empty() ||
+            unlikely(ciphertext_size > this->max_msg_size))
         return false;
+
+    uint16_t session_num = session->get_session_num();
+    if (unlikely(!session->is_synced())) {
+        this->drain_workers();
+        if (0 != copy_session_keys(this->shared_keys, session)) {
+            cerr << "Couldn't copy the session keys for the peers" << endl;
+            return false;
+        }
+        if (session_num >= this->shared_keys_syncs.size())
+            this->shared_keys_syncs.resize(session_num + 1, 0);
+        this->shared_keys_syncs[session_num] = ++this->key_syncs;
+        session->set_synced();
+    }
+
+    size_t slot = this->free_shared_slots.back();
+    this->free_shared_slots.pop_back();
+    struct shared_job job = { handle, session,
+            this->shared_slots + slot * this->max_msg_size, ciphertext_size,
+            slot, this->shared_keys[session_num] + session->get_key_phase(),
+            this->shared_keys_syncs[session_num] };
+    (void) memcpy(job.ciphertext, ciphertext, ciphertext_size);
+    /* Never fails, there are at most as many jobs as slots: */
+    (void) this->shared_jobs.try_push(job);
+    this->shared_in_flight++;
+    return true;
+}
+
+
+/**
+ * Handles shared requests of this thread. May be called by any thread that
+ * shares its requests, the responses are enqueued by this thread
+ * @param handler Thread that handles the requests
+ * @param max_jobs Maximum number of requests to handle
+ * @return Number of requests that were handled
+ */
+size_t ServerThread::handle_shared_jobs(ServerThread *handler,
+        size_t max_jobs) {
+    struct shared_job job;
+    struct shared_completion completion;
+    size_t handled = 0;
+
+    while (handled < max_jobs && this->shared_jobs.try_pop(&job)) {
+        completion = { job.handle, 0, job.slot, false };
+        CryptoSession *crypto =
+                handler->get_shared_crypto(job.keys, job.keys_sync);
+        if (likely(crypto))
+            completion.respond = process_offloaded_request(this, job.session,
+                    crypto, job.handle, job.ciphertext, job.ciphertext_len,
+                    this->max_msg_size, &(completion.response_size));
+        /* Never fails, there are at most as many completions as jobs: */
+        (void) this->shared_completions.try_push(completion);
+        handled++;
+    }
+    return handled;
+}
+
+
+/**
+ * Returns the crypto session of this thread for shared requests with the
+ * given keys. It is set up again if the keys were copied anew
+ * @param keys Copy of the session keys in a key phase
+ * @param keys_sync Number of the copy
+ * @return The crypto session or nullptr, if there is no key in that phase
+ */
+CryptoSession *ServerThread::get_shared_crypto(
+        const CryptoSession *keys, uint64_t keys_sync) {
+    size_t index = static_cast<size_t>((reinterpret_cast<uintptr_t>(keys) *
+            UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (SHARED_CRYPTO_CACHE - 1);
+    struct shared_crypto *entry = this->shared_crypto + index;
+    if (likely(entry->keys == keys && entry->keys_sync == keys_sync))
+        return &(entry->crypto);
+
+    entry->keys = nullptr;
+    if (unlikely(!keys->get_key() ||
+            0 != entry->crypto.set_key(keys->get_key(), keys->get_impl())))
+        return nullptr;
+    entry->crypto.set_security_mode(keys->get_security_mode());
+    entry->keys = keys;
+    entry->keys_sync = keys_sync;
+    return &(entry->crypto);
+}
+
+
+/**
+ * Enqueues the responses of the shared requests that were handled since the
+ * last call, copied from their slots, and frees the slots
+ * @return Number of requests that were completed
+ */
+size_t ServerThread::collect_shared() {
+    struct shared_completion completion;
+    size_t completed = 0;
+    while (this->shared_completions.try_pop(&completion)) {
+        if (likely(completion.respond))
+            this->enqueue_response_copy(completion.handle,
+                    this->shared_slots + completion.slot * this->max_msg_size,
+                    completion.response_size);
+        this->free_shared_slots.push_back(completion.slot);
+        completed++;
     }
+    this->shared_in_flight -= completed;
+    return completed;
 }
 
-/*
- * Returns the next sequence number and updates the next expected sequence
- * number for the according client
- * Should only be called with already checked sequence numbers
+
+/**
+ * Steals requests from the first peer that has some, starting with the
+ * next one after this thread, so idle threads spread over the busy ones
+ * @return Number of requests that were stolen and handled
+ */
+size_t ServerThread::steal_jobs() {
+    size_t count = peer_count.load(std::memory_order_acquire);
+    for (size_t i = 1; i < count; i++) {
+        ServerThread *peer = peers[(this->erpc_id + i) % count].load(
+                std::memory_order_acquire);
+        if (!peer)
+            continue;
+        size_t stolen = peer->handle_shared_jobs(this, STEAL_BATCH);
+        if (stolen > 0) {
+            this->stats.count_stolen(stolen);
+            return stolen;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Marks this thread as idle or busy for the peers that share their requests
+ * @param now_idle True if the last poll found nothing to do
+ */
+void ServerThread::set_idle(bool now_idle) {
+    if (likely(now_idle == this->idle))
+        return;
+    this->idle = now_idle;
+    if (now_idle)
+        idle_peers.fetch_add(1, std::memory_order_relaxed);
+    else
+        idle_peers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+
+/**
+ * Forgets all ServerThreads that shared their requests. May only be called
+ * once all of them stopped, before they are deleted
+ */
+void ServerThread::clear_peers() {
+    for (auto& peer : peers)
+        peer = nullptr;
+    peer_count = 0;
+}
+
+
+/**
+ * Switches to the session and key phase of the next request. Batched
+ * requests are processed before, if they belong to another session or key
+ * phase, since a batch is decrypted with a single key
+ * @param session Session of the next request
+ * @param phase Key phase of the next request
+ */
+void ServerThread::select_session(ServerSession *session, uint8_t phase) {
+    this->active_session = session;
+    if (likely(session == this->batch_session &&
+            phase == session->get_key_phase()))
+        return;
+    this->process_batch();
+    this->batch_session = session;
+    session->set_key_phase(phase);
+}
+
+
+/**
+ * Points key and value of a payload struct to the scratch buffers of this
+ * thread, if a request with the given size fits into them
+ * The buffers are only valid until the next request is handled
+ * @param payload Payload struct that is passed to decrypt_message
+ * @param ciphertext_size Size of the incoming request
+ * @return true if the scratch buffers are used, false if the payload pointers
+ *      are set to nullptr and decrypt_message needs to allocate memory
+ */
+bool ServerThread::get_scratch_payload(
+        struct rdma_dec_payload *payload, size_t ciphertext_size) {
+    if (likely(ciphertext_size <= this->max_msg_size)) {
+        payload->key = this->key_buf;
+        payload->value = this->value_buf;
+        return true;
+    }
+    payload->key = nullptr;
+    payload->value = nullptr;
+    return false;
+}
+
+
+/**
+ * Returns the buffer that the values of a multi-get are copied to, if the
+ * KV-store has no batched get. It has room for PAYLOAD_SIZE(max_msg_size)
+ * bytes and is only valid until the next multi-get is handled
+ * @return The buffer or nullptr, if no memory could be allocated
+ */
+unsigned char *ServerThread::get_multi_buffer() {
+    if (unlikely(!this->multi_buf)) {
+        this->multi_buf = static_cast<unsigned char *>(
+                alloc_local(PAYLOAD_SIZE(this->max_msg_size)));
+        if (!this->multi_buf)
+            cerr << "Memory allocation failure" << endl;
+    }
+    return this->multi_buf;
+}
+
+
+/* Slot of the start time of a request */
+static inline size_t request_start_slot(const erpc::ReqHandle *handle) {
+    return static_cast<size_t>((reinterpret_cast<uintptr_t>(handle) *
+            UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (REQUEST_START_SLOTS - 1);
+}
+
+
+/**
+ * Counts an incoming request and records its start time. Is called first
+ * thing by every request handler
+ * @param handle Handle of the request
+ */
+void ServerThread::begin_request(const erpc::ReqHandle *handle) {
+    this->poll_events++;
+    this->stats.count_received(handle->get_req_msgbuf()->get_data_size());
+    this->request_starts[request_start_slot(handle)] = {
+            handle, stats_clock() };
+}
+
+
+/**
+ * Enqueues a response and counts the service time of its request
+ * @param handle Handle of the request
+ * @param resp Response buffer
+ */
+void ServerThread::enqueue_response(erpc::ReqHandle *handle,
+        erpc::MsgBuffer *resp) {
+    struct request_start *start =
+            this->request_starts + request_start_slot(handle);
+    if (likely(start->handle == handle)) {
+        this->stats.count_service_time(stats_clock() - start->time);
+        start->handle = nullptr;
+    }
+    this->poll_events++;
+    this->stats.count_sent(resp->get_data_size());
+    this->rpc_host->enqueue_response(handle, resp);
+}
+
+
+/**
+ * Enqueues a response that another thread encrypted, copied to a response
+ * buffer of its size. Workers and peers can't allocate response buffers, so
+ * they encrypt to the slot of the request instead
+ * @param handle Handle of the request
+ * @param response Encrypted response
+ * @param size Size of the response
+ */
+void ServerThread::enqueue_response_copy(erpc::ReqHandle *handle,
+        const unsigned char *response, size_t size) {
+    erpc::MsgBuffer *resp = this->get_response_buffer(handle, size);
+    if (unlikely(!resp))
+        return;
+    erpc::Rpc<erpc::CTransport>::resize_msg_buffer(resp, size);
+    (void) memcpy(resp->buf, response, size);
+    this->enqueue_response(handle, resp);
+}
+
+
+/**
+ * Returns a response buffer of the given size for a request. Acks, control
+ * messages and small values fit into the pre-allocated response buffer of
+ * the request. Bigger responses get a buffer from the size classes of the
+ * eRPC allocator, which eRPC frees after sending the response.
+ * May only be called by the ServerThread itself
+ * @param handle Handle of the request
+ * @param size Size of the response
+ * @return The response buffer or nullptr on error
+ */
+erpc::MsgBuffer *ServerThread::get_response_buffer(
+        erpc::ReqHandle *handle, size_t size) {
+    if (likely(size <= this->pre_resp_size))
+        return &(handle->pre_resp_msgbuf);
+    if (unlikely(size > this->max_msg_size)) {
+        cerr << "Answer too long for a response buffer" << endl;
+        return nullptr;
+    }
+    handle->dyn_resp_msgbuf = this->rpc_host->alloc_msg_buffer(size);
+    if (unlikely(!handle->dyn_resp_msgbuf.buf)) {
+        cerr << "Couldn't allocate response buffer" << endl;
+        return nullptr;
+    }
+    return &(handle->dyn_resp_msgbuf);
+}
+
+
+/**
+ * Frees a response buffer of get_response_buffer that is not enqueued
+ * @param handle Handle of the request
+ * @param resp Response buffer of the request
  */
-uint64_t ServerThread::get_next_seq(uint64_t sequence_number, uint8_t operation) {
-    uint64_t ret = NEXT_SEQ(sequence_number);
-    this->next_seq = NEXT_SEQ(ret & SEQ_MASK);
-    return SET_OP(ret, operation);
+void ServerThread::release_response_buffer(
+        erpc::ReqHandle *handle, erpc::MsgBuffer *resp) {
+    if (resp == &(handle->dyn_resp_msgbuf))
+        this->rpc_host->free_msg_buffer(*resp);
 }
 
 void ServerThread::join() {
@@ -4,34 +4,319 @@
 
 #ifndef CLIENT_SERVER_TWOSIDED_SERVERTHREAD_H
 #define CLIENT_SERVER_TWOSIDED_SERVERTHREAD_H
+#include <atomic>
 #include <thread>
+#include <vector>
 #include "client_server_common.h"
+#include "CryptoSession.h"
+#include "CryptoWorker.h"
+#include "PollGovernor.h"
 #include "rpc.h"
 #include "Server.h"
+#include "ServerSession.h"
+#include "ServerStats.h"
+#include "WorkQueue.h"
 
-static constexpr ssize_t SEQ_THRESHOLD = 64;
+/* Maximum number of requests that are processed together */
+static constexpr size_t MAX_BATCH_SIZE = 32;
+/* Requests are only batched if decrypt_messages interleaves them with others
+ * (see is_interleaved), which makes up for copying them. Batching longer
+ * requests is slower than decrypting them to the scratch buffers */
+static constexpr size_t BATCH_SLOT_SIZE =
+        IV_LEN + AES_GCM_MAX_INTERLEAVED + MAC_LEN;
+/* Event loop iterations between two adjustments of the crypto worker pool */
+static constexpr size_t WORKER_POOL_INTERVAL = 1 << 16;
+/* A worker is added if more than 1/WORKER_POOL_STALL_RATIO of the offloaded
+ * requests had to wait because all workers were busy */
+static constexpr size_t WORKER_POOL_STALL_RATIO = 8;
+/* The pre-allocated response buffers are only sized for acks, control
+ * messages and values up to this size. Bigger responses get a buffer from
+ * the allocator of eRPC */
+static constexpr size_t SMALL_RESPONSE_SIZE = 1024;
+/* Slots for the start times of requests in flight, a power of two */
+static constexpr size_t REQUEST_START_SLOTS = 1024;
+
+/* Requests that a ServerThread shares with idle peers at most (see
+ * anchor_server::set_work_stealing) */
+static constexpr size_t SHARED_QUEUE_SIZE = 64;
+/* Requests that an idle ServerThread steals from a peer at once */
+static constexpr size_t STEAL_BATCH = 8;
+/* Crypto sessions for shared requests per ServerThread, a power of two */
+static constexpr size_t SHARED_CRYPTO_CACHE = 16;
+
+/* Request that any ServerThread may handle. Only the ServerThread that
+ * received it enqueues the response */
+struct shared_job {
+    erpc::ReqHandle *handle;
+    ServerSession *session;
+    /* Copy of the request in a slot of the receiving ServerThread, the
+     * response is encrypted to the same slot: */
+    unsigned char *ciphertext;
+    size_t ciphertext_len;
+    size_t slot;
+    /* Keys of the session in the key phase of the request, and the
+     * synchronization they were copied in: */
+    const CryptoSession *keys;
+    uint64_t keys_sync;
+};
+
+struct shared_completion {
+    erpc::ReqHandle *handle;
+    size_t response_size;
+    size_t slot;
+    bool respond;
+};
+
+/* Crypto session that a ServerThread handles shared requests with */
+struct shared_crypto {
+    const CryptoSession *keys;
+    uint64_t keys_sync;
+    CryptoSession crypto;
+};
+
+/* Start time of a request, for its service time */
+struct request_start {
+    const erpc::ReqHandle *handle;
+    uint64_t time;
+};
+
+class ServerThread;
+
+/* Request that waits for the asynchronous KV-store. Requests are pooled by
+ * the ServerThread that received them and reused after the response */
+struct anchor_server::kv_request {
+    ServerThread *st;
+    ServerSession *session;
+    erpc::ReqHandle *handle;
+    /* Header of the request, is reused for the response: */
+    struct rdma_msg_header header;
+    uint8_t key_phase;
+    /* Chunked gets only answer with the requested chunk of the value: */
+    bool chunked;
+    struct rdma_chunk_header chunk;
+    int status;
+    /* Copy of the value of a completed get, the buffer is kept for reuse: */
+    unsigned char *value;
+    size_t value_len;
+    size_t value_capacity;
+    /* Next completed request: */
+    struct kv_request *next;
+};
+
+void process_request_batch(ServerThread *st, ServerSession *session,
+        erpc::ReqHandle **handles, struct rdma_dec_batch_entry *requests,
+        size_t count);
+
+void send_deferred_response(ServerThread *st,
+        struct anchor_server::kv_request *request);
+
+/* Server-side number of the eRPC session that a request arrived on */
+static inline uint16_t get_session_num(const erpc::ReqHandle *handle) {
+    return handle->session->local_session_num;
+}
 
 class ServerThread {
 private:
     erpc::Rpc<erpc::CTransport> *rpc_host;
-    uint64_t next_seq;
-    uint8_t client_id;
-    bool stay_connected;
+    std::atomic<bool> stay_connected;
+    /* If true, the thread keeps running without clients until terminated: */
+    bool persistent;
+    const unsigned char *master_key;
+    /* Sessions of all clients, indexed by their eRPC session number: */
+    std::vector<ServerSession *> sessions;
+    size_t open_sessions;
+    /* The thread stops when the last client disconnected: */
+    bool had_sessions;
+    std::atomic_size_t closed_sessions;
+    /* Credits of the sessions, see anchor_server::set_admission */
+    struct anchor_server::admission_config admission;
+    /* Number of key partitions, this thread owns the one of its eRPC ID. 0 if
+     * the keys aren't partitioned (see anchor_server::set_partitioned) */
+    uint8_t partitions;
+    /* Work stealing: Requests that this thread or idle peers handle, and
+     * their responses, which only this thread enqueues. The requests are
+     * copied to slots, the free ones are only used by this thread */
+    bool work_stealing;
+    /* Whether the sessions keep acks for retransmitted requests (see
+     * anchor_server::set_response_cache) */
+    bool response_cache;
+    uint8_t erpc_id;
+    WorkQueue<struct shared_job, SHARED_QUEUE_SIZE> shared_jobs;
+    WorkQueue<struct shared_completion, SHARED_QUEUE_SIZE> shared_completions;
+    unsigned char *shared_slots;
+    size_t shared_slot_count;
+    std::vector<size_t> free_shared_slots;
+    size_t shared_in_flight;
+    /* Set while this thread is counted as an idle peer: */
+    bool idle;
+    /* Keys of the sessions that the shared requests are handled with. They
+     * are only copied while none is in flight, every copy is numbered: */
+    std::vector<CryptoSession *> shared_keys;
+    std::vector<uint64_t> shared_keys_syncs;
+    uint64_t key_syncs;
+    /* Crypto sessions of the shared requests this thread handled, own and
+     * stolen ones, direct-mapped by the keys they were copied from: */
+    struct shared_crypto shared_crypto[SHARED_CRYPTO_CACHE];
+    /* Session of the last request, its keystreams are precomputed: */
+    ServerSession *active_session;
+    /* Scratch buffers that incoming keys and values are decrypted to, so the
+     * request path doesn't need to allocate memory */
+    unsigned char *key_buf;
+    unsigned char *value_buf;
+    /* Copies of the values of a multi-get, allocated on first use: */
+    unsigned char *multi_buf;
+    size_t max_msg_size;
+    size_t pre_resp_size;
+    /* Allocations on the request path despite the scratch buffers */
+    size_t payload_allocations;
+    /* Short requests of one event loop iteration. The request buffers of
+     * eRPC are only valid in the request handler, so the requests are copied.
+     * All requests of a batch belong to batch_session */
+    erpc::ReqHandle *batch_handles[MAX_BATCH_SIZE];
+    struct rdma_dec_batch_entry batch[MAX_BATCH_SIZE];
+    ServerSession *batch_session;
+    unsigned char *batch_buf;
+    size_t batch_capacity;
+    size_t batch_size;
+    /* Optional pool that decrypts, handles and encrypts requests, while this
+     * thread only polls eRPC: */
+    std::vector<CryptoWorker *> workers;
+    size_t next_worker;
+    /* The pool grows and shrinks between these sizes depending on the load
+     * since the last adjustment: */
+    size_t min_workers;
+    size_t max_workers;
+    size_t pool_iterations;
+    size_t pool_requests;
+    size_t pool_stalls;
+    size_t pool_in_flight;
+    /* Requests of the asynchronous KV-store: all requests ever allocated, the
+     * unused ones, and the completed ones, which any thread may push: */
+    std::vector<struct anchor_server::kv_request *> kv_requests;
+    std::vector<struct anchor_server::kv_request *> free_kv_requests;
+    std::atomic<struct anchor_server::kv_request *> completed_kv_requests;
+    size_t deferred_requests;
+    /* Start times are direct-mapped by request handle. If requests collide,
+     * only the service time of the later one is counted */
+    struct request_start request_starts[REQUEST_START_SLOTS];
+    ServerStats stats;
+    /* Requests and responses so far, polls without new ones are idle: */
+    size_t poll_events;
+    PollGovernor governor;
     std::thread running_thread;
 
-    static void connect_and_work(ServerThread *st, erpc::Nexus *nexus,
-            uint8_t erpc_id, size_t max_msg_size);
+    static void connect_and_work(
+            ServerThread *st, erpc::Nexus *nexus, uint8_t erpc_id);
+
+    void release_closed_sessions();
+
+    void update_credits();
+
+    CryptoSession *get_shared_crypto(
+            const CryptoSession *keys, uint64_t keys_sync);
+
+    size_t collect_shared();
+
+    size_t steal_jobs();
+
+    void set_idle(bool now_idle);
+
+    void adjust_worker_pool();
+
+    int add_worker();
+
+    void remove_worker();
 
 public:
     ServerThread(erpc::Nexus *nexus, int erpc_id, size_t max_msg_size,
-            bool asynchronous = true);
+            const unsigned char *master_key, bool asynchronous = true,
+            uint8_t min_workers = 0, uint8_t max_workers = 0,
+            bool persistent = false,
+            const struct poll_config& polling = DEFAULT_POLLING,
+            const struct anchor_server::admission_config& admission =
+                    anchor_server::DEFAULT_ADMISSION,
+            bool work_stealing = false, uint8_t partitions = 0,
+            bool response_cache = false);
+
+    ~ServerThread();
 
-    bool is_seq_valid(uint64_t sequence_number);
+    static void *operator new(size_t size);
 
-    uint64_t get_next_seq(uint64_t sequence_number, uint8_t operation);
+    static void operator delete(void *thread, size_t size);
 
     void enqueue_response(erpc::ReqHandle *handle, erpc::MsgBuffer *resp);
 
+    void enqueue_response_copy(erpc::ReqHandle *handle,
+            const unsigned char *response, size_t size);
+
+    void begin_request(const erpc::ReqHandle *handle);
+
+    inline ServerStats *get_stats() {
+        return &(this->stats);
+    }
+
+    erpc::MsgBuffer *get_response_buffer(erpc::ReqHandle *handle, size_t size);
+
+    void release_response_buffer(
+            erpc::ReqHandle *handle, erpc::MsgBuffer *resp);
+
+    inline size_t get_pre_resp_size() const {
+        return this->pre_resp_size;
+    }
+
+    /* Whether the KV-store may be called for the key in this thread: */
+    inline bool owns_key(const void *key, size_t key_len) const {
+        return this->partitions == 0 ||
+                key_partition(key, key_len, this->partitions) == this->erpc_id;
+    }
+
+    ServerSession *get_session(const erpc::ReqHandle *handle);
+
+    ServerSession *open_session(const erpc::ReqHandle *handle);
+
+    void close_session(ServerSession *session);
+
+    void select_session(ServerSession *session, uint8_t phase);
+
+    bool get_scratch_payload(
+            struct rdma_dec_payload *payload, size_t ciphertext_size);
+
+    unsigned char *get_multi_buffer();
+
+    bool batch_request(erpc::ReqHandle *handle,
+            const unsigned char *ciphertext, size_t ciphertext_size);
+
+    void process_batch();
+
+    bool offload_request(ServerSession *session, erpc::ReqHandle *handle,
+            const unsigned char *ciphertext, size_t ciphertext_size);
+
+    bool share_request(ServerSession *session, erpc::ReqHandle *handle,
+            const unsigned char *ciphertext, size_t ciphertext_size);
+
+    size_t handle_shared_jobs(ServerThread *handler, size_t max_jobs);
+
+    static void clear_peers();
+
+    void collect_responses();
+
+    void drain_workers();
+
+    struct anchor_server::kv_request *defer_request(
+            ServerSession *session, erpc::ReqHandle *handle);
+
+    void push_completed_request(struct anchor_server::kv_request *request);
+
+    void complete_deferred_requests();
+
+    inline size_t get_worker_count() const {
+        return this->workers.size();
+    }
+
+    inline size_t get_payload_allocations() const {
+        return this->payload_allocations;
+    }
+
     void join();
 
     void terminate();
@@ -0,0 +1,64 @@
+#ifndef CLIENT_SERVER_TWOSIDED_SPSCRING_H
+#define CLIENT_SERVER_TWOSIDED_SPSCRING_H
+
+#include <atomic>
+#include <cstddef>
+
+static constexpr size_t CACHE_LINE_SIZE = 64;
+
+/*
+ * Bounded lock-free ring for exactly one producer and one consumer thread.
+ * Head and tail are padded to separate cache lines, so producer and consumer
+ * don't invalidate each other's line on every operation. Padding instead of
+ * alignas keeps the ring usable in objects allocated with new in C++14.
+ * Capacity has to be a power of two.
+ */
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+            "Capacity of SpscRing has to be a power of two");
+private:
+    char pad_front[CACHE_LINE_SIZE];
+    /* Written by the consumer only: */
+    std::atomic<size_t> head{0};
+    char pad_head[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    /* Written by the producer only: */
+    std::atomic<size_t> tail{0};
+    char pad_tail[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    T entries[Capacity];
+
+public:
+    /**
+     * Appends an entry. May only be called by the producer
+     * @return false if the ring is full
+     */
+    inline bool try_push(const T& entry) {
+        size_t current_tail = this->tail.load(std::memory_order_relaxed);
+        if (current_tail - this->head.load(std::memory_order_acquire)
+                == Capacity)
+            return false;
+        this->entries[current_tail & (Capacity - 1)] = entry;
+        this->tail.store(current_tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Removes the oldest entry. May only be called by the consumer
+     * @return false if the ring is empty
+     */
+    inline bool try_pop(T *entry) {
+        size_t current_head = this->head.load(std::memory_order_relaxed);
+        if (current_head == this->tail.load(std::memory_order_acquire))
+            return false;
+        *entry = this->entries[current_head & (Capacity - 1)];
+        this->head.store(current_head + 1, std::memory_order_release);
+        return true;
+    }
+
+    static constexpr size_t capacity() {
+        return Capacity;
+    }
+};
+
+
+#endif //CLIENT_SERVER_TWOSIDED_SPSCRING_H
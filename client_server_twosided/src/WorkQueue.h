@@ -0,0 +1,108 @@
+#ifndef CLIENT_SERVER_TWOSIDED_WORKQUEUE_H
+#define CLIENT_SERVER_TWOSIDED_WORKQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include "SpscRing.h"
+
+/*
+ * Bounded lock-free ring for any number of producer and consumer threads.
+ * Every cell carries a sequence number that tells producers and consumers
+ * whether it is free or filled in the current round, so a cell is never read
+ * while it is written. Producers and consumers claim a position with one CAS
+ * on tail or head, which are padded to separate cache lines like in SpscRing.
+ * Capacity has to be a power of two.
+ */
+template <typename T, size_t Capacity>
+class WorkQueue {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+            "Capacity of WorkQueue has to be a power of two");
+private:
+    struct cell {
+        std::atomic<size_t> sequence;
+        T entry;
+    };
+
+    char pad_front[CACHE_LINE_SIZE];
+    /* Claimed by the consumers: */
+    std::atomic<size_t> head{0};
+    char pad_head[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    /* Claimed by the producers: */
+    std::atomic<size_t> tail{0};
+    char pad_tail[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    struct cell cells[Capacity];
+
+    /* Distance of a sequence number from the expected one */
+    static inline ptrdiff_t distance(size_t sequence, size_t expected) {
+        return static_cast<ptrdiff_t>(sequence - expected);
+    }
+
+public:
+    WorkQueue() {
+        for (size_t i = 0; i < Capacity; i++)
+            this->cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    WorkQueue(const WorkQueue&) = delete;
+    WorkQueue& operator=(const WorkQueue&) = delete;
+
+    /**
+     * Appends an entry. May be called by any thread
+     * @return false if the queue is full
+     */
+    inline bool try_push(const T& entry) {
+        size_t position = this->tail.load(std::memory_order_relaxed);
+        while (true) {
+            struct cell *cell = this->cells + (position & (Capacity - 1));
+            ptrdiff_t diff = distance(
+                    cell->sequence.load(std::memory_order_acquire), position);
+            if (diff == 0) {
+                if (this->tail.compare_exchange_weak(position, position + 1,
+                        std::memory_order_relaxed)) {
+                    cell->entry = entry;
+                    cell->sequence.store(
+                            position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                position = this->tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Removes the oldest entry. May be called by any thread
+     * @return false if the queue is empty
+     */
+    inline bool try_pop(T *entry) {
+        size_t position = this->head.load(std::memory_order_relaxed);
+        while (true) {
+            struct cell *cell = this->cells + (position & (Capacity - 1));
+            ptrdiff_t diff = distance(
+                    cell->sequence.load(std::memory_order_acquire),
+                    position + 1);
+            if (diff == 0) {
+                if (this->head.compare_exchange_weak(position, position + 1,
+                        std::memory_order_relaxed)) {
+                    *entry = cell->entry;
+                    cell->sequence.store(
+                            position + Capacity, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                position = this->head.load(std::memory_order_relaxed);
+        }
+    }
+
+    static constexpr size_t capacity() {
+        return Capacity;
+    }
+};
+
+
+#endif //CLIENT_SERVER_TWOSIDED_WORKQUEUE_H
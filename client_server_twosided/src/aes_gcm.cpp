@@ -0,0 +1,826 @@
+#include <cstring>
+
+#include "aes_gcm.h"
+
+/* GCC 12 reports the undefined upper lanes in its own AVX-512 intrinsics
+ * (e.g. _mm512_broadcast_i32x4) as uninitialized */
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/* The whole project is compiled for SSE4.1 only. Functions that use wider
+ * instructions are compiled for them separately and only called if the CPU
+ * supports them */
+#define TARGET_AESNI __attribute__((target("sse4.1,aes,pclmul")))
+#define TARGET_VAES __attribute__((target( \
+        "sse4.1,aes,pclmul,avx2,avx512f,avx512bw,vaes,vpclmulqdq")))
+
+#define AES_ROUNDS 10
+#define BLOCK_SIZE 16
+
+/* Blocks are byte-reflected for GHASH and for incrementing the counter */
+TARGET_AESNI static inline __m128i bswap_mask() {
+    return _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+}
+
+static enum aes_gcm_impl detect_impl() {
+    __builtin_cpu_init();
+    if (!(__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("aes")
+            && __builtin_cpu_supports("pclmul")))
+        return AES_GCM_OPENSSL;
+
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+            && __builtin_cpu_supports("vaes")
+            && __builtin_cpu_supports("vpclmulqdq"))
+        return AES_GCM_VAES;
+
+    return AES_GCM_AESNI;
+}
+
+/**
+ * Returns the widest implementation that the CPU supports. Is detected once
+ * @return AES_GCM_OPENSSL if the built-in implementation is disabled or
+ *      not supported by the CPU
+ */
+enum aes_gcm_impl aes_gcm_best_impl() {
+#if NATIVE_AES_GCM
+    static const enum aes_gcm_impl best = detect_impl();
+    return best;
+#else
+    return AES_GCM_OPENSSL;
+#endif // NATIVE_AES_GCM
+}
+
+const char *aes_gcm_impl_name(enum aes_gcm_impl impl) {
+    switch (impl) {
+        case AES_GCM_AESNI:
+            return "AES-NI";
+        case AES_GCM_VAES:
+            return "VAES";
+        default:
+            return "OpenSSL";
+    }
+}
+
+
+/* ---------------------------------- AES ---------------------------------- */
+
+TARGET_AESNI static inline __m128i expand_step(__m128i key, __m128i assist) {
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+/* The round constant has to be an immediate */
+#define EXPAND_ROUND_KEY(rk, i, rcon) \
+    (rk)[i] = expand_step((rk)[(i) - 1], \
+            _mm_aeskeygenassist_si128((rk)[(i) - 1], (rcon)))
+
+TARGET_AESNI static void expand_key(__m128i *rk, const unsigned char *raw_key) {
+    rk[0] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(raw_key));
+    EXPAND_ROUND_KEY(rk, 1, 0x01);
+    EXPAND_ROUND_KEY(rk, 2, 0x02);
+    EXPAND_ROUND_KEY(rk, 3, 0x04);
+    EXPAND_ROUND_KEY(rk, 4, 0x08);
+    EXPAND_ROUND_KEY(rk, 5, 0x10);
+    EXPAND_ROUND_KEY(rk, 6, 0x20);
+    EXPAND_ROUND_KEY(rk, 7, 0x40);
+    EXPAND_ROUND_KEY(rk, 8, 0x80);
+    EXPAND_ROUND_KEY(rk, 9, 0x1b);
+    EXPAND_ROUND_KEY(rk, 10, 0x36);
+}
+
+TARGET_AESNI static inline __m128i encrypt_block(
+        const __m128i *rk, __m128i block) {
+    block = _mm_xor_si128(block, rk[0]);
+    #pragma GCC unroll 10
+    for (int i = 1; i < AES_ROUNDS; i++)
+        block = _mm_aesenc_si128(block, rk[i]);
+    return _mm_aesenclast_si128(block, rk[AES_ROUNDS]);
+}
+
+/* Encrypts 8 independent blocks, so the latency of AESENC is hidden */
+TARGET_AESNI static inline void encrypt_8_blocks(
+        const __m128i *rk, __m128i *blocks) {
+    #pragma GCC unroll 8
+    for (int j = 0; j < 8; j++)
+        blocks[j] = _mm_xor_si128(blocks[j], rk[0]);
+    #pragma GCC unroll 10
+    for (int i = 1; i < AES_ROUNDS; i++) {
+        #pragma GCC unroll 8
+        for (int j = 0; j < 8; j++)
+            blocks[j] = _mm_aesenc_si128(blocks[j], rk[i]);
+    }
+    #pragma GCC unroll 8
+    for (int j = 0; j < 8; j++)
+        blocks[j] = _mm_aesenclast_si128(blocks[j], rk[AES_ROUNDS]);
+}
+
+
+/* --------------------------------- GHASH --------------------------------- */
+
+/* Adds the unreduced 256 bit carry-less product a * b to lo, mid and hi */
+TARGET_AESNI static inline void clmul_acc(__m128i a, __m128i b,
+        __m128i *lo, __m128i *mid, __m128i *hi) {
+    *lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, b, 0x00));
+    *hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, b, 0x11));
+    *mid = _mm_xor_si128(*mid, _mm_xor_si128(
+            _mm_clmulepi64_si128(a, b, 0x01), _mm_clmulepi64_si128(a, b, 0x10)));
+}
+
+/* Reduces a 256 bit product (or a sum of products) modulo the GCM polynomial
+ * x^128 + x^7 + x^2 + x + 1 in the bit-reflected representation
+ * (Intel: Carry-Less Multiplication and Its Usage for Computing the GCM Mode) */
+TARGET_AESNI static inline __m128i ghash_reduce(
+        __m128i lo, __m128i mid, __m128i hi) {
+    __m128i tmp2, tmp3, tmp4, tmp5, tmp6, tmp7, tmp8, tmp9;
+    tmp3 = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    tmp6 = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    /* Shift the product left by one bit: */
+    tmp7 = _mm_srli_epi32(tmp3, 31);
+    tmp8 = _mm_srli_epi32(tmp6, 31);
+    tmp3 = _mm_slli_epi32(tmp3, 1);
+    tmp6 = _mm_slli_epi32(tmp6, 1);
+    tmp9 = _mm_srli_si128(tmp7, 12);
+    tmp8 = _mm_slli_si128(tmp8, 4);
+    tmp7 = _mm_slli_si128(tmp7, 4);
+    tmp3 = _mm_or_si128(tmp3, tmp7);
+    tmp6 = _mm_or_si128(tmp6, tmp8);
+    tmp6 = _mm_or_si128(tmp6, tmp9);
+
+    /* Reduce: */
+    tmp7 = _mm_slli_epi32(tmp3, 31);
+    tmp8 = _mm_slli_epi32(tmp3, 30);
+    tmp9 = _mm_slli_epi32(tmp3, 25);
+    tmp7 = _mm_xor_si128(tmp7, tmp8);
+    tmp7 = _mm_xor_si128(tmp7, tmp9);
+    tmp8 = _mm_srli_si128(tmp7, 4);
+    tmp7 = _mm_slli_si128(tmp7, 12);
+    tmp3 = _mm_xor_si128(tmp3, tmp7);
+    tmp2 = _mm_srli_epi32(tmp3, 1);
+    tmp4 = _mm_srli_epi32(tmp3, 2);
+    tmp5 = _mm_srli_epi32(tmp3, 7);
+    tmp2 = _mm_xor_si128(tmp2, tmp4);
+    tmp2 = _mm_xor_si128(tmp2, tmp5);
+    tmp2 = _mm_xor_si128(tmp2, tmp8);
+    tmp3 = _mm_xor_si128(tmp3, tmp2);
+    return _mm_xor_si128(tmp6, tmp3);
+}
+
+TARGET_AESNI static inline __m128i gfmul(__m128i a, __m128i b) {
+    __m128i lo = _mm_setzero_si128();
+    __m128i mid = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    clmul_acc(a, b, &lo, &mid, &hi);
+    return ghash_reduce(lo, mid, hi);
+}
+
+/* Hashes a single (reflected) block */
+TARGET_AESNI static inline __m128i ghash_block(const struct aes_gcm_key *key,
+        __m128i ghash, __m128i block) {
+    return gfmul(_mm_xor_si128(ghash, block),
+            key->h_powers[AES_GCM_H_POWERS - 1]);
+}
+
+/* Hashes 8 (reflected) blocks with a single reduction */
+TARGET_AESNI static inline __m128i ghash_8_blocks(
+        const struct aes_gcm_key *key, __m128i ghash, const __m128i *blocks) {
+    /* H^8 .. H^1: */
+    const __m128i *h = key->h_powers + AES_GCM_H_POWERS - 8;
+    __m128i lo = _mm_setzero_si128();
+    __m128i mid = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+
+    clmul_acc(_mm_xor_si128(ghash, blocks[0]), h[0], &lo, &mid, &hi);
+    #pragma GCC unroll 8
+    for (int j = 1; j < 8; j++)
+        clmul_acc(blocks[j], h[j], &lo, &mid, &hi);
+    return ghash_reduce(lo, mid, hi);
+}
+
+
+/* ---------------------------------- GCM ---------------------------------- */
+
+/**
+ * Expands the key and precomputes the powers of the hash key
+ * @param key Key structure to fill
+ * @param raw_key AES-128 key (16 bytes)
+ * @param impl Implementation to use. Must be supported by the CPU
+ * @return 0 on success, -1 if the implementation is not available
+ */
+TARGET_AESNI int aes_gcm_set_key(struct aes_gcm_key *key,
+        const unsigned char *raw_key, enum aes_gcm_impl impl) {
+    if (impl == AES_GCM_OPENSSL || impl > aes_gcm_best_impl())
+        return -1;
+
+    key->impl = impl;
+    expand_key(key->round_keys, raw_key);
+
+    __m128i h = _mm_shuffle_epi8(
+            encrypt_block(key->round_keys, _mm_setzero_si128()), bswap_mask());
+    __m128i power = h;
+    key->h_powers[AES_GCM_H_POWERS - 1] = h;
+    for (size_t i = AES_GCM_H_POWERS - 1; i > 0; i--) {
+        power = gfmul(power, h);
+        key->h_powers[i - 1] = power;
+    }
+    return 0;
+}
+
+
+/**
+ * Starts a new message
+ * @param ctx Context to initialize
+ * @param key Expanded key, needs to be valid as long as ctx is used
+ * @param iv 12 byte IV
+ */
+TARGET_AESNI static inline __m128i initial_counter(const unsigned char *iv) {
+    unsigned char j0[BLOCK_SIZE] = { 0 };
+    (void) memcpy(j0, iv, 12);
+    j0[BLOCK_SIZE - 1] = 1;
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(j0));
+}
+
+TARGET_AESNI void aes_gcm_init(struct aes_gcm_ctx *ctx,
+        const struct aes_gcm_key *key, const unsigned char *iv) {
+    __m128i counter = initial_counter(iv);
+    ctx->key = key;
+    ctx->precomputed = nullptr;
+    ctx->precomputed_blocks = 0;
+    ctx->tag_mask = encrypt_block(key->round_keys, counter);
+    ctx->counter = _mm_add_epi32(
+            _mm_shuffle_epi8(counter, bswap_mask()), _mm_set_epi32(0, 0, 0, 1));
+    ctx->ghash = _mm_setzero_si128();
+    ctx->aad_length = 0;
+    ctx->length = 0;
+    ctx->partial_len = 0;
+}
+
+TARGET_AESNI static inline __m128i next_counter(__m128i *counter) {
+    __m128i block = _mm_shuffle_epi8(*counter, bswap_mask());
+    *counter = _mm_add_epi32(*counter, _mm_set_epi32(0, 0, 0, 1));
+    return block;
+}
+
+
+/**
+ * Computes the tag mask and the first AES_GCM_PRECOMPUTED_BLOCKS keystream
+ * blocks of a message before the message itself is known
+ * @param keystream Keystream structure to fill
+ * @param key Expanded key
+ * @param iv 12 byte IV that the message will be sent with
+ */
+TARGET_AESNI void aes_gcm_precompute(struct aes_gcm_keystream *keystream,
+        const struct aes_gcm_key *key, const unsigned char *iv) {
+    static_assert(AES_GCM_PRECOMPUTED_BLOCKS % 8 == 0,
+            "Keystream is precomputed in chunks of 8 blocks");
+    __m128i counter = initial_counter(iv);
+    (void) memcpy(keystream->iv, iv, 12);
+    keystream->tag_mask = encrypt_block(key->round_keys, counter);
+    counter = _mm_add_epi32(
+            _mm_shuffle_epi8(counter, bswap_mask()), _mm_set_epi32(0, 0, 0, 1));
+
+    for (size_t i = 0; i < AES_GCM_PRECOMPUTED_BLOCKS; i += 8) {
+        __m128i *blocks = keystream->blocks + i;
+        #pragma GCC unroll 8
+        for (int j = 0; j < 8; j++)
+            blocks[j] = next_counter(&counter);
+        encrypt_8_blocks(key->round_keys, blocks);
+    }
+}
+
+
+/**
+ * Starts a new message whose keystream has been precomputed. The message is
+ * continued with freshly encrypted counter blocks once the precomputed
+ * keystream is used up
+ * @param ctx Context to initialize
+ * @param key Expanded key that the keystream was precomputed with
+ * @param keystream Precomputed keystream, needs to be valid as long as ctx
+ *          is used for the message
+ */
+TARGET_AESNI void aes_gcm_init_precomputed(struct aes_gcm_ctx *ctx,
+        const struct aes_gcm_key *key,
+        const struct aes_gcm_keystream *keystream) {
+    ctx->key = key;
+    ctx->precomputed = keystream->blocks;
+    ctx->precomputed_blocks = AES_GCM_PRECOMPUTED_BLOCKS;
+    ctx->tag_mask = keystream->tag_mask;
+    ctx->counter = _mm_add_epi32(_mm_shuffle_epi8(
+            initial_counter(keystream->iv), bswap_mask()),
+            _mm_set_epi32(0, 0, 0, 1 + AES_GCM_PRECOMPUTED_BLOCKS));
+    ctx->ghash = _mm_setzero_si128();
+    ctx->aad_length = 0;
+    ctx->length = 0;
+    ctx->partial_len = 0;
+}
+
+
+/* XORs the lanes of a 512 bit register */
+TARGET_VAES static inline __m128i fold_lanes(__m512i v) {
+    __m256i t = _mm256_xor_si256(
+            _mm512_castsi512_si256(v), _mm512_extracti64x4_epi64(v, 1));
+    return _mm_xor_si128(
+            _mm256_castsi256_si128(t), _mm256_extracti128_si256(t, 1));
+}
+
+/**
+ * En-/decrypts and hashes as many chunks of 16 blocks as possible with VAES
+ * and VPCLMULQDQ. Must only be called if there is no incomplete block
+ * @param counter Next counter block, is advanced
+ * @param ghash Current GHASH value, is updated
+ * @return Number of processed bytes
+ */
+TARGET_VAES static size_t update_vaes(const struct aes_gcm_key *key,
+        __m128i *counter_block, __m128i *ghash,
+        const unsigned char *in, size_t in_size, unsigned char *out,
+        bool encrypt) {
+    const __m512i mask = _mm512_broadcast_i32x4(bswap_mask());
+    const __m512i increment = _mm512_set_epi32(
+            0, 0, 0, 4, 0, 0, 0, 4, 0, 0, 0, 4, 0, 0, 0, 4);
+    __m512i rk[AES_ROUNDS + 1];
+    __m512i h[4];
+    size_t done = 0;
+
+    for (int i = 0; i <= AES_ROUNDS; i++)
+        rk[i] = _mm512_broadcast_i32x4(key->round_keys[i]);
+    /* h[0] holds H^16 .. H^13, h[3] holds H^4 .. H^1: */
+    #pragma GCC unroll 8
+    for (int j = 0; j < 4; j++)
+        h[j] = _mm512_loadu_si512(key->h_powers + 4 * j);
+
+    __m512i counter = _mm512_add_epi32(
+            _mm512_broadcast_i32x4(*counter_block),
+            _mm512_set_epi32(0, 0, 0, 3, 0, 0, 0, 2, 0, 0, 0, 1, 0, 0, 0, 0));
+
+    for (; in_size - done >= 16 * BLOCK_SIZE; done += 16 * BLOCK_SIZE) {
+        __m512i blocks[4], data[4];
+        __m512i lo = _mm512_setzero_si512();
+        __m512i mid = _mm512_setzero_si512();
+        __m512i hi = _mm512_setzero_si512();
+
+        #pragma GCC unroll 8
+
+        for (int j = 0; j < 4; j++) {
+            blocks[j] = _mm512_xor_si512(
+                    _mm512_shuffle_epi8(counter, mask), rk[0]);
+            counter = _mm512_add_epi32(counter, increment);
+        }
+        #pragma GCC unroll 10
+        for (int i = 1; i < AES_ROUNDS; i++) {
+            #pragma GCC unroll 8
+            for (int j = 0; j < 4; j++)
+                blocks[j] = _mm512_aesenc_epi128(blocks[j], rk[i]);
+        }
+        #pragma GCC unroll 8
+        for (int j = 0; j < 4; j++) {
+            blocks[j] = _mm512_aesenclast_epi128(blocks[j], rk[AES_ROUNDS]);
+            data[j] = _mm512_loadu_si512(in + done + 64 * j);
+            blocks[j] = _mm512_xor_si512(blocks[j], data[j]);
+            _mm512_storeu_si512(out + done + 64 * j, blocks[j]);
+        }
+
+        #pragma GCC unroll 8
+
+        for (int j = 0; j < 4; j++) {
+            __m512i x = _mm512_shuffle_epi8(encrypt ? blocks[j] : data[j], mask);
+            if (j == 0)
+                x = _mm512_xor_si512(x, _mm512_zextsi128_si512(*ghash));
+            lo = _mm512_xor_si512(lo, _mm512_clmulepi64_epi128(x, h[j], 0x00));
+            hi = _mm512_xor_si512(hi, _mm512_clmulepi64_epi128(x, h[j], 0x11));
+            mid = _mm512_xor_si512(mid, _mm512_xor_si512(
+                    _mm512_clmulepi64_epi128(x, h[j], 0x01),
+                    _mm512_clmulepi64_epi128(x, h[j], 0x10)));
+        }
+        *ghash = ghash_reduce(
+                fold_lanes(lo), fold_lanes(mid), fold_lanes(hi));
+    }
+
+    *counter_block = _mm512_castsi512_si128(counter);
+    return done;
+}
+
+
+/**
+ * Hashes as many chunks of 16 blocks as possible with VPCLMULQDQ
+ * @param ghash Current GHASH value, is updated
+ * @return Number of processed bytes
+ */
+TARGET_VAES static size_t ghash_vaes(const struct aes_gcm_key *key,
+        __m128i *ghash, const unsigned char *in, size_t in_size) {
+    const __m512i mask = _mm512_broadcast_i32x4(bswap_mask());
+    __m512i h[4];
+    size_t done = 0;
+
+    #pragma GCC unroll 8
+    for (int j = 0; j < 4; j++)
+        h[j] = _mm512_loadu_si512(key->h_powers + 4 * j);
+
+    for (; in_size - done >= 16 * BLOCK_SIZE; done += 16 * BLOCK_SIZE) {
+        __m512i lo = _mm512_setzero_si512();
+        __m512i mid = _mm512_setzero_si512();
+        __m512i hi = _mm512_setzero_si512();
+
+        #pragma GCC unroll 8
+        for (int j = 0; j < 4; j++) {
+            __m512i x = _mm512_shuffle_epi8(
+                    _mm512_loadu_si512(in + done + 64 * j), mask);
+            if (j == 0)
+                x = _mm512_xor_si512(x, _mm512_zextsi128_si512(*ghash));
+            lo = _mm512_xor_si512(lo, _mm512_clmulepi64_epi128(x, h[j], 0x00));
+            hi = _mm512_xor_si512(hi, _mm512_clmulepi64_epi128(x, h[j], 0x11));
+            mid = _mm512_xor_si512(mid, _mm512_xor_si512(
+                    _mm512_clmulepi64_epi128(x, h[j], 0x01),
+                    _mm512_clmulepi64_epi128(x, h[j], 0x10)));
+        }
+        *ghash = ghash_reduce(
+                fold_lanes(lo), fold_lanes(mid), fold_lanes(hi));
+    }
+    return done;
+}
+
+
+/* Hashes the incomplete block of the context padded with zeros */
+TARGET_AESNI static inline __m128i ghash_partial(struct aes_gcm_ctx *ctx,
+        __m128i ghash) {
+    (void) memset(ctx->partial + ctx->partial_len, 0,
+            BLOCK_SIZE - ctx->partial_len);
+    ctx->partial_len = 0;
+    return ghash_block(ctx->key, ghash, _mm_shuffle_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctx->partial)),
+            bswap_mask()));
+}
+
+
+/**
+ * Adds additional authenticated data to the current message. Must be called
+ * before any data of the message is en-/decrypted. Can be called several
+ * times, the data is then authenticated as if it was passed at once.
+ * If there is only additional authenticated data, the tag is a GMAC
+ * @param ctx Context of the message
+ * @param in Data that is authenticated, but not encrypted
+ * @param in_size Size of the data
+ */
+TARGET_AESNI void aes_gcm_aad_update(struct aes_gcm_ctx *ctx,
+        const unsigned char *in, size_t in_size) {
+    const struct aes_gcm_key *key = ctx->key;
+    const __m128i mask = bswap_mask();
+    __m128i ghash = ctx->ghash;
+    ctx->aad_length += in_size;
+
+    while (ctx->partial_len > 0 && in_size > 0) {
+        ctx->partial[ctx->partial_len++] = *(in++);
+        in_size--;
+        if (ctx->partial_len == BLOCK_SIZE) {
+            ghash = ghash_block(key, ghash, _mm_shuffle_epi8(_mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(ctx->partial)), mask));
+            ctx->partial_len = 0;
+        }
+    }
+
+    if (key->impl == AES_GCM_VAES && in_size >= 16 * BLOCK_SIZE) {
+        size_t done = ghash_vaes(key, &ghash, in, in_size);
+        in += done;
+        in_size -= done;
+    }
+
+    for (; in_size >= 8 * BLOCK_SIZE;
+            in_size -= 8 * BLOCK_SIZE, in += 8 * BLOCK_SIZE) {
+        __m128i blocks[8];
+        #pragma GCC unroll 8
+        for (int j = 0; j < 8; j++)
+            blocks[j] = _mm_shuffle_epi8(_mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(in) + j), mask);
+        ghash = ghash_8_blocks(key, ghash, blocks);
+    }
+
+    for (; in_size >= BLOCK_SIZE; in_size -= BLOCK_SIZE, in += BLOCK_SIZE) {
+        ghash = ghash_block(key, ghash, _mm_shuffle_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(in)), mask));
+    }
+
+    if (in_size > 0) {
+        (void) memcpy(ctx->partial, in, in_size);
+        ctx->partial_len = in_size;
+    }
+    ctx->ghash = ghash;
+}
+
+
+/* Common part of en- and decryption. GHASH is always computed over the
+ * ciphertext, which is the output for encryption and the input for
+ * decryption. in and out may be the same buffer */
+TARGET_AESNI static void update(struct aes_gcm_ctx *ctx,
+        const unsigned char *in, size_t in_size, unsigned char *out,
+        bool encrypt) {
+    const struct aes_gcm_key *key = ctx->key;
+    const __m128i *rk = key->round_keys;
+    const __m128i mask = bswap_mask();
+    /* Kept in registers, the compiler can't know that out doesn't alias ctx */
+    __m128i counter = ctx->counter;
+    __m128i ghash = ctx->ghash;
+
+    /* An incomplete block before any en-/decrypted data belongs to the AAD: */
+    if (ctx->length == 0 && ctx->partial_len > 0)
+        ghash = ghash_partial(ctx, ghash);
+    ctx->length += in_size;
+
+    /* Use up the keystream of an incomplete block first: */
+    while (ctx->partial_len > 0 && in_size > 0) {
+        unsigned char c = *(in++);
+        unsigned char p = c ^ ctx->keystream[ctx->partial_len];
+        *(out++) = p;
+        ctx->partial[ctx->partial_len++] = encrypt ? p : c;
+        in_size--;
+        if (ctx->partial_len == BLOCK_SIZE) {
+            ghash = ghash_block(key, ghash, _mm_shuffle_epi8(_mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(ctx->partial)), mask));
+            ctx->partial_len = 0;
+        }
+    }
+
+    /* Only XOR and GHASH remain for blocks whose keystream is precomputed: */
+    for (; in_size >= 8 * BLOCK_SIZE && ctx->precomputed_blocks >= 8;
+            in_size -= 8 * BLOCK_SIZE, in += 8 * BLOCK_SIZE,
+            out += 8 * BLOCK_SIZE) {
+        __m128i blocks[8], data[8];
+        #pragma GCC unroll 8
+        for (int j = 0; j < 8; j++) {
+            data[j] = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(in) + j);
+            blocks[j] = _mm_xor_si128(ctx->precomputed[j], data[j]);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out) + j, blocks[j]);
+        }
+        #pragma GCC unroll 8
+        for (int j = 0; j < 8; j++)
+            data[j] = _mm_shuffle_epi8(encrypt ? blocks[j] : data[j], mask);
+        ghash = ghash_8_blocks(key, ghash, data);
+        ctx->precomputed += 8;
+        ctx->precomputed_blocks -= 8;
+    }
+    for (; in_size >= BLOCK_SIZE && ctx->precomputed_blocks > 0;
+            in_size -= BLOCK_SIZE, in += BLOCK_SIZE, out += BLOCK_SIZE) {
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+        __m128i block = _mm_xor_si128(*(ctx->precomputed++), data);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), block);
+        ghash = ghash_block(key, ghash,
+                _mm_shuffle_epi8(encrypt ? block : data, mask));
+        ctx->precomputed_blocks--;
+    }
+
+    if (key->impl == AES_GCM_VAES && in_size >= 16 * BLOCK_SIZE) {
+        size_t done = update_vaes(
+                key, &counter, &ghash, in, in_size, out, encrypt);
+        in += done;
+        out += done;
+        in_size -= done;
+    }
+
+    for (; in_size >= 8 * BLOCK_SIZE; in_size -= 8 * BLOCK_SIZE,
+            in += 8 * BLOCK_SIZE, out += 8 * BLOCK_SIZE) {
+        __m128i blocks[8], data[8];
+        #pragma GCC unroll 8
+        for (int j = 0; j < 8; j++)
+            blocks[j] = next_counter(&counter);
+        encrypt_8_blocks(rk, blocks);
+        #pragma GCC unroll 8
+        for (int j = 0; j < 8; j++) {
+            data[j] = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(in) + j);
+            blocks[j] = _mm_xor_si128(blocks[j], data[j]);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out) + j, blocks[j]);
+        }
+        #pragma GCC unroll 8
+        for (int j = 0; j < 8; j++)
+            data[j] = _mm_shuffle_epi8(encrypt ? blocks[j] : data[j], mask);
+        ghash = ghash_8_blocks(key, ghash, data);
+    }
+
+    for (; in_size >= BLOCK_SIZE; in_size -= BLOCK_SIZE,
+            in += BLOCK_SIZE, out += BLOCK_SIZE) {
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+        __m128i block = _mm_xor_si128(
+                encrypt_block(rk, next_counter(&counter)), data);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), block);
+        ghash = ghash_block(key, ghash,
+                _mm_shuffle_epi8(encrypt ? block : data, mask));
+    }
+
+    /* Keep the rest of the keystream for the next call: */
+    if (in_size > 0) {
+        if (ctx->precomputed_blocks > 0) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(ctx->keystream),
+                    *(ctx->precomputed++));
+            ctx->precomputed_blocks--;
+        }
+        else {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(ctx->keystream),
+                    encrypt_block(rk, next_counter(&counter)));
+        }
+        for (size_t i = 0; i < in_size; i++) {
+            unsigned char c = in[i];
+            unsigned char p = c ^ ctx->keystream[i];
+            out[i] = p;
+            ctx->partial[i] = encrypt ? p : c;
+        }
+        ctx->partial_len = in_size;
+    }
+
+    ctx->counter = counter;
+    ctx->ghash = ghash;
+}
+
+void aes_gcm_encrypt_update(struct aes_gcm_ctx *ctx,
+        const unsigned char *in, size_t in_size, unsigned char *out) {
+    update(ctx, in, in_size, out, true);
+}
+
+void aes_gcm_decrypt_update(struct aes_gcm_ctx *ctx,
+        const unsigned char *in, size_t in_size, unsigned char *out) {
+    update(ctx, in, in_size, out, false);
+}
+
+
+/**
+ * Finishes a message and computes the authentication tag
+ * @param ctx Context of the message
+ * @param tag Buffer for the 16 byte tag
+ */
+TARGET_AESNI void aes_gcm_finish(struct aes_gcm_ctx *ctx, unsigned char *tag) {
+    const __m128i mask = bswap_mask();
+    if (ctx->partial_len > 0)
+        ctx->ghash = ghash_partial(ctx, ctx->ghash);
+    /* Length block: */
+    ctx->ghash = ghash_block(ctx->key, ctx->ghash, _mm_set_epi64x(
+            static_cast<long long>(ctx->aad_length * 8),
+            static_cast<long long>(ctx->length * 8)));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(tag), _mm_xor_si128(
+            _mm_shuffle_epi8(ctx->ghash, mask), ctx->tag_mask));
+}
+
+
+/* Hashes n (reflected) blocks with a single reduction */
+TARGET_AESNI static inline __m128i ghash_n_blocks(const struct aes_gcm_key *key,
+        __m128i ghash, const __m128i *blocks, size_t n) {
+    /* H^n .. H^1: */
+    const __m128i *h = key->h_powers + AES_GCM_H_POWERS - n;
+    __m128i lo = _mm_setzero_si128();
+    __m128i mid = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+
+    clmul_acc(_mm_xor_si128(ghash, blocks[0]), h[0], &lo, &mid, &hi);
+    for (size_t j = 1; j < n; j++)
+        clmul_acc(blocks[j], h[j], &lo, &mid, &hi);
+    return ghash_reduce(lo, mid, hi);
+}
+
+
+/* En-/decrypts up to AES_GCM_STREAMS short messages in lockstep. Every pass
+ * encrypts one counter block of each message at once, so the latency of
+ * AESENC is hidden even if every message only has a few blocks. After up
+ * to 8 passes, the new blocks of each message are hashed with a single
+ * reduction, in independent chains */
+TARGET_AESNI static void update_streams(const struct aes_gcm_key *key,
+        struct aes_gcm_message **messages, size_t count, bool encrypt) {
+    const __m128i *rk = key->round_keys;
+    const __m128i mask = bswap_mask();
+    __m128i counter[AES_GCM_STREAMS], ghash[AES_GCM_STREAMS];
+    __m128i tag_mask[AES_GCM_STREAMS], blocks[AES_GCM_STREAMS];
+    __m128i hashed[AES_GCM_STREAMS][8];
+    size_t message_blocks[AES_GCM_STREAMS];
+    size_t passes = 0;
+
+    /* The first pass encrypts the initial counter blocks for the tags: */
+    #pragma GCC unroll 8
+    for (size_t s = 0; s < AES_GCM_STREAMS; s++) {
+        if (s < count) {
+            blocks[s] = initial_counter(messages[s]->iv);
+            counter[s] = _mm_add_epi32(_mm_shuffle_epi8(blocks[s], mask),
+                    _mm_set_epi32(0, 0, 0, 1));
+            message_blocks[s] =
+                    (messages[s]->length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if (message_blocks[s] > passes)
+                passes = message_blocks[s];
+        }
+        else {
+            blocks[s] = _mm_setzero_si128();
+            counter[s] = _mm_setzero_si128();
+        }
+        ghash[s] = _mm_setzero_si128();
+    }
+    encrypt_8_blocks(rk, blocks);
+    #pragma GCC unroll 8
+    for (size_t s = 0; s < AES_GCM_STREAMS; s++)
+        tag_mask[s] = blocks[s];
+
+    for (size_t first = 0; first < passes; first += 8) {
+        size_t chunk = passes - first < 8 ? passes - first : 8;
+        for (size_t pass = 0; pass < chunk; pass++) {
+            size_t offset = (first + pass) * BLOCK_SIZE;
+            #pragma GCC unroll 8
+            for (size_t s = 0; s < AES_GCM_STREAMS; s++)
+                blocks[s] = next_counter(counter + s);
+            encrypt_8_blocks(rk, blocks);
+
+            for (size_t s = 0; s < count; s++) {
+                const struct aes_gcm_message *message = messages[s];
+                if (offset >= message->length)
+                    continue;
+                size_t length = message->length - offset;
+                __m128i data, block;
+                if (length >= BLOCK_SIZE) {
+                    data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                            message->in + offset));
+                    block = _mm_xor_si128(blocks[s], data);
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(
+                            message->out + offset), block);
+                }
+                else {
+                    /* The last block is hashed padded with zeros: */
+                    unsigned char partial[BLOCK_SIZE] = { 0 };
+                    (void) memcpy(partial, message->in + offset, length);
+                    data = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i *>(partial));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(partial),
+                            _mm_xor_si128(blocks[s], data));
+                    (void) memcpy(message->out + offset, partial, length);
+                    (void) memset(partial + length, 0, BLOCK_SIZE - length);
+                    block = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i *>(partial));
+                }
+                hashed[s][pass] = _mm_shuffle_epi8(encrypt ? block : data, mask);
+            }
+        }
+
+        for (size_t s = 0; s < count; s++) {
+            if (message_blocks[s] <= first)
+                continue;
+            size_t n = message_blocks[s] - first;
+            ghash[s] = ghash_n_blocks(key, ghash[s], hashed[s], n < 8 ? n : 8);
+        }
+    }
+
+    for (size_t s = 0; s < count; s++) {
+        /* Length block, there is no AAD: */
+        ghash[s] = ghash_block(key, ghash[s], _mm_set_epi64x(0,
+                static_cast<long long>(messages[s]->length * 8)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(messages[s]->tag),
+                _mm_xor_si128(_mm_shuffle_epi8(ghash[s], mask), tag_mask[s]));
+    }
+}
+
+
+/* Common part of the en- and decryption of a batch. Messages up to
+ * AES_GCM_MAX_INTERLEAVED bytes are grouped into passes of AES_GCM_STREAMS
+ * messages, longer ones are processed on their own */
+TARGET_AESNI static void update_messages(const struct aes_gcm_key *key,
+        struct aes_gcm_message *messages, size_t count, bool encrypt) {
+    struct aes_gcm_message *streams[AES_GCM_STREAMS];
+    size_t stream_count = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct aes_gcm_message *message = messages + i;
+        if (message->length > AES_GCM_MAX_INTERLEAVED) {
+            struct aes_gcm_ctx ctx;
+            aes_gcm_init(&ctx, key, message->iv);
+            update(&ctx, message->in, message->length, message->out, encrypt);
+            aes_gcm_finish(&ctx, message->tag);
+            continue;
+        }
+        streams[stream_count++] = message;
+        if (stream_count == AES_GCM_STREAMS) {
+            update_streams(key, streams, stream_count, encrypt);
+            stream_count = 0;
+        }
+    }
+    if (stream_count > 0)
+        update_streams(key, streams, stream_count, encrypt);
+}
+
+
+/**
+ * Encrypts a batch of messages with the same key. Up to AES_GCM_STREAMS
+ * messages are encrypted in the same pass
+ * @param key Expanded key
+ * @param messages Messages to encrypt, their tags are written
+ * @param count Number of messages
+ */
+void aes_gcm_encrypt_messages(const struct aes_gcm_key *key,
+        struct aes_gcm_message *messages, size_t count) {
+    update_messages(key, messages, count, true);
+}
+
+/**
+ * Decrypts a batch of messages with the same key. The tags are computed,
+ * but not verified
+ * @param key Expanded key
+ * @param messages Messages to decrypt, their tags are written
+ * @param count Number of messages
+ */
+void aes_gcm_decrypt_messages(const struct aes_gcm_key *key,
+        struct aes_gcm_message *messages, size_t count) {
+    update_messages(key, messages, count, false);
+}
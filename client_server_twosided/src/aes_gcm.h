@@ -0,0 +1,111 @@
+#ifndef CLIENT_SERVER_TWOSIDED_AES_GCM_H
+#define CLIENT_SERVER_TWOSIDED_AES_GCM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <immintrin.h>
+
+/*
+ * Built-in AES-128-GCM for x86 that bypasses the EVP layer of OpenSSL.
+ * Produces exactly the same output as EVP_aes_128_gcm() with a 12 byte IV.
+ * Additional authenticated data has to be passed before any en-/decrypted data.
+ * Implementations (the widest available one is picked at runtime):
+ *  - AES-NI and PCLMULQDQ: 8 blocks per iteration
+ *  - VAES and VPCLMULQDQ (AVX-512): 16 blocks per iteration
+ * Batches of short messages can be en-/decrypted together, so the blocks of
+ * up to AES_GCM_STREAMS messages share every pass of AESENC and PCLMULQDQ.
+ */
+
+enum aes_gcm_impl { AES_GCM_OPENSSL, AES_GCM_AESNI, AES_GCM_VAES };
+
+/* Number of precomputed powers of the hash key H */
+static constexpr size_t AES_GCM_H_POWERS = 16;
+/* Number of keystream blocks that can be precomputed for a message */
+static constexpr size_t AES_GCM_PRECOMPUTED_BLOCKS = 16;
+
+/* Number of messages that are en-/decrypted in the same pass */
+static constexpr size_t AES_GCM_STREAMS = 8;
+/* Longer messages of a batch are en-/decrypted one after the other */
+static constexpr size_t AES_GCM_MAX_INTERLEAVED = 256;
+
+struct aes_gcm_key {
+    __m128i round_keys[11];
+    /* h_powers[i] = H^(AES_GCM_H_POWERS - i), byte-reflected */
+    __m128i h_powers[AES_GCM_H_POWERS];
+    enum aes_gcm_impl impl;
+};
+
+/* Keystream of a message whose IV is known before the message itself */
+struct aes_gcm_keystream {
+    unsigned char iv[12];
+    /* Encrypted initial counter block that masks the tag */
+    __m128i tag_mask;
+    /* Encrypted counter blocks 2 .. AES_GCM_PRECOMPUTED_BLOCKS + 1 */
+    __m128i blocks[AES_GCM_PRECOMPUTED_BLOCKS];
+};
+
+struct aes_gcm_ctx {
+    const struct aes_gcm_key *key;
+    /* Precomputed keystream that is used up before new blocks are encrypted */
+    const __m128i *precomputed;
+    size_t precomputed_blocks;
+    __m128i ghash;
+    /* Next counter block, byte-reflected */
+    __m128i counter;
+    /* Encrypted initial counter block that masks the tag */
+    __m128i tag_mask;
+    uint64_t aad_length;
+    uint64_t length;
+    /* Keystream and ciphertext (or AAD) of an incomplete block */
+    unsigned char keystream[16];
+    unsigned char partial[16];
+    size_t partial_len;
+};
+
+/* A message of a batch, without additional authenticated data */
+struct aes_gcm_message {
+    const unsigned char *iv;
+    const unsigned char *in;
+    /* May be the same as in */
+    unsigned char *out;
+    size_t length;
+    /* Is set to the tag of the message */
+    unsigned char tag[16];
+};
+
+enum aes_gcm_impl aes_gcm_best_impl();
+
+const char *aes_gcm_impl_name(enum aes_gcm_impl impl);
+
+int aes_gcm_set_key(struct aes_gcm_key *key,
+        const unsigned char *raw_key, enum aes_gcm_impl impl);
+
+void aes_gcm_init(struct aes_gcm_ctx *ctx,
+        const struct aes_gcm_key *key, const unsigned char *iv);
+
+void aes_gcm_precompute(struct aes_gcm_keystream *keystream,
+        const struct aes_gcm_key *key, const unsigned char *iv);
+
+void aes_gcm_init_precomputed(struct aes_gcm_ctx *ctx,
+        const struct aes_gcm_key *key,
+        const struct aes_gcm_keystream *keystream);
+
+void aes_gcm_aad_update(struct aes_gcm_ctx *ctx,
+        const unsigned char *in, size_t in_size);
+
+void aes_gcm_encrypt_update(struct aes_gcm_ctx *ctx,
+        const unsigned char *in, size_t in_size, unsigned char *out);
+
+void aes_gcm_decrypt_update(struct aes_gcm_ctx *ctx,
+        const unsigned char *in, size_t in_size, unsigned char *out);
+
+void aes_gcm_finish(struct aes_gcm_ctx *ctx, unsigned char *tag);
+
+void aes_gcm_encrypt_messages(const struct aes_gcm_key *key,
+        struct aes_gcm_message *messages, size_t count);
+
+void aes_gcm_decrypt_messages(const struct aes_gcm_key *key,
+        struct aes_gcm_message *messages, size_t count);
+
+
+#endif //CLIENT_SERVER_TWOSIDED_AES_GCM_H
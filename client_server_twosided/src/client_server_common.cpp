@@ -1,60 +1,184 @@
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
+#include <atomic>
 #include <cstring>
+#include <mutex>
 #include <common.h>
 
 #include "client_server_common.h"
+#include "CryptoSession.h"
+
+/*
+ * Nonces are partitioned by thread, so no synchronization is needed per
+ * message:
+ * +--------------------------------+--------------------------------------+
+ * | Counter of the thread (64 bit) | Process salt + thread index (32 bit) |
+ * +--------------------------------+--------------------------------------+
+ * The thread index is unique within the process, the random salt separates
+ * the nonce spaces of different processes (e.g. client and server)
+ */
+struct nonce_generator {
+    uint64_t counter;
+    uint32_t thread_id;
+    bool initialized;
+};
+
+static_assert(sizeof(uint64_t) + sizeof(uint32_t) == IV_LEN,
+        "The nonce layout doesn't match the IV length");
+
+static std::atomic<uint32_t> next_nonce_thread{0};
+static uint32_t nonce_salt;
+static std::once_flag nonce_salt_flag;
+static thread_local struct nonce_generator nonce_gen = { 0, 0, false };
+
+static int init_nonce_generator() {
+    int ret = 0;
+    std::call_once(nonce_salt_flag, [&ret]() {
+        if (1 != RAND_bytes((unsigned char *) &nonce_salt, sizeof(nonce_salt)))
+            ret = -1;
+    });
+    // Initially generate a true random counter, then increment it to save
+    // the overhead of RAND_bytes especially for SCONE
+    if (ret || 1 != RAND_bytes(
+            (unsigned char *) &(nonce_gen.counter), sizeof(nonce_gen.counter))) {
+        cerr << "next_iv: Could not generate IV" << endl;
+        return -1;
+    }
+    nonce_gen.thread_id = nonce_salt + next_nonce_thread.fetch_add(1);
+    nonce_gen.initialized = true;
+    return 0;
+}
 
-#define MIN(a,b) ((a) < (b) ? (a) : (b))
+/**
+ * Writes the next nonce of this thread. Nonces are unique across all threads
+ * of the process
+ * @param iv Buffer of length IV_LEN
+ * @return 0 on success, -1 if no random start value could be generated
+ */
+int next_iv(unsigned char *iv) {
+    if (unlikely(!nonce_gen.initialized)) {
+        if (0 != init_nonce_generator())
+            return -1;
+    }
+    nonce_gen.counter++;
+    (void) memcpy(iv, &(nonce_gen.counter), sizeof(nonce_gen.counter));
+    (void) memcpy(iv + sizeof(nonce_gen.counter),
+            &(nonce_gen.thread_id), sizeof(nonce_gen.thread_id));
+    return 0;
+}
 
-unsigned char iv[IV_LEN];
+/* HKDF info of the session keys, followed by the ID of the session: */
+static constexpr char HANDSHAKE_INFO[] = "anchor session key";
+static constexpr char REKEY_INFO[] = "anchor rekey";
+
+/**
+ * Derives the session key of the next key phase of a session with HKDF.
+ * Client and server derive the same key from the same input
+ * @param session Session that is re-keyed with the derived key
+ * @param input_key The master key for CONTROL_HANDSHAKE, the session key of
+ *          the current key phase for CONTROL_REKEY
+ * @param type CONTROL_HANDSHAKE or CONTROL_REKEY
+ * @param session_id ID of the client, binds the key to the session
+ * @param client_random Random of the client of length KDF_RANDOM_LEN
+ * @param server_random Random of the server of length KDF_RANDOM_LEN
+ * @return 0 on success, -1 on error
+ */
+int derive_session_key(CryptoSession *session, const unsigned char *input_key,
+        uint8_t type, uint8_t session_id,
+        const unsigned char *client_random, const unsigned char *server_random) {
+    unsigned char salt[2 * KDF_RANDOM_LEN];
+    unsigned char info[sizeof(HANDSHAKE_INFO) + 1];
+    size_t info_len;
+
+    if (type == CONTROL_HANDSHAKE) {
+        (void) memcpy(info, HANDSHAKE_INFO, sizeof(HANDSHAKE_INFO));
+        info_len = sizeof(HANDSHAKE_INFO);
+    } else if (type == CONTROL_REKEY) {
+        (void) memcpy(info, REKEY_INFO, sizeof(REKEY_INFO));
+        info_len = sizeof(REKEY_INFO);
+    } else {
+        cerr << "Invalid control message type" << endl;
+        return -1;
+    }
+    info[info_len++] = session_id;
+    (void) memcpy(salt, client_random, KDF_RANDOM_LEN);
+    (void) memcpy(salt + KDF_RANDOM_LEN, server_random, KDF_RANDOM_LEN);
 
-inline void next_iv() {
-    ((uint64_t *) iv)[0] += 1;
+    return session->derive_key(input_key, salt, sizeof(salt), info, info_len);
 }
 
 const unsigned char *enc_key = nullptr;
 
-/* En-/decrypts data using EVP_CipherUpdate
- * Supports data lengths over (2^31 - 1) bytes
- * On success (i.e. if in_size bytes have been en-/decrypted without error),
- * 0 is returned, otherwise -1
- * */
-int cipher_update(EVP_CIPHER_CTX *aes_ctx,
-        const unsigned char *in, size_t in_size, unsigned char *out) {
-
-    size_t total_processed_bytes = 0;
-    int processed_bytes, to_process;
-
-    while (static_cast<size_t>(total_processed_bytes) < in_size) {
-        to_process = static_cast<int>(
-                MIN(INT32_MAX, in_size - total_processed_bytes));
-        if (1 != EVP_CipherUpdate(
-                aes_ctx, out, &processed_bytes, in, to_process)) {
-            cerr << "Could not en-/decrypt payload" << endl;
-            return -1;
-        }
-        if (processed_bytes < 0) {
-            cerr << "Something went wrong while en-/decrypting" << endl;
-            return -1;
-        }
-        total_processed_bytes += static_cast<size_t>(processed_bytes);
-        out += static_cast<size_t>(processed_bytes);
-        in += static_cast<size_t>(processed_bytes);
+/* Number of buffers that en-/decryption had to allocate in this thread */
+thread_local size_t payload_allocations = 0;
+
+size_t get_payload_allocations() {
+    return payload_allocations;
+}
+
+#if !NO_ENCRYPTION
+/* Session for callers that don't manage their own one. Is re-keyed whenever
+ * enc_key changes */
+thread_local CryptoSession default_session;
+
+static CryptoSession *get_default_session() {
+    if (unlikely(default_session.get_key() != enc_key)) {
+        if (0 != default_session.set_key(enc_key))
+            return nullptr;
     }
-    if (total_processed_bytes != in_size) {
-        cerr << "Number of en-/decrypted bytes doesn't match expected number"
-                << endl;
+    return &default_session;
+}
+#endif // NO_ENCRYPTION
+
+/* Security mode of the messages of a session */
+static inline enum security_mode get_mode(const CryptoSession *session) {
+#if NO_ENCRYPTION
+    (void) session;
+    return SECURITY_NONE;
+#else
+    return session->get_security_mode();
+#endif // NO_ENCRYPTION
+}
+
+
+#if !NO_ENCRYPTION
+/* Copies a part of a message that is sent in clear and authenticates it */
+static int write_authenticated(CryptoSession *session,
+        const unsigned char *in, size_t in_size, unsigned char *ciphertext_pos) {
+    if (0 != session->encrypt_aad_update(in, in_size))
         return -1;
-    }
+    (void) memcpy(ciphertext_pos, in, in_size);
     return 0;
 }
+#endif // NO_ENCRYPTION
+
+
+/* Writes the next part of a message, protected according to the security
+ * mode. Returns 0 on success, -1 on error */
+static inline int write_fragment(CryptoSession *session,
+        enum security_mode mode, const unsigned char *in, size_t in_size,
+        unsigned char *ciphertext_pos) {
+    if (mode == SECURITY_NONE) {
+        (void) memcpy(ciphertext_pos, in, in_size);
+        return 0;
+    }
+#if NO_ENCRYPTION
+    (void) session;
+    return -1;
+#else
+    if (mode == SECURITY_AUTHENTICATE)
+        return write_authenticated(session, in, in_size, ciphertext_pos);
+    return session->encrypt_update(in, in_size, ciphertext_pos);
+#endif // NO_ENCRYPTION
+}
 
 
 /**
  * Encrypts the header and the key/value that have to be placed in the corresponding
- * struct by the caller
+ * struct by the caller. How the message is protected depends on the security
+ * mode of the session
+ * @param session Crypto session holding the expanded key and the security mode
  * @param header Header data to encrypt
  * @param payload Payload data to encrypt
  * @param ciphertext Pointer to pointer where ciphertext is placed
@@ -62,124 +186,120 @@ int cipher_update(EVP_CIPHER_CTX *aes_ctx,
  *          by the caller. In this case, on error, the memory is freed by this method
  * @return 0 on success, -1 on error
  */
-int encrypt_message(
+int encrypt_message(CryptoSession *session,
         const struct rdma_msg_header *header,
         const struct rdma_enc_payload *payload, 
         unsigned char **ciphertext) {
+
+    if (!payload) {
+        cerr << "encrypt_message: invalid parameters" << endl;
+        return -1;
+    }
+    struct iovec value = {
+            const_cast<unsigned char *>(payload->value), payload->value_len };
+    return encrypt_message_v(session, header, payload->key, &value, 1, ciphertext);
+}
+
+
+/**
+ * Like encrypt_message, but the value is gathered from several fragments.
+ * Each fragment is encrypted straight into the message, so the value
+ * doesn't need to be copied into one buffer before
+ * @param session Crypto session holding the expanded key and the security mode
+ * @param header Header data to encrypt. key_len is the length of key
+ * @param key Key to encrypt
+ * @param value Fragments of the value, in order. Fragments without data are
+ *          skipped
+ * @param value_count Number of fragments
+ * @param ciphertext Pointer to pointer where ciphertext is placed, see
+ *          encrypt_message
+ * @return 0 on success, -1 on error
+ */
+int encrypt_message_v(CryptoSession *session,
+        const struct rdma_msg_header *header, const unsigned char *key,
+        const struct iovec *value, size_t value_count,
+        unsigned char **ciphertext) {
     bool to_free = false;
+    int ret = -1;
+    size_t value_len = 0;
 
-    if (!(header && ciphertext && payload)){
+    if (!(header && ciphertext && (value || value_count == 0))){
         cerr << "encrypt_message: invalid parameters" << endl;
         return -1;
     }
-    size_t payload_len = header->key_len + payload->value_len;
+    if (unlikely(header->key_len > KEY_LEN_MASK)) {
+        cerr << "encrypt_message: key too long" << endl;
+        return -1;
+    }
+    for (size_t i = 0; i < value_count; i++) {
+        if (value[i].iov_base)
+            value_len += value[i].iov_len;
+    }
+    enum security_mode mode = get_mode(session);
+    /* The security mode and the credits are sent along in the header: */
+    const uint64_t wire_header[] = { header->seq_op,
+            SET_CREDITS(SET_MODE(header->key_len, mode), header->credits) };
+    size_t payload_len = header->key_len + value_len;
     if (!*ciphertext) {
         *ciphertext = static_cast<unsigned char *>(
-                malloc(CIPHERTEXT_SIZE(payload_len)));
+                malloc(MESSAGE_SIZE(mode, payload_len)));
         if (!*ciphertext) {
             cerr << "Memory allocation failure" << endl;
             return -1;
         }
+        payload_allocations++;
         to_free = true;
     }
     unsigned char *ciphertext_pos = *ciphertext;
 
-#if NO_ENCRYPTION
-    (void) to_free;
-    (void) memcpy(ciphertext_pos, header, sizeof(struct rdma_msg_header));
-    ciphertext_pos += sizeof(struct rdma_msg_header);
-    if (header->key_len > 0 && payload->key) {
-        (void) memcpy(ciphertext_pos, payload->key, header->key_len);
-        ciphertext_pos += header->key_len;
-    }
-    if (payload->value_len > 0 && payload->value) {
-        (void) memcpy(ciphertext_pos, payload->value, payload->value_len);
-    }
-    return 0;
-#else
-    int ret = -1;
-    int length;
-    EVP_CIPHER_CTX *aes_ctx = EVP_CIPHER_CTX_new();
-    if (!aes_ctx){
-        cerr << "Memory allocation failure" << endl;
-        goto end_encrypt;
-    }
-
-    // Initially generate a true random IV
-    if (unlikely(((uint64_t *) iv)[0] == 0)) {
-        if (1 != RAND_bytes(iv, IV_LEN)) {
-            cerr << "encrypt_message: Could not generate IV" << endl;
+    if (mode != SECURITY_NONE) {
+        /* Reuse the expanded key (and a precomputed keystream if there is
+         * one), only set the IV: */
+        if (unlikely(0 != session->init_encryption_next_iv(ciphertext_pos))) {
+            cerr << "encrypt_message: Could not initialize encryption" << endl;
             goto end_encrypt;
         }
+        ciphertext_pos += IV_LEN;
     }
-    // Then, increment the IV to save the overhead of RAND_bytes
-    // especially for SCONE
-    next_iv();
-    memcpy(ciphertext_pos, iv, IV_LEN);
-
-    /* Initialize Encryption, set position of IV: */
-    if (1 != EVP_EncryptInit_ex(aes_ctx,
-            EVP_aes_128_gcm(), nullptr, enc_key, ciphertext_pos)){
-        cerr << "encrypt_message: Could not initialize encryption of IV" << endl;
-        goto end_encrypt;
-    }
-
-    /* Set IV length: */
-    if (1 != EVP_CIPHER_CTX_ctrl(aes_ctx, EVP_CTRL_AEAD_SET_IVLEN, IV_LEN, nullptr)){
-        cerr << "encrypt_message: Could not set IV length" << endl;
-        goto end_encrypt;
-    }
-    ciphertext_pos += IV_LEN;
 
-    /* Encrypt seq_op and length: */
-    if (1 != EVP_EncryptUpdate(aes_ctx, ciphertext_pos, &length,
-            (unsigned char *)header, sizeof(struct rdma_msg_header))) {
+    /* Protect seq_op and length: */
+    if (0 != write_fragment(session, mode, (const unsigned char *) wire_header,
+            sizeof(wire_header), ciphertext_pos)) {
         cerr << "Could not encrypt seq_op/key_len" << endl;
         goto end_encrypt;
     }
-    ciphertext_pos += (size_t)length;
+    ciphertext_pos += sizeof(wire_header);
 
-    /* Encrypt key: */
-    if (header->key_len > 0 && payload->key) {
-        if (0 > cipher_update(aes_ctx, payload->key, header->key_len, ciphertext_pos))
+    /* Protect key: */
+    if (header->key_len > 0 && key) {
+        if (0 != write_fragment(session, mode, key,
+                static_cast<size_t>(header->key_len), ciphertext_pos))
             goto end_encrypt;
-
         ciphertext_pos += static_cast<size_t>(header->key_len);
     }
 
-    /* Encrypt value: */
-    if (payload->value_len > 0 && payload->value) {
-        if (0 > cipher_update(aes_ctx, payload->value, payload->value_len, ciphertext_pos))
+    /* Protect the value, one fragment after the other: */
+    for (size_t i = 0; i < value_count; i++) {
+        if (value[i].iov_len == 0 || !value[i].iov_base)
+            continue;
+        if (0 != write_fragment(session, mode,
+                static_cast<const unsigned char *>(value[i].iov_base),
+                value[i].iov_len, ciphertext_pos))
             goto end_encrypt;
-
-        ciphertext_pos += static_cast<size_t>(payload->value_len);
-    }
-
-    /* Write final encrypted data: */
-    if (1 != EVP_EncryptFinal_ex(aes_ctx, ciphertext_pos, &length)){
-        cerr << "Could not write final encrypted data" << endl;
-        goto end_encrypt;
+        ciphertext_pos += value[i].iov_len;
     }
-    ciphertext_pos += static_cast<size_t>(length);
 
     /* Write tag: */
-    if (1 != EVP_CIPHER_CTX_ctrl(aes_ctx, EVP_CTRL_AEAD_GET_TAG, MAC_LEN, ciphertext_pos)) {
-        cerr << "Could not write authentication tag" << endl;
+    if (mode != SECURITY_NONE && 0 != session->finish_encryption(ciphertext_pos))
         goto end_encrypt;
-    }
     ret = 0;
 
 end_encrypt:
-    EVP_CIPHER_CTX_free(aes_ctx);
-
     if (to_free && ret)
         free(*ciphertext);
     return ret;
-
-#endif // NO_ENCRYPTION
 }
 
-#if NO_ENCRYPTION
 int allocate_and_copy(unsigned char **payload, 
         const unsigned char *ciphertext_pos, size_t expected_length,
         bool *to_free) {
@@ -190,16 +310,19 @@ int allocate_and_copy(unsigned char **payload,
             cerr << "Memory allocation failure" << endl;
             return -1;
         }
+        payload_allocations++;
         *to_free = true;
     }
     else
         *to_free = false;
     
-    (void) memcpy(*payload, ciphertext_pos, expected_length);
+    if (*payload != ciphertext_pos)
+        (void) memcpy(*payload, ciphertext_pos, expected_length);
     return 0;
 }
-#else
-int allocate_and_decrypt(EVP_CIPHER_CTX *aes_ctx, unsigned char **payload,
+
+#if !NO_ENCRYPTION
+int allocate_and_decrypt(CryptoSession *session, unsigned char **payload,
         const unsigned char *ciphertext_pos, size_t expected_length, bool *to_free) {
 
     if (!*payload) {
@@ -208,12 +331,13 @@ int allocate_and_decrypt(EVP_CIPHER_CTX *aes_ctx, unsigned char **payload,
             cerr << "Memory allocation failure" << endl;
             return -1;
         }
+        payload_allocations++;
         *to_free = true;
     }
     else
         *to_free = false;
 
-    if (0 > cipher_update(aes_ctx, ciphertext_pos, expected_length, *payload))
+    if (0 > session->decrypt_update(ciphertext_pos, expected_length, *payload))
         goto err_allocate_and_decrypt;
 
     return 0;
@@ -226,42 +350,61 @@ err_allocate_and_decrypt:
     }
     return -1;
 }
+
+/* Verifies a part of a message that was sent in clear and copies it */
+int allocate_and_verify(CryptoSession *session, unsigned char **payload,
+        const unsigned char *ciphertext_pos, size_t expected_length, bool *to_free) {
+
+    if (0 != session->decrypt_aad_update(ciphertext_pos, expected_length))
+        return -1;
+    return allocate_and_copy(payload, ciphertext_pos, expected_length, to_free);
+}
 #endif // NO_ENCRYPTION
 
 
+/* Size of seq_op and key_len on the wire */
+static constexpr size_t HEADER_LEN = SEQ_LEN + SIZE_LEN;
+
+/* Fills in a received header and checks the security mode in its key length */
+static inline int read_header(struct rdma_msg_header *header,
+        const uint64_t *wire_header, enum security_mode mode) {
+    if (unlikely(MODE_FROM_KEY_LEN(wire_header[1]) != mode)) {
+        cerr << "decrypt_message: Wrong security mode" << endl;
+        return -1;
+    }
+    header->seq_op = wire_header[0];
+    header->key_len = wire_header[1] & KEY_LEN_MASK;
+    header->credits = CREDITS_FROM_KEY_LEN(wire_header[1]);
+    return 0;
+}
+
+
 /**
- * Decrypts a message and stores the results of the decryption in a
- * rdma_msg_header and a rdma_dec_payload struct.
- * The pointers in the rdma_dec_payload struct are allocated by this method and
- * have to be freed by the caller, if they are null. 
- * On error, this method frees the pointers itself
- * @param header Header struct to store the header information
- * @param payload Payload struct where key and value information are stored
- *          in newly allocated pointers
- * @param ciphertext Ciphertext to decrypt
- * @param ciphertext_len Length of ciphertext to decrypt
- * @return 0 on success, -1 on error
+ * Reads a message that is sent with SECURITY_NONE
+ * @param in_place If not null, key and value are not copied, but point into
+ *          the message
  */
-int decrypt_message(
-        struct rdma_msg_header *header,
-        struct rdma_dec_payload *payload, 
-        const unsigned char *ciphertext, size_t ciphertext_len) {
+static int read_plain(struct rdma_msg_header *header,
+        struct rdma_dec_payload *payload,
+        const unsigned char *ciphertext, size_t ciphertext_len,
+        unsigned char *in_place) {
 
-    if (!(header && ciphertext && payload && ciphertext_len >= MIN_MSG_LEN)) {
-        cerr << "decrypt_message: Invalid parameters" << endl;
+    bool free_key = false, free_value = false;
+    uint64_t wire_header[2];
+    (void) memcpy(wire_header, ciphertext, HEADER_LEN);
+    if (0 != read_header(header, wire_header, SECURITY_NONE))
+        return -1;
+    ciphertext += HEADER_LEN;
+    ciphertext_len -= HEADER_LEN;
+    if (header->key_len > ciphertext_len) {
+        cerr << "decrypt_message: Wrong key length in header" << endl;
         return -1;
     }
-    bool free_key = false, free_value = false;
-
-#if NO_ENCRYPTION
-    (void) memcpy(header, ciphertext, sizeof(struct rdma_msg_header));
-    ciphertext += sizeof(struct rdma_msg_header);
-    ciphertext_len -= sizeof(struct rdma_msg_header);
+    if (in_place) {
+        payload->key = in_place + HEADER_LEN;
+        payload->value = payload->key + header->key_len;
+    }
     if (header->key_len > 0) {
-        if (header->key_len > ciphertext_len) {
-            cerr << "decrypt_message: Wrong key length in header" << endl;
-            return -1;
-        }
         if (0 > allocate_and_copy(&(payload->key), 
                 ciphertext, header->key_len, &free_key)) {
             return -1;
@@ -277,63 +420,82 @@ int decrypt_message(
                 free(payload->key);
             return -1;
         }
-        payload->value_len = ciphertext_len;
     }
+    payload->value_len = ciphertext_len;
     return 0;
-#else
-    int ret = -1;
-    size_t expected_payload_len = PAYLOAD_SIZE(ciphertext_len);
-    int64_t expected_value_len;
-    size_t bytes_decrypted = 0;
+}
 
-    int length;
 
-    EVP_CIPHER_CTX *aes_ctx = EVP_CIPHER_CTX_new();
-    if (!aes_ctx){
-        cerr << "Memory allocation failure" << endl;
+/**
+ * Common implementation of decrypt_message and decrypt_message_in_place
+ * @param in_place If not null, the (writable) ciphertext buffer. Key and value
+ *          are then decrypted in place instead of to the payload pointers
+ */
+static int decrypt_message_internal(CryptoSession *session,
+        struct rdma_msg_header *header,
+        struct rdma_dec_payload *payload,
+        const unsigned char *ciphertext, size_t ciphertext_len,
+        unsigned char *in_place) {
+
+    enum security_mode mode = get_mode(session);
+    if (!(header && ciphertext && payload &&
+            ciphertext_len >= MESSAGE_SIZE(mode, 0))) {
+        cerr << "decrypt_message: Invalid parameters" << endl;
         return -1;
     }
 
-    if (1 != EVP_DecryptInit_ex(aes_ctx, EVP_aes_128_gcm(), nullptr,
-            enc_key, ciphertext + bytes_decrypted)){
-        cerr << "decrypt_message: failed to initialize decryption" << endl;
-        goto end_decrypt;
-    }
+    if (mode == SECURITY_NONE)
+        return read_plain(header, payload, ciphertext, ciphertext_len, in_place);
 
-    /* Set the location of the authentication tag: */
-    if (1 != EVP_CIPHER_CTX_ctrl(aes_ctx, EVP_CTRL_AEAD_SET_TAG,
-            MAC_LEN, (void *) (ciphertext + ciphertext_len - MAC_LEN))) {
-        cerr << "decrypt_message: Could not set Tag location" << endl;
-        goto end_decrypt;
-    }
+#if NO_ENCRYPTION
+    return -1;
+#else
+    bool free_key = false, free_value = false;
+    bool authenticate_only = mode == SECURITY_AUTHENTICATE;
+    int ret = -1;
+    size_t expected_payload_len = PAYLOAD_SIZE(ciphertext_len);
+    int64_t expected_value_len;
+    size_t bytes_decrypted = 0;
+    uint64_t wire_header[2];
 
-    /* Set the length of the IV: */
-    if (1 != EVP_CIPHER_CTX_ctrl(aes_ctx, EVP_CTRL_AEAD_SET_IVLEN, IV_LEN, nullptr)){
-        cerr << "decrypt_message: Could not set IV length" << endl;
-        goto end_decrypt;
+    /* Reuse the expanded key, only set IV and the location of the tag: */
+    if (unlikely(0 != session->init_decryption(
+            ciphertext, ciphertext + ciphertext_len - MAC_LEN))) {
+        cerr << "decrypt_message: failed to initialize decryption" << endl;
+        return -1;
     }
     bytes_decrypted += IV_LEN;
 
     /* Decrypt seq_op and length: */
-    if (1 != EVP_DecryptUpdate(aes_ctx, (unsigned char *) header,
-            &length, ciphertext + bytes_decrypted, sizeof(struct rdma_msg_header))) {
-        cerr << "Could not decrypt seq/op/length" << endl;
-        goto end_decrypt;
+    if (authenticate_only) {
+        if (0 != session->decrypt_aad_update(
+                ciphertext + bytes_decrypted, HEADER_LEN))
+            goto end_decrypt;
+        (void) memcpy(wire_header, ciphertext + bytes_decrypted, HEADER_LEN);
     }
-    if (length != sizeof(struct rdma_msg_header)) {
-        cerr << "Seq_Op and length were not completely written to struct" << endl;
+    else if (0 != session->decrypt_update(ciphertext + bytes_decrypted,
+            HEADER_LEN, (unsigned char *) wire_header)) {
+        cerr << "Could not decrypt seq/op/length" << endl;
         goto end_decrypt;
     }
-    bytes_decrypted += static_cast<size_t>(length);
+    bytes_decrypted += HEADER_LEN;
 
+    if (0 != read_header(header, wire_header, mode))
+        goto end_decrypt;
     if (header->key_len > expected_payload_len) {
         cerr << "Invalid key length" << endl;
         goto end_decrypt;
     }
+    /* Key and value are decrypted to the position of their ciphertext: */
+    if (in_place) {
+        payload->key = in_place + bytes_decrypted;
+        payload->value = payload->key + header->key_len;
+    }
     /* Decrypt key: */
     if (header->key_len > 0) {
-        if (0 > allocate_and_decrypt(aes_ctx, &(payload->key),
-                ciphertext + bytes_decrypted, header->key_len, &free_key))
+        if (0 > (authenticate_only ? allocate_and_verify : allocate_and_decrypt)(
+                session, &(payload->key), ciphertext + bytes_decrypted,
+                header->key_len, &free_key))
             goto end_decrypt;
 
         bytes_decrypted += header->key_len;
@@ -343,17 +505,15 @@ int decrypt_message(
     expected_value_len = static_cast<int64_t>(expected_payload_len) -
             static_cast<int64_t>(header->key_len);
     if (expected_value_len > 0) {
-        if (0 > allocate_and_decrypt(aes_ctx, &(payload->value),
-                ciphertext + bytes_decrypted,
+        if (0 > (authenticate_only ? allocate_and_verify : allocate_and_decrypt)(
+                session, &(payload->value), ciphertext + bytes_decrypted,
                 static_cast<size_t>(expected_value_len), &free_value))
             goto end_decrypt;
     }
 
     /* Finish decryption: */
-    if (1 != EVP_DecryptFinal_ex(aes_ctx, nullptr, &length)){
-        cerr << "Could not finish decryption" << endl;
+    if (0 != session->finish_decryption())
         goto end_decrypt;
-    }
     payload->value_len = static_cast<size_t>(expected_value_len);
     ret = 0;
 
@@ -368,7 +528,379 @@ end_decrypt:
             payload->value = nullptr;
         }
     }
-    EVP_CIPHER_CTX_free(aes_ctx);
     return ret;
 #endif // NO_ENCRYPTION
 }
+
+
+/**
+ * Decrypts a message and stores the results of the decryption in a
+ * rdma_msg_header and a rdma_dec_payload struct.
+ * The pointers in the rdma_dec_payload struct are allocated by this method and
+ * have to be freed by the caller, if they are null. 
+ * On error, this method frees the pointers itself
+ * @param session Crypto session holding the expanded key
+ * @param header Header struct to store the header information
+ * @param payload Payload struct where key and value information are stored
+ *          in newly allocated pointers
+ * @param ciphertext Ciphertext to decrypt
+ * @param ciphertext_len Length of ciphertext to decrypt
+ * @return 0 on success, -1 on error
+ */
+int decrypt_message(CryptoSession *session,
+        struct rdma_msg_header *header,
+        struct rdma_dec_payload *payload,
+        const unsigned char *ciphertext, size_t ciphertext_len) {
+    return decrypt_message_internal(
+            session, header, payload, ciphertext, ciphertext_len, nullptr);
+}
+
+
+/**
+ * Decrypts a message in place. Afterwards, the key and the value pointers
+ * of the payload point into the ciphertext buffer
+ * @param session Crypto session holding the expanded key
+ * @param header Header struct to store the header information
+ * @param payload Payload struct whose pointers are set by this method
+ * @param ciphertext Ciphertext to decrypt, is overwritten by the plaintext
+ * @param ciphertext_len Length of ciphertext to decrypt
+ * @return 0 on success, -1 on error
+ */
+int decrypt_message_in_place(CryptoSession *session,
+        struct rdma_msg_header *header,
+        struct rdma_dec_payload *payload,
+        unsigned char *ciphertext, size_t ciphertext_len) {
+    return decrypt_message_internal(
+            session, header, payload, ciphertext, ciphertext_len, ciphertext);
+}
+
+
+#if !NO_ENCRYPTION
+/**
+ * Encrypts up to AES_GCM_STREAMS messages of a batch in the same pass, see
+ * CryptoSession::encrypt_messages. The plaintext of every message is
+ * gathered into its ciphertext buffer and encrypted in place
+ */
+static void encrypt_streams(CryptoSession *session,
+        struct rdma_enc_batch_entry *batch, size_t count) {
+    struct aes_gcm_message messages[AES_GCM_STREAMS];
+    struct rdma_enc_batch_entry *entries[AES_GCM_STREAMS];
+    size_t stream_count = 0;
+    int ret;
+
+    for (size_t i = 0; i < count; i++) {
+        struct rdma_enc_batch_entry *entry = batch + i;
+        const struct rdma_msg_header *header = &(entry->header);
+        const struct rdma_enc_payload *payload = &(entry->payload);
+        size_t value_len = payload->value ? payload->value_len : 0;
+        /* Long messages are encrypted without gathering them first, as are
+         * messages that encrypt_message would reject or allocate: */
+        if (HEADER_LEN + header->key_len + value_len > AES_GCM_MAX_INTERLEAVED ||
+                unlikely(!entry->ciphertext || header->key_len > KEY_LEN_MASK ||
+                (header->key_len > 0 && !payload->key))) {
+            entry->ret = encrypt_message(
+                    session, header, payload, &(entry->ciphertext));
+            continue;
+        }
+        if (unlikely(0 != next_iv(entry->ciphertext))) {
+            cerr << "encrypt_message: Could not initialize encryption" << endl;
+            entry->ret = -1;
+            continue;
+        }
+        const uint64_t wire_header[] = { header->seq_op, SET_CREDITS(
+                SET_MODE(header->key_len, SECURITY_ENCRYPT), header->credits) };
+        unsigned char *plaintext = entry->ciphertext + IV_LEN;
+        (void) memcpy(plaintext, wire_header, HEADER_LEN);
+        if (header->key_len > 0)
+            (void) memcpy(plaintext + HEADER_LEN, payload->key, header->key_len);
+        if (value_len > 0)
+            (void) memcpy(plaintext + HEADER_LEN + header->key_len,
+                    payload->value, value_len);
+        messages[stream_count] = { entry->ciphertext, plaintext, plaintext,
+                HEADER_LEN + header->key_len + value_len, { 0 } };
+        entries[stream_count++] = entry;
+    }
+    if (stream_count == 0)
+        return;
+
+    ret = session->encrypt_messages(messages, stream_count);
+    for (size_t i = 0; i < stream_count; i++) {
+        entries[i]->ret = ret;
+        if (ret == 0)
+            (void) memcpy(messages[i].out + messages[i].length,
+                    messages[i].tag, MAC_LEN);
+    }
+}
+
+
+/**
+ * Decrypts up to AES_GCM_STREAMS messages of a batch in place in the same
+ * pass, see CryptoSession::decrypt_messages
+ */
+static void decrypt_streams(CryptoSession *session,
+        struct rdma_dec_batch_entry *batch, size_t count) {
+    struct aes_gcm_message messages[AES_GCM_STREAMS];
+    struct rdma_dec_batch_entry *entries[AES_GCM_STREAMS];
+    const unsigned char *tags[AES_GCM_STREAMS];
+    int results[AES_GCM_STREAMS];
+    size_t stream_count = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct rdma_dec_batch_entry *entry = batch + i;
+        entry->ret = -1;
+        if (unlikely(!entry->ciphertext ||
+                entry->ciphertext_len < MESSAGE_SIZE(SECURITY_ENCRYPT, 0))) {
+            cerr << "decrypt_message: Invalid parameters" << endl;
+            continue;
+        }
+        if (!is_interleaved(session, entry->ciphertext_len)) {
+            entry->ret = decrypt_message_in_place(session, &(entry->header),
+                    &(entry->payload), entry->ciphertext, entry->ciphertext_len);
+            continue;
+        }
+        unsigned char *plaintext = entry->ciphertext + IV_LEN;
+        messages[stream_count] = { entry->ciphertext, plaintext, plaintext,
+                entry->ciphertext_len - IV_LEN - MAC_LEN, { 0 } };
+        tags[stream_count] = plaintext + messages[stream_count].length;
+        entries[stream_count++] = entry;
+    }
+    if (stream_count == 0)
+        return;
+    (void) session->decrypt_messages(messages, tags, results, stream_count);
+
+    for (size_t i = 0; i < stream_count; i++) {
+        struct rdma_dec_batch_entry *entry = entries[i];
+        uint64_t wire_header[2];
+        if (results[i] != 0)
+            continue;
+        (void) memcpy(wire_header, messages[i].out, HEADER_LEN);
+        if (0 != read_header(&(entry->header), wire_header, SECURITY_ENCRYPT))
+            continue;
+        size_t payload_len = PAYLOAD_SIZE(entry->ciphertext_len);
+        if (entry->header.key_len > payload_len) {
+            cerr << "Invalid key length" << endl;
+            continue;
+        }
+        entry->payload.key = messages[i].out + HEADER_LEN;
+        entry->payload.value = entry->payload.key + entry->header.key_len;
+        entry->payload.value_len = payload_len - entry->header.key_len;
+        entry->ret = 0;
+    }
+}
+#endif // NO_ENCRYPTION
+
+
+/**
+ * Encrypts a batch of messages with the same session.
+ * With SECURITY_ENCRYPT and the built-in implementation, up to
+ * AES_GCM_STREAMS messages are encrypted in the same pass.
+ * The result of every single message is stored in its ret field
+ * @param session Crypto session holding the expanded key
+ * @param batch Messages to encrypt. The ciphertext pointers must point to
+ *          buffers that are big enough for the according message
+ * @param count Number of messages in the batch
+ * @return 0 if all messages were encrypted successfully, -1 otherwise
+ */
+int encrypt_messages(CryptoSession *session,
+        struct rdma_enc_batch_entry *batch, size_t count) {
+    int ret = 0;
+#if !NO_ENCRYPTION
+    if (get_mode(session) == SECURITY_ENCRYPT && session->supports_batches()) {
+        for (size_t i = 0; i < count; i += AES_GCM_STREAMS)
+            encrypt_streams(session, batch + i, count - i < AES_GCM_STREAMS ?
+                    count - i : AES_GCM_STREAMS);
+        for (size_t i = 0; i < count; i++)
+            ret |= batch[i].ret;
+        return ret;
+    }
+#endif // NO_ENCRYPTION
+    for (size_t i = 0; i < count; i++) {
+        batch[i].ret = encrypt_message(session,
+                &(batch[i].header), &(batch[i].payload), &(batch[i].ciphertext));
+        ret |= batch[i].ret;
+    }
+    return ret;
+}
+
+
+/**
+ * Decrypts a batch of messages in place with the same session.
+ * With SECURITY_ENCRYPT and the built-in implementation, up to
+ * AES_GCM_STREAMS messages are decrypted in the same pass.
+ * The result of every single message is stored in its ret field
+ * @param session Crypto session holding the expanded key
+ * @param batch Messages to decrypt. Header and payload of each entry are
+ *          filled in, the payload points into the ciphertext buffer
+ * @param count Number of messages in the batch
+ * @return 0 if all messages were decrypted successfully, -1 otherwise
+ */
+int decrypt_messages(CryptoSession *session,
+        struct rdma_dec_batch_entry *batch, size_t count) {
+    int ret = 0;
+#if !NO_ENCRYPTION
+    if (get_mode(session) == SECURITY_ENCRYPT && session->supports_batches()) {
+        for (size_t i = 0; i < count; i += AES_GCM_STREAMS)
+            decrypt_streams(session, batch + i, count - i < AES_GCM_STREAMS ?
+                    count - i : AES_GCM_STREAMS);
+        for (size_t i = 0; i < count; i++)
+            ret |= batch[i].ret;
+        return ret;
+    }
+#endif // NO_ENCRYPTION
+    for (size_t i = 0; i < count; i++) {
+        batch[i].ret = decrypt_message_in_place(session,
+                &(batch[i].header), &(batch[i].payload),
+                batch[i].ciphertext, batch[i].ciphertext_len);
+        ret |= batch[i].ret;
+    }
+    return ret;
+}
+
+
+/**
+ * Tells whether decrypt_messages decrypts a message together with the other
+ * messages of a batch. Only then, a batch is faster than decrypting the
+ * messages one after the other
+ * @param session Crypto session of the batch
+ * @param ciphertext_size Size of the message
+ * @return true if the message is interleaved with others
+ */
+bool is_interleaved(CryptoSession *session, size_t ciphertext_size) {
+#if NO_ENCRYPTION
+    (void) session;
+    (void) ciphertext_size;
+    return false;
+#else
+    return get_mode(session) == SECURITY_ENCRYPT &&
+            session->supports_batches() &&
+            ciphertext_size <= IV_LEN + AES_GCM_MAX_INTERLEAVED + MAC_LEN;
+#endif // NO_ENCRYPTION
+}
+
+
+int encrypt_message(
+        const struct rdma_msg_header *header,
+        const struct rdma_enc_payload *payload,
+        unsigned char **ciphertext) {
+#if NO_ENCRYPTION
+    return encrypt_message(nullptr, header, payload, ciphertext);
+#else
+    CryptoSession *session = get_default_session();
+    if (unlikely(!session))
+        return -1;
+    return encrypt_message(session, header, payload, ciphertext);
+#endif // NO_ENCRYPTION
+}
+
+
+int decrypt_message(
+        struct rdma_msg_header *header,
+        struct rdma_dec_payload *payload,
+        const unsigned char *ciphertext, size_t ciphertext_len) {
+#if NO_ENCRYPTION
+    return decrypt_message(nullptr, header, payload, ciphertext, ciphertext_len);
+#else
+    CryptoSession *session = get_default_session();
+    if (unlikely(!session))
+        return -1;
+    return decrypt_message(
+            session, header, payload, ciphertext, ciphertext_len);
+#endif // NO_ENCRYPTION
+}
+
+
+/**
+ * Splits the value of a multi-get or multi-put request into its entries
+ * @param value Value of the request
+ * @param value_len Length of value
+ * @param op RDMA_GET or RDMA_PUT
+ * @param keys Is filled with the keys of the entries
+ * @param values Is filled with the values of the entries of a multi-put
+ * @param response_len Is set to the maximum length of the response value
+ * @return Number of entries, 0 if the request is malformed
+ */
+size_t parse_multi_request(unsigned char *value, size_t value_len,
+        uint8_t op, struct iovec *keys, struct iovec *values,
+        size_t *response_len) {
+
+    struct rdma_multi_header multi;
+    struct rdma_multi_entry entry;
+    size_t table_len, keys_len = 0, values_len = 0;
+
+    if (unlikely(value_len < sizeof(multi)))
+        return 0;
+    (void) memcpy(&multi, value, sizeof(multi));
+    if (unlikely(multi.count == 0 || multi.count > MAX_MULTI_ENTRIES))
+        return 0;
+    table_len = sizeof(multi) + multi.count * sizeof(entry);
+    if (unlikely(value_len < table_len))
+        return 0;
+
+    for (size_t i = 0; i < multi.count; i++) {
+        (void) memcpy(&entry,
+                value + sizeof(multi) + i * sizeof(entry), sizeof(entry));
+        if (unlikely(op == RDMA_GET && entry.value_len > 0))
+            return 0;
+        keys[i].iov_len = entry.key_len;
+        values[i].iov_len = entry.value_len;
+        keys_len += entry.key_len;
+        values_len += entry.value_len;
+    }
+    if (unlikely(table_len + keys_len + values_len != value_len))
+        return 0;
+
+    /* Keys and values follow the table in the order of the entries: */
+    unsigned char *key = value + table_len;
+    unsigned char *entry_value = key + keys_len;
+    for (size_t i = 0; i < multi.count; i++) {
+        keys[i].iov_base = key;
+        key += keys[i].iov_len;
+        values[i].iov_base = entry_value;
+        entry_value += values[i].iov_len;
+    }
+    *response_len = multi.response_len;
+    return multi.count;
+}
+
+
+/**
+ * Checks the response to a multi-get or multi-put against the request and
+ * copies the values of a multi-get to their destinations. Values that don't
+ * fit into their destination fail
+ * @param value Value of the response
+ * @param value_len Length of value
+ * @param op RDMA_GET or RDMA_PUT
+ * @param count Number of entries of the request
+ * @param values Destinations of the values of a multi-get, their lengths are
+ *  set to the lengths of the values
+ * @param succeeded Is set for every entry that succeeded
+ * @return 0 on success, -1 if the response is malformed
+ */
+int parse_multi_response(const unsigned char *value, size_t value_len,
+        uint8_t op, size_t count, struct iovec *values, bool *succeeded) {
+
+    struct rdma_multi_result result;
+    size_t offset = count * sizeof(result);
+
+    if (unlikely(count > MAX_MULTI_ENTRIES || value_len < offset))
+        return -1;
+    for (size_t i = 0; i < count; i++) {
+        (void) memcpy(&result, value + i * sizeof(result), sizeof(result));
+        succeeded[i] = false;
+        if (result.status != MULTI_SUCCESS)
+            continue;
+        if (op != RDMA_GET) {
+            succeeded[i] = true;
+            continue;
+        }
+        if (unlikely(result.value_len > value_len - offset))
+            return -1;
+        if (result.value_len <= values[i].iov_len) {
+            (void) memcpy(values[i].iov_base, value + offset, result.value_len);
+            values[i].iov_len = result.value_len;
+            succeeded[i] = true;
+        }
+        offset += result.value_len;
+    }
+    return offset == value_len ? 0 : -1;
+}
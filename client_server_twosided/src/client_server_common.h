@@ -1,9 +1,13 @@
 #ifndef RDMA_COMMON_METHODS
 #define RDMA_COMMON_METHODS
 
+#include <cstdint>
 #include <iostream>
+#include <sys/uio.h>
 using namespace std;
 
+class CryptoSession;
+
 /*
  * Macros for handling seq_op numbers. seq_op is 64 bit and looks like this:
  * +--------------------------+------------+------------+
@@ -28,10 +32,118 @@ using namespace std;
 #define CIPHERTEXT_SIZE(payload_size) ((payload_size) + MIN_MSG_LEN)
 #define PAYLOAD_SIZE(ciphertext_size) ((ciphertext_size) - MIN_MSG_LEN)
 
+/* Size of a message in the given security mode. Never exceeds CIPHERTEXT_SIZE */
+#define MESSAGE_SIZE(mode, payload_size) ((mode) == SECURITY_NONE ? \
+        (payload_size) + SEQ_LEN + SIZE_LEN : CIPHERTEXT_SIZE(payload_size))
+
+/*
+ * On the wire, the highest byte of key_len holds the security mode of the
+ * message, so both sides agree on it. The credits of a response follow:
+ * +-----------------------+------------------+----------------------+
+ * | Security mode (8 bit) | Credits (16 bit) | Key length (40 bit)  |
+ * +-----------------------+------------------+----------------------+
+ */
+#define MODE_SHIFT 56
+#define CREDITS_SHIFT 40
+#define KEY_LEN_MASK (((uint64_t) 1 << CREDITS_SHIFT) - 1)
+#define CREDITS_MASK (uint64_t) 0xffff
+#define MODE_FROM_KEY_LEN(key_len) ((key_len) >> MODE_SHIFT)
+#define CREDITS_FROM_KEY_LEN(key_len) \
+    ((uint16_t) (((key_len) >> CREDITS_SHIFT) & CREDITS_MASK))
+#define SET_MODE(key_len, mode) ((key_len) | ((uint64_t) (mode) << MODE_SHIFT))
+#define SET_CREDITS(key_len, credits) \
+    ((key_len) | ((uint64_t) (credits) << CREDITS_SHIFT))
+
+/*
+ * Credits of a response: The number of requests that the client may have in
+ * flight at the server, which grants them per session. 0 if the response
+ * doesn't grant any (requests, handshakes of old servers).
+ * CREDITS_REJECTED is set in an error response if the server refused the
+ * request because the client exceeded its credits or its request rate
+ */
+static constexpr uint16_t CREDITS_REJECTED = 0x8000;
+#define CREDITS_GRANTED(credits) ((uint16_t) ((credits) & ~CREDITS_REJECTED))
+
+/* Protection of the messages of a session. Is chosen by the client at
+ * connect and has to be accepted by the server */
+enum security_mode : uint8_t {
+    /* AES-GCM: header and payload are encrypted and authenticated */
+    SECURITY_ENCRYPT = 0,
+    /* GMAC: header and payload are authenticated, but sent in clear */
+    SECURITY_AUTHENTICATE = 1,
+    /* Neither encrypted nor authenticated */
+    SECURITY_NONE = 2
+};
+
+#define SECURITY_MODE_BIT(mode) ((uint8_t) (1 << (mode)))
+static constexpr uint8_t SECURITY_MODES_ALL = SECURITY_MODE_BIT(SECURITY_ENCRYPT)
+        | SECURITY_MODE_BIT(SECURITY_AUTHENTICATE)
+        | SECURITY_MODE_BIT(SECURITY_NONE);
+
+/*
+ * Every security mode has its own eRPC request type per key phase. The key
+ * phase flips with every rekeying, so requests under the old and the new
+ * session key can be told apart without trial decryption.
+ * Gets, puts, deletes and disconnects (RDMA_ERR) have request types of their
+ * own as well, so the server knows the size of the response before it
+ * decrypts the request
+ */
 static constexpr uint8_t DEFAULT_REQ_TYPE = 2;
+static constexpr uint8_t NUM_SECURITY_MODES = 3;
+static constexpr uint8_t NUM_KEY_PHASES = 2;
+static constexpr uint8_t NUM_REQ_OPS = 4;
+#define REQ_TYPE(op, mode, phase) ((uint8_t) (DEFAULT_REQ_TYPE + (mode) + \
+        ((phase) + (op) * NUM_KEY_PHASES) * NUM_SECURITY_MODES))
+/* Handshake and rekeying use the request types after the data requests: */
+#define CONTROL_REQ_TYPE(phase) ((uint8_t) (DEFAULT_REQ_TYPE + \
+        NUM_REQ_OPS * NUM_KEY_PHASES * NUM_SECURITY_MODES + (phase)))
+/* Chunks of values that don't fit into one message use the types after: */
+#define CHUNK_REQ_TYPE(mode, phase) ((uint8_t) (CONTROL_REQ_TYPE(NUM_KEY_PHASES) \
+        + (mode) + (phase) * NUM_SECURITY_MODES))
+/* Multi-gets and multi-puts use the types after the chunks: */
+#define MULTI_REQ_TYPE(mode, phase) ((uint8_t) (CHUNK_REQ_TYPE(0, \
+        NUM_KEY_PHASES) + (mode) + (phase) * NUM_SECURITY_MODES))
+#define NEXT_KEY_PHASE(phase) ((uint8_t) ((phase) ^ 1))
 
 static constexpr size_t MAX_PENDING_REQUESTS = 1024;
 
+/* How an event loop polls while it has nothing to do (see PollGovernor) */
+struct poll_config {
+    /* Empty polls in a row that are busy-polled */
+    size_t spin_polls;
+    /* Empty polls after that, each followed by a pause of the core */
+    size_t pause_polls;
+    /* Maximum sleep between two polls afterwards in us, which bounds the
+     * reaction time of an idle loop. 0 never sleeps */
+    uint32_t max_sleep;
+};
+static constexpr uint32_t MIN_POLL_SLEEP = 1;
+/* Sleeps after about a millisecond without traffic, wakes up every ms: */
+static constexpr struct poll_config DEFAULT_POLLING = { 1 << 14, 1 << 16, 1000 };
+/* Dedicates the core to the event loop: */
+static constexpr struct poll_config BUSY_POLLING = { SIZE_MAX, 0, 0 };
+
+/* Number of messages whose keystream is precomputed per session while idle
+ * (only with PRECOMPUTE_KEYSTREAM) */
+static constexpr size_t PRECOMPUTED_MESSAGES = 16;
+
+/* Partition of a key when the keys are partitioned among the server threads
+ * (see anchor_server::set_partitioned): FNV-1a of the key, mapped onto the
+ * partitions by its upper bits. Clients and partitioned KV-stores use it to
+ * find the server thread that owns a key */
+static inline uint8_t key_partition(
+        const void *key, size_t key_len, uint8_t partitions) {
+    auto bytes = static_cast<const unsigned char *>(key);
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < key_len; i++)
+        hash = (hash ^ bytes[i]) * UINT64_C(0x100000001b3);
+    return static_cast<uint8_t>(((hash >> 32) * partitions) >> 32);
+}
+
+/* Number of messages that the client encrypts under one session key before it
+ * rekeys, far below the limits of AES-GCM for a single key */
+static constexpr uint64_t REKEY_INTERVAL = (uint64_t) 1 << 32;
+
 static constexpr uint8_t RDMA_GET = 0b00;
 static constexpr uint8_t RDMA_PUT = 0b01;
 static constexpr uint8_t RDMA_DELETE = 0b10;
@@ -40,6 +152,8 @@ static constexpr uint8_t RDMA_ERR = 0b11;
 struct rdma_msg_header {
     uint64_t seq_op;
     uint64_t key_len;
+    /* Flow control of the server, see CREDITS_REJECTED */
+    uint16_t credits;
 };
 
 struct rdma_enc_payload {
@@ -54,12 +168,114 @@ struct rdma_dec_payload {
     size_t value_len;
 };
 
+/*
+ * Value of a control message. The client sends its random, the server
+ * answers with its own one. Both sides derive the session key of the next
+ * key phase from the two randoms:
+ * - CONTROL_HANDSHAKE: From the master key, directly after connecting
+ * - CONTROL_REKEY: From the current session key, while requests of the
+ *   current key phase may still be pending
+ */
+static constexpr uint8_t CONTROL_HANDSHAKE = 0;
+static constexpr uint8_t CONTROL_REKEY = 1;
+static constexpr size_t KDF_RANDOM_LEN = 16;
+
+struct rdma_control_payload {
+    uint8_t type;
+    unsigned char random[KDF_RANDOM_LEN];
+};
+
+/*
+ * Values whose message would exceed the maximum message size of eRPC are
+ * transferred in chunks of CHUNK_SIZE bytes. Every chunk is a request of its
+ * own with its own sequence number. The chunk header is sent in front of the
+ * key, so it is protected like the rest of the message and binds the chunk
+ * to its transfer:
+ * PUT request:  key = chunk header | key (only chunk 0), value = chunk data
+ * PUT response: RDMA_ERR if the chunk or the final put failed
+ * GET request:  key = chunk header | key, total_len and count are 0
+ * GET response: key = chunk header, value = chunk data
+ * The server takes a snapshot of a value when chunk 0 of its get arrives
+ * and serves the other chunks from it, so they belong to the same version
+ * Up to CHUNK_WINDOW chunks of a transfer are in flight at the same time
+ */
+static constexpr size_t CHUNK_SIZE = 1 << 16;
+static constexpr size_t CHUNK_WINDOW = 16;
+static constexpr size_t MAX_CHUNKED_TRANSFERS = 4;
+
+struct rdma_chunk_header {
+    /* Sequence number and ID of chunk 0 */
+    uint64_t transfer_seq;
+    uint64_t total_len;
+    uint32_t index;
+    uint32_t count;
+};
+
+#define CHUNK_COUNT(total_len) \
+        ((total_len) == 0 ? 1 : ((total_len) + CHUNK_SIZE - 1) / CHUNK_SIZE)
+/* Size of a chunk of a value with the given length: */
+#define CHUNK_LEN(total_len, index) \
+        ((total_len) - (index) * CHUNK_SIZE < CHUNK_SIZE ? \
+        (total_len) - (index) * CHUNK_SIZE : CHUNK_SIZE)
+/* Chunk messages fit the chunk data and up to CHUNK_SIZE bytes of chunk
+ * header and key: */
+#define CHUNK_MESSAGE_SIZE CIPHERTEXT_SIZE(2 * CHUNK_SIZE)
+
+/*
+ * Multi-gets and multi-puts carry up to MAX_MULTI_ENTRIES keys in a single
+ * message, which is encrypted and authenticated as a whole. The op in seq_op
+ * is RDMA_GET or RDMA_PUT, key_len is 0 and the value is:
+ * Request:  rdma_multi_header | count * rdma_multi_entry | keys | values
+ * Response: count * rdma_multi_result | values of the successful gets
+ * The server answers as many values as fit into response_len, the other
+ * entries fail
+ */
+static constexpr size_t MAX_MULTI_ENTRIES = 64;
+static constexpr uint32_t MULTI_SUCCESS = 0;
+static constexpr uint32_t MULTI_FAILED = 1;
+
+struct rdma_multi_header {
+    uint32_t count;
+    /* Maximum length of the value of the response */
+    uint32_t response_len;
+};
+
+struct rdma_multi_entry {
+    uint32_t key_len;
+    /* Only set for multi-puts */
+    uint32_t value_len;
+};
+
+struct rdma_multi_result {
+    uint32_t status;
+    uint32_t value_len;
+};
+
+/* A single message of a batch that is encrypted with encrypt_messages */
+struct rdma_enc_batch_entry {
+    struct rdma_msg_header header;
+    struct rdma_enc_payload payload;
+    unsigned char *ciphertext;
+    int ret;
+};
+
+/* A single message of a batch that is decrypted with decrypt_messages */
+struct rdma_dec_batch_entry {
+    struct rdma_msg_header header;
+    struct rdma_dec_payload payload;
+    unsigned char *ciphertext;
+    size_t ciphertext_len;
+    int ret;
+};
+
 
 /* Request format:
  * +----------+--------------+-----------------+-----------+------------+
  * | IV (12B) | Seq, OP (8B) | key length (8B) | key/value | GMAC (16B) |
  * +----------+--------------+-----------------+-----------+------------+
  *            |---------encrypted and authenticated--------|
+ * With SECURITY_AUTHENTICATE, the same fields are only authenticated.
+ * With SECURITY_NONE, there is neither an IV nor a GMAC.
  */
 
 /* Length of IV: 12 Byte
@@ -76,10 +292,64 @@ static constexpr size_t MIN_MSG_LEN = SEQ_LEN + SIZE_LEN;
 static constexpr size_t MIN_MSG_LEN = IV_LEN + MAC_LEN + SEQ_LEN + SIZE_LEN;
 #endif // NO_ENCRYPTION
 
+/* Control messages are always encrypted, whatever the session uses: */
+#if NO_ENCRYPTION
+static constexpr enum security_mode CONTROL_SECURITY_MODE = SECURITY_NONE;
+#else
+static constexpr enum security_mode CONTROL_SECURITY_MODE = SECURITY_ENCRYPT;
+#endif // NO_ENCRYPTION
+#define CONTROL_MESSAGE_SIZE MESSAGE_SIZE( \
+        CONTROL_SECURITY_MODE, sizeof(struct rdma_control_payload))
+
 static constexpr uint16_t kUDPPort = 31850;
 
 extern const unsigned char *enc_key;
 
+int next_iv(unsigned char *iv);
+
+int derive_session_key(CryptoSession *session, const unsigned char *input_key,
+        uint8_t type, uint8_t session_id,
+        const unsigned char *client_random, const unsigned char *server_random);
+
+int encrypt_message(CryptoSession *session,
+        const struct rdma_msg_header *header,
+        const struct rdma_enc_payload *payload, unsigned char **ciphertext);
+
+int encrypt_message_v(CryptoSession *session,
+        const struct rdma_msg_header *header, const unsigned char *key,
+        const struct iovec *value, size_t value_count,
+        unsigned char **ciphertext);
+
+int decrypt_message(CryptoSession *session,
+        struct rdma_msg_header *header,
+        struct rdma_dec_payload *payload,
+        const unsigned char *ciphertext, size_t ciphertext_len);
+
+int decrypt_message_in_place(CryptoSession *session,
+        struct rdma_msg_header *header,
+        struct rdma_dec_payload *payload,
+        unsigned char *ciphertext, size_t ciphertext_len);
+
+int encrypt_messages(CryptoSession *session,
+        struct rdma_enc_batch_entry *batch, size_t count);
+
+int decrypt_messages(CryptoSession *session,
+        struct rdma_dec_batch_entry *batch, size_t count);
+
+bool is_interleaved(CryptoSession *session, size_t ciphertext_size);
+
+/* Returns how often en-/decryption had to allocate memory in this thread */
+size_t get_payload_allocations();
+
+/* Layout of multi-operations, see MAX_MULTI_ENTRIES: */
+size_t parse_multi_request(unsigned char *value, size_t value_len,
+        uint8_t op, struct iovec *keys, struct iovec *values,
+        size_t *response_len);
+
+int parse_multi_response(const unsigned char *value, size_t value_len,
+        uint8_t op, size_t count, struct iovec *values, bool *succeeded);
+
+/* Use a thread-local session for enc_key: */
 int encrypt_message(
         const struct rdma_msg_header *header,
         const struct rdma_enc_payload *payload, unsigned char **ciphertext);
@@ -4,7 +4,7 @@
 
 #include "sent_message_tag.h"
 
-sent_message_tag::sent_message_tag() : valid{false} {}
+sent_message_tag::sent_message_tag() : key_phase{0}, valid{false} {}
 
 void sent_message_tag::validate(const void *tag,
     status_callback cb, size_t *value_size) {
@@ -7,7 +7,9 @@
 #include "client_server_common.h"
 #include "rpc.h"
 
-enum ret_val { OP_SUCCESS, OP_FAILED, TIMEOUT, INVALID_RESPONSE };
+/* OP_REJECTED: The server refused the request, because the client exceeded
+ * its credits or its request rate. The request may be sent again later */
+enum ret_val { OP_SUCCESS, OP_FAILED, TIMEOUT, INVALID_RESPONSE, OP_REJECTED };
 typedef void (*status_callback)(enum ret_val, const void *);
 
 struct sent_message_tag {
@@ -18,6 +20,8 @@ struct sent_message_tag {
     erpc::MsgBuffer request;
     erpc::MsgBuffer response;
     status_callback callback;
+    /* Key phase the request was encrypted in, the response uses the same */
+    uint8_t key_phase;
     bool valid;
 
     sent_message_tag();
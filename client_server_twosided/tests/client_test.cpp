@@ -21,6 +21,9 @@ void test_callback(enum ret_val status, const void *tag) {
             break;
         case ret_val::INVALID_RESPONSE:
             cerr << "Invalid response" << endl;
+            break;
+        case ret_val::OP_REJECTED:
+            cerr << "Rejected by admission control" << endl;
     }
 
     EXPECT_EQUAL(OP_SUCCESS, status);
@@ -2,6 +2,7 @@
 #include <cstdlib>
 #include <cstring>
 #include "Client.h"
+#include "PartitionedClient.h"
 #include "test_common.h"
 
 #if NO_KV_OVERHEAD
@@ -137,7 +138,8 @@ inline void get_random_key() {
 }
 
 #if NO_KV_OVERHEAD
-void issue_requests(Client *client) {
+template <typename KVClient>
+void issue_requests(KVClient *client) {
     /* We have all start times in an array and pass the pointers
      * to the put/get functions as a tag that is returned in the callback
      */
@@ -230,7 +232,8 @@ void issue_requests(Client *client) {
 #else // NO_KV_OVERHEAD
 
 
-void issue_requests(Client *client) {
+template <typename KVClient>
+void issue_requests(KVClient *client) {
     /* We have all start times in an array and pass the pointers
      * to the put/get functions as a tag that is returned in the callback
      */
@@ -280,32 +283,54 @@ void issue_requests(Client *client) {
 #endif // NO_KV_OVERHEAD
 
 
+/* Waits for the other threads and issues the requests of a connected
+ * client */
+template <typename KVClient>
+void start_requests(KVClient *client, uint8_t id) {
+    srand(static_cast<unsigned int>(id));
+
+    if (--countdown == 0) {
+        (void) clock_gettime(CLOCK_MONOTONIC, &total_time_begin);
+    } else {
+        while (countdown > 0);
+    }
+
+    issue_requests(client);
+}
+
 void test_thread(struct test_params *params, struct test_results *results,
         std::string *server_hostname) {
 
     key_buf = static_cast<unsigned char *>(calloc(1, KEY_SIZE));
     value_buf = static_cast<unsigned char *>(malloc(VAL_SIZE));
-    {
-        Client client{params->id, KEY_SIZE, VAL_SIZE};
-        if (!(key_buf && value_buf))
-            goto end_test_thread;
-
-        local_results = results;
-        if (0 > client.connect(
-            *server_hostname, params->port, key_do_not_use)) {
+    if (!(key_buf && value_buf))
+        goto end_test_thread;
+    local_results = results;
+
+    if (PARTITIONED) {
+        auto partitions = SERVER_THREADS ? SERVER_THREADS : NUM_CLIENTS;
+        /* Every thread has an eRPC ID per partition: */
+        PartitionedClient client{static_cast<uint8_t>(params->id * partitions),
+                partitions, KEY_SIZE, VAL_SIZE};
+        client.set_polling(POLLING);
+        if (0 > client.connect(*server_hostname, params->port, key_do_not_use,
+                static_cast<enum security_mode>(SECURITY_MODE))) {
             cerr << "Thread " << params->id
                  << ": Failed to connect to server" << endl;
-            return;
+            goto end_test_thread;
         }
-        srand(static_cast<unsigned int>(params->id));
-
-        if (--countdown == 0) {
-            (void) clock_gettime(CLOCK_MONOTONIC, &total_time_begin);
-        } else {
-            while (countdown > 0);
+        start_requests(&client, params->id);
+    } else {
+        Client client{params->id, KEY_SIZE, VAL_SIZE};
+        client.set_polling(POLLING);
+        if (0 > client.connect(*server_hostname, params->port,
+            key_do_not_use, static_cast<enum security_mode>(SECURITY_MODE),
+            SERVER_THREADS)) {
+            cerr << "Thread " << params->id
+                 << ": Failed to connect to server" << endl;
+            goto end_test_thread;
         }
-
-        issue_requests(&client);
+        start_requests(&client, params->id);
     }
 
 end_test_thread:
@@ -421,17 +446,6 @@ void print_summary(bool all, struct test_params *params,
     puts("\n");
 }
 
-bool csv_file_exists() {
-    FILE *test = fopen(PATH_CSV, "r");
-    if (!test) {
-        return false;
-    }
-    else {
-        fclose(test);
-        return true;
-    }
-}
-
 void print_summary_csv(struct test_params *params,
     struct test_results *result) {
 
@@ -0,0 +1,556 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "client_server_common.h"
+#include "CryptoSession.h"
+#include "test_common.h"
+
+/*
+ * Measures how fast messages are en- and decrypted with encrypt_message and
+ * decrypt_message, independent of the network. First, single-threaded
+ * variants of en- and decryption are compared (see run_comparisons). Then,
+ * for every value size in bench_value_sizes and every thread count up to -n,
+ * each thread en- and decrypts its own messages with its own session, once
+ * with pre-allocated buffers and once with buffers that are allocated per
+ * message.
+ * Build with -DENCRYPT=off to measure the overhead without encryption.
+ */
+
+static const size_t bench_value_sizes[] = {
+    0, 64, 256, 512, 1 << 10, 2 << 10, 4 << 10,
+    16 << 10, 64 << 10, 256 << 10, 1 << 20
+};
+
+/* Limits the messages a thread processes per configuration: */
+static constexpr size_t BENCH_BYTES_PER_THREAD = 256 << 20;
+/* Messages per variant in the single-threaded comparisons: */
+static constexpr size_t BENCH_ITERATIONS = 100000;
+
+struct bench_config {
+    uint8_t threads;
+    size_t key_size;
+    size_t value_size;
+    size_t operations;
+    bool preallocated;
+};
+
+struct bench_results {
+    uint64_t encrypt_time;
+    uint64_t decrypt_time;
+    size_t failed_ops;
+};
+
+std::atomic_uint8_t countdown;
+
+
+enum security_mode bench_security_mode() {
+#if NO_ENCRYPTION
+    return SECURITY_NONE;
+#else
+    return static_cast<enum security_mode>(SECURITY_MODE);
+#endif // NO_ENCRYPTION
+}
+
+
+/* Starts all threads of a configuration at the same time: */
+void wait_for_threads() {
+    if (--countdown > 0) {
+        while (countdown > 0)
+            std::this_thread::yield();
+    }
+}
+
+
+void bench_thread(const struct bench_config *config,
+        struct bench_results *results) {
+    struct timespec start, end;
+    struct rdma_msg_header header = { 0, config->key_size, 0 };
+    struct rdma_dec_payload dec_payload;
+    CryptoSession session(key_do_not_use);
+    session.set_security_mode(bench_security_mode());
+    size_t message_size = MESSAGE_SIZE(bench_security_mode(),
+            config->key_size + config->value_size);
+
+    auto key = static_cast<unsigned char *>(
+            malloc(std::max(config->key_size, (size_t) 1)));
+    auto value = static_cast<unsigned char *>(
+            malloc(std::max(config->value_size, (size_t) 1)));
+    auto ciphertext = static_cast<unsigned char *>(malloc(message_size));
+    auto key_buf = static_cast<unsigned char *>(
+            malloc(std::max(config->key_size, (size_t) 1)));
+    auto value_buf = static_cast<unsigned char *>(
+            malloc(std::max(config->value_size, (size_t) 1)));
+    if (!(key && value && ciphertext && key_buf && value_buf)) {
+        cerr << "Memory allocation failure" << endl;
+        results->failed_ops = config->operations;
+        wait_for_threads();
+        goto end_bench_thread;
+    }
+    value_from_key(value, config->value_size, key, config->key_size);
+    {
+        struct rdma_enc_payload enc_payload = {
+                key, value, config->value_size };
+
+        /* The decryption runs on this ciphertext: */
+        if (0 != encrypt_message(
+                &session, &header, &enc_payload, &ciphertext)) {
+            results->failed_ops = config->operations;
+            wait_for_threads();
+            goto end_bench_thread;
+        }
+
+        wait_for_threads();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < config->operations; i++) {
+            unsigned char *out = config->preallocated ? ciphertext : nullptr;
+            header.seq_op = i << 10;
+            if (0 != encrypt_message(&session, &header, &enc_payload, &out))
+                results->failed_ops++;
+            else if (!config->preallocated)
+                free(out);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        results->encrypt_time = time_diff(&start, &end);
+    }
+
+    /* The last encrypted message is decrypted over and over: */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < config->operations; i++) {
+        if (config->preallocated)
+            dec_payload = { key_buf, value_buf, 0 };
+        else
+            dec_payload = { nullptr, nullptr, 0 };
+        if (0 != decrypt_message(&session,
+                &header, &dec_payload, ciphertext, message_size))
+            results->failed_ops++;
+        if (!config->preallocated) {
+            free(dec_payload.key);
+            free(dec_payload.value);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    results->decrypt_time = time_diff(&start, &end);
+
+end_bench_thread:
+    free(key);
+    free(value);
+    free(ciphertext);
+    free(key_buf);
+    free(value_buf);
+}
+
+
+void print_summary_csv(const struct bench_config *config,
+        double encrypt_latency, double encrypt_throughput,
+        double decrypt_latency, double decrypt_throughput) {
+
+    bool file_exists = csv_file_exists();
+    FILE *csv = fopen(PATH_CSV, "a");
+    if (!csv) {
+        fprintf(stderr, "Could not open CSV file at %s\n", PATH_CSV);
+        return;
+    }
+
+    if (!file_exists) {
+        fputs(
+            "Threads,Key Size,Value size,Security Mode,Encryption,"
+            "Preallocated,Operations/Thread,,"
+            "Encrypt Latency(ns),Encrypt Throughput(GB/s),,"
+            "Decrypt Latency(ns),Decrypt Throughput(GB/s)\n",
+            csv);
+    }
+
+    // Threads, Key Size, Value Size, Security Mode, Encryption,
+    // Preallocated, Operations/Thread
+    fprintf(csv, "%u,%zu,%zu,%u,%u,%u,%zu,,",
+        config->threads, config->key_size, config->value_size,
+        static_cast<unsigned>(bench_security_mode()), !NO_ENCRYPTION,
+        config->preallocated, config->operations);
+
+    // Encrypt Latency, Encrypt Throughput
+    fprintf(csv, "%f,%f,,", encrypt_latency, encrypt_throughput);
+
+    // Decrypt Latency, Decrypt Throughput
+    fprintf(csv, "%f,%f\n", decrypt_latency, decrypt_throughput);
+
+    fclose(csv);
+}
+
+
+/**
+ * Runs one configuration in config->threads threads and prints the results
+ * @return 0 on success, -1 if a message couldn't be en- or decrypted
+ */
+int run_bench(const struct bench_config *config) {
+    std::vector<struct bench_results> results(config->threads,
+            { 0, 0, 0 });
+    std::vector<std::thread> threads;
+    uint64_t encrypt_time = 0, decrypt_time = 0;
+    uint64_t encrypt_wall = 0, decrypt_wall = 0;
+    size_t failed_ops = 0;
+
+    countdown = config->threads;
+    for (uint8_t i = 1; i < config->threads; i++)
+        threads.emplace_back(bench_thread, config, &results[i]);
+    bench_thread(config, &results[0]);
+    for (auto& thread : threads)
+        thread.join();
+
+    for (const auto& result : results) {
+        encrypt_time += result.encrypt_time;
+        decrypt_time += result.decrypt_time;
+        encrypt_wall = std::max(encrypt_wall, result.encrypt_time);
+        decrypt_wall = std::max(decrypt_wall, result.decrypt_time);
+        failed_ops += result.failed_ops;
+    }
+    if (failed_ops > 0) {
+        fprintf(stderr, "%zu operations failed\n", failed_ops);
+        return -1;
+    }
+
+    auto total_ops = static_cast<double>(config->threads * config->operations);
+    double total_bytes = total_ops *
+            static_cast<double>(config->key_size + config->value_size);
+    /* Average time of a single operation in a thread: */
+    double encrypt_latency = static_cast<double>(encrypt_time) / total_ops;
+    double decrypt_latency = static_cast<double>(decrypt_time) / total_ops;
+    /* Payload bytes of all threads, Bytes/ns = GB/s: */
+    double encrypt_throughput =
+            total_bytes / static_cast<double>(std::max(encrypt_wall, 1ul));
+    double decrypt_throughput =
+            total_bytes / static_cast<double>(std::max(decrypt_wall, 1ul));
+
+    printf("Threads: %u, Key: %zu B, Value: %zu B, %s: "
+           "Encrypt %f ns/op, %f GB/s, Decrypt %f ns/op, %f GB/s\n",
+        config->threads, config->key_size, config->value_size,
+        config->preallocated ? "pre-allocated" : "malloc",
+        encrypt_latency, encrypt_throughput,
+        decrypt_latency, decrypt_throughput);
+
+    if (PATH_CSV)
+        print_summary_csv(config, encrypt_latency, encrypt_throughput,
+                decrypt_latency, decrypt_throughput);
+    return 0;
+}
+
+
+/* Returns the average time in ns for sending and receiving a message in
+ * the given security mode */
+double benchmark_security_mode(enum security_mode mode,
+        const unsigned char *key, size_t key_size,
+        const unsigned char *value, size_t value_size) {
+
+    struct rdma_msg_header enc_header = { 40 | RDMA_PUT, key_size, 0 };
+    struct rdma_msg_header dec_header;
+    struct rdma_enc_payload enc_payload = { key, value, value_size };
+    size_t message_size = MESSAGE_SIZE(mode, key_size + value_size);
+    auto *message = static_cast<unsigned char *>(malloc(message_size));
+    struct rdma_dec_payload dec_payload;
+    struct timespec begin, end;
+    double ret = -1.0;
+    CryptoSession session{key_do_not_use};
+
+    session.set_security_mode(mode);
+    if (!message)
+        goto end_benchmark_security_mode;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+        if (0 != encrypt_message(&session,
+                &enc_header, &enc_payload, &message) ||
+            0 != decrypt_message_in_place(&session, &dec_header,
+                &dec_payload, message, message_size)) {
+            cerr << "En- or decryption failed" << endl;
+            goto end_benchmark_security_mode;
+        }
+    }
+    (void) clock_gettime(CLOCK_MONOTONIC, &end);
+    ret = static_cast<double>(time_diff(&begin, &end)) / BENCH_ITERATIONS;
+
+end_benchmark_security_mode:
+    free(message);
+    return ret;
+}
+
+
+/* Returns the average time in ns for encrypting a message. If precompute is
+ * true, the keystream of every message is precomputed outside of the
+ * measured time, as it would be in an idle event loop iteration */
+double benchmark_precomputation(bool precompute,
+        const unsigned char *key, size_t key_size,
+        const unsigned char *value, size_t value_size) {
+
+    struct rdma_msg_header header = { 40 | RDMA_PUT, key_size, 0 };
+    struct rdma_enc_payload payload = { key, value, value_size };
+    auto *ciphertext = static_cast<unsigned char *>(
+            malloc(CIPHERTEXT_SIZE(key_size + value_size)));
+    struct timespec begin, end;
+    uint64_t total = 0;
+    double ret = -1.0;
+    CryptoSession session;
+
+    if (!ciphertext || 0 != session.set_key(key_do_not_use) ||
+            0 != session.enable_precomputation(precompute ? 1 : 0))
+        goto end_benchmark_precomputation;
+
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+        (void) session.precompute_keystreams();
+        (void) clock_gettime(CLOCK_MONOTONIC, &begin);
+        if (0 != encrypt_message(&session, &header, &payload, &ciphertext)) {
+            cerr << "Encryption failed" << endl;
+            goto end_benchmark_precomputation;
+        }
+        (void) clock_gettime(CLOCK_MONOTONIC, &end);
+        total += time_diff(&begin, &end);
+    }
+    ret = static_cast<double>(total) / BENCH_ITERATIONS;
+
+end_benchmark_precomputation:
+    free(ciphertext);
+    return ret;
+}
+
+
+/* Returns the average time in ns for encrypting and decrypting a message.
+ * If reuse_session is false, a new CryptoSession is created for every message,
+ * which means that the key is expanded for every message */
+double benchmark_session(bool reuse_session, enum aes_gcm_impl impl,
+        const unsigned char *key, size_t key_size,
+        const unsigned char *value, size_t value_size) {
+
+    struct rdma_msg_header enc_header = { 40 | RDMA_PUT, key_size, 0 };
+    struct rdma_msg_header dec_header;
+    struct rdma_enc_payload enc_payload = { key, value, value_size };
+    size_t ciphertext_size = CIPHERTEXT_SIZE(key_size + value_size);
+    auto *ciphertext = static_cast<unsigned char *>(malloc(ciphertext_size));
+    auto *dec_key = static_cast<unsigned char *>(malloc(key_size));
+    auto *dec_value = static_cast<unsigned char *>(malloc(value_size));
+    struct rdma_dec_payload dec_payload = { dec_key, dec_value, 0 };
+    struct timespec begin, end;
+    double ret = -1.0;
+    CryptoSession session;
+
+    if (!(ciphertext && dec_key && dec_value) ||
+            0 != session.set_key(key_do_not_use, impl))
+        goto end_benchmark_session;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+        if (!reuse_session)
+            (void) session.set_key(key_do_not_use, impl);
+        if (0 != encrypt_message(&session,
+                &enc_header, &enc_payload, &ciphertext) ||
+            0 != decrypt_message(&session, &dec_header,
+                &dec_payload, ciphertext, ciphertext_size)) {
+            cerr << "En- or decryption failed" << endl;
+            goto end_benchmark_session;
+        }
+    }
+    (void) clock_gettime(CLOCK_MONOTONIC, &end);
+    ret = static_cast<double>(time_diff(&begin, &end)) / BENCH_ITERATIONS;
+
+end_benchmark_session:
+    free(ciphertext);
+    free(dec_key);
+    free(dec_value);
+    return ret;
+}
+
+
+/* Returns the time of en- and decrypting a message in batches of 32
+ * messages with the given value size, in ns. Without batched, the messages
+ * of a batch are en- and decrypted one after the other */
+double benchmark_batch(bool batched, enum aes_gcm_impl impl,
+        const unsigned char *value, size_t value_size) {
+    const size_t count = 32;
+    struct rdma_enc_batch_entry enc_batch[count];
+    struct rdma_dec_batch_entry dec_batch[count];
+    struct timespec begin, end;
+    double ret = -1.0;
+    CryptoSession session;
+
+    for (size_t i = 0; i < count; i++) {
+        enc_batch[i].header = { (i << 10) | RDMA_PUT, 0, 0 };
+        enc_batch[i].payload = { nullptr, value, value_size };
+        enc_batch[i].ciphertext = static_cast<unsigned char *>(
+                malloc(CIPHERTEXT_SIZE(value_size)));
+        dec_batch[i].ciphertext = enc_batch[i].ciphertext;
+        dec_batch[i].ciphertext_len = CIPHERTEXT_SIZE(value_size);
+        if (!enc_batch[i].ciphertext)
+            goto end_benchmark_batch;
+    }
+    if (0 != session.set_key(key_do_not_use, impl))
+        goto end_benchmark_batch;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (size_t n = 0; n < BENCH_ITERATIONS / count; n++) {
+        if (batched) {
+            if (0 != encrypt_messages(&session, enc_batch, count) ||
+                    0 != decrypt_messages(&session, dec_batch, count))
+                goto end_benchmark_batch;
+            continue;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (0 != encrypt_message(&session, &(enc_batch[i].header),
+                    &(enc_batch[i].payload), &(enc_batch[i].ciphertext)) ||
+                    0 != decrypt_message_in_place(&session,
+                    &(dec_batch[i].header), &(dec_batch[i].payload),
+                    dec_batch[i].ciphertext, dec_batch[i].ciphertext_len))
+                goto end_benchmark_batch;
+        }
+    }
+    (void) clock_gettime(CLOCK_MONOTONIC, &end);
+    ret = static_cast<double>(time_diff(&begin, &end)) /
+            static_cast<double>(BENCH_ITERATIONS / count * count);
+
+end_benchmark_batch:
+    for (size_t i = 0; i < count; i++)
+        free(enc_batch[i].ciphertext);
+    return ret;
+}
+
+
+/**
+ * Compares single-threaded variants of en- and decryption: key expansion per
+ * message, the security modes, precomputed keystreams, the AES-GCM
+ * implementations and batches. Each one is measured over BENCH_ITERATIONS
+ * messages
+ * @return 0 on success, -1 if a message couldn't be en- or decrypted
+ */
+int run_comparisons() {
+    std::vector<unsigned char> key(8, 0x4b), value(16384, 0x56);
+
+    printf("Key expansion per message vs. reused session, %s:\n",
+            aes_gcm_impl_name(aes_gcm_best_impl()));
+    for (size_t size : { 64ul, 256ul, 1024ul, 4096ul }) {
+        double new_session = benchmark_session(false, aes_gcm_best_impl(),
+                key.data(), key.size(), value.data(), size);
+        double reused_session = benchmark_session(true, aes_gcm_best_impl(),
+                key.data(), key.size(), value.data(), size);
+        if (new_session < 0 || reused_session < 0)
+            return -1;
+        printf("Value size %4zu: new session: %8.1f ns/op, "
+               "reused session: %8.1f ns/op\n",
+               size, new_session, reused_session);
+    }
+
+#if !NO_ENCRYPTION
+    printf("Security modes:\n");
+    for (size_t size : { 64ul, 1024ul, 16384ul }) {
+        double times[SECURITY_NONE + 1];
+        for (int mode = SECURITY_ENCRYPT; mode <= SECURITY_NONE; mode++) {
+            times[mode] = benchmark_security_mode(
+                    static_cast<enum security_mode>(mode),
+                    key.data(), key.size(), value.data(), size);
+            if (times[mode] < 0)
+                return -1;
+        }
+        printf("Value size %5zu: encrypt: %8.1f ns/op, authenticate: %8.1f "
+               "ns/op, none: %8.1f ns/op\n", size, times[SECURITY_ENCRYPT],
+               times[SECURITY_AUTHENTICATE], times[SECURITY_NONE]);
+    }
+#endif // NO_ENCRYPTION
+
+    if (aes_gcm_best_impl() != AES_GCM_OPENSSL) {
+        printf("Encryption with precomputed keystreams:\n");
+        for (size_t size : { 16ul, 64ul, 200ul, 1024ul }) {
+            double computed = benchmark_precomputation(false,
+                    key.data(), key.size(), value.data(), size);
+            double precomputed = benchmark_precomputation(true,
+                    key.data(), key.size(), value.data(), size);
+            if (computed < 0 || precomputed < 0)
+                return -1;
+            printf("Value size %4zu: computed: %8.1f ns/op, "
+                   "precomputed: %8.1f ns/op\n",
+                   size, computed, precomputed);
+        }
+    }
+
+    printf("AES-GCM implementations:\n");
+    for (int impl = AES_GCM_OPENSSL; impl <= aes_gcm_best_impl(); impl++) {
+        for (size_t size : { 64ul, 1024ul, 16384ul }) {
+            double time = benchmark_session(true,
+                    static_cast<enum aes_gcm_impl>(impl),
+                    key.data(), key.size(), value.data(), size);
+            if (time < 0)
+                return -1;
+            printf("%-8s value size %5zu: %8.1f ns/op\n",
+                    aes_gcm_impl_name(static_cast<enum aes_gcm_impl>(impl)),
+                    size, time);
+        }
+    }
+
+    printf("Batched vs. single en-/decryption:\n");
+    for (int impl = AES_GCM_AESNI; impl <= aes_gcm_best_impl(); impl++) {
+        for (size_t size : { 0ul, 64ul, 200ul, 1024ul }) {
+            double single = benchmark_batch(false,
+                    static_cast<enum aes_gcm_impl>(impl), value.data(), size);
+            double batched = benchmark_batch(true,
+                    static_cast<enum aes_gcm_impl>(impl), value.data(), size);
+            if (single < 0 || batched < 0)
+                return -1;
+            printf("%-8s value size %4zu: single %6.1f ns/op, "
+                   "batched %6.1f ns/op\n",
+                    aes_gcm_impl_name(static_cast<enum aes_gcm_impl>(impl)),
+                    size, single, batched);
+        }
+    }
+    return 0;
+}
+
+
+/* Thread counts are doubled up to NUM_CLIENTS, returns 0 after the last */
+uint8_t next_thread_count(uint8_t threads) {
+    if (threads >= NUM_CLIENTS)
+        return 0;
+    return static_cast<uint8_t>(std::min(2 * threads, (int) NUM_CLIENTS));
+}
+
+
+void print_usage(const char *argv0) {
+    cout << "Usage: " << argv0 << " [options]\n"
+            "Uses -k as key size, -n as maximum number of threads, "
+            "-p as maximum number of operations per thread, -m and -f"
+            << endl;
+    global_test_params::print_options();
+}
+
+
+int main(int argc, const char *argv[]) {
+    if (0 != global_params.parse_args(argc - 1, argv + 1)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (NUM_CLIENTS == 0 || SECURITY_MODE >= NUM_SECURITY_MODES) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    printf("Encryption: %s, Security mode: %u\n",
+        NO_ENCRYPTION ? "off" : "on",
+        static_cast<unsigned>(bench_security_mode()));
+    if (0 != run_comparisons())
+        return 1;
+
+    for (uint8_t threads = 1; threads > 0;
+            threads = next_thread_count(threads)) {
+        for (size_t value_size : bench_value_sizes) {
+            size_t message_size = CIPHERTEXT_SIZE(KEY_SIZE + value_size);
+            size_t operations = std::max((size_t) 1, std::min(
+                    TOTAL_PUTS, BENCH_BYTES_PER_THREAD / message_size));
+            for (bool preallocated : { true, false }) {
+                struct bench_config config = { threads, KEY_SIZE,
+                        value_size, operations, preallocated };
+                if (0 != run_bench(&config))
+                    return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -1,11 +1,31 @@
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
 #include <stdlib.h>
+#include <openssl/rand.h>
 
 #include "client_server_common.h"
+#include "CryptoSession.h"
+#include "ServerSession.h"
 #include "simple_unit_test.h"
 #include "test_common.h"
+#include "WorkQueue.h"
 
 #define MAX_TEST_SIZE (1 << 16)
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+CryptoSession default_test_session{key_do_not_use};
+
+
+static inline bool headers_equal(const struct rdma_msg_header *a,
+        const struct rdma_msg_header *b) {
+    return a->seq_op == b->seq_op && a->key_len == b->key_len &&
+            a->credits == b->credits;
+}
 
 
 int test_pre_alloc(size_t key_size, size_t value_size,
@@ -48,7 +68,7 @@ int single_test_encryption(bool pre_alloc,
         const unsigned char *value, size_t value_size) {
 
     int ret = -1;
-    struct rdma_msg_header enc_header = { 40 | RDMA_GET, key_size };
+    struct rdma_msg_header enc_header = { 40 | RDMA_GET, key_size, 0 };
     struct rdma_msg_header dec_header;
     struct rdma_enc_payload enc_payload = { key, value, value_size };
     struct rdma_dec_payload dec_payload;
@@ -67,18 +87,26 @@ int single_test_encryption(bool pre_alloc,
     }
 
     int header_cmp, key_cmp, value_cmp;
+    size_t allocations_before;
 
     if (0 != encrypt_message(&enc_header, &enc_payload, &ciphertext)) {
         cerr << "Encryption failed" << endl;
         goto end_test_encryption;
     }
+    allocations_before = get_payload_allocations();
     if (0 != decrypt_message(&dec_header,
             &dec_payload, ciphertext, ciphertext_size)) {
         cerr << "Decryption failed" << endl;
         goto end_test_encryption;
     }
+    /* Pre-allocated buffers must be used as they are: */
+    if (pre_alloc && get_payload_allocations() != allocations_before) {
+        cerr << "Decryption allocated memory despite pre-allocated buffers"
+             << endl;
+        goto end_test_encryption;
+    }
 
-    header_cmp = memcmp(&enc_header, &dec_header, sizeof(struct rdma_msg_header));
+    header_cmp = !headers_equal(&enc_header, &dec_header);
     key_cmp = memcmp(key, dec_payload.key, dec_header.key_len);
     value_cmp = memcmp(value, dec_payload.value, dec_payload.value_len);
     if (header_cmp || key_cmp || value_cmp ||
@@ -111,6 +139,959 @@ void execute_tests(unsigned char *key, size_t key_size, unsigned char *value, si
 }
 
 
+/* Encrypts a batch of messages with different sizes and decrypts it in place */
+int test_batch(const unsigned char *key, const unsigned char *value,
+        size_t count) {
+    int ret = -1;
+    struct rdma_enc_batch_entry enc_batch[32];
+    struct rdma_dec_batch_entry dec_batch[32];
+    size_t allocations_before;
+
+    for (size_t i = 0; i < count; i++) {
+        enc_batch[i].header = { (i << 10) | RDMA_PUT, i,
+                static_cast<uint16_t>(i) };
+        enc_batch[i].payload = { key, value, 2 * i };
+        enc_batch[i].ciphertext = static_cast<unsigned char *>(
+                malloc(CIPHERTEXT_SIZE(3 * i)));
+    }
+    if (0 != encrypt_messages(&default_test_session, enc_batch, count)) {
+        cerr << "Batch encryption failed" << endl;
+        goto end_test_batch;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        dec_batch[i].ciphertext = enc_batch[i].ciphertext;
+        dec_batch[i].ciphertext_len = CIPHERTEXT_SIZE(3 * i);
+    }
+    allocations_before = get_payload_allocations();
+    if (0 != decrypt_messages(&default_test_session, dec_batch, count)) {
+        cerr << "Batch decryption failed" << endl;
+        goto end_test_batch;
+    }
+    if (get_payload_allocations() != allocations_before) {
+        cerr << "In-place decryption allocated memory" << endl;
+        goto end_test_batch;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!headers_equal(&(enc_batch[i].header), &(dec_batch[i].header)) ||
+                dec_batch[i].payload.value_len != 2 * i ||
+                memcmp(key, dec_batch[i].payload.key, i) ||
+                memcmp(value, dec_batch[i].payload.value, 2 * i)) {
+            cerr << "Batch en- or decryption doesn't work correctly" << endl;
+            goto end_test_batch;
+        }
+    }
+    ret = 0;
+
+end_test_batch:
+    for (size_t i = 0; i < count; i++)
+        free(enc_batch[i].ciphertext);
+    return ret;
+}
+
+/* Encrypts a batch of messages with the given implementation and decrypts
+ * every message on its own with OpenSSL and vice versa. Values grow by
+ * stride bytes per message, so short and long messages are mixed. The tag
+ * of one message is modified, which must only fail this message */
+int test_native_batch(enum aes_gcm_impl impl, const unsigned char *key,
+        const unsigned char *value, size_t count, size_t stride) {
+    int ret = -1;
+    CryptoSession native, openssl;
+    struct rdma_enc_batch_entry enc_batch[32];
+    struct rdma_dec_batch_entry dec_batch[32];
+    size_t modified = count / 2;
+
+    for (size_t i = 0; i < count; i++)
+        enc_batch[i].ciphertext = nullptr;
+    if (count > 32 || 0 != native.set_key(key_do_not_use, impl) ||
+            0 != openssl.set_key(key_do_not_use, AES_GCM_OPENSSL) ||
+            !native.supports_batches())
+        goto end_test_native_batch;
+
+    for (size_t i = 0; i < count; i++) {
+        enc_batch[i].header = { (i << 10) | RDMA_PUT, i % 8,
+                static_cast<uint16_t>(i) };
+        enc_batch[i].payload = { key, value, i * stride };
+        enc_batch[i].ciphertext = static_cast<unsigned char *>(
+                malloc(CIPHERTEXT_SIZE(i % 8 + i * stride)));
+        if (!enc_batch[i].ciphertext)
+            goto end_test_native_batch;
+    }
+    if (0 != encrypt_messages(&native, enc_batch, count))
+        goto end_test_native_batch;
+    for (size_t i = 0; i < count; i++) {
+        struct rdma_msg_header header;
+        struct rdma_dec_payload payload = { nullptr, nullptr, 0 };
+        int dec_ret = decrypt_message(&openssl, &header, &payload,
+                enc_batch[i].ciphertext, CIPHERTEXT_SIZE(i % 8 + i * stride));
+        bool equal = dec_ret == 0 &&
+                headers_equal(&(enc_batch[i].header), &header) &&
+                payload.value_len == i * stride &&
+                0 == memcmp(key, payload.key, i % 8) &&
+                0 == memcmp(value, payload.value, i * stride);
+        free(payload.key);
+        free(payload.value);
+        if (!equal) {
+            cerr << aes_gcm_impl_name(impl) << ": batch differs from OpenSSL"
+                    << " (message " << i << ")" << endl;
+            goto end_test_native_batch;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (0 != encrypt_message(&openssl, &(enc_batch[i].header),
+                &(enc_batch[i].payload), &(enc_batch[i].ciphertext)))
+            goto end_test_native_batch;
+        dec_batch[i].ciphertext = enc_batch[i].ciphertext;
+        dec_batch[i].ciphertext_len = CIPHERTEXT_SIZE(i % 8 + i * stride);
+    }
+    dec_batch[modified].ciphertext[dec_batch[modified].ciphertext_len - 1] ^= 1;
+    if (0 == decrypt_messages(&native, dec_batch, count))
+        goto end_test_native_batch;
+    for (size_t i = 0; i < count; i++) {
+        if (i == modified) {
+            if (dec_batch[i].ret == 0)
+                goto end_test_native_batch;
+            continue;
+        }
+        if (dec_batch[i].ret != 0 ||
+                !headers_equal(&(enc_batch[i].header), &(dec_batch[i].header)) ||
+                dec_batch[i].payload.value_len != i * stride ||
+                memcmp(key, dec_batch[i].payload.key, i % 8) ||
+                memcmp(value, dec_batch[i].payload.value, i * stride)) {
+            cerr << aes_gcm_impl_name(impl) << ": batch decryption failed"
+                    << " (message " << i << ")" << endl;
+            goto end_test_native_batch;
+        }
+    }
+    ret = 0;
+
+end_test_native_batch:
+    for (size_t i = 0; i < count; i++)
+        free(enc_batch[i].ciphertext);
+    return ret;
+}
+
+
+
+/* En- and decrypts data of the given size with the given implementation and
+ * OpenSSL, split into update calls of split bytes. Checks that the ciphertext
+ * and the tag are identical and that a modified tag is detected */
+int test_native_impl(enum aes_gcm_impl impl, const unsigned char *data,
+        size_t size, size_t split) {
+    int ret = -1;
+    CryptoSession native, openssl;
+    const unsigned char test_iv[IV_LEN] = {
+            1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, static_cast<unsigned char>(size) };
+    auto *expected = static_cast<unsigned char *>(malloc(size + MAC_LEN));
+    auto *actual = static_cast<unsigned char *>(malloc(size + MAC_LEN));
+
+    if (!(expected && actual) ||
+            0 != native.set_key(key_do_not_use, impl) ||
+            0 != openssl.set_key(key_do_not_use, AES_GCM_OPENSSL) ||
+            native.get_impl() != impl)
+        goto end_test_native_impl;
+
+    if (0 != openssl.init_encryption(test_iv) ||
+            0 != openssl.encrypt_update(data, size, expected) ||
+            0 != openssl.finish_encryption(expected + size))
+        goto end_test_native_impl;
+
+    if (0 != native.init_encryption(test_iv))
+        goto end_test_native_impl;
+    for (size_t pos = 0; pos < size; pos += split) {
+        if (0 != native.encrypt_update(
+                data + pos, MIN(split, size - pos), actual + pos))
+            goto end_test_native_impl;
+    }
+    if (0 != native.finish_encryption(actual + size) ||
+            0 != memcmp(expected, actual, size + MAC_LEN)) {
+        cerr << aes_gcm_impl_name(impl) << ": ciphertext differs from OpenSSL"
+                << " (size " << size << ", split " << split << ")" << endl;
+        goto end_test_native_impl;
+    }
+
+    /* Decrypt in place: */
+    if (0 != native.init_decryption(test_iv, expected + size))
+        goto end_test_native_impl;
+    for (size_t pos = 0; pos < size; pos += split) {
+        if (0 != native.decrypt_update(
+                actual + pos, MIN(split, size - pos), actual + pos))
+            goto end_test_native_impl;
+    }
+    if (0 != native.finish_decryption() || 0 != memcmp(data, actual, size)) {
+        cerr << aes_gcm_impl_name(impl) << ": decryption failed" << endl;
+        goto end_test_native_impl;
+    }
+
+    expected[size] ^= 1;
+    if (0 != native.init_decryption(test_iv, expected + size) ||
+            0 != native.decrypt_update(expected, size, actual) ||
+            0 == native.finish_decryption())
+        goto end_test_native_impl;
+    ret = 0;
+
+end_test_native_impl:
+    free(expected);
+    free(actual);
+    return ret;
+}
+
+
+/* Authenticates size bytes of additional data followed by a few encrypted
+ * bytes with the given implementation and OpenSSL. The additional data is
+ * split into update calls of split bytes */
+int test_native_aad(enum aes_gcm_impl impl, const unsigned char *data,
+        size_t size, size_t split) {
+    const size_t encrypted_size = 5;
+    CryptoSession native, openssl;
+    const unsigned char test_iv[IV_LEN] = {
+            12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, static_cast<unsigned char>(size) };
+    unsigned char expected[encrypted_size + MAC_LEN];
+    unsigned char actual[encrypted_size + MAC_LEN];
+
+    if (0 != native.set_key(key_do_not_use, impl) ||
+            0 != openssl.set_key(key_do_not_use, AES_GCM_OPENSSL))
+        return -1;
+
+    if (0 != openssl.init_encryption(test_iv) ||
+            0 != openssl.encrypt_aad_update(data, size) ||
+            0 != openssl.encrypt_update(data, encrypted_size, expected) ||
+            0 != openssl.finish_encryption(expected + encrypted_size))
+        return -1;
+
+    if (0 != native.init_encryption(test_iv))
+        return -1;
+    for (size_t pos = 0; pos < size; pos += split) {
+        if (0 != native.encrypt_aad_update(data + pos, MIN(split, size - pos)))
+            return -1;
+    }
+    if (0 != native.encrypt_update(data, encrypted_size, actual) ||
+            0 != native.finish_encryption(actual + encrypted_size))
+        return -1;
+    if (0 != memcmp(expected, actual, encrypted_size + MAC_LEN)) {
+        cerr << aes_gcm_impl_name(impl) << ": tag over AAD differs from OpenSSL"
+                << " (size " << size << ", split " << split << ")" << endl;
+        return -1;
+    }
+
+    /* Only the additional data is authenticated (GMAC): */
+    if (0 != openssl.init_encryption(test_iv) ||
+            0 != openssl.encrypt_aad_update(data, size) ||
+            0 != openssl.finish_encryption(expected) ||
+            0 != native.init_encryption(test_iv) ||
+            0 != native.encrypt_aad_update(data, size) ||
+            0 != native.finish_encryption(actual) ||
+            0 != memcmp(expected, actual, MAC_LEN))
+        return -1;
+    return 0;
+}
+
+
+/* Sends a message in the given security mode and checks that it can only be
+ * read by a session in the same mode. For SECURITY_AUTHENTICATE, the payload
+ * has to be readable in the message and modifications have to be detected */
+int test_security_mode(enum security_mode mode,
+        const unsigned char *key, size_t key_size,
+        const unsigned char *value, size_t value_size) {
+    int ret = -1;
+    CryptoSession sender{key_do_not_use}, receiver{key_do_not_use};
+    struct rdma_msg_header enc_header =
+            { 40 | RDMA_PUT, key_size, CREDITS_REJECTED | 42 };
+    struct rdma_msg_header dec_header;
+    struct rdma_enc_payload enc_payload = { key, value, value_size };
+    struct rdma_dec_payload dec_payload;
+    size_t message_size = MESSAGE_SIZE(mode, key_size + value_size);
+    auto *message = static_cast<unsigned char *>(malloc(message_size));
+
+    sender.set_security_mode(mode);
+    if (!message || 0 != encrypt_message(
+            &sender, &enc_header, &enc_payload, &message))
+        goto end_test_security_mode;
+
+    for (int other = SECURITY_ENCRYPT; other <= SECURITY_NONE; other++) {
+        if (other == mode)
+            continue;
+        receiver.set_security_mode(static_cast<enum security_mode>(other));
+        dec_payload = { nullptr, nullptr, 0 };
+        if (0 == decrypt_message(&receiver, &dec_header,
+                &dec_payload, message, message_size)) {
+            cerr << "Message was accepted in the wrong security mode" << endl;
+            free(dec_payload.key);
+            free(dec_payload.value);
+            goto end_test_security_mode;
+        }
+    }
+
+    if (mode == SECURITY_AUTHENTICATE && key_size > 0) {
+        unsigned char *sent_key =
+                message + IV_LEN + SEQ_LEN + SIZE_LEN;
+        if (0 != memcmp(key, sent_key, key_size))
+            goto end_test_security_mode;
+        sent_key[0] ^= 1;
+        receiver.set_security_mode(mode);
+        dec_payload = { nullptr, nullptr, 0 };
+        if (0 == decrypt_message(&receiver, &dec_header,
+                &dec_payload, message, message_size)) {
+            cerr << "Modified message was accepted" << endl;
+            free(dec_payload.key);
+            free(dec_payload.value);
+            goto end_test_security_mode;
+        }
+        sent_key[0] ^= 1;
+    }
+
+    receiver.set_security_mode(mode);
+    if (0 != decrypt_message_in_place(&receiver, &dec_header,
+            &dec_payload, message, message_size))
+        goto end_test_security_mode;
+    if (!headers_equal(&enc_header, &dec_header) ||
+            dec_payload.value_len != value_size ||
+            (key_size > 0 && memcmp(key, dec_payload.key, key_size)) ||
+            (value_size > 0 && memcmp(value, dec_payload.value, value_size))) {
+        cerr << "Message in security mode " << mode << " was not received"
+                << " correctly" << endl;
+        goto end_test_security_mode;
+    }
+    ret = 0;
+
+end_test_security_mode:
+    free(message);
+    return ret;
+}
+
+
+/* Encrypts a value that is split into fragments of fragment_size bytes, with
+ * an empty fragment in between, and checks that it is received as a whole */
+int test_scatter_gather(enum security_mode mode,
+        const unsigned char *key, size_t key_size,
+        const unsigned char *value, size_t value_size, size_t fragment_size) {
+    int ret = -1;
+    CryptoSession sender{key_do_not_use}, receiver{key_do_not_use};
+    struct rdma_msg_header enc_header = { 40 | RDMA_PUT, key_size, 0 };
+    struct rdma_msg_header dec_header;
+    struct rdma_dec_payload dec_payload = { nullptr, nullptr, 0 };
+    std::vector<struct iovec> fragments;
+    size_t message_size = MESSAGE_SIZE(mode, key_size + value_size);
+    auto *message = static_cast<unsigned char *>(malloc(message_size));
+
+    for (size_t offset = 0; offset < value_size; offset += fragment_size) {
+        fragments.push_back({ const_cast<unsigned char *>(value) + offset,
+                std::min(fragment_size, value_size - offset) });
+        if (fragments.size() == 2)
+            fragments.push_back({ nullptr, 0 });
+    }
+
+    sender.set_security_mode(mode);
+    receiver.set_security_mode(mode);
+    if (!message || 0 != encrypt_message_v(&sender, &enc_header, key,
+            fragments.data(), fragments.size(), &message))
+        goto end_test_scatter_gather;
+    if (0 != decrypt_message_in_place(&receiver, &dec_header,
+            &dec_payload, message, message_size))
+        goto end_test_scatter_gather;
+    if (dec_payload.value_len != value_size ||
+            (key_size > 0 && memcmp(key, dec_payload.key, key_size)) ||
+            (value_size > 0 && memcmp(value, dec_payload.value, value_size))) {
+        cerr << "Fragmented value was not received correctly" << endl;
+        goto end_test_scatter_gather;
+    }
+    ret = 0;
+
+end_test_scatter_gather:
+    free(message);
+    return ret;
+}
+
+
+/* Checks that the chunks of a value of the given length cover it exactly and
+ * that a chunk with header and a key of up to max_key_size fits into a chunk
+ * message */
+int test_chunk_layout(size_t total_len, size_t max_key_size) {
+    size_t covered = 0;
+    size_t count = CHUNK_COUNT(total_len);
+    for (size_t index = 0; index < count; index++) {
+        size_t chunk_len = CHUNK_LEN(total_len, index);
+        if (chunk_len > CHUNK_SIZE || (chunk_len == 0 && total_len > 0))
+            return -1;
+        if (CIPHERTEXT_SIZE(sizeof(struct rdma_chunk_header) + max_key_size +
+                chunk_len) > CHUNK_MESSAGE_SIZE)
+            return -1;
+        covered += chunk_len;
+    }
+    return covered == total_len ? 0 : -1;
+}
+
+
+/* Sends a message from one session to another and returns whether it was
+ * accepted */
+static bool exchange_message(CryptoSession *sender, CryptoSession *receiver) {
+    const unsigned char key[] = "session key test";
+    struct rdma_msg_header enc_header = { 40 | RDMA_PUT, sizeof(key), 0 };
+    struct rdma_msg_header dec_header;
+    struct rdma_enc_payload enc_payload = { key, key, sizeof(key) };
+    struct rdma_dec_payload dec_payload = { nullptr, nullptr, 0 };
+    unsigned char message[CIPHERTEXT_SIZE(2 * sizeof(key))];
+    unsigned char *message_ptr = message;
+
+    return 0 == encrypt_message(sender,
+            &enc_header, &enc_payload, &message_ptr) &&
+        0 == decrypt_message_in_place(receiver,
+            &dec_header, &dec_payload, message, sizeof(message)) &&
+        0 == memcmp(key, dec_payload.value, sizeof(key));
+}
+
+
+/* Derives the session keys of a handshake and a following rekeying on both
+ * sides and checks that only the matching keys are accepted */
+int test_session_keys() {
+    unsigned char client_random[KDF_RANDOM_LEN], server_random[KDF_RANDOM_LEN];
+    CryptoSession client[NUM_KEY_PHASES], server[NUM_KEY_PHASES];
+    CryptoSession master{key_do_not_use}, other_session;
+
+    if (1 != RAND_bytes(client_random, KDF_RANDOM_LEN) ||
+            1 != RAND_bytes(server_random, KDF_RANDOM_LEN))
+        return -1;
+
+    /* Handshake: */
+    if (0 != derive_session_key(client, key_do_not_use, CONTROL_HANDSHAKE, 3,
+            client_random, server_random) ||
+            0 != derive_session_key(server, key_do_not_use, CONTROL_HANDSHAKE,
+                3, client_random, server_random) ||
+            0 != derive_session_key(&other_session, key_do_not_use,
+                CONTROL_HANDSHAKE, 4, client_random, server_random))
+        return -1;
+    if (!exchange_message(client, server) || !exchange_message(server, client))
+        return -1;
+    if (0 == memcmp(client->get_key(), key_do_not_use, ENC_KEY_LEN) ||
+            exchange_message(&master, server) ||
+            exchange_message(&other_session, server)) {
+        cerr << "Session key isn't bound to the session" << endl;
+        return -1;
+    }
+
+    /* Rekeying, the old key phase stays usable: */
+    server_random[0] ^= 1;
+    if (0 != derive_session_key(client + 1, client->get_key(), CONTROL_REKEY,
+            3, client_random, server_random) ||
+            0 != derive_session_key(server + 1, server->get_key(),
+                CONTROL_REKEY, 3, client_random, server_random))
+        return -1;
+    if (!exchange_message(client + 1, server + 1) ||
+            !exchange_message(client, server) ||
+            exchange_message(client, server + 1) ||
+            exchange_message(client + 1, server)) {
+        cerr << "Key phases aren't separated after rekeying" << endl;
+        return -1;
+    }
+    /* Both messages in the new key phase were sent by client[1]: */
+    if (client[1].get_encrypted_messages() != 2) {
+        cerr << "Encrypted messages aren't counted per key" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+
+/* seq_op of the request with the given number, as the client sends it */
+static inline uint64_t request_seq_op(uint64_t request, uint8_t id) {
+    return SET_ID(request * 2 << 10, id) | RDMA_PUT;
+}
+
+
+/* Feeds a deep pipeline of requests in shuffled order and replays of them
+ * to the anti-replay window of a session */
+int test_replay_window(uint64_t first_request) {
+    const uint8_t id = 5;
+    ServerSession session{0, key_do_not_use, false};
+    std::vector<uint64_t> requests;
+    session.set_client_id(id);
+
+    /* The first request starts the window: */
+    if (!session.is_seq_valid(request_seq_op(first_request, id)) ||
+            session.is_seq_valid(request_seq_op(first_request, id)))
+        return -1;
+    /* Whole pipelines of MAX_PENDING_REQUESTS arrive in any order: */
+    for (uint64_t round = 0; round < 8; round++) {
+        requests.clear();
+        for (uint64_t i = 1; i <= MAX_PENDING_REQUESTS; i++)
+            requests.push_back(first_request + round * MAX_PENDING_REQUESTS + i);
+        std::reverse(requests.begin() + round % 2, requests.end());
+        std::swap(requests.front(), requests.back());
+        for (auto request : requests) {
+            if (!session.is_seq_valid(request_seq_op(request, id))) {
+                cerr << "Request in the window was rejected" << endl;
+                return -1;
+            }
+        }
+        for (auto request : requests) {
+            if (session.is_seq_valid(request_seq_op(request, id))) {
+                cerr << "Replay in the window was accepted" << endl;
+                return -1;
+            }
+        }
+    }
+
+    uint64_t last = first_request + 8 * MAX_PENDING_REQUESTS;
+    /* Too old, too far ahead, or from another client: */
+    if (session.is_seq_valid(request_seq_op(last - MAX_PENDING_REQUESTS, id)) ||
+            session.is_seq_valid(request_seq_op(
+                    last + MAX_PENDING_REQUESTS + 1, id)) ||
+            session.is_seq_valid(request_seq_op(last + 1, id + 1)))
+        return -1;
+    /* A gap that is filled later: */
+    if (!session.is_seq_valid(request_seq_op(last + 3, id)) ||
+            !session.is_seq_valid(request_seq_op(last + 1, id)) ||
+            session.is_seq_valid(request_seq_op(last + 3, id)))
+        return -1;
+    return 0;
+}
+
+
+/* Caches the acks of more requests than fit into the response cache and
+ * checks that retransmissions of the recent ones get the same ack. Without
+ * the cache enabled, nothing is kept */
+int test_response_cache() {
+    const uint8_t id = 5;
+    ServerSession session{0, key_do_not_use, false, true};
+    ServerSession uncached{0, key_do_not_use, false};
+    unsigned char ack[CACHED_RESPONSE_SIZE], cached[CACHED_RESPONSE_SIZE];
+    size_t size;
+
+    (void) memset(ack, 0, sizeof(ack));
+    uncached.cache_response(SET_OP(NEXT_SEQ(request_seq_op(1, id)), RDMA_PUT),
+            ack, sizeof(ack));
+    if (uncached.has_cached_response(request_seq_op(1, id)) ||
+            uncached.get_cached_response(request_seq_op(1, id), cached, &size))
+        return -1;
+
+    for (uint64_t request = 1; request <= 3 * RESPONSE_CACHE_SIZE; request++) {
+        uint64_t seq_op = request_seq_op(request, id);
+        (void) memset(ack, static_cast<int>(request), sizeof(ack));
+        session.cache_response(SET_OP(NEXT_SEQ(seq_op), RDMA_PUT),
+                ack, sizeof(ack) - request % 2);
+    }
+    /* Bigger responses aren't cached: */
+    session.cache_response(SET_OP(NEXT_SEQ(request_seq_op(1000, id)), RDMA_GET),
+            ack, CACHED_RESPONSE_SIZE + 1);
+
+    for (uint64_t request = 1; request <= 3 * RESPONSE_CACHE_SIZE; request++) {
+        uint64_t seq_op = request_seq_op(request, id);
+        bool recent = request > 2 * RESPONSE_CACHE_SIZE;
+        if (session.has_cached_response(seq_op) != recent ||
+                session.get_cached_response(seq_op, cached, &size) != recent)
+            return -1;
+        (void) memset(ack, static_cast<int>(request), sizeof(ack));
+        if (recent && (size != sizeof(ack) - request % 2 ||
+                0 != memcmp(ack, cached, size)))
+            return -1;
+    }
+    if (session.has_cached_response(request_seq_op(1000, id)) ||
+            session.has_cached_response(
+                    request_seq_op(3 * RESPONSE_CACHE_SIZE, id + 1)))
+        return -1;
+    return 0;
+}
+
+
+/* Checks the credits in the responses of a session and both limits of its
+ * admission control */
+int test_admission() {
+    const uint8_t id = 5;
+    const uint64_t second = 1000000000;
+    ServerSession session{0, key_do_not_use, false};
+    struct rdma_msg_header header = { request_seq_op(1, id), 0, 0 };
+    uint64_t now = second;
+
+    session.set_credits(16);
+    session.set_response(&header, RDMA_PUT);
+    if (header.seq_op != SET_OP(NEXT_SEQ(request_seq_op(1, id)), RDMA_PUT) ||
+            header.credits != 16)
+        return -1;
+    /* Without a rate limit, every request is admitted: */
+    for (size_t i = 0; i < 1000; i++) {
+        if (!session.admit(now))
+            return -1;
+    }
+
+    /* 1000 requests per second in bursts of up to 10: */
+    session.limit_rate(1000, 10);
+    for (size_t i = 0; i < 10; i++) {
+        if (!session.admit(now))
+            return -1;
+    }
+    if (session.admit(now))
+        return -1;
+    now += second / 1000;
+    if (!session.admit(now) || session.admit(now))
+        return -1;
+    /* An idle client gets its burst back, but not more: */
+    now += second;
+    for (size_t i = 0; i < 10; i++) {
+        if (!session.admit(now))
+            return -1;
+    }
+    if (session.admit(now))
+        return -1;
+
+    /* Requests at the asynchronous KV-store stay below the credits: */
+    session.limit_rate(0, 0);
+    session.set_credits(2);
+    session.add_deferred();
+    session.add_deferred();
+    if (session.admit(now))
+        return -1;
+    session.remove_deferred();
+    if (!session.admit(now))
+        return -1;
+    session.remove_deferred();
+    return 0;
+}
+
+
+/* Takes snapshots of chunked gets and checks that they keep the value of
+ * chunk 0, even if it changes afterwards, and that the oldest transfer is
+ * replaced when a client starts more of them */
+int test_chunk_snapshots() {
+    const uint8_t id = 5;
+    ServerSession session{0, key_do_not_use, false};
+    std::vector<unsigned char> value(3 * CHUNK_SIZE + 5, 'a');
+    struct chunk_snapshot *snapshot;
+
+    snapshot = session.take_snapshot(request_seq_op(1, id),
+            value.data(), value.size());
+    (void) memset(value.data(), 'b', value.size());
+    if (!snapshot || snapshot->count != 4 ||
+            snapshot->total_len != value.size() || snapshot->served != 0 ||
+            snapshot->value[0] != 'a' || snapshot->value[value.size() - 1] != 'a')
+        return -1;
+    if (session.get_snapshot(request_seq_op(1, id)) != snapshot ||
+            session.get_snapshot(request_seq_op(3, id)))
+        return -1;
+
+    /* A fifth transfer replaces the first one: */
+    for (uint64_t request = 3; request <= 2 * MAX_CHUNKED_TRANSFERS + 1;
+            request += 2) {
+        if (!session.take_snapshot(request_seq_op(request, id),
+                value.data(), request))
+            return -1;
+    }
+    if (session.get_snapshot(request_seq_op(1, id)) ||
+            !session.get_snapshot(request_seq_op(3, id)))
+        return -1;
+    snapshot = session.get_snapshot(request_seq_op(3, id));
+    session.release_snapshot(snapshot);
+    if (session.get_snapshot(request_seq_op(3, id)))
+        return -1;
+    return 0;
+}
+
+
+/* Builds the value of a multi-operation: the header with count, one entry
+ * per pair of key and value length, then padding bytes for the keys and
+ * values (or fewer if extra is negative) */
+static std::vector<unsigned char> multi_request(uint32_t count,
+        const std::vector<struct rdma_multi_entry>& entries, long extra = 0) {
+    struct rdma_multi_header header = { count, 4096 };
+    std::vector<unsigned char> value(sizeof(header));
+    size_t data_len = 0;
+
+    (void) memcpy(value.data(), &header, sizeof(header));
+    for (const struct rdma_multi_entry& entry : entries) {
+        const auto *bytes = (const unsigned char *) &entry;
+        value.insert(value.end(), bytes, bytes + sizeof(entry));
+        data_len += entry.key_len + entry.value_len;
+    }
+    value.resize((size_t) ((long) (value.size() + data_len) + extra), 'k');
+    return value;
+}
+
+
+/* Parses valid and malformed multi-requests. Malformed ones must be rejected
+ * before any key or value points outside of the request */
+int test_multi_request() {
+    struct iovec keys[MAX_MULTI_ENTRIES + 1];
+    struct iovec values[MAX_MULTI_ENTRIES + 1];
+    size_t response_len = 0;
+    std::vector<unsigned char> value;
+
+    value = multi_request(2, { { 3, 0 }, { 5, 0 } });
+    if (2 != parse_multi_request(value.data(), value.size(), RDMA_GET,
+            keys, values, &response_len) || response_len != 4096)
+        return -1;
+    if (keys[0].iov_len != 3 || keys[1].iov_len != 5 ||
+            keys[1].iov_base != value.data() + value.size() - 5)
+        return -1;
+    value = multi_request(2, { { 3, 7 }, { 5, 0 } });
+    if (2 != parse_multi_request(value.data(), value.size(), RDMA_PUT,
+            keys, values, &response_len))
+        return -1;
+    if (values[0].iov_len != 7 ||
+            values[0].iov_base != value.data() + value.size() - 7)
+        return -1;
+
+    /* Count 0 and more than MAX_MULTI_ENTRIES: */
+    value = multi_request(0, {});
+    if (0 != parse_multi_request(value.data(), value.size(), RDMA_GET,
+            keys, values, &response_len))
+        return -1;
+    value = multi_request(MAX_MULTI_ENTRIES + 1, std::vector<
+            struct rdma_multi_entry>(MAX_MULTI_ENTRIES + 1, { 1, 0 }));
+    if (0 != parse_multi_request(value.data(), value.size(), RDMA_GET,
+            keys, values, &response_len))
+        return -1;
+
+    /* Value shorter than the header or the table: */
+    value = multi_request(1, { { 1, 0 } });
+    if (0 != parse_multi_request(value.data(), sizeof(struct rdma_multi_header)
+            - 1, RDMA_GET, keys, values, &response_len))
+        return -1;
+    value = multi_request(4, { { 1, 0 }, { 1, 0 } });
+    if (0 != parse_multi_request(value.data(), value.size(), RDMA_GET,
+            keys, values, &response_len))
+        return -1;
+
+    /* Keys and values that don't add up to the length of the value: */
+    for (long extra : { -1l, 1l }) {
+        value = multi_request(2, { { 3, 7 }, { 5, 2 } }, extra);
+        if (0 != parse_multi_request(value.data(), value.size(), RDMA_PUT,
+                keys, values, &response_len))
+            return -1;
+    }
+    value = multi_request(2, { { UINT32_MAX, 0 }, { 5, 0 } },
+            -(long) UINT32_MAX);
+    if (0 != parse_multi_request(value.data(), value.size(), RDMA_GET,
+            keys, values, &response_len))
+        return -1;
+
+    /* Gets don't carry values: */
+    value = multi_request(2, { { 3, 0 }, { 5, 1 } });
+    if (0 != parse_multi_request(value.data(), value.size(), RDMA_GET,
+            keys, values, &response_len))
+        return -1;
+    return 0;
+}
+
+
+/* Parses valid and malformed responses to multi-operations. Values of the
+ * response must never be read beyond its end */
+int test_multi_response() {
+    const struct rdma_multi_result results[3] = {
+            { MULTI_SUCCESS, 4 }, { MULTI_FAILED, 0 }, { MULTI_SUCCESS, 6 } };
+    unsigned char response[sizeof(results) + 10];
+    unsigned char destinations[3][8];
+    struct iovec values[3];
+    bool succeeded[3];
+    auto reset_values = [&values, &destinations](size_t last_len) {
+        for (size_t i = 0; i < 3; i++)
+            values[i] = { destinations[i], sizeof(destinations[i]) };
+        values[2].iov_len = last_len;
+    };
+
+    (void) memcpy(response, results, sizeof(results));
+    (void) memcpy(response + sizeof(results), "aaaabbbbbb", 10);
+    reset_values(8);
+    if (0 != parse_multi_response(response, sizeof(response), RDMA_GET, 3,
+            values, succeeded))
+        return -1;
+    if (!succeeded[0] || succeeded[1] || !succeeded[2] ||
+            values[0].iov_len != 4 || values[2].iov_len != 6 ||
+            0 != memcmp(destinations[2], "bbbbbb", 6))
+        return -1;
+    /* A value that doesn't fit into its destination fails: */
+    reset_values(5);
+    if (0 != parse_multi_response(response, sizeof(response), RDMA_GET, 3,
+            values, succeeded) || !succeeded[0] || succeeded[2])
+        return -1;
+
+    /* Values that overrun the response, or trailing bytes: */
+    reset_values(8);
+    if (0 == parse_multi_response(response, sizeof(response) - 1, RDMA_GET, 3,
+            values, succeeded))
+        return -1;
+    struct rdma_multi_result overrun = { MULTI_SUCCESS, UINT32_MAX };
+    (void) memcpy(response + 2 * sizeof(overrun), &overrun, sizeof(overrun));
+    if (0 == parse_multi_response(response, sizeof(response), RDMA_GET, 3,
+            values, succeeded))
+        return -1;
+    (void) memcpy(response, results, sizeof(results));
+    if (0 == parse_multi_response(response, sizeof(response), RDMA_GET, 2,
+            values, succeeded))
+        return -1;
+
+    /* Table longer than the response: */
+    if (0 == parse_multi_response(response, sizeof(results) - 1, RDMA_PUT, 3,
+            values, succeeded))
+        return -1;
+    if (0 == parse_multi_response(response, sizeof(response),
+            RDMA_GET, MAX_MULTI_ENTRIES + 1, values, succeeded))
+        return -1;
+
+    /* Puts are answered with the table only: */
+    if (0 != parse_multi_response(response, sizeof(results), RDMA_PUT, 3,
+            values, succeeded) || !succeeded[0] || succeeded[1])
+        return -1;
+    if (0 == parse_multi_response(response, sizeof(response), RDMA_PUT, 3,
+            values, succeeded))
+        return -1;
+    return 0;
+}
+
+
+/* Encrypts data with a precomputed keystream, split into update calls of
+ * split bytes, and checks the result against OpenSSL with the same nonce */
+int test_precomputed_keystream(enum aes_gcm_impl impl,
+        const unsigned char *data, size_t size, size_t split) {
+    int ret = -1;
+    CryptoSession native, openssl;
+    unsigned char iv[IV_LEN];
+    auto *expected = static_cast<unsigned char *>(malloc(size + MAC_LEN));
+    auto *actual = static_cast<unsigned char *>(malloc(size + MAC_LEN));
+
+    if (!(expected && actual) ||
+            0 != native.set_key(key_do_not_use, impl) ||
+            0 != openssl.set_key(key_do_not_use, AES_GCM_OPENSSL) ||
+            0 != native.enable_precomputation(4) ||
+            4 != native.precompute_keystreams(8) ||
+            0 != native.precompute_keystreams(1))
+        goto end_test_precomputed_keystream;
+
+    if (0 != native.init_encryption_next_iv(iv) ||
+            native.get_precomputed_keystreams() != 3)
+        goto end_test_precomputed_keystream;
+    for (size_t pos = 0; pos < size; pos += split) {
+        if (0 != native.encrypt_update(
+                data + pos, MIN(split, size - pos), actual + pos))
+            goto end_test_precomputed_keystream;
+    }
+    if (0 != native.finish_encryption(actual + size))
+        goto end_test_precomputed_keystream;
+
+    if (0 != openssl.init_encryption(iv) ||
+            0 != openssl.encrypt_update(data, size, expected) ||
+            0 != openssl.finish_encryption(expected + size))
+        goto end_test_precomputed_keystream;
+    if (0 != memcmp(expected, actual, size + MAC_LEN)) {
+        cerr << aes_gcm_impl_name(impl) << ": precomputed keystream differs"
+                << " from OpenSSL (size " << size << ", split " << split << ")"
+                << endl;
+        goto end_test_precomputed_keystream;
+    }
+
+    /* Decryption never uses the keystreams of the session: */
+    if (0 != native.init_decryption(iv, expected + size) ||
+            0 != native.decrypt_update(expected, size, actual) ||
+            0 != native.finish_decryption() || 0 != memcmp(data, actual, size) ||
+            native.get_precomputed_keystreams() != 3)
+        goto end_test_precomputed_keystream;
+    ret = 0;
+
+end_test_precomputed_keystream:
+    free(expected);
+    free(actual);
+    return ret;
+}
+
+
+/* Generates nonces in several threads concurrently and checks that no nonce
+ * is generated twice */
+int test_nonce_uniqueness(size_t thread_count, size_t nonces_per_thread) {
+    std::vector<std::string> nonces(thread_count * nonces_per_thread);
+    std::vector<std::thread> threads;
+    std::vector<int> results(thread_count, 0);
+
+    for (size_t t = 0; t < thread_count; t++) {
+        threads.emplace_back([&, t]() {
+            unsigned char nonce[IV_LEN];
+            for (size_t i = 0; i < nonces_per_thread; i++) {
+                results[t] |= next_iv(nonce);
+                nonces[t * nonces_per_thread + i].assign(
+                        reinterpret_cast<char *>(nonce), IV_LEN);
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    for (int result : results) {
+        if (result != 0)
+            return -1;
+    }
+    std::set<std::string> unique(nonces.begin(), nonces.end());
+    return unique.size() == nonces.size() ? 0 : -1;
+}
+
+
+/* Passes values from several producer to several consumer threads through a
+ * small WorkQueue and checks that every value arrives exactly once */
+int test_work_queue(size_t producer_count, size_t consumer_count,
+        size_t values_per_producer) {
+    WorkQueue<size_t, 16> queue;
+    size_t total = producer_count * values_per_producer;
+    std::vector<std::vector<size_t>> received(consumer_count);
+    std::atomic_size_t consumed{0};
+    std::vector<std::thread> threads;
+
+    for (size_t t = 0; t < producer_count; t++) {
+        threads.emplace_back([&, t]() {
+            for (size_t i = 0; i < values_per_producer; i++) {
+                while (!queue.try_push(t * values_per_producer + i))
+                    std::this_thread::yield();
+            }
+        });
+    }
+    for (size_t t = 0; t < consumer_count; t++) {
+        threads.emplace_back([&, t]() {
+            size_t value;
+            while (consumed.load() < total) {
+                if (queue.try_pop(&value)) {
+                    received[t].push_back(value);
+                    consumed++;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    size_t value;
+    if (queue.try_pop(&value))
+        return -1;
+    std::vector<bool> seen(total, false);
+    for (const auto& values : received) {
+        for (size_t v : values) {
+            if (v >= total || seen[v])
+                return -1;
+            seen[v] = true;
+        }
+    }
+    return consumed.load() == total ? 0 : -1;
+}
+
+
+/* Maps consecutive integer keys onto the partitions and checks that every
+ * partition gets about the same share of them */
+int test_key_partition(uint8_t partitions, size_t keys) {
+    std::vector<size_t> counts(partitions, 0);
+    for (uint64_t key = 0; key < keys; key++) {
+        uint8_t partition = key_partition(&key, sizeof(key), partitions);
+        if (partition >= partitions ||
+                partition != key_partition(&key, sizeof(key), partitions))
+            return -1;
+        counts[partition]++;
+    }
+    size_t expected = keys / partitions;
+    for (size_t count : counts) {
+        if (count < expected * 9 / 10 || count > expected * 11 / 10)
+            return -1;
+    }
+    return 0;
+}
+
+
 /* Tests if encryption and decryption in client_server_common.h works: */
 int main(void) {
     enc_key = key_do_not_use;
@@ -135,6 +1116,138 @@ int main(void) {
     }
     END_TEST_DELIMITER();
 
+    BEGIN_TEST_DELIMITER("batched encryption and in-place decryption");
+    EXPECT_EQUAL(0, test_batch(test_key, test_value, 1));
+    EXPECT_EQUAL(0, test_batch(test_key, test_value, 32));
+#if !NO_ENCRYPTION
+    /* Without encryption, no session interleaves a batch: */
+    for (int impl = AES_GCM_AESNI; impl <= aes_gcm_best_impl(); impl++) {
+        for (size_t stride : { 0ul, 1ul, 7ul, 16ul, 33ul }) {
+            EXPECT_EQUAL(0, test_native_batch(static_cast<enum aes_gcm_impl>(
+                    impl), test_key, test_value, 32, stride));
+        }
+        EXPECT_EQUAL(0, test_native_batch(static_cast<enum aes_gcm_impl>(
+                impl), test_key, test_value, 5, 100));
+    }
+#endif // NO_ENCRYPTION
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("uniqueness of nonces across threads");
+    EXPECT_EQUAL(0, test_nonce_uniqueness(1, 100000));
+    EXPECT_EQUAL(0, test_nonce_uniqueness(8, 100000));
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("partitioning of keys among server threads");
+    for (uint8_t partitions : { 1, 2, 3, 8, 255 }) {
+        EXPECT_EQUAL(0, test_key_partition(partitions, 1000000));
+    }
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("work queue with several producers and consumers");
+    EXPECT_EQUAL(0, test_work_queue(1, 1, 100000));
+    EXPECT_EQUAL(0, test_work_queue(1, 4, 100000));
+    EXPECT_EQUAL(0, test_work_queue(4, 4, 100000));
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("built-in AES-GCM implementations against OpenSSL");
+    printf("Best available implementation: %s\n",
+            aes_gcm_impl_name(aes_gcm_best_impl()));
+    for (int impl = AES_GCM_AESNI; impl <= aes_gcm_best_impl(); impl++) {
+        for (size_t size = 0; size <= 1100; size += 13) {
+            for (size_t split : { 1ul, 7ul, 16ul, 100ul, 1100ul }) {
+                EXPECT_EQUAL(0, test_native_impl(static_cast<enum aes_gcm_impl>(
+                        impl), test_value, size, split));
+            }
+        }
+        EXPECT_EQUAL(0, test_native_impl(static_cast<enum aes_gcm_impl>(
+                impl), test_value, MAX_TEST_SIZE, MAX_TEST_SIZE));
+    }
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("additional authenticated data against OpenSSL");
+    for (int impl = AES_GCM_AESNI; impl <= aes_gcm_best_impl(); impl++) {
+        for (size_t size = 0; size <= 600; size += 11) {
+            for (size_t split : { 1ul, 7ul, 16ul, 100ul, 600ul }) {
+                EXPECT_EQUAL(0, test_native_aad(
+                        static_cast<enum aes_gcm_impl>(impl),
+                        test_value, size, split));
+            }
+        }
+    }
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("scatter-gather encryption of fragmented values");
+    for (int mode = SECURITY_ENCRYPT; mode <= SECURITY_NONE; mode++) {
+        for (size_t size : { 0ul, 1ul, 100ul, 4096ul }) {
+            for (size_t fragment_size : { 1ul, 15ul, 16ul, 1000ul }) {
+                EXPECT_EQUAL(0, test_scatter_gather(
+                        static_cast<enum security_mode>(mode), test_key, 8,
+                        test_value, size, fragment_size));
+            }
+        }
+    }
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("chunk layout of values bigger than one message");
+    for (size_t size : { 0ul, 1ul, CHUNK_SIZE - 1, CHUNK_SIZE, CHUNK_SIZE + 1,
+            10 * CHUNK_SIZE, (64ul << 20) + 3 }) {
+        EXPECT_EQUAL(0, test_chunk_layout(
+                size, CHUNK_SIZE - sizeof(struct rdma_chunk_header)));
+    }
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("parsing of malformed multi-operations");
+    EXPECT_EQUAL(0, test_multi_request());
+    EXPECT_EQUAL(0, test_multi_response());
+    END_TEST_DELIMITER();
+
+#if !NO_ENCRYPTION
+    BEGIN_TEST_DELIMITER("security modes");
+    for (int mode = SECURITY_ENCRYPT; mode <= SECURITY_NONE; mode++) {
+        for (size_t size : { 0ul, 1ul, 15ul, 16ul, 100ul, 4096ul }) {
+            EXPECT_EQUAL(0, test_security_mode(
+                    static_cast<enum security_mode>(mode),
+                    test_key, size, test_value, size + 3));
+        }
+    }
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("session key derivation and rekeying");
+    EXPECT_EQUAL(0, test_session_keys());
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("anti-replay window with deep pipelines");
+    for (uint64_t first_request : { 0ul, 31ul, 1000ul }) {
+        EXPECT_EQUAL(0, test_replay_window(first_request));
+    }
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("response cache for retransmitted requests");
+    EXPECT_EQUAL(0, test_response_cache());
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("credits and admission control of a session");
+    EXPECT_EQUAL(0, test_admission());
+    END_TEST_DELIMITER();
+
+    BEGIN_TEST_DELIMITER("snapshots of chunked gets");
+    EXPECT_EQUAL(0, test_chunk_snapshots());
+    END_TEST_DELIMITER();
+
+#endif // NO_ENCRYPTION
+
+    BEGIN_TEST_DELIMITER("precomputed keystreams against OpenSSL");
+    for (int impl = AES_GCM_AESNI; impl <= aes_gcm_best_impl(); impl++) {
+        for (size_t size = 0; size <= 600; size += 11) {
+            for (size_t split : { 1ul, 7ul, 16ul, 100ul, 600ul }) {
+                EXPECT_EQUAL(0, test_precomputed_keystream(
+                        static_cast<enum aes_gcm_impl>(impl),
+                        test_value, size, split));
+            }
+        }
+    }
+    END_TEST_DELIMITER();
+
     BEGIN_TEST_DELIMITER("encryption and decryption with payload sizes over 2^31 bytes");
     size_t huge_test_key_size = (size_t) INT32_MAX + 100;
     size_t huge_test_value_size = (size_t) INT32_MAX + 99;
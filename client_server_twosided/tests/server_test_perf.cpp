@@ -1,4 +1,3 @@
-#include <atomic>
 #include <cstring>
 #include <cstdlib>
 #include <map>
@@ -16,11 +15,6 @@ thread_local unsigned char *default_value;
 
 #endif // NO_KV_OVERHEAD
 
-#if MEASURE_THROUGHPUT
-std::atomic_size_t request_count{0};
-thread_local struct timespec start;
-#endif // MEASURE_THROUGHPUT
-
 #if NO_KV_OVERHEAD
 const void *kv_get(const void *, size_t, size_t *data_len) {
     if (!default_value)
@@ -30,9 +24,6 @@ const void *kv_get(const void *, size_t, size_t *data_len) {
 }
 
 int kv_put(const void *, size_t, void *, size_t) {
-#if MEASURE_THROUGHPUT
-    ++request_count;
-#endif // MEASURE_THROUGHPUT
     return 0;
 }
 
@@ -42,6 +33,25 @@ int kv_delete(const void *, size_t) {
 
 #endif // NO_KV_OVERHEAD
 
+/* The asynchronous interface around the same KV-store completes every
+ * request right away: */
+void kv_async_get(const void *key, size_t key_len,
+        struct anchor_server::kv_request *request) {
+    size_t data_len = 0;
+    const void *data = kv_get(key, key_len, &data_len);
+    anchor_server::complete_request(request, 0, data, data_len);
+}
+
+void kv_async_put(const void *key, size_t key_len, void *value,
+        size_t value_len, struct anchor_server::kv_request *request) {
+    anchor_server::complete_request(request,
+            kv_put(key, key_len, value, value_len));
+}
+
+void kv_async_delete(const void *key, size_t key_len,
+        struct anchor_server::kv_request *request) {
+    anchor_server::complete_request(request, kv_delete(key, key_len));
+}
 
 
 void print_usage(const char *argv0) {
@@ -61,33 +71,54 @@ int main(int argc, const char *argv[]) {
     std::string ip(argv[1]);
     int ret = 1;
     const uint16_t standard_udp_port = 31850;
-    if (0 != anchor_server::init(ip, standard_udp_port))
-        return 1;
-
     if (0 > global_params.parse_args(argc - 2, argv + 2)) {
         print_usage(argv[0]);
         return 1;
     }
 
+    int numa_node = NIC_DEVICE ?
+            anchor_server::get_nic_numa_node(NIC_DEVICE) : 0;
+    if (numa_node < 0) {
+        cerr << "NUMA node of " << NIC_DEVICE << " is unknown, using 0" << endl;
+        numa_node = 0;
+    }
+    if (0 != anchor_server::init(ip, standard_udp_port,
+            static_cast<uint8_t>(numa_node)))
+        return 1;
+    if (0 != anchor_server::set_placement(
+            static_cast<enum anchor_server::placement_policy>(PLACEMENT)))
+        return 1;
+    anchor_server::set_polling(POLLING);
+    anchor_server::set_partitioned(PARTITIONED);
+
 #if NO_KV_OVERHEAD
 #else
-    initialize_kv_store();
+    initialize_kv_store(PARTITIONED ?
+            (SERVER_THREADS ? SERVER_THREADS : NUM_CLIENTS) : 0);
 #endif // NO_KV_OVERHEAD
 
-    if (anchor_server::host_server(
-            key_do_not_use, NUM_CLIENTS,
-            KEY_SIZE + VAL_SIZE,
-#if MEASURE_THROUGHPUT
-            true,
-#else
-            false,
-#endif
-            kv_get, kv_put, kv_delete)) {
+    if (ASYNC_KV)
+        ret = anchor_server::host_server(
+                key_do_not_use, SERVER_THREADS ? SERVER_THREADS : NUM_CLIENTS,
+                KEY_SIZE + VAL_SIZE, MEASURE_THROUGHPUT,
+                kv_async_get, kv_async_put, kv_async_delete,
+                SECURITY_MODE_BIT(SECURITY_MODE));
+    else
+        ret = anchor_server::host_server(
+                key_do_not_use, SERVER_THREADS ? SERVER_THREADS : NUM_CLIENTS,
+                KEY_SIZE + VAL_SIZE, MEASURE_THROUGHPUT,
+                kv_get, kv_put, kv_delete, SECURITY_MODE_BIT(SECURITY_MODE),
+                CRYPTO_WORKERS, MAX_CRYPTO_WORKERS);
+    if (ret) {
         cerr << "Failed to host server" << endl;
-        return ret;
+        return 1;
     }
+    if (STATS_SOCKET && 0 != anchor_server::open_stats_socket(STATS_SOCKET))
+        cerr << "Serving the server stats failed" << endl;
 
 #if MEASURE_THROUGHPUT
+    /* Puts that the server threads answered so far: */
+    struct anchor_server::server_stats stats;
     std::vector<double> results;
     results.reserve(128);
     bool running = true;
@@ -95,7 +126,8 @@ int main(int argc, const char *argv[]) {
     clock_gettime(CLOCK_MONOTONIC, times + 1);
     for (int i = 0; running; i ^= 1) {
         sleep(10);
-        size_t requests_interval = request_count - requests_old;
+        anchor_server::get_stats(&stats);
+        size_t requests_interval = stats.requests[RDMA_PUT] - requests_old;
         requests_old += requests_interval;
         if (requests_old > 0) {
             clock_gettime(CLOCK_MONOTONIC, times + i);
@@ -110,7 +142,7 @@ int main(int argc, const char *argv[]) {
             results.push_back(throughput);
 
             // Stop if there are no requests anymore
-            running = request_count == 0 || requests_interval > 0;
+            running = stats.requests[RDMA_PUT] == 0 || requests_interval > 0;
         }
     }
 
@@ -122,12 +154,16 @@ int main(int argc, const char *argv[]) {
     }
     size_t result_count = results.size() - 4;
     total_throughput /= static_cast<double>(result_count);
-    printf("Final result (taken from %zu data points): %f Gbit/s\n\n",
-        result_count, total_throughput);
+    printf("Final result (taken from %zu data points, %u crypto workers "
+           "per thread): %f Gbit/s\n\n", result_count,
+           static_cast<unsigned>(CRYPTO_WORKERS), total_throughput);
 
 #endif
 
     anchor_server::close_connection(false);
+    anchor_server::close_stats_socket();
+    printf("Heap allocations on the request path: %zu\n",
+        anchor_server::get_request_allocations());
 
 #if NO_KV_OVERHEAD
     free(default_value);
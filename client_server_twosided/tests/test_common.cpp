@@ -1,4 +1,5 @@
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
 #include "test_common.h"
@@ -77,6 +78,36 @@ int global_test_params::parse_args(int argc, const char **argv) {
             case 'f':
                 global_params.path_csv = argv[++i];
                 break;
+            case 'm':
+                STRTOUI8(security_mode, "Security mode");
+                break;
+            case 'w':
+                STRTOUI8(crypto_workers, "Number of crypto workers");
+                break;
+            case 'x':
+                STRTOUI8(max_crypto_workers, "Maximum number of crypto workers");
+                break;
+            case 'a':
+                STRTOUI8(async_kv, "Asynchronous KV-store flag");
+                break;
+            case 'r':
+                STRTOUI8(server_threads, "Number of server threads");
+                break;
+            case 'o':
+                global_params.stats_socket = argv[++i];
+                break;
+            case 'u':
+                STRTOUI8(placement, "Placement policy");
+                break;
+            case 'e':
+                global_params.nic_device = argv[++i];
+                break;
+            case 'b':
+                STRTOUI8(busy_polling, "Busy polling flag");
+                break;
+            case 'h':
+                STRTOUI8(partitioned, "Key partitioning flag");
+                break;
             default:
                 std::cerr << "Unknown commandline option: "
                           << argv[i] << std::endl;
@@ -96,5 +127,26 @@ void global_test_params::print_options() {
                  "\t[-g <total number of get operations>]\n"
                  "\t[-d <total number of delete operations>]\n"
                  "\t[-f <csv filename>]\n"
+                 "\t[-m <security mode (0: encrypt, 1: authenticate, 2: none)>]\n"
+                 "\t[-w <crypto workers per server thread>]\n"
+                 "\t[-x <maximum crypto workers per server thread>]\n"
+                 "\t[-r <server threads (0: one per client)>]\n"
+                 "\t[-a <1: asynchronous KV-store interface>]\n"
+                 "\t[-o <path of the server stats socket>]\n"
+                 "\t[-u <placement (0: none, 1: NUMA node, 2: cores)>]\n"
+                 "\t[-e <network interface of the NIC>]\n"
+                 "\t[-b <1: busy polling while idle>]\n"
+                 "\t[-h <1: keys partitioned among the server threads>]\n"
                  << std::endl;
 }
+
+bool csv_file_exists() {
+    FILE *test = fopen(PATH_CSV, "r");
+    if (!test) {
+        return false;
+    }
+    else {
+        fclose(test);
+        return true;
+    }
+}
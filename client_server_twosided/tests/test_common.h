@@ -17,6 +17,16 @@
 #define TOTAL_DELS global_params.total_dels
 #define MIN_TIME global_params.minimum_time
 #define PATH_CSV global_params.path_csv
+#define SECURITY_MODE global_params.security_mode
+#define CRYPTO_WORKERS global_params.crypto_workers
+#define MAX_CRYPTO_WORKERS global_params.max_crypto_workers
+#define SERVER_THREADS global_params.server_threads
+#define ASYNC_KV global_params.async_kv
+#define STATS_SOCKET global_params.stats_socket
+#define PLACEMENT global_params.placement
+#define NIC_DEVICE global_params.nic_device
+#define POLLING (global_params.busy_polling ? BUSY_POLLING : DEFAULT_POLLING)
+#define PARTITIONED global_params.partitioned
 
 
 struct global_test_params {
@@ -30,6 +40,27 @@ struct global_test_params {
     size_t total_dels{1 << 12};
     size_t minimum_time{0};
     const char *path_csv{nullptr};
+    /* enum security_mode of the sessions */
+    uint8_t security_mode{0};
+    /* Crypto worker threads per server thread, 0 disables offloading */
+    uint8_t crypto_workers{0};
+    /* If bigger than crypto_workers, the worker pool grows up to this size */
+    uint8_t max_crypto_workers{0};
+    /* Server threads that the clients are spread across, 0: one per client */
+    uint8_t server_threads{0};
+    /* If not 0, the server uses the asynchronous KV-store interface */
+    uint8_t async_kv{0};
+    /* If set, the server serves its stats on a Unix domain socket here */
+    const char *stats_socket{nullptr};
+    /* enum anchor_server::placement_policy of the server threads */
+    uint8_t placement{0};
+    /* Network interface or PCI address of the NIC, for its NUMA node */
+    const char *nic_device{nullptr};
+    /* If not 0, server and clients busy-poll even while idle */
+    uint8_t busy_polling{0};
+    /* If not 0, every server thread owns a partition of the keys and the
+     * clients route their requests by key */
+    uint8_t partitioned{0};
 
     int parse_args(int argc, const char *argv[]);
     static void print_options();
@@ -49,6 +80,9 @@ static const unsigned char key_do_not_use[16] =
 void value_from_key(
         void *value, size_t value_len, const void *key, size_t key_len);
 
+/* Whether the CSV file at PATH_CSV exists already, so it has a header */
+bool csv_file_exists();
+
 
 inline uint64_t time_diff(
     const struct timespec *start, const struct timespec *end){
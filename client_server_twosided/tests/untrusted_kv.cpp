@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <atomic>
 #include <iostream>
 #include <map>
@@ -47,7 +48,11 @@ std::vector<unsigned char *> allocated_areas;
 unsigned char *current_pointer{nullptr};
 size_t area_size{0};
 
-std::map<std::vector<unsigned char>, unsigned char *> test_kv_store;
+typedef std::map<std::vector<unsigned char>, unsigned char *> kv_map;
+/* One map per key partition of a partitioned server, otherwise a single map
+ * behind kv_flag (see initialize_kv_store) */
+std::vector<kv_map> test_kv_store(1);
+uint8_t kv_partitions{0};
 std::atomic_flag kv_flag{false};
 
 thread_local unsigned char *val_buf{nullptr};
@@ -78,13 +83,23 @@ static unsigned char *untrusted_malloc(size_t size) {
     }
 }
 
+/* Only the server thread of a partition accesses its map: */
 void lock_kv() {
+    if (kv_partitions > 0)
+        return;
     while (kv_flag.test_and_set())
         ;
 }
 
 void unlock_kv() {
-    kv_flag.clear();
+    if (kv_partitions == 0)
+        kv_flag.clear();
+}
+
+static inline kv_map& get_kv_map(const void *key, size_t key_size) {
+    if (kv_partitions == 0)
+        return test_kv_store[0];
+    return test_kv_store[key_partition(key, key_size, kv_partitions)];
 }
 
 
@@ -96,9 +111,10 @@ const void *kv_get(const void *key, size_t key_size, size_t *data_len) {
     if (!val_buf)
         val_buf = static_cast<unsigned char *>(malloc(VAL_SIZE));
 
+    kv_map& store = get_kv_map(key, key_size);
     lock_kv();
-    auto iter = test_kv_store.find(vec);
-    if (iter != test_kv_store.end()) {
+    auto iter = store.find(vec);
+    if (iter != store.end()) {
         struct rdma_msg_header header;
         struct rdma_dec_payload payload = {nullptr, val_buf, 0ul};
         if (0 != decrypt_message(&header, &payload, iter->second,
@@ -121,19 +137,20 @@ int kv_put(const void *key, size_t key_size, void *value, size_t value_size) {
     auto *key_uc = static_cast<const unsigned char *>(key);
     auto vec = std::vector<unsigned char>();
     vec.assign(key_uc, key_uc + key_size);
-    auto iter = test_kv_store.find(vec);
+    kv_map& store = get_kv_map(key, key_size);
+    auto iter = store.find(vec);
     unsigned char *val;
-    struct rdma_msg_header header{0ul, 0ul };
+    struct rdma_msg_header header{0ul, 0ul, 0 };
     struct rdma_enc_payload payload{
         nullptr, static_cast<unsigned char *>(value), value_size
     };
 
     lock_kv();
-    if (iter == test_kv_store.end()) {
+    if (iter == store.end()) {
         val = untrusted_malloc(CIPHERTEXT_SIZE(VAL_SIZE));
         if (!val)
             goto end_kv_put;
-        test_kv_store.insert({vec, val});
+        store.insert({vec, val});
     }
     else {
         val = iter->second;
@@ -157,10 +174,11 @@ int kv_delete(const void *key, size_t key_size) {
     auto *key_uc = static_cast<const unsigned char *>(key);
     auto vec = std::vector<unsigned char>();
     vec.assign(key_uc, key_uc + key_size);
+    kv_map& store = get_kv_map(key, key_size);
     lock_kv();
-    auto iter = test_kv_store.find(vec);
-    if (iter != test_kv_store.end()) {
-        test_kv_store.erase(iter);
+    auto iter = store.find(vec);
+    if (iter != store.end()) {
+        store.erase(iter);
         free(iter->second);
         ret = 0;
     }
@@ -168,8 +186,14 @@ int kv_delete(const void *key, size_t key_size) {
     return ret;
 }
 
-void initialize_kv_store() {
-    unlock_kv();
+/**
+ * @param partitions Number of threads of a partitioned server, whose KV-store
+ *          is split into one unlocked map per thread. 0 for a single map
+ */
+void initialize_kv_store(uint8_t partitions) {
+    kv_partitions = partitions;
+    test_kv_store.assign(std::max((size_t) partitions, (size_t) 1), kv_map());
+    kv_flag.clear();
     area_size = CIPHERTEXT_SIZE(VAL_SIZE) * (1 << 20);
 }
 
@@ -1,3 +1,4 @@
+#include <cstdint>
 #include <unistd.h>
 
 const void *kv_get(const void *key, size_t key_size, size_t *data_len);
@@ -6,7 +7,7 @@ int kv_put(const void *key, size_t key_size, void *value, size_t value_size);
 
 int kv_delete(const void *key, size_t key_size);
 
-void initialize_kv_store();
+void initialize_kv_store(uint8_t partitions = 0);
 
 void cleanup_kv_store();
 